@@ -1,15 +1,18 @@
 #include "caj_lsl_parse.h"
+#include "caj_lsl_compile.h"
 #include "caj_vm.h"
 #include "caj_vm_asm.h"
 #include "caj_vm_ops.h"
 
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 #include <cassert>
 #include <stdio.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 // Possible Linden dain bramage:
 // Order of operations (second operand, first operand)
@@ -33,13 +36,37 @@ struct lsl_compile_state {
   var_scope globals;
   // std::map<std::string, var_desc> vars; // locals
   std::map<std::string, const vm_function*> funcs;
-  std::map<std::string, function*> sys_funcs;
+  const std::map<std::string, function*> *sys_funcs;
   std::map<std::string, int> states;
   loc_atom var_stack;
   var_scope *scope;
   std::map<std::string, loc_atom> labels;
+  std::vector<var_scope*> child_scopes; // freed along with us
+  FILE *out; // error messages
+
+  // for the optimiser
+  int optimise;
+  std::map<std::string, expr_node*> const_globals; // never written to
+  std::set<std::string> func_reads; // names read in the current function
 
   lsl_compile_state() : globals(NULL) { }
+
+  ~lsl_compile_state() {
+    for(std::vector<var_scope*>::iterator iter = child_scopes.begin();
+	iter != child_scopes.end(); iter++) {
+      delete *iter;
+    }
+  }
+};
+
+// The parsed runtime function prototypes and such, which are the same for
+// every script. Read-only once created, so it's safe to share.
+struct caj_lsl_compiler {
+  lsl_arena *arena; // everything from runtime_funcs.lsl lives in here
+  std::map<std::string, function*> sys_funcs;
+  std::vector<vm_function*> op_funcs;
+  int flags; // CAJ_LSL_*
+  char id[40]; // see caj_lsl_compiler_id
 };
 
 static const vm_function *make_function(vm_asm &vasm, function *func, int state_no = -1);
@@ -61,9 +88,9 @@ static void update_loc(lsl_compile_state &st, const statement *statem) {
 static void do_error(lsl_compile_state &st, const char* format, ...) {
   va_list args;
   if(st.error != 0) return;
-  printf("(%i, %i): ", st.line_no, st.column_no);
+  fprintf(st.out, "(%i, %i): ", st.line_no, st.column_no);
   va_start (args, format);
-  vprintf (format, args);
+  vfprintf (st.out, format, args);
   va_end (args);
   st.error = 1;
 }
@@ -73,7 +100,7 @@ static void handle_arg_vars(vm_asm &vasm, lsl_compile_state &st,
 			    var_scope *scope) {
   for(int arg_no = 0; args != NULL; args = args->next, arg_no++) {
     if(scope->vars.count(args->name)) {
-      printf("ERROR: duplicate function argument %s\n",args->name);
+      fprintf(st.out, "ERROR: duplicate function argument %s\n",args->name);
       st.error = 1; return;
     } else {
       var_desc var; var.type = args->vtype; var.is_global = 0;
@@ -113,7 +140,7 @@ static void extract_local_vars(vm_asm &vasm, lsl_compile_state &st,
 	     statem->expr[0]->node_type == NODE_IDENT);
 
       if(statem->expr[0]->u.ident.item != NULL) {
-	printf("ERROR: silly programmer, item accesses are for expressions\n");
+	fprintf(st.out, "ERROR: silly programmer, item accesses are for expressions\n");
 	st.error = 1; return;
       }
 
@@ -160,6 +187,7 @@ static void extract_local_vars(vm_asm &vasm, lsl_compile_state &st,
       if(st.error) return;
       for(int i = 0; i < count; i++) {
 	var_scope *child_ctx = new var_scope(scope);
+	st.child_scopes.push_back(child_ctx);
 	extract_local_vars(vasm, st, statem->child[i], child_ctx);
 	statem->child_vars[i] = child_ctx;
       }
@@ -214,6 +242,260 @@ static int dotted_item_to_idx(char *item) {
   else return  item[0] - 'x';
 }
 
+// Everything from here to propagate_types is only used with st.optimise set.
+
+// Collects the names of variables some code reads and writes. It goes by
+// name alone, ignoring scopes, so it errs on the side of caution.
+static void scan_expr_names(expr_node *expr, std::set<std::string> *reads,
+			    std::set<std::string> *writes) {
+  if(expr == NULL) return;
+  switch(expr->node_type) {
+  case NODE_CONST:
+    break;
+  case NODE_IDENT:
+    if(reads != NULL) reads->insert(expr->u.ident.name);
+    break;
+  case NODE_ASSIGN:
+    // the target's a constant if someone's assigning to one. Error later.
+    if(writes != NULL && expr->u.child[0]->node_type == NODE_IDENT) 
+      writes->insert(expr->u.child[0]->u.ident.name);
+    scan_expr_names(expr->u.child[1], reads, writes);
+    break;
+  case NODE_ASSIGNADD:
+  case NODE_ASSIGNSUB:
+  case NODE_ASSIGNMUL:
+  case NODE_ASSIGNDIV:
+  case NODE_ASSIGNMOD:
+    scan_expr_names(expr->u.child[1], reads, writes);
+    // fall through - these read the old value too
+  case NODE_PREINC:
+  case NODE_POSTINC:
+  case NODE_PREDEC:
+  case NODE_POSTDEC:
+    if(writes != NULL && expr->u.child[0]->node_type == NODE_IDENT) 
+      writes->insert(expr->u.child[0]->u.ident.name);
+    scan_expr_names(expr->u.child[0], reads, writes);
+    break;
+  case NODE_NEGATE:
+  case NODE_NOT:
+  case NODE_L_NOT:
+  case NODE_CAST:
+    scan_expr_names(expr->u.child[0], reads, writes);
+    break;
+  case NODE_VECTOR:
+  case NODE_ROTATION:
+    for(int i = 0; i < (expr->node_type == NODE_VECTOR ? 3 : 4); i++)
+      scan_expr_names(expr->u.child[i], reads, writes);
+    break;
+  case NODE_CALL:
+    for(list_node *lnode = expr->u.call.args; lnode != NULL; lnode = lnode->next)
+      scan_expr_names(lnode->expr, reads, writes);
+    break;
+  case NODE_LIST:
+    for(list_node *lnode = expr->u.list; lnode != NULL; lnode = lnode->next)
+      scan_expr_names(lnode->expr, reads, writes);
+    break;
+  default: // binary operators
+    scan_expr_names(expr->u.child[0], reads, writes);
+    scan_expr_names(expr->u.child[1], reads, writes);
+    break;
+  }
+}
+
+static void scan_code_names(statement *statem, std::set<std::string> *reads,
+			    std::set<std::string> *writes) {
+  for( ; statem != NULL; statem = statem->next) {
+    switch(statem->stype) {
+    case STMT_DECL: // expr[0] is the variable being declared
+      scan_expr_names(statem->expr[1], reads, writes);
+      break;
+    case STMT_EXPR:
+    case STMT_RET:
+      scan_expr_names(statem->expr[0], reads, writes);
+      break;
+    case STMT_IF:
+      scan_expr_names(statem->expr[0], reads, writes);
+      scan_code_names(statem->child[0], reads, writes);
+      scan_code_names(statem->child[1], reads, writes);
+      break;
+    case STMT_WHILE:
+    case STMT_DO:
+      scan_expr_names(statem->expr[0], reads, writes);
+      scan_code_names(statem->child[0], reads, writes);
+      break;
+    case STMT_FOR:
+      for(int i = 0; i < 3; i++)
+	scan_expr_names(statem->expr[i], reads, writes);
+      scan_code_names(statem->child[0], reads, writes);
+      break;
+    case STMT_BLOCK:
+      scan_code_names(statem->child[0], reads, writes);
+      break;
+    }
+  }
+}
+
+static int is_const(expr_node *expr, uint8_t vtype) {
+  return expr->node_type == NODE_CONST && expr->vtype == vtype;
+}
+
+static void make_const_int(expr_node *expr, int32_t val) {
+  expr->node_type = NODE_CONST; expr->vtype = VM_TYPE_INT; expr->u.i = val;
+}
+
+static void make_const_float(expr_node *expr, float val) {
+  expr->node_type = NODE_CONST; expr->vtype = VM_TYPE_FLOAT; expr->u.f = val;
+}
+
+// Works out operators with constant operands at compile time, getting 
+// exactly the result the VM would. Anything that could fail at runtime, 
+// such as division by zero, is left for the VM to complain about.
+static void fold_const(expr_node *expr) {
+  expr_node *l = expr->u.child[0];
+  switch(expr->node_type) {
+  case NODE_NEGATE:
+    if(is_const(l, VM_TYPE_INT)) 
+      make_const_int(expr, (int32_t)(0u - (uint32_t)l->u.i));
+    else if(is_const(l, VM_TYPE_FLOAT)) 
+      make_const_float(expr, -l->u.f);
+    return;
+  case NODE_NOT:
+    if(is_const(l, VM_TYPE_INT)) make_const_int(expr, ~l->u.i);
+    return;
+  case NODE_L_NOT:
+    if(is_const(l, VM_TYPE_INT)) make_const_int(expr, !l->u.i);
+    return;
+  case NODE_CAST:
+    if(l->node_type == NODE_CAST) fold_const(l);
+    if(is_const(l, VM_TYPE_FLOAT) && expr->vtype == VM_TYPE_INT &&
+       l->u.f > -2147483648.0f && l->u.f < 2147483648.0f) {
+      make_const_int(expr, (int32_t)l->u.f);
+    } else if(is_const(l, VM_TYPE_INT) && expr->vtype == VM_TYPE_STR) {
+      char buf[40]; sprintf(buf, "%i", (int)l->u.i);
+      expr->node_type = NODE_CONST; expr->u.s = lsl_strdup(buf);
+    }
+    return;
+  }
+
+  // binary operators from here on; propagate_types may have cast the 
+  // operands after it'd already folded them.
+  expr_node *r = expr->u.child[1];
+  if(l->node_type == NODE_CAST) fold_const(l);
+  if(r->node_type == NODE_CAST) fold_const(r);
+
+  if(is_const(l, VM_TYPE_INT) && is_const(r, VM_TYPE_INT)) {
+    int32_t a = l->u.i, b = r->u.i, int_min = (int32_t)0x80000000u;
+    uint32_t ua = a, ub = b;
+    switch(expr->node_type) {
+    case NODE_ADD: make_const_int(expr, (int32_t)(ua + ub)); break;
+    case NODE_SUB: make_const_int(expr, (int32_t)(ua - ub)); break;
+    case NODE_MUL: make_const_int(expr, (int32_t)(ua * ub)); break;
+    case NODE_DIV:
+      if(b == 0) return;
+      make_const_int(expr, (b == -1 && a == int_min) ? int_min : a / b);
+      break;
+    case NODE_MOD:
+      if(b == 0) return;
+      make_const_int(expr, b == -1 ? 0 : a % b);
+      break;
+    case NODE_AND: make_const_int(expr, a & b); break;
+    case NODE_OR: make_const_int(expr, a | b); break;
+    case NODE_XOR: make_const_int(expr, a ^ b); break;
+    case NODE_SHL: 
+      if(b < 0 || b > 31) return; // the VM leaves these to the CPU
+      make_const_int(expr, (int32_t)(ua << b)); break;
+    case NODE_SHR:
+      if(b < 0 || b > 31) return;
+      make_const_int(expr, a >> b); break;
+    case NODE_L_AND: make_const_int(expr, a && b); break;
+    case NODE_L_OR: make_const_int(expr, a || b); break;
+    case NODE_EQUAL: make_const_int(expr, a == b); break;
+    case NODE_NEQUAL: make_const_int(expr, a != b); break;
+    case NODE_LEQUAL: make_const_int(expr, a <= b); break;
+    case NODE_GEQUAL: make_const_int(expr, a >= b); break;
+    case NODE_LESS: make_const_int(expr, a < b); break;
+    case NODE_GREATER: make_const_int(expr, a > b); break;
+    }
+  } else if(is_const(l, VM_TYPE_FLOAT) && is_const(r, VM_TYPE_FLOAT)) {
+    float a = l->u.f, b = r->u.f;
+    switch(expr->node_type) {
+    case NODE_ADD: make_const_float(expr, a + b); break;
+    case NODE_SUB: make_const_float(expr, a - b); break;
+    case NODE_MUL: make_const_float(expr, a * b); break;
+    case NODE_DIV: 
+      if(b == 0.0f) return;
+      make_const_float(expr, a / b); break;
+    case NODE_EQUAL: make_const_int(expr, a == b); break;
+    case NODE_NEQUAL: make_const_int(expr, a != b); break;
+    case NODE_LEQUAL: make_const_int(expr, a <= b); break;
+    case NODE_GEQUAL: make_const_int(expr, a >= b); break;
+    case NODE_LESS: make_const_int(expr, a < b); break;
+    case NODE_GREATER: make_const_int(expr, a > b); break;
+    }
+  } else if(is_const(l, VM_TYPE_STR) && is_const(r, VM_TYPE_STR)) {
+    switch(expr->node_type) {
+    case NODE_ADD:
+      {
+	size_t llen = strlen(l->u.s), rlen = strlen(r->u.s);
+	char *s = (char*)lsl_alloc(llen+rlen+1);
+	memcpy(s, l->u.s, llen); memcpy(s+llen, r->u.s, rlen+1);
+	expr->node_type = NODE_CONST; expr->vtype = VM_TYPE_STR;
+	expr->u.s = s;
+	break;
+      }
+    case NODE_EQUAL: 
+      make_const_int(expr, strcmp(l->u.s, r->u.s) == 0); break;
+    }
+  }
+}
+
+// Can be left out entirely if its value isn't used: no side effects, and
+// nothing that can fail at runtime.
+static int expr_is_pure(expr_node *expr) {
+  switch(expr->node_type) {
+  case NODE_CONST:
+  case NODE_IDENT:
+    return 1;
+  case NODE_CAST:
+    // these allocate memory, and so could fail
+    if(expr->vtype == VM_TYPE_STR || expr->vtype == VM_TYPE_LIST) return 0;
+    // fall through
+  case NODE_NEGATE:
+  case NODE_NOT:
+  case NODE_L_NOT:
+    return expr_is_pure(expr->u.child[0]);
+  case NODE_VECTOR:
+  case NODE_ROTATION:
+    for(int i = 0; i < (expr->node_type == NODE_VECTOR ? 3 : 4); i++)
+      if(!expr_is_pure(expr->u.child[i])) return 0;
+    return 1;
+  case NODE_ADD:
+  case NODE_SUB:
+  case NODE_MUL:
+  case NODE_EQUAL:
+  case NODE_NEQUAL:
+  case NODE_LEQUAL:
+  case NODE_GEQUAL:
+  case NODE_LESS:
+  case NODE_GREATER:
+  case NODE_OR:
+  case NODE_AND: 
+  case NODE_XOR:
+  case NODE_L_OR:
+  case NODE_L_AND:
+  case NODE_SHR:
+  case NODE_SHL:
+    for(int i = 0; i < 2; i++) {
+      uint8_t vtype = expr->u.child[i]->vtype;
+      if((vtype != VM_TYPE_INT && vtype != VM_TYPE_FLOAT) || 
+	 !expr_is_pure(expr->u.child[i])) return 0;
+    }
+    return 1;
+  default:
+    return 0;
+  }
+}
+
 static void propagate_types(vm_asm &vasm, lsl_compile_state &st, expr_node *expr) {
   uint16_t insn; uint8_t ltype, rtype; list_node *lnode;
   update_loc(st, expr);
@@ -244,6 +526,20 @@ static void propagate_types(vm_asm &vasm, lsl_compile_state &st, expr_node *expr
       }
       expr->vtype = VM_TYPE_FLOAT;
     }
+    if(st.optimise && st.error == 0 && 
+       get_variable(st, expr->u.ident.name).is_global) {
+      std::map<std::string, expr_node*>::iterator iter = 
+	st.const_globals.find(expr->u.ident.name);
+      if(iter != st.const_globals.end()) {
+	expr_node *val = iter->second;
+	if(expr->u.ident.item == NULL) {
+	  expr->u = val->u;
+	} else {
+	  expr->u.f = val->u.v[dotted_item_to_idx(expr->u.ident.item)];
+	}
+	expr->node_type = NODE_CONST;
+      }
+    }
     break;
   case NODE_ASSIGN:
     if(expr->u.child[0]->node_type != NODE_IDENT) {
@@ -275,6 +571,7 @@ static void propagate_types(vm_asm &vasm, lsl_compile_state &st, expr_node *expr
     if(st.error != 0) return;
     update_loc(st, expr);
     expr->vtype = expr->u.child[0]->vtype;
+    if(st.optimise) fold_const(expr);
     break;
   case NODE_VECTOR:
   case NODE_ROTATION:
@@ -298,8 +595,7 @@ static void propagate_types(vm_asm &vasm, lsl_compile_state &st, expr_node *expr
       expr->vtype = expr->node_type == NODE_VECTOR ? VM_TYPE_VECT : VM_TYPE_ROT;
       if(is_const) {
 	for(int i = 0; i < count; i++) {
-	  v[i] = expr->u.child[i]->u.f;
-	  free(expr->u.child[i]); // FIXME - do this right!
+	  v[i] = expr->u.child[i]->u.f; // child freed with the arena
 	}
 	expr->node_type = NODE_CONST;
 	for(int i = 0; i < count; i++) expr->u.v[i] = v[i];
@@ -373,6 +669,7 @@ static void propagate_types(vm_asm &vasm, lsl_compile_state &st, expr_node *expr
       expr->vtype = VM_TYPE_INT;
     } else if(insn != 0) {
       expr->vtype = get_insn_ret_type(insn);
+      if(st.optimise) fold_const(expr);
     } else {
       do_error(st, "ERROR: bad types passed to operator %i %s : %s %s\n",
 	       expr->node_type, node_names[expr->node_type],
@@ -389,6 +686,7 @@ static void propagate_types(vm_asm &vasm, lsl_compile_state &st, expr_node *expr
       do_error(st, "ERROR: bitwise NOT on non-integer"); return;
     }
     expr->vtype = VM_TYPE_INT; 
+    if(st.optimise) fold_const(expr);
     break;
   case NODE_L_NOT:
     propagate_types(vasm, st, expr->u.child[0]);
@@ -396,6 +694,7 @@ static void propagate_types(vm_asm &vasm, lsl_compile_state &st, expr_node *expr
     update_loc(st, expr);
     // no type enforcement, boolean context
     expr->vtype = VM_TYPE_INT; 
+    if(st.optimise) fold_const(expr);
     break;
   case NODE_PREINC:
   case NODE_POSTINC:
@@ -407,6 +706,8 @@ static void propagate_types(vm_asm &vasm, lsl_compile_state &st, expr_node *expr
     break;
   case NODE_CAST:
     propagate_types(vasm, st, expr->u.child[0]);
+    if(st.error != 0) return;
+    if(st.optimise) fold_const(expr);
     break;
   case NODE_CALL:
     {
@@ -424,10 +725,10 @@ static void propagate_types(vm_asm &vasm, lsl_compile_state &st, expr_node *expr
 	std::map<std::string, const vm_function*>::iterator iter =
 	  st.funcs.find(expr->u.call.name);
 	if(iter == st.funcs.end()) {
-	  std::map<std::string, function*>::iterator sfiter = 
-	    st.sys_funcs.find(expr->u.call.name);
+	  std::map<std::string, function*>::const_iterator sfiter = 
+	    st.sys_funcs->find(expr->u.call.name);
 	  
-	  if(sfiter == st.sys_funcs.end()) {
+	  if(sfiter == st.sys_funcs->end()) {
 	    do_error(st, "ERROR: call to unknown function %s\n", expr->u.call.name);
 	    return;
 	  } else {
@@ -670,6 +971,86 @@ static void asm_cast_to_bool(vm_asm &vasm, lsl_compile_state &st, expr_node *exp
   }
 }
 
+static void assemble_expr(vm_asm &vasm, lsl_compile_state &st, expr_node *expr);
+
+// If expr is just an integer local variable, returns non-zero and fills in var.
+static int is_local_int(lsl_compile_state &st, expr_node *expr, var_desc &var) {
+  if(expr->node_type != NODE_IDENT || expr->u.ident.item != NULL ||
+     expr->vtype != VM_TYPE_INT) return 0;
+  var = get_variable(st, expr->u.ident.name);
+  return st.error == 0 && !var.is_global && var.type == VM_TYPE_INT;
+}
+
+// An int operand that can be evaluated after the other side without anyone
+// noticing. 
+static int is_simple_int(expr_node *expr) {
+  return expr->vtype == VM_TYPE_INT && (expr->node_type == NODE_CONST ||
+	  (expr->node_type == NODE_IDENT && expr->u.ident.item == NULL));
+}
+
+// foo = foo + <expr> and foo = foo - <expr> (which is what += and -= turn
+// into) on int locals, using LOCAL_I ops. Returns 0 if it can't.
+static int assemble_local_add(vm_asm &vasm, lsl_compile_state &st, 
+			      expr_node *expr) {
+  expr_node *rhs = expr->u.child[1]; var_desc var;
+  if((rhs->node_type != NODE_ADD && rhs->node_type != NODE_SUB) ||
+     rhs->vtype != VM_TYPE_INT || !is_local_int(st, expr->u.child[0], var))
+    return 0;
+  const char *name = expr->u.child[0]->u.ident.name;
+  expr_node *id = rhs->u.child[0], *operand = rhs->u.child[1];
+  if(id->node_type != NODE_IDENT || id->u.ident.item != NULL ||
+     strcmp(id->u.ident.name, name) != 0 || operand->vtype != VM_TYPE_INT)
+    return 0;
+  // foo = foo + foo++ would see the wrong foo
+  std::set<std::string> writes;
+  scan_expr_names(operand, NULL, &writes);
+  if(writes.count(name) || !vasm.local_int_op_ok(var.offset)) return 0;
+
+  if(is_const(operand, VM_TYPE_INT) && operand->u.i == 1) {
+    vasm.local_int_op(rhs->node_type == NODE_ADD ? 
+		      LOCAL_I_INC : LOCAL_I_DEC, var.offset);
+    return 1;
+  }
+  assemble_expr(vasm, st, operand);
+  if(st.error != 0) return 1;
+  update_loc(st, expr);
+  vasm.local_int_op(rhs->node_type == NODE_ADD ? 
+		    LOCAL_I_ADD : LOCAL_I_SUB, var.offset);
+  return 1;
+}
+
+// comparisons between an int local and a constant or another variable,
+// using LOCAL_I ops. Returns 0 if it can't.
+static int assemble_local_cmp(vm_asm &vasm, lsl_compile_state &st, 
+			      expr_node *expr) {
+  int op, swapped_op;
+  switch(expr->node_type) {
+  case NODE_EQUAL: op = swapped_op = LOCAL_I_EQ; break;
+  case NODE_NEQUAL: op = swapped_op = LOCAL_I_NEQ; break;
+  case NODE_GREATER: op = LOCAL_I_GR; swapped_op = LOCAL_I_LES; break;
+  case NODE_LESS: op = LOCAL_I_LES; swapped_op = LOCAL_I_GR; break;
+  case NODE_GEQUAL: op = LOCAL_I_GEQ; swapped_op = LOCAL_I_LEQ; break;
+  case NODE_LEQUAL: op = LOCAL_I_LEQ; swapped_op = LOCAL_I_GEQ; break;
+  default: return 0;
+  }
+
+  expr_node *operand; var_desc var;
+  if(is_simple_int(expr->u.child[1]) && 
+     is_local_int(st, expr->u.child[0], var)) {
+    operand = expr->u.child[1];
+  } else if(is_simple_int(expr->u.child[0]) && 
+	    is_local_int(st, expr->u.child[1], var)) {
+    operand = expr->u.child[0]; op = swapped_op;
+  } else return 0;
+  if(!vasm.local_int_op_ok(var.offset)) return 0;
+
+  assemble_expr(vasm, st, operand);
+  if(st.error != 0) return 1;
+  update_loc(st, expr);
+  vasm.local_int_op(op, var.offset);
+  return 1;
+}
+
 static void assemble_expr(vm_asm &vasm, lsl_compile_state &st, expr_node *expr) {
   uint8_t insn;
   update_loc(st, expr);
@@ -714,6 +1095,7 @@ static void assemble_expr(vm_asm &vasm, lsl_compile_state &st, expr_node *expr)
   case NODE_ASSIGN:
     {
       assert(expr->u.child[0]->node_type == NODE_IDENT); // checked in grammar
+      if(st.optimise && assemble_local_add(vasm, st, expr)) break;
       uint8_t vtype = expr->u.child[1]->vtype; // FIXME - use child[0]?
       var_desc var = get_variable(st, expr->u.child[0]->u.ident.name);
       if(st.error != 0) return;
@@ -787,6 +1169,7 @@ static void assemble_expr(vm_asm &vasm, lsl_compile_state &st, expr_node *expr)
   case NODE_SHR:
   case NODE_SHL:
     {
+      if(st.optimise && assemble_local_cmp(vasm, st, expr)) break;
       bool list_magic = false;
       insn = get_insn_binop(expr->node_type, expr->u.child[0]->vtype, 
 			    expr->u.child[1]->vtype);
@@ -922,12 +1305,19 @@ static void assemble_expr(vm_asm &vasm, lsl_compile_state &st, expr_node *expr)
       var_desc var = get_variable(st, expr->u.child[0]->u.s);
       if(st.error != 0) return;
       assert(var.type == vtype);
+      int is_inc = (expr->node_type == NODE_PREINC || 
+		    expr->node_type ==  NODE_POSTINC);
+      if(st.optimise && expr->vtype == VM_TYPE_NONE && !var.is_global &&
+	 vtype == VM_TYPE_INT && vasm.local_int_op_ok(var.offset)) {
+	vasm.local_int_op(is_inc ? LOCAL_I_INC : LOCAL_I_DEC, var.offset);
+	break;
+      }
       int is_post = (expr->node_type == NODE_POSTINC || 
 		     expr->node_type == NODE_POSTDEC);
       uint16_t insn, dup_insn;
       switch(vtype) {
       case VM_TYPE_INT:
-	if(expr->node_type == NODE_PREINC || expr->node_type ==  NODE_POSTINC)
+	if(is_inc)
 	  insn = INSN_INC_I;
 	else insn = INSN_DEC_I;
 	dup_insn = MAKE_INSN(ICLASS_RDL_I, 1);
@@ -1022,6 +1412,36 @@ static expr_node *cast_to_void(expr_node *expr) {
   return enode_cast(expr, VM_TYPE_NONE);
 }
 
+// assignment to a local variable that's never read
+static int is_dead_store(lsl_compile_state &st, expr_node *expr) {
+  if(expr->node_type != NODE_ASSIGN) return 0;
+  const char *name = expr->u.child[0]->u.ident.name;
+  return !get_variable(st, name).is_global && st.func_reads.count(name) == 0;
+}
+
+// For expressions whose value isn't used. When optimising, dead stores are
+// reduced to their right hand side and anything with no side effects is 
+// left out, as are any casts on the way to throwing the value away.
+static void assemble_void_expr(vm_asm &vasm, lsl_compile_state &st, 
+			       expr_node *&expr) {
+  if(st.optimise && is_dead_store(st, expr)) expr = expr->u.child[1];
+  expr = cast_to_void(expr);
+  if(st.optimise) {
+    while(expr->node_type == NODE_CAST && expr->vtype == VM_TYPE_NONE &&
+	  expr->u.child[0]->node_type == NODE_CAST) {
+      expr = cast_to_void(expr->u.child[0]->u.child[0]);
+    }
+    if(expr_is_pure(expr)) return;
+  }
+  assemble_expr(vasm, st, expr);
+}
+
+// 0 or 1 if a condition's value is known at compile time, otherwise -1
+static int const_cond(lsl_compile_state &st, expr_node *expr) {
+  if(!st.optimise || !is_const(expr, VM_TYPE_INT)) return -1;
+  return expr->u.i != 0;
+}
+
 static loc_atom get_jump_label(vm_asm &vasm, lsl_compile_state &st, 
 			       const char *label) {
   std::map<std::string, loc_atom>::iterator iter =
@@ -1035,6 +1455,52 @@ static loc_atom get_jump_label(vm_asm &vasm, lsl_compile_state &st,
   }
 }
 
+static void produce_code(vm_asm &vasm, lsl_compile_state &st, 
+			 statement *statem, var_scope *scope);
+
+// while and for loops, when optimising. The test goes at the bottom, so 
+// each time round the loop only takes the one conditional jump:
+//     jump test; body: <body> <post>; test: <cond>; COND; jump body
+// The condition's types must already have been propagated.
+static void produce_rotated_loop(vm_asm &vasm, lsl_compile_state &st,
+				 expr_node *cond, statement *body, 
+				 var_scope *body_scope, expr_node *post) {
+  var_scope *scope = st.scope;
+  loc_atom loop_body = vasm.make_loc();
+  loc_atom loop_test = vasm.make_loc();
+  vasm.do_jump(loop_test);
+  vasm.verify_stack(st.var_stack);
+  vasm.do_label(loop_body);
+  if(vasm.get_error() != NULL) {
+    do_error(st, "ASSEMBLER ERROR: %s\n", vasm.get_error());
+    return;
+  }
+
+  produce_code(vasm, st, body, body_scope);
+  if(st.error) return;
+  st.scope = scope;
+  if(post != NULL) {
+    propagate_types(vasm, st, post);
+    if(st.error) return;
+    update_loc(st, post);
+    assemble_void_expr(vasm, st, post);
+    if(st.error) return;
+  }
+
+  vasm.do_label(loop_test);
+  assemble_expr(vasm, st, cond);
+  if(st.error) return;
+  update_loc(st, cond);
+  asm_cast_to_bool(vasm, st, cond);
+  if(st.error) return;
+  vasm.insn(INSN_COND);
+  vasm.do_jump(loop_body);
+  if(vasm.get_error() != NULL) {
+    do_error(st, "ASSEMBLER ERROR: %s\n", vasm.get_error());
+    return;
+  }
+}
+
 static void produce_code(vm_asm &vasm, lsl_compile_state &st, 
 			 statement *statem, var_scope *scope) {
   for( ; statem != NULL; statem = statem->next) {
@@ -1050,15 +1516,15 @@ static void produce_code(vm_asm &vasm, lsl_compile_state &st,
 	propagate_types(vasm, st, &fake_expr);
 	if(st.error) return;
 	assert(fake_expr.vtype == VM_TYPE_NONE);
-	assemble_expr(vasm, st, &fake_expr);
+	expr_node *expr = &fake_expr;
+	assemble_void_expr(vasm, st, expr);
       }
       break; 
     case STMT_EXPR:
       propagate_types(vasm, st, statem->expr[0]);
       if(st.error) return;
       update_loc(st, statem);
-      statem->expr[0] = cast_to_void(statem->expr[0]);
-      assemble_expr(vasm, st, statem->expr[0]);
+      assemble_void_expr(vasm, st, statem->expr[0]);
       break;
     case STMT_IF:
       {
@@ -1066,14 +1532,22 @@ static void produce_code(vm_asm &vasm, lsl_compile_state &st,
 	loc_atom end_if = vasm.make_loc();
 	propagate_types(vasm, st, statem->expr[0]); // FIXME - horrid code duplication
 	if(st.error) return;
-	assemble_expr(vasm, st, statem->expr[0]);
-	if(st.error) return;
-	update_loc(st, statem);
-	asm_cast_to_bool(vasm, st, statem->expr[0]);
-	if(st.error) return;
+	int cond = const_cond(st, statem->expr[0]);
+	if(cond < 0) {
+	  assemble_expr(vasm, st, statem->expr[0]);
+	  if(st.error) return;
+	  update_loc(st, statem);
+	  asm_cast_to_bool(vasm, st, statem->expr[0]);
+	  if(st.error) return;
 
-	vasm.insn(INSN_NCOND);
-	vasm.do_jump(else_cl);
+	  vasm.insn(INSN_NCOND);
+	  vasm.do_jump(else_cl);
+	} else if(cond == 0) {
+	  // The branch still gets compiled so any errors in it are reported, 
+	  // then the assembler drops it as unreachable.
+	  vasm.do_jump(else_cl);
+	  vasm.verify_stack(st.var_stack);
+	}
 	if(vasm.get_error() != NULL) {
 	  do_error(st, "ASSEMBLER ERROR: %s\n", vasm.get_error());
 	  return;
@@ -1083,6 +1557,8 @@ static void produce_code(vm_asm &vasm, lsl_compile_state &st,
 
 	update_loc(st, statem);
 	if(statem->child[1] != NULL) vasm.do_jump(end_if);
+	if(cond > 0 && statem->child[1] != NULL) 
+	  vasm.verify_stack(st.var_stack); // nothing jumps to else_cl
 	vasm.do_label(else_cl);
 	if(statem->child[1] != NULL) {
 	  produce_code(vasm, st, statem->child[1], (var_scope*)statem->child_vars[1]);
@@ -1130,17 +1606,29 @@ static void produce_code(vm_asm &vasm, lsl_compile_state &st,
       {
 	loc_atom loop_start = vasm.make_loc();
 	loc_atom loop_end = vasm.make_loc();
-	vasm.do_label(loop_start);
 	propagate_types(vasm, st, statem->expr[0]);
 	if(st.error) return;
-	assemble_expr(vasm, st, statem->expr[0]);
-	if(st.error) return;
+	int cond = const_cond(st, statem->expr[0]);
+	if(st.optimise && cond < 0) {
+	  produce_rotated_loop(vasm, st, statem->expr[0], statem->child[0],
+			       (var_scope*)statem->child_vars[0], NULL);
+	  st.scope = scope;
+	  break;
+	}
+	vasm.do_label(loop_start);
+	if(cond < 0) {
+	  assemble_expr(vasm, st, statem->expr[0]);
+	  if(st.error) return;
 	
-	update_loc(st, statem);
-	asm_cast_to_bool(vasm, st, statem->expr[0]);
-	if(st.error) return;
-	vasm.insn(INSN_NCOND);
-	vasm.do_jump(loop_end);
+	  update_loc(st, statem);
+	  asm_cast_to_bool(vasm, st, statem->expr[0]);
+	  if(st.error) return;
+	  vasm.insn(INSN_NCOND);
+	  vasm.do_jump(loop_end);
+	} else if(cond == 0) {
+	  vasm.do_jump(loop_end);
+	  vasm.verify_stack(st.var_stack);
+	}
 	if(vasm.get_error() != NULL) {
 	  do_error(st, "ASSEMBLER ERROR: %s\n", vasm.get_error());
 	  return;
@@ -1148,6 +1636,7 @@ static void produce_code(vm_asm &vasm, lsl_compile_state &st,
 	produce_code(vasm, st, statem->child[0], (var_scope*)statem->child_vars[0]);
 	if(st.error) return;
 	vasm.do_jump(loop_start);
+	if(cond > 0) vasm.verify_stack(st.var_stack);
 	vasm.do_label(loop_end);
       }
       break;
@@ -1165,14 +1654,20 @@ static void produce_code(vm_asm &vasm, lsl_compile_state &st,
 	propagate_types(vasm, st, statem->expr[0]);
 	if(st.error) return;
 	//statem->expr[0] = enode_cast(statem->expr[0], VM_TYPE_INT); // FIXME - special bool cast?
-	assemble_expr(vasm, st, statem->expr[0]);
-	if(st.error) return;
+	int cond = const_cond(st, statem->expr[0]);
+	if(cond < 0) {
+	  assemble_expr(vasm, st, statem->expr[0]);
+	  if(st.error) return;
 
-	update_loc(st, statem);
-	asm_cast_to_bool(vasm, st, statem->expr[0]);
-	if(st.error) return;
-	vasm.insn(INSN_COND);
-	vasm.do_jump(loop_start);
+	  update_loc(st, statem);
+	  asm_cast_to_bool(vasm, st, statem->expr[0]);
+	  if(st.error) return;
+	  vasm.insn(INSN_COND);
+	  vasm.do_jump(loop_start);
+	} else if(cond > 0) {
+	  vasm.do_jump(loop_start);
+	  vasm.verify_stack(st.var_stack);
+	}
       }
       break;
     case STMT_FOR:
@@ -1184,23 +1679,38 @@ static void produce_code(vm_asm &vasm, lsl_compile_state &st,
 	  if(st.error) return;
 
 	  update_loc(st, statem->expr[0]);
-	  statem->expr[0] = cast_to_void(statem->expr[0]);
-	  assemble_expr(vasm, st, statem->expr[0]);
+	  assemble_void_expr(vasm, st, statem->expr[0]);
 	  if(st.error) return;
 	}
 	
-	vasm.do_label(loop_start);
+	int cond = -1;
 	if(statem->expr[1] != NULL) { // loop condition
 	  propagate_types(vasm, st, statem->expr[1]);
 	  if(st.error) return;
-	  assemble_expr(vasm, st, statem->expr[1]);
-	  if(st.error) return;
+	  cond = const_cond(st, statem->expr[1]);
+	}
+	if(st.optimise && statem->expr[1] != NULL && cond < 0) {
+	  produce_rotated_loop(vasm, st, statem->expr[1], statem->child[0],
+			       (var_scope*)statem->child_vars[0], statem->expr[2]);
+	  st.scope = scope;
+	  break;
+	}
 
-	  update_loc(st, statem->expr[1]);
-	  asm_cast_to_bool(vasm, st, statem->expr[1]);
-	  if(st.error) return;
-	  vasm.insn(INSN_NCOND);
-	  vasm.do_jump(loop_end);
+	vasm.do_label(loop_start);
+	if(statem->expr[1] != NULL) {
+	  if(cond < 0) {
+	    assemble_expr(vasm, st, statem->expr[1]);
+	    if(st.error) return;
+
+	    update_loc(st, statem->expr[1]);
+	    asm_cast_to_bool(vasm, st, statem->expr[1]);
+	    if(st.error) return;
+	    vasm.insn(INSN_NCOND);
+	    vasm.do_jump(loop_end);
+	  } else if(cond == 0) {
+	    vasm.do_jump(loop_end);
+	    vasm.verify_stack(st.var_stack);
+	  }
 	  if(vasm.get_error() != NULL) {
 	    do_error(st, "ASSEMBLER ERROR: %s\n", vasm.get_error());
 	    return;
@@ -1216,13 +1726,14 @@ static void produce_code(vm_asm &vasm, lsl_compile_state &st,
 	  if(st.error) return;
 
 	  update_loc(st, statem->expr[2]);
-	  statem->expr[2] = cast_to_void(statem->expr[2]);
-	  assemble_expr(vasm, st, statem->expr[2]);
+	  assemble_void_expr(vasm, st, statem->expr[2]);
 	  if(st.error) return;
 	}
 
 	update_loc(st, statem);
-	vasm.do_jump(loop_start); vasm.do_label(loop_end);
+	vasm.do_jump(loop_start); 
+	if(cond > 0) vasm.verify_stack(st.var_stack);
+	vasm.do_label(loop_end);
 	if(vasm.get_error() != NULL) {
 	  do_error(st, "ASSEMBLER ERROR: %s\n", vasm.get_error());
 	  return;
@@ -1277,13 +1788,12 @@ static const vm_function *make_function(vm_asm &vasm, function *func, int state_
   char *name = func->name;
   int num_args = 0, j = 0;
   for(func_arg* arg = func->args; arg != NULL; arg = arg->next) num_args++;
-  uint8_t *args = new uint8_t[num_args];
+  uint8_t *args = (uint8_t*)lsl_alloc(num_args);
   for(func_arg* arg = func->args; arg != NULL; arg = arg->next) 
     args[j++] = arg->vtype;
   
   if(state_no > -1) {
-    // FIXME - this leaks memory (but then, so does everything)...
-    int len = strlen(func->name)+10; name = (char*)malloc(len);
+    int len = strlen(func->name)+10; name = (char*)lsl_alloc(len);
     snprintf(name, len, "%i:%s", state_no, func->name);
   }
   return  vasm.add_func(func->ret_type, args, num_args, name);
@@ -1301,6 +1811,11 @@ static void compile_function(vm_asm &vasm, lsl_compile_state &st, function *func
     extract_local_vars(vasm, st, func->code->first, &func_scope);
     if(st.error) return;
 
+    if(st.optimise) {
+      st.func_reads.clear();
+      scan_code_names(func->code->first, &st.func_reads, NULL);
+    }
+
     st.var_stack = vasm.mark_stack();
 
     produce_code(vasm, st, func->code->first, &func_scope);
@@ -1314,7 +1829,7 @@ static void compile_function(vm_asm &vasm, lsl_compile_state &st, function *func
     st.labels.clear();
   
     if(vasm.get_error() != NULL) {
-      printf("ASSEMBLER ERROR: %s\n", vasm.get_error());
+      fprintf(st.out, "ASSEMBLER ERROR: %s\n", vasm.get_error());
       st.error = 1; return;
     }
 }
@@ -1376,32 +1891,20 @@ static uint32_t constify_list(vm_asm &vasm, lsl_compile_state &st,
   return build_const_list(vasm, st, item);
 }
 
-int main(int argc, char** argv) {
+static int compile_lsl(caj_lsl_compiler *comp, const char *src, int src_len,
+		       FILE *out, unsigned char **data_out, size_t *len_out) {
   int num_funcs = 0; int func_no;
   vm_asm vasm;
   lsl_program *prog;
   lsl_compile_state st;
-  st.error = 0;
-
-  if(argc != 3) {
-    printf("Usage: %s input.lsl output.cvm\n",argv[0]);
-    return 1;
-  }
-
-  // First, we load the LSL runtime functions
-  prog = caj_parse_lsl("runtime_funcs.lsl");
-  if(prog == NULL) {
-    printf("ERROR: couldn't parse function template\n"); return 1;
-  }
-
-  for(function *func = prog->funcs; func != NULL; func = func->next) {
-    st.sys_funcs[func->name] = func;
-  }
+  st.error = 0; st.out = out;
+  st.sys_funcs = &comp->sys_funcs;
+  st.optimise = (comp->flags & CAJ_LSL_OPTIMISE) != 0;
+  vasm.set_optimise(st.optimise);
 
-  // Now, we can do the actual compile!
-  prog = caj_parse_lsl(argv[1]);
+  prog = caj_parse_lsl(src, src_len, out);
   if(prog == NULL) {
-    printf(" *** Compile failed.\n"); return 1;
+    fprintf(out, " *** Compile failed.\n"); return 1;
   }
 
   st.line_no = 0; st.column_no = 0;
@@ -1410,7 +1913,7 @@ int main(int argc, char** argv) {
   // The first step is to find all the global variables.
   for(global *g = prog->globals; g != NULL; g = g->next) {
     if(st.globals.vars.count(g->name)) {
-      printf("ERROR: duplicate definition of global var %s\n",g->name);
+      fprintf(out, "ERROR: duplicate definition of global var %s\n",g->name);
       st.error = 1; return 1;
     } else {
       var_desc var; var.type = g->vtype; var.is_global = 1;
@@ -1423,8 +1926,8 @@ int main(int argc, char** argv) {
 	} else if(g->val->node_type != NODE_CONST ||
 		  (g->val->vtype != g->vtype && 
 		   (g->vtype != VM_TYPE_KEY && g->val->vtype != VM_TYPE_STR))) {
-	  printf("FIXME: global var initialiser not const of expected type\n");
-	  printf("DEBUG: got %i %s node, wanted const %s\n",
+	  fprintf(out, "FIXME: global var initialiser not const of expected type\n");
+	  fprintf(out, "DEBUG: got %i %s node, wanted const %s\n",
 		 g->val->node_type, type_names[g->val->vtype], type_names[g->vtype]);
 	  st.error = 1; return 1;
 	}
@@ -1461,7 +1964,7 @@ int main(int argc, char** argv) {
 	  vasm.add_global_float(g->val == NULL ? 0.0f : g->val->u.v[3]); 
 	break;
       default:
-	printf("ERROR: unknown type of global var %s\n",g->name);
+	fprintf(out, "ERROR: unknown type of global var %s\n",g->name);
 	st.error = 1; return 1;
 	// FIXME - handle this
       }
@@ -1472,19 +1975,47 @@ int main(int argc, char** argv) {
     }
   }
 
+  if(st.optimise) {
+    // Globals that are never assigned to are really constants, and can be
+    // treated as such. Scripts use them for channel numbers and the like.
+    std::set<std::string> writes;
+    for(function *func = prog->funcs; func != NULL; func = func->next)
+      scan_code_names(func->code->first, NULL, &writes);
+    for(lsl_state *lstate = prog->states; lstate != NULL; lstate = lstate->next) {
+      for(function *func = lstate->funcs; func != NULL; func = func->next)
+	scan_code_names(func->code->first, NULL, &writes);
+    }
+
+    for(global *g = prog->globals; g != NULL; g = g->next) {
+      if(writes.count(g->name)) continue;
+      if(g->vtype != VM_TYPE_INT && g->vtype != VM_TYPE_FLOAT &&
+	 g->vtype != VM_TYPE_STR && g->vtype != VM_TYPE_VECT &&
+	 g->vtype != VM_TYPE_ROT) continue;
+      if(g->val != NULL) {
+	if(is_const(g->val, g->vtype)) st.const_globals[g->name] = g->val;
+      } else {
+	expr_node *val = (expr_node*)lsl_alloc(sizeof(expr_node));
+	val->node_type = NODE_CONST; val->vtype = g->vtype;
+	memset(&val->u, 0, sizeof(val->u));
+	if(g->vtype == VM_TYPE_STR) val->u.s = (char*)"";
+	st.const_globals[g->name] = val;
+      }
+    }
+  }
+
   // we want to make sure the default state is state 0
   lsl_state* dflt_state = NULL; int num_states = 1;
   st.states["default"] = 0;
   for(lsl_state *lstate = prog->states; lstate != NULL; lstate = lstate->next) {
     if(lstate->name == NULL) {
       if(dflt_state != NULL) {
-	printf("ERROR: duplicate definition of default state\n"); return 1;
+	fprintf(out, "ERROR: duplicate definition of default state\n"); return 1;
       }
 
       dflt_state = lstate;
     } else {
       if(st.states.count(lstate->name)) {
-	printf("ERROR: duplicate definition of state %s\n", lstate->name); return 1;
+	fprintf(out, "ERROR: duplicate definition of state %s\n", lstate->name); return 1;
       }
 
       st.states[lstate->name] = num_states++;
@@ -1494,18 +2025,18 @@ int main(int argc, char** argv) {
       num_funcs++;
   }
 
-  if(dflt_state == NULL) { printf("ERROR: no default state defined\n"); return 1; }
+  if(dflt_state == NULL) { fprintf(out, "ERROR: no default state defined\n"); return 1; }
 
   // count the normal, non-event functions too...
   for(function *func = prog->funcs; func != NULL; func = func->next)
     num_funcs++;
 
   // Now we make a list of all functions - first the normal ones...
-  const vm_function ** funcs = new const vm_function*[num_funcs]; // FIXME - use std::vector
+  std::vector<const vm_function*> funcs(num_funcs);
   func_no = 0;
   for(function *func = prog->funcs; func != NULL; func = func->next) {
     if(st.funcs.count(func->name)) {
-      printf("ERROR: duplicate definition of func %s\n", func->name);
+      fprintf(out, "ERROR: duplicate definition of func %s\n", func->name);
       st.error = 1; return 1;
     }
 
@@ -1524,13 +2055,103 @@ int main(int argc, char** argv) {
   }
 
   // Insert the functions that are really instructions, if they aren't overridden
+  for(std::vector<vm_function*>::iterator iter = comp->op_funcs.begin();
+      iter != comp->op_funcs.end(); iter++) {
+    if(st.funcs.count((*iter)->name)) continue;
+    st.funcs[(*iter)->name] = *iter;
+  }
+
+  // now we build the code. It's important this is done in the same order as 
+  // above, since the code here assumes this to be the case.
+  func_no = 0;
+  for(function *func = prog->funcs; func != NULL; func = func->next, func_no++) {
+    // fprintf(out, "DEBUG: assembling function %s\n", func->name);
+
+    compile_function(vasm, st, func, funcs[func_no]);
+    if(st.error != 0) return 1;
+  }
+
+  state_ctr = 1;
+  for(lsl_state *lstate = prog->states; lstate != NULL; lstate = lstate->next) {
+    int state_no = lstate->name == NULL ? 0 : state_ctr++;
+    for(function *func = lstate->funcs; func != NULL; func = func->next, func_no++) {
+      // fprintf(out, "DEBUG: assembling state func %i:%s\n", state_no, func->name);
+      compile_function(vasm, st, func, funcs[func_no]);
+      if(st.error != 0) return 1;
+    }
+  }
+
+  // finally, we serialise the whole thing
+  *data_out = vasm.finish(len_out);
+  if(*data_out == NULL) {
+    fprintf(out, "Error assembling: %s\n", vasm.get_error());
+    return 1;
+  }
+  return 0;
+}
+
+int caj_lsl_compile(caj_lsl_compiler *comp, const char *src, int src_len,
+		    FILE *out, unsigned char **data_out, size_t *len_out) {
+  lsl_arena *arena = lsl_arena_new();
+  lsl_arena *old_arena = lsl_arena_set(arena);
+  int ret = compile_lsl(comp, src, src_len, out, data_out, len_out);
+  lsl_arena_set(old_arena); lsl_arena_free(arena);
+  return ret;
+}
+
+static char *read_lsl_file(const char *fname, int *len_out) {
+  FILE *f = fopen(fname, "rb");
+  if(f == NULL) return NULL;
+  int len = 0, alloc = 4096; 
+  char *data = (char*)malloc(alloc);
+  for(;;) {
+    size_t ret = fread(data+len, 1, alloc-len, f);
+    len += ret;
+    if(ret == 0) break;
+    if(len == alloc) { alloc *= 2; data = (char*)realloc(data, alloc); }
+  }
+  fclose(f);
+  *len_out = len; return data;
+}
+
+caj_lsl_compiler *caj_lsl_compiler_new(const char *runtime_fname, int flags,
+				      FILE *out) {
+  int len; char *src = read_lsl_file(runtime_fname, &len);
+  if(src == NULL) {
+    fprintf(out, "ERROR: couldn't read %s\n", runtime_fname); return NULL;
+  }
+
+  caj_lsl_compiler *comp = new caj_lsl_compiler();
+  comp->flags = flags;
+
+  // FNV-1a of the runtime functions, since they decide the function numbers
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for(int i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)src[i]) * 0x100000001b3ULL;
+  }
+  snprintf(comp->id, sizeof(comp->id), "lslc%i%s-%016llx", 
+	   CAJ_LSL_COMPILER_VERSION, (flags & CAJ_LSL_OPTIMISE) ? "o" : "",
+	   (unsigned long long)hash);
+
+  comp->arena = lsl_arena_new();
+  lsl_arena *old_arena = lsl_arena_set(comp->arena);
+  lsl_program *prog = caj_parse_lsl(src, len, out);
+  lsl_arena_set(old_arena); free(src);
+  if(prog == NULL) {
+    fprintf(out, "ERROR: couldn't parse function template\n"); 
+    caj_lsl_compiler_free(comp); return NULL;
+  }
+
+  for(function *func = prog->funcs; func != NULL; func = func->next) {
+    comp->sys_funcs[func->name] = func;
+  }
+
   for(int i = 0; op_funcs[i].name != NULL; i++) {
-    if(st.funcs.count(op_funcs[i].name)) continue;
-    // leaks memory horribly, as per usual
     vm_function *vfunc = new vm_function();
     vfunc->name = (char*)op_funcs[i].name;
     vfunc->ret_type = op_funcs[i].ret;
     vfunc->func_num = 0xffff; vfunc->insn_ptr = op_funcs[i].insn; // hack
+    vfunc->arg_offsets = NULL;
     if(op_funcs[i].arg1 == VM_TYPE_NONE) {
       assert(op_funcs[i].arg2 == VM_TYPE_NONE);
       vfunc->arg_count = 0; vfunc->arg_types = NULL;
@@ -1542,37 +2163,51 @@ int main(int argc, char** argv) {
       vfunc->arg_types[0] = op_funcs[i].arg1; 
       vfunc->arg_types[1] = op_funcs[i].arg2;
     }
-    st.funcs[op_funcs[i].name] = vfunc;
+    comp->op_funcs.push_back(vfunc);
   }
+  return comp;
+}
 
-  // now we build the code. It's important this is done in the same order as 
-  // above, since the code here assumes this to be the case.
-  func_no = 0;
-  for(function *func = prog->funcs; func != NULL; func = func->next, func_no++) {
-    // printf("DEBUG: assembling function %s\n", func->name);
+const char* caj_lsl_compiler_id(caj_lsl_compiler *comp) {
+  return comp->id;
+}
 
-    compile_function(vasm, st, func, funcs[func_no]);
-    if(st.error != 0) return 1;
+void caj_lsl_compiler_free(caj_lsl_compiler *comp) {
+  for(std::vector<vm_function*>::iterator iter = comp->op_funcs.begin();
+      iter != comp->op_funcs.end(); iter++) {
+    delete[] (*iter)->arg_types; delete *iter;
   }
+  lsl_arena_free(comp->arena);
+  delete comp;
+}
 
-  state_ctr = 1;
-  for(lsl_state *lstate = prog->states; lstate != NULL; lstate = lstate->next) {
-    int state_no = lstate->name == NULL ? 0 : state_ctr++;
-    for(function *func = lstate->funcs; func != NULL; func = func->next, func_no++) {
-      // printf("DEBUG: assembling state func %i:%s\n", state_no, func->name);
-      compile_function(vasm, st, func, funcs[func_no]);
-      if(st.error != 0) return 1;
-    }
+#ifdef CAJ_LSL_COMPILE_MAIN
+int main(int argc, char** argv) {
+  int flags = 0;
+  if(argc == 4 && strcmp(argv[1], "-O") == 0) {
+    flags |= CAJ_LSL_OPTIMISE; argv++; argc--;
   }
-
-  // finally, we serialise the whole thing and save it to disk
-  size_t len;
-  unsigned char *data = vasm.finish(&len);
-  if(data == NULL) {
-    printf("Error assembling: %s\n", vasm.get_error());
+  if(argc != 3) {
+    printf("Usage: %s [-O] input.lsl output.cvm\n",argv[0]);
     return 1;
   }
 
+  // First, we load the LSL runtime functions
+  caj_lsl_compiler *comp = caj_lsl_compiler_new("runtime_funcs.lsl", flags,
+						stdout);
+  if(comp == NULL) return 1;
+
+  int src_len; char *src = read_lsl_file(argv[1], &src_len);
+  if(src == NULL) {
+    printf("ERROR: file not found\n"); return 1;
+  }
+
+  // Now, we can do the actual compile!
+  size_t len; unsigned char *data;
+  if(caj_lsl_compile(comp, src, src_len, stdout, &data, &len)) return 1;
+  free(src); caj_lsl_compiler_free(comp);
+
+  // finally, save it to disk
   int fd = open(argv[2], O_WRONLY|O_CREAT|O_EXCL, 0644);
   if(fd < 0) {
     perror("opening output file");
@@ -1590,3 +2225,4 @@ int main(int argc, char** argv) {
   
   return 0;
 }
+#endif
@@ -0,0 +1,56 @@
+/* Copyright (c) 2009-2010 Aidan Thornton, all rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AIDAN THORNTON ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AIDAN THORNTON BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF 
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CAJ_LSL_COMPILE_H
+#define CAJ_LSL_COMPILE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Bump this whenever the compiler's output changes for the same input, or
+// cached bytecode from the old version will keep being used.
+#define CAJ_LSL_COMPILER_VERSION 3
+
+// flags for caj_lsl_compiler_new
+#define CAJ_LSL_OPTIMISE 1 // constant folding, dead code removal and such
+
+// The LSL compiler, usable from inside the sim. A caj_lsl_compiler holds the 
+// parsed runtime_funcs.lsl and is read-only once created, so any number of 
+// threads can compile with the same one at once.
+struct caj_lsl_compiler;
+
+// Messages go to out. Returns NULL on failure.
+caj_lsl_compiler *caj_lsl_compiler_new(const char *runtime_fname, int flags,
+				      FILE *out);
+void caj_lsl_compiler_free(caj_lsl_compiler *comp);
+
+// Identifies the compiler version and runtime functions in use, for keying
+// caches of compiled scripts.
+const char* caj_lsl_compiler_id(caj_lsl_compiler *comp);
+
+// Returns 0 on success, in which case *data_out is the script bytecode, 
+// to be freed with free(). Compiler errors are written to out in the 
+// form the viewer expects.
+int caj_lsl_compile(caj_lsl_compiler *comp, const char *src, int src_len,
+		    FILE *out, unsigned char **data_out, size_t *len_out);
+
+#endif
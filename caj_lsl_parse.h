@@ -24,6 +24,7 @@
 #define CAJ_LSL_PARSE_H
 
 #include <stdint.h>
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -185,7 +186,21 @@ static const char* type_names[] = {"void","int","float","str","key","vect","rot"
     } u;
   } lsl_const;
 
-  lsl_program *caj_parse_lsl(const char* fname);
+  typedef struct lsl_parse_state {
+    void *scanner;
+    lsl_program prog;
+    FILE *out; /* where syntax errors go */
+  } lsl_parse_state;
+
+  typedef struct lsl_arena lsl_arena;
+
+  lsl_arena *lsl_arena_new(void);
+  void lsl_arena_free(lsl_arena *arena);
+  lsl_arena *lsl_arena_set(lsl_arena *arena); /* returns the old one */
+  void *lsl_alloc(size_t len);
+  char *lsl_strdup(const char *s);
+
+  lsl_program *caj_parse_lsl(const char* src, int len, FILE *out);
   expr_node *enode_cast(expr_node *expr, uint8_t vtype);
   void enode_split_assign(expr_node *expr);
   const lsl_const* find_lsl_const(const char* name);
@@ -1317,6 +1317,22 @@ static unsigned char* build_dummy_texture_entry(uuid_t texture, int *len) {
   return data;
 }
 
+// called once we've found where the new prim should go
+static void object_add_raycast_cb(struct simulator_ctx *sim, void *priv,
+				  struct caj_phys_hit *hits, int num_hits) {
+  primitive_obj* prim = (primitive_obj*)priv;
+  if(num_hits < 0) {
+    world_free_prim(prim); return;
+  } else if(num_hits > 0) {
+    // rest it on the surface we hit. FIXME - should take rotation into account
+    float offset = prim->ob.scale.z / 2.0f;
+    prim->ob.local_pos.x = hits[0].pos.x + hits[0].normal.x * offset;
+    prim->ob.local_pos.y = hits[0].pos.y + hits[0].normal.y * offset;
+    prim->ob.local_pos.z = hits[0].pos.z + hits[0].normal.z * offset;
+  }
+  world_insert_obj(sim, &prim->ob);
+}
+
 static void handle_ObjectAdd_msg(struct omuser_ctx* lctx, struct sl_message* msg) {
   SL_DECLBLK_GET1(ObjectAdd, AgentData, ad, msg);
   SL_DECLBLK_GET1(ObjectAdd, ObjectData, objd, msg);
@@ -1333,7 +1349,7 @@ static void handle_ObjectAdd_msg(struct omuser_ctx* lctx, struct sl_message* msg
   uuid_copy(prim->creator, prim->owner);
   // FIXME - set group of object
 
-  prim->ob.local_pos = objd->RayEnd; // FIXME - do proper raycast
+  prim->ob.local_pos = objd->RayEnd; // used if the raycast doesn't hit
 
   prim->material = objd->Material;
   // FIXME - handle AddFlags
@@ -1368,7 +1384,20 @@ static void handle_ObjectAdd_msg(struct omuser_ctx* lctx, struct sl_message* msg
 
   // FIXME - TODO
 
-  world_insert_obj(user_get_sim(lctx->u), &prim->ob);
+  caj_vector3 ray_dir = objd->RayEnd - objd->RayStart;
+  float ray_len = sqrtf(ray_dir.x*ray_dir.x + ray_dir.y*ray_dir.y + 
+			ray_dir.z*ray_dir.z);
+  if(objd->BypassRaycast || objd->RayEndIsIntersection || ray_len < 0.01f) {
+    world_insert_obj(user_get_sim(lctx->u), &prim->ob);
+  } else {
+    // cast a little past the end, in case RayEnd is right on the surface.
+    caj_vector3 ray_end = objd->RayEnd;
+    ray_end.x += ray_dir.x / ray_len * 0.5f;
+    ray_end.y += ray_dir.y / ray_len * 0.5f;
+    ray_end.z += ray_dir.z / ray_len * 0.5f;
+    world_phys_raycast(user_get_sim(lctx->u), &objd->RayStart, &ray_end,
+		       0, 1, object_add_raycast_cb, prim);
+  }
 }
 
 static world_obj* get_obj_for_update(struct omuser_ctx* lctx, uint32_t localid) {
@@ -1634,6 +1663,8 @@ static void handle_ObjectName_msg(struct omuser_ctx* lctx, struct sl_message* ms
 
     free(prim->name);
     prim->name = strdup((char*)objd->Name.data);
+    world_mark_object_updated(user_get_sim(lctx->u), &prim->ob, 
+			      CAJ_OBJUPD_PROPERTIES);
   }
 }
 
@@ -1654,6 +1685,8 @@ static void handle_ObjectDescription_msg(struct omuser_ctx* lctx, struct sl_mess
 
     free(prim->description);
     prim->description = strdup((char*)objd->Description.data);
+    world_mark_object_updated(user_get_sim(lctx->u), &prim->ob, 
+			      CAJ_OBJUPD_PROPERTIES);
   }
 }
 
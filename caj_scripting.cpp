@@ -24,14 +24,22 @@
 #include "cajeput_world.h"
 #include "cajeput_user.h"
 #include "caj_vm.h"
+#include "caj_lsl_compile.h"
 #include "caj_version.h"
 #include "caj_script.h"
 #include "caj_logging.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <algorithm>
 #include <deque>
-#include <set>
+#include <map>
+#include <string>
+#include <math.h>
+#include <vector>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 /* This code is reasonably robust, but a tad interesting internally.
    A few rules for dealing with the message-passing stuff:
@@ -47,6 +55,9 @@
      to get any further messages for this script after KILL_SCRIPT, and can't 
      send any after the SCRIPT_KILLED.
    - Messages are delivered in order.
+   - There's actually a pool of script threads (see struct script_worker),
+     but any given script is only ever being run by one of them at once,
+     and "the script thread" above means whichever one that is.
    - The RPC stuff is easy - it just passes ownership of scr->vm to the main 
      thread temporarily in order for it to do the call there.
    - You may think that you can respond to RPCed native calls asynchronously.
@@ -59,41 +70,95 @@
 
 struct sim_script;
 
-struct timer_sched {
-  double time;
+struct list_head {
+  struct list_head *next, *prev;
+};
+
+// Script timers and llSleep delays are kept in a hierarchical timer wheel,
+// so that adding and cancelling them is O(1) no matter how many there are.
+// Level 0 has a slot for each tick of the next TW_SIZE ticks; each level
+// above covers TW_SIZE times as long, and its slots get cascaded down into 
+// the level below as the time comes near. With 4 levels of 64 slots and a
+// 10ms tick, that's 64^4 ticks, or about 46.6 hours; anything further off
+// sits in the top level until it cascades down.
+#define TW_BITS 6
+#define TW_SIZE (1 << TW_BITS)
+#define TW_MASK (TW_SIZE-1)
+#define TW_LEVELS 4
+#define TW_TICK 0.01 // seconds
+#define TW_NEVER G_MAXUINT64
+
+struct tw_timer {
+  list_head list; // must be first
+  guint64 expires; // in ticks
   sim_script *scr;
+  int pending; // on the wheel
+};
 
-  timer_sched(double time_, sim_script *scr_) : time(time_), scr(scr_) { }
-  timer_sched(sim_script *scr_);
+struct timer_wheel {
+  guint64 now; // next tick to be run
+  int count;
+  list_head slots[TW_LEVELS][TW_SIZE];
 };
 
-static inline bool operator< (const timer_sched &s1, const timer_sched &s2) {
-  return s1.time < s2.time || (s1.time == s2.time && s1.scr < s2.scr);
-}
+struct script_msg;
+
+// Scripts are run by a pool of worker threads. Each script has a home 
+// worker, picked round-robin when it's added, and everything to do with 
+// scheduling it - its place on the run queue, its incoming messages and its
+// timer - is protected by the home worker's lock. Workers run scripts off
+// their own run queue, and steal from the back of other workers' queues 
+// when theirs is empty, but the script stays on its home worker's queue 
+// and timers regardless of who last ran it.
+struct script_worker {
+  struct sim_scripts *simscr;
+  GThread *thread;
+  int id;
+
+  GMutex *lock;
+  GCond *cond; // signalled when something's queued while we're asleep
+  int sleeping;
+  list_head runq; // scripts in state SCR_SCHED_QUEUED
+  timer_wheel wheel; // timers and llSleep delays of scripts homed here
+  guint64 wake_tick; // when we're planning to wake up, if sleeping
+};
+
+struct bc_cache_entry;
 
 struct sim_scripts {
   // used by main thread
-  GThread *thread;
   simulator_ctx *sim;
-
-  // used by script thread
-  GTimer *timer;
-  std::set<timer_sched> timers;
-  std::set<timer_sched> delayed; // for llSleep etc.
+  int next_worker;
+  std::map<std::string, bc_cache_entry*> bc_cache; // keyed by bc_cache_key
+  std::deque<std::string> bc_cache_order; // finished entries, oldest first
+  size_t bc_cache_size;
 
   // these are used by both main and scripting threads. Don't modify them.
-  GAsyncQueue *to_st;
+  std::vector<script_worker*> workers;
+  GTimer *timer;
   GAsyncQueue *to_mt;
+  int mt_wake_fd; // eventfd, see send_to_mt
+  GIOChannel *mt_wake_chan; guint mt_wake_watch;
+  volatile gint mt_wake_pending; // already written to mt_wake_fd
   vm_world *vmw;
   caj_logger *log;
-
-  // this is evil. It allows the main thread to access the VM data structures.
-  // However, it's intentionally *not* used for RPC calls in the main thread.
-  GStaticMutex vm_mutex;
-};
-
-struct list_head {
-  struct list_head *next, *prev;
+  caj_lsl_compiler *compiler;
+  GThreadPool *compile_pool;
+  GThreadPool *load_pool; // see load_script
+  int profile_funcs; // [script] profile_funcs
+
+  // Scripts restored in one go, which normally means the region starting
+  // up. boot_start and boot_total are written by the main thread when the
+  // first of a batch is restored; boot_running_ms is set by whichever 
+  // script thread starts the last of them.
+  double boot_start; int boot_total;
+  volatile gint boot_pending; // restored, but not running yet
+  volatile gint boot_seq; // for staggering their first events
+  volatile gint boot_running_ms; // time to all running, or -1 if not yet
+
+  volatile gint queued; // scripts on any worker's run queue
+  volatile gint num_sleeping; // workers waiting for something to do
+  int shutdown; // protected by all the workers' locks
 };
 
 // these are entirely internal. You can change them if you really need to, but
@@ -117,19 +182,71 @@ struct list_head {
 #define SCR_MT_RUNNING 3
 #define SCR_MT_PAUSED 4
 #define SCR_MT_KILLING 5
+#define SCR_MT_LOADING 6 // restored, load_script hasn't finished with it
 
 #define SCRIPT_MAGIC 0xd0f87153
 
 // FIXME - check this!
 #define MAX_LISTENS 16
 
-struct compiler_output {
-  GIOChannel *stdout, *stderr;
-  int len, buflen;
-  char *buf;
+// scheduling states, protected by the home worker's lock
+#define SCR_SCHED_IDLE 0 // nothing to do, or waiting on an RPC or llSleep
+#define SCR_SCHED_QUEUED 1 // on its home worker's run queue
+#define SCR_SCHED_RUNNING 2 // being run by some worker
+#define SCR_SCHED_DEAD 3 // killed, must never be queued again
+
+// how many VM instructions to run a script for before moving on
+#define SCRIPT_SLICE_INSNS 100
+
+// how long a script has to sit idle before its stack and heap are packed 
+// away with vm_script_hibernate, in seconds
+#define SCRIPT_HIBERNATE_AFTER 30.0
+
+// how often a script that keeps changing its globals gets a fresh saved 
+// snapshot (see st_update_saved), in seconds
+#define SCRIPT_SAVE_INTERVAL 10.0
+
+// Restored scripts have their first event held back so that no more than
+// SCRIPT_BOOT_BATCH per worker thread start every SCRIPT_BOOT_STAGGER 
+// seconds, rather than a whole region's worth all at once.
+#define SCRIPT_BOOT_BATCH 50
+#define SCRIPT_BOOT_STAGGER 0.1
+
+// how long the main thread can spend on script requests at once, in seconds
+#define MT_BATCH_TIME 0.005
+
+// A script being compiled. Owned by whichever compile thread has it until
+// it's sent back to the main thread in a CAJ_SMSG_COMPILE_DONE.
+struct compile_job {
+  sim_script *scr;
+  char *src; int src_len;
   compile_done_cb cb; void *cb_priv;
+  std::string key; // bytecode cache key
+  int compiled; // went through a compile thread, so update the cache
+
+  int success;
+  unsigned char *data; size_t data_len; // the bytecode
+  char *output; size_t output_len; // compiler messages
 };
 
+// Compiled bytecode, so identical scripts (which is most of them - think 
+// doors and poseballs) only get compiled once. There's also a copy of 
+// everything that compiles successfully in BC_CACHE_DIR, which survives
+// restarts and is shared with the other regions. Main thread only.
+#define BC_CACHE_DIR "script_cache/"
+#define BC_CACHE_MAX_SIZE (4*1024*1024) // in-memory bytecode, in bytes
+
+struct bc_cache_entry {
+  int compiling;
+  unsigned char *data; size_t data_len;
+  char *output; size_t output_len;
+  std::vector<compile_job*> waiting; // identical scripts added meanwhile
+};
+
+static void bc_cache_free_entry(bc_cache_entry *ent) {
+  free(ent->data); free(ent->output); delete ent;
+}
+
 struct generic_event {
   int event_id;
 
@@ -149,8 +266,14 @@ struct detected_event : generic_event {
   caj_quat rot;
   int det_type;
   struct caj_touch_info touch; // FIXME make optional
+
+  // Further detections merged into the same call, as llDetected* 1, 2, ...
+  // num_det and last are only meaningful on the first one.
+  detected_event *next, *last;
+  int num_det;
   
-  detected_event() : name(NULL), det_type(0) {
+  detected_event() : name(NULL), det_type(0), next(NULL), last(this), 
+		     num_det(1) {
     uuid_clear(key); uuid_clear(owner);
     pos.x = 0.0f; pos.y = 0.0f; pos.z = 0.0f;
     vel.x = 0.0f; vel.y = 0.0f; vel.z = 0.0f;
@@ -166,7 +289,7 @@ struct detected_event : generic_event {
   }
 
   ~detected_event() {
-    free(name);
+    free(name); delete next;
   }
 };
 
@@ -203,43 +326,100 @@ struct filtered_chat_listener {
   char *name, *id, *msg;
 };
 
+// A copy of the prim properties the common getters need, so they can run in
+// the script thread rather than going round the main thread. Only the main
+// thread writes it (see mt_update_snapshot), whenever the prim changes; the 
+// script thread reads it without locking, seqlock-style: seq is odd while 
+// it's being updated, and the reader retries if seq changed underneath it.
+struct prim_snapshot {
+  volatile gint seq; // 0 if not filled in yet
+  caj_vector3 world_pos, local_pos, root_pos, scale;
+  caj_quat rot, root_rot;
+  uuid_t id, owner;
+  int attach_point; // 0 if not attached
+  int name_ok, desc_ok; // zero if too long for the buffers
+  char name[64], desc[128];
+};
+
 struct sim_script {
+  list_head list; // must be first. On home->runq, protected by home->lock
+
   // section used by scripting thread
-  list_head list;
-  int is_running, in_rpc;
+  int in_rpc;
   script_state *vm;
   int state_entry, timer_fired; // HACK!
   double time; // for llGetTime etc
-  double next_timer_event, delay_until;
+  double delay_until;
   detected_event *detected;
   std::deque<generic_event*> pending_events;
+  uint32_t changed; // changed events are just ORed together until delivered
+  int timer_last; // timer was the last event, so the queue goes next
+  // for get_script_stats; also protected by vm_mutex, except queue_drops
+  double run_time; uint32_t num_events, num_rpcs;
+  volatile gint queue_drops;
+
+  // protected by home->lock
+  script_worker *home;
+  int sched; // SCR_SCHED_*
+  std::deque<script_msg*> mail;
+  int timer_pending; // timer's fired, but the script hasn't seen it yet
+  double next_timer_event, delay_sched;
   float timer_interval;
-  uint32_t changed;
+  tw_timer timer_ent, delay_ent, idle_ent;
+  int hibernate_due; // idle_ent fired
+
+  // The script's saved state as of some recent safe point, so save_script
+  // doesn't have to stop the script and serialise it. Written by whoever 
+  // holds vm_mutex, with saved_lock held. saved_stale means the VM's been
+  // dirtied since; next_save is when the scripting thread next updates it.
+  GStaticMutex saved_lock;
+  caj_string saved; int have_saved;
+  volatile gint saved_stale;
+  double next_save;
+
+  // this is evil. It allows the main thread to access the VM data structures.
+  // However, it's intentionally *not* used for RPC calls in the main thread.
+  GStaticMutex vm_mutex;
 
   // section used by main thread
   int mt_state; // state as far as main thread is concerned
   primitive_obj *prim;
-  compiler_output *comp_out;
   std::vector<filtered_chat_listener*> listens;
   int evmask;
 
+  // written by main thread, read by scripting thread
+  prim_snapshot snap;
+
+  // commands sent with ASYNC_TO_MAIN that the main thread hasn't run yet
+  volatile gint cmds_pending;
+
   // used by both threads, basically read-only 
   uint32_t magic;
   sim_scripts *simscr;
-  char *cvm_file; // basically the script executable
+  unsigned char *cvm_data; // bytecode, until the script thread loads it
+  size_t cvm_len;
 
   sim_script(primitive_obj *prim, sim_scripts *simscr) {
     this->prim = prim; mt_state = 0; evmask = 0;
-    is_running = 0; this->simscr = simscr; magic = SCRIPT_MAGIC;
-    detected = NULL; in_rpc = 0; changed = 0;
+    this->simscr = simscr; magic = SCRIPT_MAGIC;
+    detected = NULL; in_rpc = 0; changed = 0; timer_last = 0;
+    run_time = 0.0; num_events = num_rpcs = 0; queue_drops = 0;
     timer_interval = 0.0f; next_timer_event = 0.0; delay_until = 0.0;
-    cvm_file = NULL; vm = NULL; comp_out = NULL;
+    cvm_data = NULL; cvm_len = 0; vm = NULL; cmds_pending = 0;
+    home = simscr->workers[simscr->next_worker++ % simscr->workers.size()];
+    sched = SCR_SCHED_IDLE; timer_pending = 0; 
+    delay_sched = 0.0;
+    timer_ent.scr = this; timer_ent.pending = 0;
+    delay_ent.scr = this; delay_ent.pending = 0;
+    idle_ent.scr = this; idle_ent.pending = 0; hibernate_due = 0;
+    g_static_mutex_init(&vm_mutex);
+    g_static_mutex_init(&saved_lock);
+    saved.data = NULL; saved.len = 0; have_saved = 0;
+    saved_stale = 0; next_save = 0.0;
+    memset(&snap, 0, sizeof(snap));
   }
 };
 
-// FIXME - really want this to be static!
-timer_sched::timer_sched(sim_script *scr_) : time(scr_->next_timer_event), scr(scr_) { }
-
 #define CAJ_SMSG_SHUTDOWN 0
 #define CAJ_SMSG_ADD_SCRIPT 1
 #define CAJ_SMSG_REMOVE_SCRIPT 2
@@ -252,9 +432,25 @@ timer_sched::timer_sched(sim_script *scr_) : time(scr_->next_timer_event), scr(s
 #define CAJ_SMSG_DETECTED 9 // FIXME - rename this to EVENT 
 #define CAJ_SMSG_RESTORE_SCRIPT 10
 #define CAJ_SMSG_CHANGED_EVENT 11
+#define CAJ_SMSG_COMPILE_DONE 12
+#define CAJ_SMSG_ASYNC_CMD 13
+#define CAJ_SMSG_LOAD_DONE 14
 
 typedef void(*script_rpc_func)(script_state *st, sim_script *sc, int func_id);
 
+struct script_cmd;
+typedef void(*script_cmd_func)(sim_script *sc, script_cmd *cmd);
+
+// Arguments for a function that runs in the main thread without the script
+// waiting for it (see ASYNC_TO_MAIN). The strings and list are freed after.
+struct script_cmd {
+  script_cmd_func func;
+  // if the script had too many queued, it waits for this one like an RPC
+  script_state *st; int func_id;
+  int32_t i[2]; float f; caj_vector3 v; caj_quat q;
+  char *s[2]; heap_header *list;
+};
+
 struct script_msg {
   int msg_type;
   sim_script *scr;
@@ -270,18 +466,25 @@ struct script_msg {
     generic_event *event;
     caj_string cstr;
     int changed;
+    compile_job *compile;
+    script_cmd *cmd;
+    script_state *vm; // LOAD_DONE and RESTORE_SCRIPT; NULL if it failed
   } u;
 };
 
 #define MAX_QUEUED_EVENTS 32
+#define MAX_DETECTED 16 // most detections passed to one event call
+#define MAX_QUEUED_CMDS 16
 
 static void rpc_func_return(script_state *st, sim_script *scr, int func_id);
+static void mt_update_snapshot(sim_script *scr);
 
 static void listen_callback(struct simulator_ctx *sim, struct world_obj *obj,
 			    const struct chat_message *msg,
 			    struct obj_chat_listener *listen, void *user_data);
 
-static gboolean mt_process_queued(gpointer data);
+static gboolean mt_process_queued(GIOChannel *source, GIOCondition cond,
+				   gpointer data);
 
 // -------------- script thread code -----------------------------------------
 
@@ -304,47 +507,178 @@ static void list_insert_before(list_head *item, list_head *here) {
   here->prev->next = item; here->prev = item;
 }
 
-static unsigned char *read_file_data(const char *name, int *lenout) {
-  int len = 0, maxlen = 512, ret;
-  unsigned char *data = (unsigned char*)malloc(maxlen);
-  //FILE *f = fopen(name,"r");
-  int fd = open(name,O_RDONLY);
-  if(fd < 0) return NULL;
-  for(;;) {
-    //ret = fread(data+len, maxlen-len, 1, f);
-    ret = read(fd, data+len, maxlen-len);
-    if(ret <= 0) break;
-    len += ret;
-    if(maxlen-len < 256) {
-      maxlen *= 2;
-      data = (unsigned char*)realloc(data, maxlen);
+// ------ timer wheel -------
+
+static void tw_init(timer_wheel *tw, guint64 now) {
+  tw->now = now; tw->count = 0;
+  for(int l = 0; l < TW_LEVELS; l++) {
+    for(int i = 0; i < TW_SIZE; i++) list_head_init(&tw->slots[l][i]);
+  }
+}
+
+// never early, since the wheel only fires timers once that tick has begun
+static guint64 tw_ticks_ceil(double time) {
+  return (guint64)ceil(time / TW_TICK);
+}
+
+static guint64 tw_ticks_floor(double time) {
+  return (guint64)floor(time / TW_TICK);
+}
+
+static void tw_place(timer_wheel *tw, tw_timer *t) {
+  guint64 expires = t->expires;
+  if(expires < tw->now) expires = tw->now;
+  guint64 delta = expires - tw->now;
+  int level = 0;
+  while(level < TW_LEVELS-1 && delta >= ((guint64)1 << (TW_BITS*(level+1))))
+    level++;
+  if(delta >= ((guint64)1 << (TW_BITS*TW_LEVELS))) {
+    // too far in the future. Park it as far out as we can; it'll get put
+    // in the right place when it's cascaded.
+    expires = tw->now + ((guint64)1 << (TW_BITS*TW_LEVELS)) - 1;
+  }
+  int slot = (expires >> (TW_BITS*level)) & TW_MASK;
+  list_insert_before(&t->list, &tw->slots[level][slot]);
+}
+
+static void tw_add(timer_wheel *tw, tw_timer *t, guint64 expires) {
+  assert(!t->pending);
+  // Longer timers don't need to be as precise, so round them up a bit. 
+  // This lets more of them share a tick and thus a wakeup.
+  if(expires > tw->now) {
+    guint64 slack = (expires - tw->now) >> TW_BITS, gran = 1;
+    while(gran*2 <= slack) gran *= 2;
+    expires = (expires + gran - 1) & ~(gran - 1);
+  }
+  t->expires = expires; t->pending = 1; tw->count++;
+  tw_place(tw, t);
+}
+
+static void tw_cancel(timer_wheel *tw, tw_timer *t) {
+  if(!t->pending) return;
+  list_remove(&t->list);
+  t->pending = 0; tw->count--;
+}
+
+// Moves every timer that's due by tick `until` onto the expired list, 
+// leaving them marked as pending so the caller can tell what fired.
+static void tw_run(timer_wheel *tw, guint64 until, list_head *expired) {
+  if(tw->count == 0) {
+    if(until >= tw->now) tw->now = until + 1;
+    return;
+  }
+  while(tw->now <= until) {
+    // when a level wraps round, cascade the next slot of the level above
+    for(int l = 1; l < TW_LEVELS; l++) {
+      if((tw->now & (((guint64)1 << (TW_BITS*l)) - 1)) != 0) break;
+      list_head *slot = &tw->slots[l][(tw->now >> (TW_BITS*l)) & TW_MASK];
+      while(slot->next != slot) {
+	tw_timer *t = (tw_timer*)slot->next;
+	list_remove(&t->list);
+	tw_place(tw, t);
+      }
+    }
+    list_head *slot = &tw->slots[0][tw->now & TW_MASK];
+    while(slot->next != slot) {
+      tw_timer *t = (tw_timer*)slot->next;
+      list_remove(&t->list);
+      if(t->expires > tw->now) {
+	tw_place(tw, t); // parked long timer that's not due yet
+      } else {
+	tw->count--;
+	list_insert_before(&t->list, expired);
+      }
+    }
+    tw->now++;
+    if(tw->count == 0 && until >= tw->now) tw->now = until + 1;
+  }
+}
+
+// The earliest tick at which tw_run might have something to do, which for 
+// timers on the higher levels is when they get cascaded.
+static guint64 tw_next_expiry(timer_wheel *tw) {
+  if(tw->count == 0) return TW_NEVER;
+  guint64 next = TW_NEVER;
+  for(int l = 0; l < TW_LEVELS; l++) {
+    int shift = TW_BITS*l;
+    guint64 cur = tw->now >> shift;
+    for(int i = 0; i < TW_SIZE; i++) {
+      if(tw->slots[l][i].next == &tw->slots[l][i]) continue;
+      guint64 t = ((cur & ~(guint64)TW_MASK) + i) << shift;
+      if(l == 0 ? (i < (int)(cur & TW_MASK)) : (i <= (int)(cur & TW_MASK)))
+	t += (guint64)TW_SIZE << shift;
+      if(t < next) next = t;
     }
   }
-  close(fd); *lenout = len; return data;
+  return next;
 }
 
 static void st_load_script(sim_script *scr) {
   scr->vm = NULL;
-  int len;
-  unsigned char *dat = read_file_data(scr->cvm_file, &len);
-  if(dat == NULL) { CAJ_ERROR("ERROR: can't read script file?!\n"); return; }
+  if(scr->cvm_data == NULL) { CAJ_ERROR("ERROR: no bytecode for script?!\n"); return; }
 
-  scr->vm = vm_load_script(scr->simscr->log, dat, len); free(dat);
+  scr->vm = vm_load_script(scr->simscr->log, scr->simscr->vmw, 
+			   scr->cvm_data, scr->cvm_len); 
+  free(scr->cvm_data); scr->cvm_data = NULL;
   if(scr->vm == NULL) { CAJ_ERROR("ERROR: couldn't load script\n"); return; }
 
   vm_prepare_script(scr->vm, scr, scr->simscr->vmw); 
+  if(scr->simscr->profile_funcs) vm_script_set_profiling(scr->vm, TRUE);
 }
 
-static void st_restore_script(sim_script *scr, caj_string *str) {
-  scr->vm = vm_load_script(scr->simscr->log, str->data, str->len);
+// The VM has already been loaded by load_script.
+static void st_restore_script(sim_script *scr, script_state *vm) {
+  scr->vm = vm;
   if(scr->vm == NULL) { CAJ_ERROR("ERROR: couldn't load script\n"); return; }
 
   vm_prepare_script(scr->vm, scr, scr->simscr->vmw); 
+  if(scr->simscr->profile_funcs) vm_script_set_profiling(scr->vm, TRUE);
 }
 
+// Replaces the script's saved snapshot with str, which it takes ownership
+// of. Call with vm_mutex held.
+static void set_saved_state(sim_script *scr, caj_string *str) {
+  g_static_mutex_lock(&scr->saved_lock);
+  caj_string_free(&scr->saved);
+  caj_string_steal(&scr->saved, str); scr->have_saved = 1;
+  g_atomic_int_set(&scr->saved_stale, 0);
+  g_static_mutex_unlock(&scr->saved_lock);
+}
+
+static void serialise_to_saved(sim_script *scr) {
+  caj_string str; size_t len;
+  str.data = vm_serialise_script(scr->vm, &len);
+  str.len = str.data != NULL ? len : 0;
+  vm_script_clear_dirty(scr->vm);
+  set_saved_state(scr, &str);
+}
+
+// Called at the end of each time slice, with vm_mutex held. Only scripts
+// that have changed their globals get re-serialised, and busy ones no more
+// than every SCRIPT_SAVE_INTERVAL; in between, save_script sees it's stale.
+static void st_update_saved(sim_script *scr, double time_now, int force) {
+  if(!vm_script_is_dirty(scr->vm)) return;
+  if(!force && time_now < scr->next_save) {
+    g_atomic_int_set(&scr->saved_stale, 1); return;
+  }
+  serialise_to_saved(scr);
+  scr->next_save = time_now + SCRIPT_SAVE_INTERVAL;
+}
+
+static void mt_wakeup(sim_scripts *simscr) {
+  uint64_t one = 1;
+  if(g_atomic_int_compare_and_exchange(&simscr->mt_wake_pending, 0, 1)) {
+    if(write(simscr->mt_wake_fd, &one, sizeof(one)) != sizeof(one)) {
+      CAJ_ERROR_L(simscr->log, "ERROR: couldn't wake main thread\n");
+    }
+  }
+}
+
+// Only the first message since the main thread last looked actually wakes
+// it; it then deals with everything queued in one go. 
 static void send_to_mt(sim_scripts *simscr, script_msg *msg) {
   g_async_queue_push(simscr->to_mt, msg);
-  g_idle_add(mt_process_queued, simscr);
+  mt_wakeup(simscr);
 }
 
 /* Delays execution of the script for delay seconds.
@@ -367,7 +701,7 @@ static void do_say(sim_script *scr, int chan, char* message, int chat_type) {
 
 static void do_rpc(script_state *st, sim_script *scr, int func_id, 
 		   script_rpc_func func) {
-  scr->in_rpc = 1;
+  scr->in_rpc = 1; scr->num_rpcs++;
   script_msg *smsg = new script_msg();
   smsg->msg_type = CAJ_SMSG_RPC;
   smsg->scr = scr;
@@ -382,28 +716,88 @@ static void do_rpc(script_state *st, sim_script *scr, int func_id,
   do_rpc(st, scr, func_id, name##_rpc); \
 }
 
-static void st_update_timer_sched(sim_script *scr, double next_event) {
-  sim_scripts *simscr = scr->simscr;
-  if(scr->next_timer_event != 0.0) {
-    assert(simscr->timers.count(timer_sched(scr)) != 0); // FIXME - remove.
-    simscr->timers.erase(timer_sched(scr));
+static void do_async(script_state *st, sim_script *scr, int func_id,
+		     script_cmd *cmd) {
+  if(cmd->list != NULL) cmd->list = vm_list_copy(cmd->list);
+  scr->num_rpcs++;
+  // don't let a script in a tight loop queue up commands without limit
+  if(g_atomic_int_exchange_and_add(&scr->cmds_pending, 1) >= MAX_QUEUED_CMDS) {
+    scr->in_rpc = 1; cmd->st = st; cmd->func_id = func_id;
+  } else {
+    vm_func_return(st, func_id);
   }
+  script_msg *smsg = new script_msg();
+  smsg->msg_type = CAJ_SMSG_ASYNC_CMD;
+  smsg->scr = scr;
+  smsg->u.cmd = cmd;
+  send_to_mt(scr->simscr, smsg);
+}
+
+// For functions that don't return anything and can't fail in any way the 
+// script could notice. The arguments (the ... is passed to vm_func_get_args,
+// and can refer to cmd) are copied out and the script carries on, while
+// name##_cmd runs later in the main thread. Since it goes through the same 
+// queue as RPCs, everything a script does still happens in order.
+#define ASYNC_TO_MAIN(name, delay, ...) static void name##_cb(script_state *st, void *sc_priv, int func_id) { \
+  sim_script *scr = (sim_script*)sc_priv; \
+  script_cmd *cmd = new script_cmd(); cmd->func = name##_cmd; \
+  if(delay > 0.0) delay_script(scr, delay); \
+  vm_func_get_args(st, func_id, __VA_ARGS__); \
+  do_async(st, scr, func_id, cmd); \
+}
+
+// Returns FALSE if the main thread hasn't filled in the snapshot yet.
+static int st_read_snapshot(sim_script *scr, prim_snapshot *out) {
+  for(;;) {
+    gint seq = g_atomic_int_get(&scr->snap.seq);
+    if(seq == 0) return FALSE;
+    if(seq & 1) continue; // mid-update; it won't take long
+    memcpy(out, (const void*)&scr->snap, sizeof(*out));
+    if(g_atomic_int_get(&scr->snap.seq) == seq) return TRUE;
+  }
+}
+
+// For getters that can be answered from the prim_snapshot. name##_snap
+// returns FALSE if it can't, in which case we fall back to name##_rpc. The
+// snapshot is stale while the script has commands queued, and going via the
+// main thread puts us behind them.
+#define SNAPSHOT_OR_RPC(name) static void name##_cb(script_state *st, void *sc_priv, int func_id) { \
+  sim_script *scr = (sim_script*)sc_priv; prim_snapshot snap; \
+  if(g_atomic_int_get(&scr->cmds_pending) == 0 && \
+     st_read_snapshot(scr, &snap) && name##_snap(st, &snap, func_id)) { \
+    vm_func_return(st, func_id); \
+  } else { \
+    do_rpc(st, scr, func_id, name##_rpc); \
+  } \
+}
+
+// call with scr->home->lock held
+static void st_update_timer_sched_locked(sim_script *scr, double next_event) {
+  script_worker *home = scr->home;
+  tw_cancel(&home->wheel, &scr->timer_ent);
   scr->next_timer_event = next_event;
   if(scr->next_timer_event != 0.0) {
-    simscr->timers.insert(timer_sched(scr));
+    tw_add(&home->wheel, &scr->timer_ent, tw_ticks_ceil(next_event));
+    // may need to wake up sooner than it planned to
+    if(home->sleeping && scr->timer_ent.expires < home->wake_tick) 
+      g_cond_signal(home->cond);
   }
 }
 
 static void llSetTimerEvent_cb(script_state *st, void *sc_priv, int func_id) {
   sim_script *scr = (sim_script*)sc_priv;
-  vm_func_get_args(st, func_id, &scr->timer_interval);
+  float interval;
+  vm_func_get_args(st, func_id, &interval);
+  g_mutex_lock(scr->home->lock);
+  scr->timer_interval = interval;
   // FIXME - enforce limit on minimum interval between timer events?
   if(scr->timer_interval <= 0.0f || !finite(scr->timer_interval)) {
-    st_update_timer_sched(scr, 0.0f);
-    scr->timer_fired = 0;
+    st_update_timer_sched_locked(scr, 0.0f);
+    scr->timer_fired = 0; scr->timer_pending = 0;
   } else {
-    st_update_timer_sched(scr, scr->timer_interval+g_timer_elapsed(scr->simscr->timer, NULL));
+    st_update_timer_sched_locked(scr, scr->timer_interval+g_timer_elapsed(scr->simscr->timer, NULL));
   }
+  g_mutex_unlock(scr->home->lock);
   vm_func_return(st, func_id);
 }
 
@@ -504,82 +898,67 @@ static void debug_message_mt(sim_script *scr, const char *msg) {
 }
 
 // actually called from main thread
-static void llSetText_rpc(script_state *st, sim_script *scr, int func_id) {
-  char *text; caj_vector3 color; float alpha;
+static void llSetText_cmd(sim_script *scr, script_cmd *cmd) {
   uint8_t textcol[4];
-  vm_func_get_args(st, func_id, &text, &color, &alpha);
-  textcol[0] = CONVERT_COLOR(color.x);
-  textcol[1] = CONVERT_COLOR(color.y);
-  textcol[2] = CONVERT_COLOR(color.z);
-  textcol[3] = 255-CONVERT_COLOR(alpha);
-  world_prim_set_text(scr->simscr->sim, scr->prim, text, textcol);
-  free(text);
-  rpc_func_return(st, scr, func_id);
+  textcol[0] = CONVERT_COLOR(cmd->v.x);
+  textcol[1] = CONVERT_COLOR(cmd->v.y);
+  textcol[2] = CONVERT_COLOR(cmd->v.z);
+  textcol[3] = 255-CONVERT_COLOR(cmd->f);
+  world_prim_set_text(scr->simscr->sim, scr->prim, cmd->s[0], textcol);
 }
 
-RPC_TO_MAIN(llSetText, 0.0)
+ASYNC_TO_MAIN(llSetText, 0.0, &cmd->s[0], &cmd->v, &cmd->f)
 
-static void llApplyImpulse_rpc(script_state *st, sim_script *scr, int func_id) {
-  caj_vector3 impulse; int is_local;
-  vm_func_get_args(st, func_id, &impulse, &is_local);
-  world_prim_apply_impulse(scr->simscr->sim, scr->prim, impulse, is_local);
-  rpc_func_return(st, scr, func_id);
+static void llApplyImpulse_cmd(sim_script *scr, script_cmd *cmd) {
+  world_prim_apply_impulse(scr->simscr->sim, scr->prim, cmd->v, cmd->i[0]);
 }
 
-RPC_TO_MAIN(llApplyImpulse, 0.0)
+ASYNC_TO_MAIN(llApplyImpulse, 0.0, &cmd->v, &cmd->i[0])
 
-static void llSetPos_rpc(script_state *st, sim_script *scr, int func_id) {
+static void llSetPos_cmd(sim_script *scr, script_cmd *cmd) {
   caj_multi_upd upd; upd.flags = CAJ_MULTI_UPD_POS;
-  vm_func_get_args(st, func_id, &upd.pos);
+  upd.pos = cmd->v;
   if(caj_vect3_dist(&upd.pos, &scr->prim->ob.local_pos) > 10.0f) {
     // FIXME - TODO!
   }
   world_multi_update_obj(scr->simscr->sim, &scr->prim->ob, &upd);
-  rpc_func_return(st, scr, func_id);
 }
 
-RPC_TO_MAIN(llSetPos, 0.2) // FIXME - double check delay
+ASYNC_TO_MAIN(llSetPos, 0.2, &cmd->v) // FIXME - double check delay
 
-static void llSetRot_rpc(script_state *st, sim_script *scr, int func_id) {
+static void llSetRot_cmd(sim_script *scr, script_cmd *cmd) {
   caj_multi_upd upd; upd.flags = CAJ_MULTI_UPD_ROT;
-  vm_func_get_args(st, func_id, &upd.rot);
+  upd.rot = cmd->q;
   // FIXME - normalise quaternion
   world_multi_update_obj(scr->simscr->sim, &scr->prim->ob, &upd);
-  rpc_func_return(st, scr, func_id);
 }
 
-RPC_TO_MAIN(llSetRot, 0.2)
+ASYNC_TO_MAIN(llSetRot, 0.2, &cmd->q)
 
-static void llSetScale_rpc(script_state *st, sim_script *scr, int func_id) {
+static void llSetScale_cmd(sim_script *scr, script_cmd *cmd) {
   caj_multi_upd upd; upd.flags = CAJ_MULTI_UPD_SCALE;
-  vm_func_get_args(st, func_id, &upd.scale);
+  upd.scale = cmd->v;
   // FIXME - limit size!
   world_multi_update_obj(scr->simscr->sim, &scr->prim->ob, &upd);
-  rpc_func_return(st, scr, func_id);
 }
 
-RPC_TO_MAIN(llSetScale, 0.2) // FIXME - what should the delay be?
+ASYNC_TO_MAIN(llSetScale, 0.2, &cmd->v) // FIXME - what should the delay be?
 
-static void llSitTarget_rpc(script_state *st, sim_script *scr, int func_id) {
-  caj_vector3 pos; caj_quat rot;
-  vm_func_get_args(st, func_id, &pos, &rot);
+static void llSitTarget_cmd(sim_script *scr, script_cmd *cmd) {
   // FIXME - clamp these!
-  scr->prim->sit_target = pos; scr->prim->sit_rot = rot;
-  rpc_func_return(st, scr, func_id);
+  scr->prim->sit_target = cmd->v; scr->prim->sit_rot = cmd->q;
 }
 
-RPC_TO_MAIN(llSitTarget, 0.0)
+ASYNC_TO_MAIN(llSitTarget, 0.0, &cmd->v, &cmd->q)
 
-static void llUnSit_rpc(script_state *st, sim_script *scr, int func_id) {
-  char *id; uuid_t agent_id;
-  vm_func_get_args(st, func_id, &id);
-  if(uuid_parse(id, agent_id) == 0 && !uuid_is_null(agent_id)) {
+static void llUnSit_cmd(sim_script *scr, script_cmd *cmd) {
+  uuid_t agent_id;
+  if(uuid_parse(cmd->s[0], agent_id) == 0 && !uuid_is_null(agent_id)) {
     world_unsit_avatar_via_script(scr->simscr->sim, scr->prim, agent_id);
   }
-  rpc_func_return(st, scr, func_id);
 }
 
-RPC_TO_MAIN(llUnSit, 0.0)
+ASYNC_TO_MAIN(llUnSit, 0.0, &cmd->s[0])
 
 
 static void set_prim_params(sim_script *scr, heap_header *rules, world_spp_ctx &spp ) {
@@ -702,45 +1081,43 @@ static void set_prim_params(sim_script *scr, heap_header *rules, world_spp_ctx &
 // NOTE: OpenSim doesn't seem to bother with the delays on 
 // llSetPrimitiveParams etc. However, we're not OpenSim!
 
-static void llSetPrimitiveParams_rpc(script_state *st, sim_script *scr, int func_id) {
+static void llSetPrimitiveParams_cmd(sim_script *scr, script_cmd *cmd) {
   world_spp_ctx spp;
-  heap_header *rules; 
-  vm_func_get_args(st, func_id, &rules);
   world_prim_spp_begin(scr->simscr->sim, scr->prim, &spp);
-  set_prim_params(scr, rules, spp);
-  rpc_func_return(st, scr, func_id);
+  set_prim_params(scr, cmd->list, spp);
 }
 
-RPC_TO_MAIN(llSetPrimitiveParams, 0.2); 
+ASYNC_TO_MAIN(llSetPrimitiveParams, 0.2, &cmd->list); 
 
-static void llSetLinkPrimitiveParams_rpc(script_state *st, sim_script *scr, int func_id) {
+static void llSetLinkPrimitiveParams_cmd(sim_script *scr, script_cmd *cmd) {
   world_spp_ctx spp;
-  int link_num; heap_header *rules; 
-  vm_func_get_args(st, func_id, &link_num, &rules);
-
-
   primitive_obj *prim = world_prim_by_link_id(scr->simscr->sim, scr->prim, 
-					      link_num);
+					      cmd->i[0]);
   if(prim != NULL) {
     world_prim_spp_begin(scr->simscr->sim, prim, &spp);
-    set_prim_params(scr, rules, spp);
+    set_prim_params(scr, cmd->list, spp);
   } else {
     debug_message_mt(scr, "llSetLinkPrimitiveParams: bad link number");
   }
-  rpc_func_return(st, scr, func_id);
 }
 
-RPC_TO_MAIN(llSetLinkPrimitiveParams, 0.2);
+ASYNC_TO_MAIN(llSetLinkPrimitiveParams, 0.2, &cmd->i[0], &cmd->list);
 
-#define llSetLinkPrimitiveParamsFast_rpc llSetLinkPrimitiveParams_rpc
-RPC_TO_MAIN(llSetLinkPrimitiveParamsFast, 0.0);
+#define llSetLinkPrimitiveParamsFast_cmd llSetLinkPrimitiveParams_cmd
+ASYNC_TO_MAIN(llSetLinkPrimitiveParamsFast, 0.0, &cmd->i[0], &cmd->list);
 
 static void llGetPos_rpc(script_state *st, sim_script *scr, int func_id) {
   vm_func_set_vect_ret(st, func_id, &scr->prim->ob.world_pos);
   rpc_func_return(st, scr, func_id);
 }
 
-RPC_TO_MAIN(llGetPos, 0.0)
+static int llGetPos_snap(script_state *st, const prim_snapshot *snap, 
+			 int func_id) {
+  vm_func_set_vect_ret(st, func_id, &snap->world_pos);
+  return TRUE;
+}
+
+SNAPSHOT_OR_RPC(llGetPos)
 
 static void llGetRot_rpc(script_state *st, sim_script *scr, int func_id) {
   // FIXME - should be global rotation
@@ -748,21 +1125,39 @@ static void llGetRot_rpc(script_state *st, sim_script *scr, int func_id) {
   rpc_func_return(st, scr, func_id);
 }
 
-RPC_TO_MAIN(llGetRot, 0.0)
+static int llGetRot_snap(script_state *st, const prim_snapshot *snap, 
+			 int func_id) {
+  vm_func_set_rot_ret(st, func_id, &snap->rot);
+  return TRUE;
+}
+
+SNAPSHOT_OR_RPC(llGetRot)
 
 static void llGetLocalPos_rpc(script_state *st, sim_script *scr, int func_id) {
   vm_func_set_vect_ret(st, func_id, &scr->prim->ob.local_pos);
   rpc_func_return(st, scr, func_id);
 }
 
-RPC_TO_MAIN(llGetLocalPos, 0.0)
+static int llGetLocalPos_snap(script_state *st, const prim_snapshot *snap, 
+			      int func_id) {
+  vm_func_set_vect_ret(st, func_id, &snap->local_pos);
+  return TRUE;
+}
+
+SNAPSHOT_OR_RPC(llGetLocalPos)
 
 static void llGetLocalRot_rpc(script_state *st, sim_script *scr, int func_id) {
   vm_func_set_rot_ret(st, func_id, &scr->prim->ob.rot);
   rpc_func_return(st, scr, func_id);
 }
 
-RPC_TO_MAIN(llGetLocalRot, 0.0)
+static int llGetLocalRot_snap(script_state *st, const prim_snapshot *snap, 
+			      int func_id) {
+  vm_func_set_rot_ret(st, func_id, &snap->rot);
+  return TRUE;
+}
+
+SNAPSHOT_OR_RPC(llGetLocalRot)
 
 static void llGetRootPosition_rpc(script_state *st, sim_script *scr, int func_id) {
   primitive_obj *root = world_get_root_prim(scr->prim);
@@ -770,7 +1165,13 @@ static void llGetRootPosition_rpc(script_state *st, sim_script *scr, int func_id
   rpc_func_return(st, scr, func_id);
 }
 
-RPC_TO_MAIN(llGetRootPosition, 0.0)
+static int llGetRootPosition_snap(script_state *st, const prim_snapshot *snap, 
+				  int func_id) {
+  vm_func_set_vect_ret(st, func_id, &snap->root_pos);
+  return TRUE;
+}
+
+SNAPSHOT_OR_RPC(llGetRootPosition)
 
 static void llGetRootRotation_rpc(script_state *st, sim_script *scr, int func_id) {
   primitive_obj *root = world_get_root_prim(scr->prim);
@@ -779,7 +1180,13 @@ static void llGetRootRotation_rpc(script_state *st, sim_script *scr, int func_id
   rpc_func_return(st, scr, func_id);
 }
 
-RPC_TO_MAIN(llGetRootRotation, 0.0)
+static int llGetRootRotation_snap(script_state *st, const prim_snapshot *snap, 
+				  int func_id) {
+  vm_func_set_rot_ret(st, func_id, &snap->root_rot);
+  return TRUE;
+}
+
+SNAPSHOT_OR_RPC(llGetRootRotation)
 
 static void llGetNumberOfPrims_rpc(script_state *st, sim_script *scr, int func_id) {
   // FIXME - revisit and check when we support sitting on prims
@@ -795,7 +1202,20 @@ static void llGetScale_rpc(script_state *st, sim_script *scr, int func_id) {
   rpc_func_return(st, scr, func_id);
 }
 
-RPC_TO_MAIN(llGetScale, 0.0)
+static int llGetScale_snap(script_state *st, const prim_snapshot *snap, 
+			   int func_id) {
+  vm_func_set_vect_ret(st, func_id, &snap->scale);
+  return TRUE;
+}
+
+SNAPSHOT_OR_RPC(llGetScale)
+
+static void llGetMass_rpc(script_state *st, sim_script *scr, int func_id) {
+  vm_func_set_float_ret(st, func_id, world_object_mass(&scr->prim->ob));
+  rpc_func_return(st, scr, func_id);
+}
+
+RPC_TO_MAIN(llGetMass, 0.0)
 
 static void llGetKey_rpc(script_state *st, sim_script *scr, int func_id) {
   // FIXME - should this be the root prim?
@@ -803,7 +1223,13 @@ static void llGetKey_rpc(script_state *st, sim_script *scr, int func_id) {
   rpc_func_return(st, scr, func_id);
 }
 
-RPC_TO_MAIN(llGetKey, 0.0)
+static int llGetKey_snap(script_state *st, const prim_snapshot *snap, 
+			 int func_id) {
+  vm_func_set_key_ret(st, func_id, snap->id);
+  return TRUE;
+}
+
+SNAPSHOT_OR_RPC(llGetKey)
 
 static void llGetOwner_rpc(script_state *st, sim_script *scr, int func_id) {
   // FIXME - should this be the root prim?
@@ -811,7 +1237,13 @@ static void llGetOwner_rpc(script_state *st, sim_script *scr, int func_id) {
   rpc_func_return(st, scr, func_id);
 }
 
-RPC_TO_MAIN(llGetOwner, 0.0)
+static int llGetOwner_snap(script_state *st, const prim_snapshot *snap, 
+			   int func_id) {
+  vm_func_set_key_ret(st, func_id, snap->owner);
+  return TRUE;
+}
+
+SNAPSHOT_OR_RPC(llGetOwner)
 
 static void llGetAttached_rpc(script_state *st, sim_script *scr, int func_id) {
   primitive_obj* root = world_get_root_prim(scr->prim);
@@ -823,7 +1255,13 @@ static void llGetAttached_rpc(script_state *st, sim_script *scr, int func_id) {
   rpc_func_return(st, scr, func_id);
 }
 
-RPC_TO_MAIN(llGetAttached, 0.0)
+static int llGetAttached_snap(script_state *st, const prim_snapshot *snap, 
+			      int func_id) {
+  vm_func_set_int_ret(st, func_id, snap->attach_point);
+  return TRUE;
+}
+
+SNAPSHOT_OR_RPC(llGetAttached)
 
 static void llAvatarOnSitTarget_rpc(script_state *st, sim_script *scr, int func_id) {
   // FIXME - should return NULL_KEY if we don't have a sit target
@@ -861,14 +1299,28 @@ static void llGetObjectName_rpc(script_state *st, sim_script *scr, int func_id)
   rpc_func_return(st, scr, func_id);
 }
 
-RPC_TO_MAIN(llGetObjectName, 0.0)
+static int llGetObjectName_snap(script_state *st, const prim_snapshot *snap, 
+				int func_id) {
+  if(!snap->name_ok) return FALSE;
+  vm_func_set_str_ret(st, func_id, snap->name);
+  return TRUE;
+}
+
+SNAPSHOT_OR_RPC(llGetObjectName)
 
 static void llGetObjectDesc_rpc(script_state *st, sim_script *scr, int func_id) {
   vm_func_set_str_ret(st, func_id, scr->prim->description);
   rpc_func_return(st, scr, func_id);
 }
 
-RPC_TO_MAIN(llGetObjectDesc, 0.0)
+static int llGetObjectDesc_snap(script_state *st, const prim_snapshot *snap, 
+				int func_id) {
+  if(!snap->desc_ok) return FALSE;
+  vm_func_set_str_ret(st, func_id, snap->desc);
+  return TRUE;
+}
+
+SNAPSHOT_OR_RPC(llGetObjectDesc)
 
 
 static void llKey2Name_rpc(script_state *st, sim_script *scr, int func_id) {
@@ -922,6 +1374,20 @@ static void llGetOwnerKey_rpc(script_state *st, sim_script *scr, int func_id) {
 
 RPC_TO_MAIN(llGetOwnerKey, 0.0);
 
+static void llGetObjectMass_rpc(script_state *st, sim_script *scr, int func_id) {
+  char *id; uuid_t uuid; float mass = 0.0f;
+  vm_func_get_args(st, func_id, &id);
+  if(uuid_parse(id, uuid) == 0) {
+    world_obj* obj = world_object_by_id(scr->simscr->sim, uuid);
+    if(obj != NULL) mass = world_object_mass(obj);
+  }
+  vm_func_set_float_ret(st, func_id, mass);
+  free(id);
+  rpc_func_return(st, scr, func_id);  
+}
+
+RPC_TO_MAIN(llGetObjectMass, 0.0);
+
 
 // We're not as paranoid as OpenSim yet, so this isn't restricted. May be
 // modified to provide restricted version information to untrusted scripts at
@@ -968,12 +1434,20 @@ static void osTeleportAgent_name_rpc(script_state *st, sim_script *scr, int func
 
 RPC_TO_MAIN(osTeleportAgent_name, 5.0);
 
+// the num'th detection in the event we're handling, or NULL if none
+static detected_event *get_detected(sim_script *scr, int num) {
+  detected_event *det = scr->detected;
+  for( ; det != NULL && num > 0; num--) det = det->next;
+  return num < 0 ? NULL : det;
+}
+
 static void llDetectedName_cb(script_state *st, void *sc_priv, int func_id) {
   sim_script *scr = (sim_script*)sc_priv;
   int num;
   vm_func_get_args(st, func_id, &num);
-  if(scr->detected != NULL && num == 0 && scr->detected->name != NULL) {
-    vm_func_set_str_ret(st, func_id, scr->detected->name);
+  detected_event *det = get_detected(scr, num);
+  if(det != NULL && det->name != NULL) {
+    vm_func_set_str_ret(st, func_id, det->name);
   } else {
     vm_func_set_str_ret(st, func_id, "");
   }
@@ -984,8 +1458,9 @@ static void llDetectedType_cb(script_state *st, void *sc_priv, int func_id) {
   sim_script *scr = (sim_script*)sc_priv;
   int num;
   vm_func_get_args(st, func_id, &num);
-  if(scr->detected != NULL && num == 0) {
-    vm_func_set_int_ret(st, func_id, scr->detected->det_type);
+  detected_event *det = get_detected(scr, num);
+  if(det != NULL) {
+    vm_func_set_int_ret(st, func_id, det->det_type);
   } else {
     vm_func_set_int_ret(st, func_id, 0);
   }
@@ -1001,8 +1476,9 @@ static void llDetectedKey_cb(script_state *st, void *sc_priv, int func_id) {
   sim_script *scr = (sim_script*)sc_priv;
   int num;
   vm_func_get_args(st, func_id, &num);
-  if(scr->detected != NULL && num == 0) {
-    vm_func_set_key_ret(st, func_id, scr->detected->key);
+  detected_event *det = get_detected(scr, num);
+  if(det != NULL) {
+    vm_func_set_key_ret(st, func_id, det->key);
   } else {
     vm_func_set_key_ret(st, func_id, zero_uuid);
   }
@@ -1014,8 +1490,9 @@ static void llDetectedPos_cb(script_state *st, void *sc_priv, int func_id) {
   sim_script *scr = (sim_script*)sc_priv;
   int num;
   vm_func_get_args(st, func_id, &num);
-  if(scr->detected != NULL && num == 0) {
-    vm_func_set_vect_ret(st, func_id, &scr->detected->pos);
+  detected_event *det = get_detected(scr, num);
+  if(det != NULL) {
+    vm_func_set_vect_ret(st, func_id, &det->pos);
   } else {
     vm_func_set_vect_ret(st, func_id, &zero_vect);
   }
@@ -1026,8 +1503,9 @@ static void llDetectedRot_cb(script_state *st, void *sc_priv, int func_id) {
   sim_script *scr = (sim_script*)sc_priv;
   int num;
   vm_func_get_args(st, func_id, &num);
-  if(scr->detected != NULL && num == 0) {
-    vm_func_set_rot_ret(st, func_id, &scr->detected->rot);
+  detected_event *det = get_detected(scr, num);
+  if(det != NULL) {
+    vm_func_set_rot_ret(st, func_id, &det->rot);
   } else {
     vm_func_set_rot_ret(st, func_id, &zero_rot);
   }
@@ -1038,8 +1516,9 @@ static void llDetectedVel_cb(script_state *st, void *sc_priv, int func_id) {
   sim_script *scr = (sim_script*)sc_priv;
   int num;
   vm_func_get_args(st, func_id, &num);
-  if(scr->detected != NULL && num == 0) {
-    vm_func_set_vect_ret(st, func_id, &scr->detected->vel);
+  detected_event *det = get_detected(scr, num);
+  if(det != NULL) {
+    vm_func_set_vect_ret(st, func_id, &det->vel);
   } else {
     vm_func_set_vect_ret(st, func_id, &zero_vect);
   }
@@ -1050,8 +1529,9 @@ static void llDetectedTouchFace_cb(script_state *st, void *sc_priv, int func_id)
   sim_script *scr = (sim_script*)sc_priv;
   int num;
   vm_func_get_args(st, func_id, &num);
-  if(scr->detected != NULL && num == 0) {
-    vm_func_set_int_ret(st, func_id, scr->detected->touch.face_index);
+  detected_event *det = get_detected(scr, num);
+  if(det != NULL) {
+    vm_func_set_int_ret(st, func_id, det->touch.face_index);
   } else {
     vm_func_set_int_ret(st, func_id, -1);
   }
@@ -1064,8 +1544,9 @@ static void llDetectedTouchUV_cb(script_state *st, void *sc_priv, int func_id) {
   sim_script *scr = (sim_script*)sc_priv;
   int num;
   vm_func_get_args(st, func_id, &num);
-  if(scr->detected != NULL && num == 0) {
-    vm_func_set_vect_ret(st, func_id, &scr->detected->touch.uv);
+  detected_event *det = get_detected(scr, num);
+  if(det != NULL) {
+    vm_func_set_vect_ret(st, func_id, &det->touch.uv);
   } else {
     vm_func_set_vect_ret(st, func_id, &null_v);
   }
@@ -1078,8 +1559,9 @@ static void llDetectedTouchST_cb(script_state *st, void *sc_priv, int func_id) {
   sim_script *scr = (sim_script*)sc_priv;
   int num;
   vm_func_get_args(st, func_id, &num);
-  if(scr->detected != NULL && num == 0) {
-    vm_func_set_vect_ret(st, func_id, &scr->detected->touch.st);
+  detected_event *det = get_detected(scr, num);
+  if(det != NULL) {
+    vm_func_set_vect_ret(st, func_id, &det->touch.st);
   } else {
     vm_func_set_vect_ret(st, func_id, &null_v);
   }
@@ -1106,14 +1588,13 @@ static void llGetRegionCorner_rpc(script_state *st, sim_script *scr, int func_id
 
 RPC_TO_MAIN(llGetRegionCorner, 0.0);
 
-static void llMessageLinked_rpc(script_state *st, sim_script *scr, int func_id) {
-  int link_num, num; char *str, *id;
-  vm_func_get_args(st, func_id, &link_num, &num, &str, &id);
-  world_script_link_message(scr->simscr->sim, scr->prim, link_num, num, str, id);
-  free(str); free(id); rpc_func_return(st, scr, func_id);
+static void llMessageLinked_cmd(sim_script *scr, script_cmd *cmd) {
+  world_script_link_message(scr->simscr->sim, scr->prim, cmd->i[0], cmd->i[1],
+			    cmd->s[0], cmd->s[1]);
 }
 
-RPC_TO_MAIN(llMessageLinked, 0.0);
+ASYNC_TO_MAIN(llMessageLinked, 0.0, &cmd->i[0], &cmd->i[1], &cmd->s[0], 
+	      &cmd->s[1]);
 
 static void llListen_rpc(script_state *st, sim_script *scr, int func_id) {
   int channel; char *name, *id, *message;
@@ -1292,11 +1773,34 @@ static void script_upd_evmask(sim_script *scr) {
   
 }
 
-static void awaken_script(sim_script *scr, list_head *running) {
-  if(!scr->is_running) {
-    // yes, we really do schedule this to run next.
-    scr->is_running = 1; list_remove(&scr->list);
-    list_insert_after(&scr->list, running);
+// Queues the script on its home worker if it isn't already queued or 
+// running. Call with scr->home->lock held. Returns TRUE if some other idle
+// worker should be poked to come and steal it, since the home one is busy.
+static int wake_script_locked(sim_script *scr) {
+  script_worker *home = scr->home;
+  if(scr->sched != SCR_SCHED_IDLE) return FALSE;
+  // yes, we really do schedule this to run next.
+  scr->sched = SCR_SCHED_QUEUED;
+  list_insert_after(&scr->list, &home->runq);
+  g_atomic_int_inc(&scr->simscr->queued);
+  if(home->sleeping) {
+    g_cond_signal(home->cond); return FALSE;
+  }
+  return g_atomic_int_get(&scr->simscr->num_sleeping) > 0;
+}
+
+// call without holding any worker locks
+static void wake_idle_worker(sim_scripts *simscr) {
+  for(std::vector<script_worker*>::iterator iter = simscr->workers.begin();
+      iter != simscr->workers.end(); iter++) {
+    script_worker *worker = *iter;
+    g_mutex_lock(worker->lock);
+    if(worker->sleeping) {
+      g_cond_signal(worker->cond);
+      g_mutex_unlock(worker->lock);
+      return;
+    }
+    g_mutex_unlock(worker->lock);
   }
 }
 
@@ -1307,229 +1811,426 @@ static void state_change_cb(script_state *st, void *sc_priv) {
   // FIXME - need to do a whole bunch of other stuff.
 }
 
-static gpointer script_thread(gpointer data) {
-  sim_scripts *simscr = (sim_scripts*)data;
-  list_head running, waiting;
-  list_head_init(&running); list_head_init(&waiting);
-  simscr->timer = g_timer_new();
-  for(;;) {
-    g_static_mutex_lock(&simscr->vm_mutex);
-    double time_now = g_timer_elapsed(simscr->timer, NULL);
-    while(!simscr->timers.empty() && simscr->timers.begin()->time < time_now) {
-      sim_script *scr = simscr->timers.begin()->scr;
-      scr->timer_fired = 1; awaken_script(scr, &running);
-      st_update_timer_sched(scr, time_now + scr->timer_interval);
+static int is_detected_event(int event_id) {
+  switch(event_id) {
+  case EVENT_TOUCH_START:
+  case EVENT_TOUCH_END:
+  case EVENT_TOUCH:
+  case EVENT_COLLISION_START:
+  case EVENT_COLLISION_END:
+  case EVENT_COLLISION:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// Queues an event for the script. Touches and collisions are merged into the
+// newest queued detected event if it's the same type, so a burst of them 
+// becomes a single call with up to MAX_DETECTED detections. Only the newest
+// is considered, so a touch_start never overtakes an earlier touch_end.
+static void st_queue_event(sim_script *scr, generic_event *event) {
+  int event_id = event->event_id;
+  int is_cont = event_id == EVENT_TOUCH || event_id == EVENT_COLLISION;
+  if(is_detected_event(event_id)) {
+    detected_event *det = static_cast<detected_event*>(event);
+    for(std::deque<generic_event*>::reverse_iterator iter = 
+	  scr->pending_events.rbegin(); iter != scr->pending_events.rend(); 
+	iter++) {
+      if(!is_detected_event((*iter)->event_id)) continue;
+      if((*iter)->event_id != event_id) break;
+
+      detected_event *head = static_cast<detected_event*>(*iter);
+      if(is_cont) {
+	// a continuing touch or collision with something that's already 
+	// queued just updates it
+	for(detected_event *old = head; old != NULL; old = old->next) {
+	  if(uuid_compare(old->key, det->key) == 0) {
+	    std::swap(old->name, det->name);
+	    old->pos = det->pos; old->rot = det->rot; old->vel = det->vel;
+	    old->det_type = det->det_type; old->touch = det->touch;
+	    delete det; return;
+	  }
+	}
+      }
+      if(head->num_det < MAX_DETECTED) {
+	head->last->next = det; head->last = det;
+	head->num_det++; return;
+      }
+      break;
     }
+  }
 
-    // FIXME - we really want to schedule these earliest time first!
-    while(!simscr->delayed.empty() && 
-	  simscr->delayed.begin()->time < time_now) {
-      sim_script *scr = simscr->delayed.begin()->scr;
-      awaken_script(scr, &running); 
-      simscr->delayed.erase(simscr->delayed.begin());
+  if(scr->pending_events.size() >= MAX_QUEUED_EVENTS) {
+    // Continuing touches and collisions are the least important thing in 
+    // the queue, since there'll be another along shortly; drop the oldest
+    // one to make room for anything else.
+    std::deque<generic_event*>::iterator iter = scr->pending_events.begin();
+    if(!is_cont) {
+      for( ; iter != scr->pending_events.end(); iter++) {
+	if((*iter)->event_id == EVENT_TOUCH || 
+	   (*iter)->event_id == EVENT_COLLISION) break;
+      }
+    }
+    CAJ_DEBUG_L(scr->simscr->log, "DEBUG: discarding script event due to queue size\n");
+    g_atomic_int_inc(&scr->queue_drops);
+    if(is_cont || iter == scr->pending_events.end()) {
+      delete event; return;
     }
+    delete *iter; scr->pending_events.erase(iter);
+  }
+  scr->pending_events.push_back(event);
+}
 
-    for(int i = 0; i < 20; i++) {
-      if(running.next == &running) break;
-      sim_script *scr = (sim_script*)running.next; 
-      assert(scr->is_running);
-      if(scr->in_rpc) {
-	// deschedule. Special-cased because we don't have ownership of scr->vm
-	// during RPC calls to the main thread.
-	scr->is_running = 0; list_remove(&scr->list);
-	list_insert_after(&scr->list, &waiting);
-	continue;
-      }
-      if(scr->delay_until > time_now) {
-	// the script is being delayed, deschedule.
-	simscr->delayed.insert(timer_sched(scr->delay_until, scr));
-	scr->is_running = 0; list_remove(&scr->list);
-	list_insert_after(&scr->list, &waiting);
-	continue;
-      }
+// When a restored script's first event may run; see SCRIPT_BOOT_STAGGER.
+static double st_boot_slot(sim_scripts *simscr) {
+  int seq = g_atomic_int_exchange_and_add(&simscr->boot_seq, 1);
+  int per_slot = SCRIPT_BOOT_BATCH * simscr->workers.size();
+  return simscr->boot_start + (seq / per_slot) * SCRIPT_BOOT_STAGGER;
+}
 
-      if(vm_script_is_idle(scr->vm)) {
-	if(scr->detected != NULL) {
-	  // FIXME - this is leaked if the script is destroyed at the wrong time
-	  delete scr->detected; scr->detected = NULL;
-	}
+static void boot_script_done(sim_scripts *simscr) {
+  if(!g_atomic_int_dec_and_test(&simscr->boot_pending)) return;
+  double elapsed = g_timer_elapsed(simscr->timer, NULL) - simscr->boot_start;
+  g_atomic_int_set(&simscr->boot_running_ms, (int)(elapsed*1000.0));
+  CAJ_INFO_L(simscr->log, "INFO: all %i restored scripts running after "
+	     "%.3f s\n", simscr->boot_total, elapsed);
+}
+
+// Handles a message for a script we're running. Returns TRUE if the script 
+// has been killed, in which case the caller mustn't touch it again.
+static int st_handle_msg(script_worker *worker, sim_script *scr, 
+			 script_msg *msg) {
+  sim_scripts *simscr = scr->simscr;
+  switch(msg->msg_type) {
+  case CAJ_SMSG_ADD_SCRIPT:
+    CAJ_DEBUG_L(simscr->log, "DEBUG: handling ADD_SCRIPT\n");
+    g_static_mutex_lock(&scr->vm_mutex);
+    scr->time = g_timer_elapsed(simscr->timer, NULL);
+    st_load_script(scr);
+    g_static_mutex_unlock(&scr->vm_mutex);
+    if(scr->vm != NULL) {
+      script_upd_evmask(scr);
+    } else {
+      CAJ_DEBUG_L(simscr->log, "DEBUG: failed to load script\n");
+      // FIXME - what to do?
+    }
+    break;
+  case CAJ_SMSG_RESTORE_SCRIPT:
+    CAJ_DEBUG_L(simscr->log, "DEBUG: handling RESTORE_SCRIPT\n");
+    g_static_mutex_lock(&scr->vm_mutex);
+    scr->time = g_timer_elapsed(simscr->timer, NULL);
+    st_restore_script(scr, msg->u.vm);
+    if(scr->vm != NULL) {
+      // what we restored from is already a perfectly good snapshot
+      vm_script_clear_dirty(scr->vm);
+      scr->next_save = scr->time + SCRIPT_SAVE_INTERVAL;
+      scr->delay_until = st_boot_slot(simscr);
+    }
+    g_static_mutex_unlock(&scr->vm_mutex);
+    boot_script_done(simscr);
+    if(scr->vm != NULL) {
+      script_upd_evmask(scr);
+    } else {
+      CAJ_DEBUG_L(simscr->log, "DEBUG: failed to load script\n");
+      // FIXME - what to do?
+    }
+    break;
+  case CAJ_SMSG_KILL_SCRIPT:
+    CAJ_DEBUG_L(simscr->log, "DEBUG: got KILL_SCRIPT\n");
+    g_mutex_lock(scr->home->lock);
+    st_update_timer_sched_locked(scr, 0.0);
+    tw_cancel(&scr->home->wheel, &scr->delay_ent);
+    tw_cancel(&scr->home->wheel, &scr->idle_ent);
+    scr->delay_sched = 0.0;
+    scr->sched = SCR_SCHED_DEAD;
+    g_mutex_unlock(scr->home->lock);
+    if(scr->vm != NULL) vm_free_script(scr->vm);
+    scr->vm = NULL;
+    delete scr->detected; scr->detected = NULL;
+    while(!scr->pending_events.empty()) {
+      delete scr->pending_events.front(); scr->pending_events.pop_front();
+    }
+	
+    // sending this message must be the last thing we do with the script
+    msg->msg_type = CAJ_SMSG_SCRIPT_KILLED;
+    send_to_mt(simscr, msg);
+    return TRUE;
+  case CAJ_SMSG_RPC_RETURN:
+    assert(scr->in_rpc); scr->in_rpc = 0;
+    break;
+  case CAJ_SMSG_DETECTED:
+    st_queue_event(scr, msg->u.event);
+    break;
+  case CAJ_SMSG_CHANGED_EVENT:
+    scr->changed |= msg->u.changed;
+    break;
+  }
+
+  delete msg;
+  return FALSE;
+}
+
+// Runs one slice of a script that we've just taken off a run queue and 
+// marked SCR_SCHED_RUNNING, then puts it back on its home worker's queue 
+// if it has more to do.
+static void st_run_script(script_worker *worker, sim_script *scr) {
+  script_worker *home = scr->home;
+  std::deque<script_msg*> mail;
+
+  g_mutex_lock(home->lock);
+  mail.swap(scr->mail);
+  if(scr->timer_pending) {
+    scr->timer_fired = 1; scr->timer_pending = 0;
+  }
+  int hibernate = scr->hibernate_due; scr->hibernate_due = 0;
+  g_mutex_unlock(home->lock);
 
-	if(scr->state_entry) {
-	  CAJ_DEBUG("DEBUG: calling state_entry\n");
-	  scr->state_entry = 0;
-	  vm_call_event(scr->vm,EVENT_STATE_ENTRY);
-	} else if(scr->changed != 0) {
-	  vm_call_event(scr->vm, EVENT_CHANGED, scr->changed);
-	  scr->changed = 0;
-	} else if(scr->timer_fired) {
-	  scr->timer_fired = 0;
-	  vm_call_event(scr->vm,EVENT_TIMER);
-	} else if(!scr->pending_events.empty()) {
-	  // FIXME - coalesce detected events into one call somehow
-	  
-	  CAJ_DEBUG("DEBUG: handing pending queued event\n");
-	  generic_event *event = scr->pending_events.front();
-	  scr->pending_events.pop_front();
-	  switch(event->event_id) {
-	  case EVENT_TOUCH_START:
-	  case EVENT_TOUCH_END:
-	  case EVENT_TOUCH:
-	  case EVENT_COLLISION_START:
-	  case EVENT_COLLISION_END:
-	  case EVENT_COLLISION:
-	    scr->detected = static_cast<detected_event*>(event);
-	    vm_call_event(scr->vm, event->event_id, 1);
+  for(std::deque<script_msg*>::iterator iter = mail.begin(); 
+      iter != mail.end(); iter++) {
+    if(st_handle_msg(worker, scr, *iter)) {
+      // anything after the KILL_SCRIPT would be a bug in the main thread
+      assert(iter+1 == mail.end());
+      return;
+    }
+  }
+
+  int more_work = 0, ran = 0;
+  double time_now = g_timer_elapsed(scr->simscr->timer, NULL);
+  // the main thread owns scr->vm during RPC calls, so leave it alone.
+  if(scr->vm != NULL && !scr->in_rpc && scr->delay_until <= time_now) {
+    g_static_mutex_lock(&scr->vm_mutex);
+    if(vm_script_is_idle(scr->vm)) {
+      if(scr->detected != NULL) {
+	// FIXME - this is leaked if the script is destroyed at the wrong time
+	delete scr->detected; scr->detected = NULL;
+      }
+
+      if(scr->state_entry) {
+	CAJ_DEBUG("DEBUG: calling state_entry\n");
+	scr->state_entry = 0;
+	vm_call_event(scr->vm,EVENT_STATE_ENTRY);
+      } else if(scr->changed != 0) {
+	vm_call_event(scr->vm, EVENT_CHANGED, scr->changed);
+	scr->changed = 0;
+      } else if(scr->timer_fired && 
+		(!scr->timer_last || scr->pending_events.empty())) {
+	// the timer and the queue take turns, so neither a fast timer nor
+	// a flood of messages can starve the other
+	scr->timer_fired = 0; scr->timer_last = 1;
+	vm_call_event(scr->vm,EVENT_TIMER);
+      } else if(!scr->pending_events.empty()) {
+	CAJ_DEBUG("DEBUG: handing pending queued event\n");
+	scr->timer_last = 0;
+	generic_event *event = scr->pending_events.front();
+	scr->pending_events.pop_front();
+	switch(event->event_id) {
+	case EVENT_TOUCH_START:
+	case EVENT_TOUCH_END:
+	case EVENT_TOUCH:
+	case EVENT_COLLISION_START:
+	case EVENT_COLLISION_END:
+	case EVENT_COLLISION:
+	  scr->detected = static_cast<detected_event*>(event);
+	  vm_call_event(scr->vm, event->event_id, scr->detected->num_det);
+	  break;
+	case EVENT_LINK_MESSAGE:
+	  {
+	    link_message_event *lmsg = static_cast<link_message_event*>(event);
+	    vm_call_event(scr->vm,  EVENT_LINK_MESSAGE, lmsg->sender_num, 
+			  lmsg->num, lmsg->str, lmsg->id);
+	    delete lmsg;
 	    break;
-	  case EVENT_LINK_MESSAGE:
-	    {
-	      link_message_event *lmsg = static_cast<link_message_event*>(event);
-	      vm_call_event(scr->vm,  EVENT_LINK_MESSAGE, lmsg->sender_num, 
-			    lmsg->num, lmsg->str, lmsg->id);
-	      delete lmsg;
-	      break;
-	    }
-	  case EVENT_CHAT_MESSAGE:
-	    {
-	      chat_message_event *cmsg = static_cast<chat_message_event*>(event);
-	      vm_call_event(scr->vm, EVENT_CHAT_MESSAGE, cmsg->channel, 
-			    cmsg->name, cmsg->id, cmsg->msg);
-	      delete cmsg;
-	      break;
-	    }
-	  default:
-	    CAJ_DEBUG("INTERNAL ERROR: unhandled event type - impossible!\n");
-	    delete event;
+	  }
+	case EVENT_CHAT_MESSAGE:
+	  {
+	    chat_message_event *cmsg = static_cast<chat_message_event*>(event);
+	    vm_call_event(scr->vm, EVENT_CHAT_MESSAGE, cmsg->channel, 
+			  cmsg->name, cmsg->id, cmsg->msg);
+	    delete cmsg;
 	    break;
 	  }
+	default:
+	  CAJ_DEBUG("INTERNAL ERROR: unhandled event type - impossible!\n");
+	  delete event;
+	  break;
 	}
-	// FIXME - schedule events
       }
-      if(vm_script_is_runnable(scr->vm)) {
-	vm_run_script(scr->vm, 100);
-      } else {
-	if(vm_script_has_failed(scr->vm)) {
-	  do_say(scr, DEBUG_CHANNEL, vm_script_get_error(scr->vm),
-		 CHAT_TYPE_NORMAL);
-	}
-	// deschedule.
-	scr->is_running = 0;  list_remove(&scr->list);
-	list_insert_after(&scr->list, &waiting);
+      if(!vm_script_is_idle(scr->vm)) scr->num_events++;
+    }
+    if(vm_script_is_runnable(scr->vm)) {
+      vm_run_script(scr->vm, SCRIPT_SLICE_INSNS);
+      scr->run_time += g_timer_elapsed(scr->simscr->timer, NULL) - time_now;
+      more_work = 1; ran = 1;
+    } else if(vm_script_has_failed(scr->vm)) {
+      do_say(scr, DEBUG_CHANNEL, vm_script_get_error(scr->vm),
+	     CHAT_TYPE_NORMAL);
+    } else {
+      more_work = scr->state_entry || scr->changed != 0 || 
+	scr->timer_fired || !scr->pending_events.empty();
+      // it'll wake up again by itself when it next gets an event. Saving it
+      // first means nothing has to wake it just to serialise it.
+      if(!more_work && hibernate) {
+	st_update_saved(scr, time_now, TRUE);
+	vm_script_hibernate(scr->vm);
       }
     }
-    g_static_mutex_unlock(&simscr->vm_mutex);
-
-    script_msg *msg;
-    for(;;) {
-      double next_event = 0.0;
-      if(!simscr->timers.empty())
-	next_event = simscr->timers.begin()->time;
-      if(!simscr->delayed.empty() && 
-	 simscr->delayed.begin()->time < next_event)
-	next_event = simscr->delayed.begin()->time;
-      if(running.next != &running) {
-	msg = (script_msg*)g_async_queue_try_pop(simscr->to_st);
-      } else if(next_event == 0.0) {
-	msg = (script_msg*)g_async_queue_pop(simscr->to_st);
+    st_update_saved(scr, time_now, FALSE);
+    g_static_mutex_unlock(&scr->vm_mutex);
+  }
+
+  int poke = FALSE;
+  g_mutex_lock(home->lock);
+  scr->sched = SCR_SCHED_IDLE;
+  if(ran) {
+    // it's not idle, so put off hibernating it
+    tw_cancel(&home->wheel, &scr->idle_ent);
+    tw_add(&home->wheel, &scr->idle_ent, 
+	   tw_ticks_ceil(time_now + SCRIPT_HIBERNATE_AFTER));
+    if(home->sleeping && scr->idle_ent.expires < home->wake_tick) 
+      g_cond_signal(home->cond);
+  }
+  if(scr->in_rpc || scr->vm == NULL) {
+    // wait for RPC_RETURN, or leave it be if it failed to load
+  } else if(scr->delay_until > time_now) {
+    // the script is being delayed, deschedule.
+    if(scr->delay_sched != scr->delay_until) {
+      tw_cancel(&home->wheel, &scr->delay_ent);
+      scr->delay_sched = scr->delay_until;
+      tw_add(&home->wheel, &scr->delay_ent, tw_ticks_ceil(scr->delay_sched));
+      if(home->sleeping && scr->delay_ent.expires < home->wake_tick) 
+	g_cond_signal(home->cond);
+    }
+  } else if(more_work) {
+    scr->sched = SCR_SCHED_QUEUED;
+    list_insert_before(&scr->list, &home->runq);
+    g_atomic_int_inc(&scr->simscr->queued);
+    if(home != worker && home->sleeping) g_cond_signal(home->cond);
+  }
+  // anything that arrived while we were running it?
+  if(scr->sched == SCR_SCHED_IDLE && (!scr->mail.empty() || 
+				      scr->timer_pending))
+    poke = wake_script_locked(scr);
+  g_mutex_unlock(home->lock);
+  if(poke) wake_idle_worker(scr->simscr);
+}
+
+// fire any timers and delays that have expired. Call with worker->lock held.
+static void st_fire_timers_locked(script_worker *worker, double time_now) {
+  list_head expired; list_head_init(&expired);
+  tw_run(&worker->wheel, tw_ticks_floor(time_now), &expired);
+
+  while(expired.next != &expired) {
+    tw_timer *t = (tw_timer*)expired.next;
+    sim_script *scr = t->scr;
+    list_remove(&t->list); t->pending = 0;
+    if(t == &scr->timer_ent) {
+      st_update_timer_sched_locked(scr, time_now + scr->timer_interval);
+      scr->timer_pending = 1;
+    } else if(t == &scr->idle_ent) {
+      scr->hibernate_due = 1;
+    } else {
+      scr->delay_sched = 0.0;
+    }
+    wake_script_locked(scr);
+  }
+}
+
+// take a script from the back of some other worker's queue
+static sim_script* st_steal_script(script_worker *worker) {
+  sim_scripts *simscr = worker->simscr;
+  int num_workers = simscr->workers.size();
+  if(g_atomic_int_get(&simscr->queued) <= 0) return NULL;
+
+  for(int i = 1; i < num_workers; i++) {
+    script_worker *victim = simscr->workers[(worker->id + i) % num_workers];
+    g_mutex_lock(victim->lock);
+    if(victim->runq.prev != &victim->runq) {
+      sim_script *scr = (sim_script*)victim->runq.prev;
+      list_remove(&scr->list);
+      scr->sched = SCR_SCHED_RUNNING;
+      g_atomic_int_add(&simscr->queued, -1);
+      g_mutex_unlock(victim->lock);
+      return scr;
+    }
+    g_mutex_unlock(victim->lock);
+  }
+  return NULL;
+}
+
+static gpointer script_worker_thread(gpointer data) {
+  script_worker *worker = (script_worker*)data;
+  sim_scripts *simscr = worker->simscr;
+
+  g_mutex_lock(worker->lock);
+  while(!simscr->shutdown) {
+    st_fire_timers_locked(worker, g_timer_elapsed(simscr->timer, NULL));
+
+    sim_script *scr = NULL;
+    if(worker->runq.next != &worker->runq) {
+      scr = (sim_script*)worker->runq.next;
+      list_remove(&scr->list);
+      scr->sched = SCR_SCHED_RUNNING;
+      g_atomic_int_add(&simscr->queued, -1);
+    }
+    g_mutex_unlock(worker->lock);
+
+    if(scr == NULL) scr = st_steal_script(worker);
+    if(scr != NULL) {
+      st_run_script(worker, scr);
+      g_mutex_lock(worker->lock);
+      continue;
+    }
+
+    g_mutex_lock(worker->lock);
+    if(simscr->shutdown || worker->runq.next != &worker->runq) continue;
+
+    // Nothing to do. Once we've said we're sleeping, anyone queueing work
+    // elsewhere will poke us, so only have to recheck for that once.
+    worker->sleeping = 1;
+    g_atomic_int_inc(&simscr->num_sleeping);
+    if(g_atomic_int_get(&simscr->queued) <= 0) {
+      worker->wake_tick = tw_next_expiry(&worker->wheel);
+      if(worker->wake_tick == TW_NEVER) {
+	g_cond_wait(worker->cond, worker->lock);
       } else {
-	double wait = next_event - g_timer_elapsed(simscr->timer, NULL);
+	double wait = worker->wake_tick * TW_TICK - 
+	  g_timer_elapsed(simscr->timer, NULL);
 	GTimeVal tval;
 	// FIXME - slightly inaccurate. Should we use GTimeVal throughout?
 	g_get_current_time(&tval);
 	// g_time_val_add can't do longer intervals than about 2147 seconds
 	// on 32-bit systems. Epic fail.
 	if(wait > 600) wait = 600;
-	g_time_val_add(&tval, G_USEC_PER_SEC*wait);
-	if(wait <= 0.0)
-	  msg = (script_msg*)g_async_queue_try_pop(simscr->to_st);
-	else msg = (script_msg*)g_async_queue_timed_pop(simscr->to_st, &tval);
-      }
-      if(msg == NULL) break;
-
-      switch(msg->msg_type) {
-      case CAJ_SMSG_SHUTDOWN:
-	g_timer_destroy(simscr->timer);
-	delete msg;
-	return NULL;
-      case CAJ_SMSG_ADD_SCRIPT:
-	CAJ_DEBUG_L(simscr->log, "DEBUG: handling ADD_SCRIPT\n");
-	g_static_mutex_lock(&simscr->vm_mutex);
-	msg->scr->time = g_timer_elapsed(simscr->timer, NULL);
-	st_load_script(msg->scr);
-	g_static_mutex_unlock(&simscr->vm_mutex);
-	if(msg->scr->vm != NULL) {
-	  CAJ_DEBUG_L(simscr->log, "DEBUG: adding to run queue\n");
-	  msg->scr->is_running = 1;
-	  list_insert_before(&msg->scr->list, &running);
-	  script_upd_evmask(msg->scr);
-	} else {
-	  CAJ_DEBUG_L(simscr->log, "DEBUG: failed to load script\n");
-	  // FIXME - what to do?
-	  msg->scr->is_running = 0;
-	  list_insert_after(&msg->scr->list, &waiting);
-	}
-	break;
-      case CAJ_SMSG_RESTORE_SCRIPT:
-	CAJ_DEBUG_L(simscr->log, "DEBUG: handling RESTORE_SCRIPT\n");
-	g_static_mutex_lock(&simscr->vm_mutex);
-	msg->scr->time = g_timer_elapsed(simscr->timer, NULL);
-	st_restore_script(msg->scr, &msg->u.cstr);
-	g_static_mutex_unlock(&simscr->vm_mutex);
-	caj_string_free(&msg->u.cstr);
-	if(msg->scr->vm != NULL) {
-	  CAJ_DEBUG_L(simscr->log, "DEBUG: adding to run queue\n");
-	  msg->scr->is_running = 1;
-	  list_insert_before(&msg->scr->list, &running);
-	  script_upd_evmask(msg->scr);
-	} else {
-	  CAJ_DEBUG_L(simscr->log, "DEBUG: failed to load script\n");
-	  // FIXME - what to do?
-	  msg->scr->is_running = 0;
-	  list_insert_after(&msg->scr->list, &waiting);
-	}
-	break;
-      case CAJ_SMSG_KILL_SCRIPT:
-	CAJ_DEBUG_L(simscr->log, "DEBUG: got KILL_SCRIPT\n");
-	list_remove(&msg->scr->list);
-	st_update_timer_sched(msg->scr, 0.0);
-	if(msg->scr->vm != NULL) vm_free_script(msg->scr->vm);
-	msg->scr->vm = NULL;
-	delete msg->scr->detected; msg->scr->detected = NULL;
-	
-	// sending this message must be the last thing we do with the script
-	msg->msg_type = CAJ_SMSG_SCRIPT_KILLED;
-	send_to_mt(simscr, msg); msg = NULL;
-	break;
-      case CAJ_SMSG_RPC_RETURN:
-	assert(msg->scr->in_rpc); msg->scr->in_rpc = 0;
-	awaken_script(msg->scr, &running);
-	break;
-      case CAJ_SMSG_DETECTED:
-	if(msg->scr->pending_events.size() >= MAX_QUEUED_EVENTS) {
-	  CAJ_DEBUG_L(simscr->log, "DEBUG: discarding script event due to queue size\n");
-	  delete msg->u.event;
-	} else {
-	  msg->scr->pending_events.push_back(msg->u.event);
-	  awaken_script(msg->scr, &running);
+	if(wait > 0.0) {
+	  g_time_val_add(&tval, G_USEC_PER_SEC*wait);
+	  g_cond_timed_wait(worker->cond, worker->lock, &tval);
 	}
-	break;
-      case CAJ_SMSG_CHANGED_EVENT:
-	msg->scr->changed |= msg->u.changed;
-	awaken_script(msg->scr, &running);
-	break;
       }
-
-      delete msg;
     }
+    worker->sleeping = 0; worker->wake_tick = TW_NEVER;
+    g_atomic_int_add(&simscr->num_sleeping, -1);
   }
+  g_mutex_unlock(worker->lock);
+  return NULL;
 }
 
 // --------------- main thread code ------------------------
 
 static void send_to_script(sim_scripts *simscr, script_msg *msg) {
-  g_async_queue_push(simscr->to_st, msg);
+  sim_script *scr = msg->scr;
+  g_mutex_lock(scr->home->lock);
+  assert(scr->sched != SCR_SCHED_DEAD);
+  scr->mail.push_back(msg);
+  int poke = wake_script_locked(scr);
+  g_mutex_unlock(scr->home->lock);
+  if(poke) wake_idle_worker(simscr);
 }
 
 static void rpc_func_return(script_state *st, sim_script *scr, int func_id) {
+  // not everything a script can change marks the prim as updated, and it
+  // ought to see its own changes.
+  mt_update_snapshot(scr);
   vm_func_return(st, func_id);
   script_msg *smsg = new script_msg();
   smsg->msg_type = CAJ_SMSG_RPC_RETURN;
@@ -1537,46 +2238,98 @@ static void rpc_func_return(script_state *st, sim_script *scr, int func_id) {
   send_to_script(scr->simscr, smsg);
 }
 
-static void shutdown_scripting(struct simulator_ctx *sim, void *priv) {
-  sim_scripts *simscr = (sim_scripts*)priv;
-  {
-    script_msg *msg = new script_msg();
-    msg->msg_type = CAJ_SMSG_SHUTDOWN;
-    g_async_queue_push(simscr->to_st, msg);
-    g_thread_join(simscr->thread);
+static void mt_run_cmd(sim_script *scr, script_cmd *cmd) {
+  if(scr->prim != NULL) {
+    cmd->func(scr, cmd);
+    mt_update_snapshot(scr); // must be before cmds_pending drops
   }
+  g_atomic_int_add(&scr->cmds_pending, -1);
+  if(cmd->st != NULL && scr->prim != NULL) 
+    rpc_func_return(cmd->st, scr, cmd->func_id);
+  free(cmd->s[0]); free(cmd->s[1]);
+  if(cmd->list != NULL) vm_list_free(cmd->list);
+  delete cmd;
+}
 
-  // shouldn't be any pending notifications, but if there are cancel them
-  while(g_idle_remove_by_data(simscr)) { }
+static void shutdown_scripting(struct simulator_ctx *sim, void *priv) {
+  sim_scripts *simscr = (sim_scripts*)priv;
+  for(std::vector<script_worker*>::iterator iter = simscr->workers.begin();
+      iter != simscr->workers.end(); iter++) {
+    g_mutex_lock((*iter)->lock);
+  }
+  simscr->shutdown = 1;
+  for(std::vector<script_worker*>::iterator iter = simscr->workers.begin();
+      iter != simscr->workers.end(); iter++) {
+    g_cond_signal((*iter)->cond);
+    g_mutex_unlock((*iter)->lock);
+  }
+  for(std::vector<script_worker*>::iterator iter = simscr->workers.begin();
+      iter != simscr->workers.end(); iter++) {
+    script_worker *worker = *iter;
+    g_thread_join(worker->thread);
+    g_mutex_free(worker->lock);
+    g_cond_free(worker->cond);
+    delete worker;
+  }
+  g_timer_destroy(simscr->timer);
+
+  // drops any loads that haven't started yet; FIXME - leaks them.
+  g_thread_pool_free(simscr->load_pool, TRUE, TRUE);
+
+  // drops any compiles that haven't started yet; FIXME - leaks them.
+  if(simscr->compile_pool != NULL)
+    g_thread_pool_free(simscr->compile_pool, TRUE, TRUE);
+  if(simscr->compiler != NULL) 
+    caj_lsl_compiler_free(simscr->compiler);
+  for(std::map<std::string, bc_cache_entry*>::iterator iter = 
+	simscr->bc_cache.begin(); iter != simscr->bc_cache.end(); iter++) {
+    bc_cache_free_entry(iter->second);
+  }
+
+  g_source_remove(simscr->mt_wake_watch);
+  g_io_channel_unref(simscr->mt_wake_chan);
+  close(simscr->mt_wake_fd);
 
   vm_world_free(simscr->vmw);
   delete simscr;
 }
 
-static void save_script_text_file(caj_logger *logger, caj_string *dat, char *name) {
-  int len = dat->len;  if(len > 0 && dat->data[len-1] == 0) len--;
-  int fd = open(name, O_WRONLY|O_CREAT|O_EXCL, 0644);
-  if(fd < 0) {
-    CAJ_ERROR_L(logger, "ERROR: couldn't open script file for save\n"); return;
-  }
-  int off = 0; ssize_t ret;
-  while(off < len) {
-    ret = write(fd, dat->data+off, len-off);
-    if(ret <= 0) { perror("ERROR: saving script file"); close(fd); return; }
-    off += ret;
-  }
-  close(fd);
-}
-
 // internal function, main thread
 static void mt_free_script(sim_script *scr) {
   if(scr->vm != NULL) { 
     CAJ_ERROR("ERROR: mt_free_script before scr->vm freed. This will leak!\n");
   }
-  free(scr->cvm_file);
+  free(scr->cvm_data);
+  caj_string_free(&scr->saved);
+  g_static_mutex_free(&scr->vm_mutex);
+  g_static_mutex_free(&scr->saved_lock);
   delete scr;
 }
 
+static void mt_update_snapshot(sim_script *scr) {
+  primitive_obj *prim = scr->prim;
+  if(prim == NULL) return;
+  primitive_obj *root = world_get_root_prim(prim);
+  prim_snapshot *snap = &scr->snap;
+
+  g_atomic_int_inc(&snap->seq); // odd, so readers will wait
+  snap->world_pos = prim->ob.world_pos; snap->local_pos = prim->ob.local_pos;
+  snap->root_pos = root->ob.world_pos; snap->scale = prim->ob.scale;
+  // FIXME - should be global rotations, same as the RPC versions
+  snap->rot = prim->ob.rot; snap->root_rot = root->ob.rot;
+  uuid_copy(snap->id, prim->ob.id); uuid_copy(snap->owner, prim->owner);
+  if(root->ob.parent != NULL && root->ob.parent->type == OBJ_TYPE_AVATAR)
+    snap->attach_point = root->attach_point;
+  else snap->attach_point = 0;
+  snap->name_ok = prim->name != NULL && 
+    strlen(prim->name) < sizeof(snap->name);
+  if(snap->name_ok) strcpy(snap->name, prim->name);
+  snap->desc_ok = prim->description != NULL &&
+    strlen(prim->description) < sizeof(snap->desc);
+  if(snap->desc_ok) strcpy(snap->desc, prim->description);
+  g_atomic_int_inc(&snap->seq);
+}
+
 static void mt_enable_script(sim_script *scr) {
   scr->mt_state = SCR_MT_RUNNING;
   
@@ -1585,169 +2338,363 @@ static void mt_enable_script(sim_script *scr) {
   script_msg *msg = new script_msg();
   msg->msg_type = CAJ_SMSG_ADD_SCRIPT;
   msg->scr = scr;
-  g_async_queue_push(scr->simscr->to_st, msg);
-}
-
-static void flush_compile_output(GIOChannel *source, compiler_output *outp) {
-  gsize len_read = 0;
-  do {
-    if(outp->buflen - outp->len < 256) {
-      outp->buflen *= 2;
-      outp->buf = (char*)realloc(outp->buf, outp->buflen);
-      if(outp->buf == NULL) abort();
-    }
-
-    if(G_IO_ERROR_NONE != g_io_channel_read(source, outp->buf+outp->len, 
-					    (outp->buflen - outp->len) - 1, 
-					    &len_read)) {
-      printf("ERROR: couldn't read output from compiler\n"); return;
-    }
-    outp->len += len_read;
-  } while(len_read != 0);
+  send_to_script(scr->simscr, msg);
 }
 
-static void compile_done(GPid pid, gint status,  gpointer data) {
-  int success;
-  sim_script *scr = (sim_script*)data;
-  g_spawn_close_pid(pid);
-  CAJ_DEBUG("DEBUG: script compile done, result %i\n", status);
+static void mt_compile_done(sim_script *scr, compile_job *job) {
+  CAJ_DEBUG("DEBUG: script compile done, result %i\n", job->success);
   
-  if(WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-    success = 1;
+  if(job->success) {
+    scr->cvm_data = job->data; scr->cvm_len = job->data_len;
     if(scr->prim != NULL) {
       mt_enable_script(scr);
     }
   } else {
     CAJ_DEBUG("ERROR: script compile failed\n");
-    success = 0;
     scr->mt_state = SCR_MT_COMPILE_ERROR;
   }
 
-  assert(scr->comp_out != NULL);
-
-  flush_compile_output(scr->comp_out->stdout, scr->comp_out);
-  flush_compile_output(scr->comp_out->stderr, scr->comp_out);
-  scr->comp_out->buf[scr->comp_out->len] = 0;
-  printf("DEBUG: got compiler output: ~%s~\n", scr->comp_out->buf);
+  printf("DEBUG: got compiler output: ~%s~\n", job->output);
 
-  if(scr->comp_out->cb != NULL) {
-    scr->comp_out->cb(scr->comp_out->cb_priv, success, scr->comp_out->buf,
-		      scr->comp_out->len);
+  if(job->cb != NULL) {
+    job->cb(job->cb_priv, job->success, job->output, job->output_len);
   }
-
-  g_io_channel_shutdown(scr->comp_out->stdout, FALSE, NULL);
-  g_io_channel_shutdown(scr->comp_out->stderr, FALSE, NULL);
-  g_io_channel_unref(scr->comp_out->stdout);
-  g_io_channel_unref(scr->comp_out->stderr);
-  free(scr->comp_out->buf); delete scr->comp_out; scr->comp_out = NULL;
+  free(job->output); delete job;
 
   if(scr->prim == NULL) {
     mt_free_script(scr);
   }
 }
 
-static gboolean got_compile_output(GIOChannel *source, GIOCondition cond, 
-				   gpointer priv) {
-  if(cond & G_IO_IN) {
-    compiler_output * outp = (compiler_output*)priv;
-    if(outp->buflen - outp->len < 256) {
-      outp->buflen *= 2;
-      outp->buf = (char*)realloc(outp->buf, outp->buflen);
-      if(outp->buf == NULL) abort();
-    }
-    gsize len_read = 0;
-    if(G_IO_ERROR_NONE != g_io_channel_read(source, outp->buf+outp->len, 
-					    (outp->buflen - outp->len) - 1, 
-					    &len_read)) {
-    printf("ERROR: couldn't read output from compiler\n"); return TRUE;
-    }
-    outp->len += len_read;
-    return TRUE;
-  } 
-  if(cond & G_IO_NVAL) return FALSE; // blech. There must be a cleaner way.
-  if((cond & (G_IO_IN|G_IO_NVAL)) != cond) {
-    printf("FIXME: got_compile_output: unexpected cond\n"); return FALSE;
+// fills in a job's results from a finished cache entry
+static void bc_cache_fill_job(compile_job *job, bc_cache_entry *ent) {
+  job->success = ent->data != NULL;
+  job->data = NULL; job->data_len = 0;
+  if(job->success) {
+    job->data = (unsigned char*)malloc(ent->data_len);
+    memcpy(job->data, ent->data, ent->data_len); job->data_len = ent->data_len;
   }
-  return TRUE; // shouldn't actually ever reach here...
+  job->output = (char*)malloc(ent->output_len+1);
+  memcpy(job->output, ent->output, ent->output_len+1);
+  job->output_len = ent->output_len;
 }
 
-static compiler_output* listen_compiler_output(int stdout_compile, 
-					       int stderr_compile) {
-  compiler_output* outp = new compiler_output();
-  outp->len = 0; outp->buflen = 1024;
-  outp->buf = (char*)malloc(outp->buflen);
+static void mt_compile_finished(sim_scripts *simscr, compile_job *job) {
+  std::map<std::string, bc_cache_entry*>::iterator iter = 
+    simscr->bc_cache.find(job->key);
+  assert(iter != simscr->bc_cache.end());
+  bc_cache_entry *ent = iter->second;
+  assert(ent->compiling);
+
+  // the entry takes the results, everyone gets their own copy.
+  ent->compiling = 0; 
+  ent->data = job->data; ent->data_len = job->data_len;
+  ent->output = job->output; ent->output_len = job->output_len;
+  if(!job->success) { free(ent->data); ent->data = NULL; }
+
+  std::vector<compile_job*> waiting;
+  waiting.swap(ent->waiting); waiting.push_back(job);
+
+  if(job->success) {
+    simscr->bc_cache_order.push_back(job->key);
+    simscr->bc_cache_size += ent->data_len;
+  } else {
+    // don't keep failures around; the source is probably about to be fixed
+    simscr->bc_cache.erase(iter);
+  }
+
+  for(std::vector<compile_job*>::iterator jiter = waiting.begin();
+      jiter != waiting.end(); jiter++) {
+    bc_cache_fill_job(*jiter, ent);
+    mt_compile_done((*jiter)->scr, *jiter);
+  }
+
+  if(!job->success) bc_cache_free_entry(ent);
+
+  while(simscr->bc_cache_size > BC_CACHE_MAX_SIZE && 
+	!simscr->bc_cache_order.empty()) {
+    iter = simscr->bc_cache.find(simscr->bc_cache_order.front());
+    simscr->bc_cache_order.pop_front();
+    if(iter == simscr->bc_cache.end()) continue;
+    simscr->bc_cache_size -= iter->second->data_len;
+    bc_cache_free_entry(iter->second);
+    simscr->bc_cache.erase(iter);
+  }
+}
+
+static std::string bc_cache_key(sim_scripts *simscr, const char *src, 
+				int src_len) {
+  GChecksum *csum = g_checksum_new(G_CHECKSUM_SHA256);
+  const char *id = caj_lsl_compiler_id(simscr->compiler);
+  g_checksum_update(csum, (const guchar*)id, strlen(id)+1);
+  g_checksum_update(csum, (const guchar*)src, src_len);
+  std::string key = g_checksum_get_string(csum);
+  g_checksum_free(csum);
+  return key;
+}
+
+// compile thread
+static void compile_script(gpointer data, gpointer user_data) {
+  compile_job *job = (compile_job*)data;
+  sim_scripts *simscr = (sim_scripts*)user_data;
+  std::string fname = BC_CACHE_DIR + job->key + ".cvm";
+  gchar *cached; gsize cached_len;
+
+  job->output = NULL; job->output_len = 0; job->data = NULL;
+  FILE *out = open_memstream(&job->output, &job->output_len);
+  if(out == NULL) abort();
+  if(g_file_get_contents(fname.c_str(), &cached, &cached_len, NULL)) {
+    job->success = 1; job->data_len = cached_len;
+    job->data = (unsigned char*)malloc(cached_len);
+    memcpy(job->data, cached, cached_len); g_free(cached);
+  } else {
+    job->success = caj_lsl_compile(simscr->compiler, job->src, job->src_len,
+				   out, &job->data, &job->data_len) == 0;
+    if(job->success && 
+       !g_file_set_contents(fname.c_str(), (const gchar*)job->data,
+			    job->data_len, NULL)) {
+      CAJ_WARN_L(simscr->log, "WARNING: couldn't save compiled script to %s\n",
+		 fname.c_str());
+    }
+  }
+  fclose(out);
+  free(job->src); job->src = NULL;
 
-  // FIXME - not quite Windows-clean.
-  outp->stdout = g_io_channel_unix_new(stdout_compile);
-  g_io_add_watch(outp->stdout, (GIOCondition)(G_IO_IN|G_IO_NVAL), got_compile_output, outp);
-  outp->stderr = g_io_channel_unix_new(stderr_compile);
-  g_io_add_watch(outp->stderr, (GIOCondition)(G_IO_IN|G_IO_NVAL), got_compile_output, outp);
-  return outp;
+  script_msg *msg = new script_msg();
+  msg->msg_type = CAJ_SMSG_COMPILE_DONE;
+  msg->scr = job->scr; msg->u.compile = job;
+  send_to_mt(simscr, msg);
 }
 
 static void* add_script(simulator_ctx *sim, void *priv, primitive_obj *prim, 
 			inventory_item *inv, simple_asset *asset, 
 			compile_done_cb cb, void *cb_priv) {
   sim_scripts *simscr = (sim_scripts*)priv;
-  char *args[4]; int stdout_compile = -1, stderr_compile = -1;
-  char buf[40], srcname[60], binname[60]; GPid pid;
-  uuid_unparse(asset->id, buf);
-  snprintf(srcname, 60, "script_tmp/%s.lsl", buf); 
-  snprintf(binname, 60, "script_tmp/%s.cvm", buf);
   printf("DEBUG: compiling and adding script\n");
-  save_script_text_file(simscr->log, &asset->data, srcname);
-  
-  args[0] = "./lsl_compile"; args[1] = srcname; args[2] = binname; args[3] = 0;
-  if(!g_spawn_async_with_pipes(NULL, args, NULL, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, 
-			       &pid, NULL, &stdout_compile, &stderr_compile, NULL)) {
-    CAJ_ERROR_L(simscr->log, "ERROR: couldn't launch script compiler\n");
+  if(simscr->compile_pool == NULL) {
+    CAJ_ERROR_L(simscr->log, "ERROR: script compiler isn't available\n");
     return NULL;
   }
 
   sim_script *scr = new sim_script(prim, simscr);
   scr->mt_state = SCR_MT_COMPILING;
-  scr->cvm_file = strdup(binname);
-  scr->comp_out = listen_compiler_output(stdout_compile, stderr_compile);
-  scr->comp_out->cb = cb; scr->comp_out->cb_priv = cb_priv;
+  mt_update_snapshot(scr);
+
+  compile_job *job = new compile_job();
+  job->scr = scr; job->cb = cb; job->cb_priv = cb_priv;
+  job->src_len = asset->data.len;
+  if(job->src_len > 0 && asset->data.data[job->src_len-1] == 0) job->src_len--;
+  job->key = bc_cache_key(simscr, (const char*)asset->data.data, job->src_len);
+
+  std::map<std::string, bc_cache_entry*>::iterator iter = 
+    simscr->bc_cache.find(job->key);
+  if(iter != simscr->bc_cache.end()) {
+    job->src = NULL; job->compiled = 0;
+    if(iter->second->compiling) {
+      iter->second->waiting.push_back(job);
+    } else {
+      // still delivered asynchronously, same as a real compile.
+      bc_cache_fill_job(job, iter->second);
+      script_msg *msg = new script_msg();
+      msg->msg_type = CAJ_SMSG_COMPILE_DONE;
+      msg->scr = scr; msg->u.compile = job;
+      send_to_mt(simscr, msg);
+    }
+    return scr;
+  }
+
+  bc_cache_entry *ent = new bc_cache_entry();
+  ent->compiling = 1; ent->data = NULL; ent->output = NULL;
+  ent->data_len = 0; ent->output_len = 0;
+  simscr->bc_cache[job->key] = ent;
 
-  // we don't bother filling out the first half of the struct yet...
+  job->compiled = 1;
+  job->src = (char*)malloc(job->src_len+1);
+  memcpy(job->src, asset->data.data, job->src_len); job->src[job->src_len] = 0;
 
-  g_child_watch_add(pid, compile_done, scr);
+  g_thread_pool_push(simscr->compile_pool, job, NULL);
   return scr;
 }
 
+// load thread. Decoding and verifying the bytecode is most of the work of
+// restoring a script, so this is done in parallel rather than by the 
+// script's worker when it gets round to it.
+static void load_script(gpointer data, gpointer user_data) {
+  script_msg *msg = (script_msg*)data;
+  sim_scripts *simscr = (sim_scripts*)user_data;
+  sim_script *scr = msg->scr;
+  // nothing changes scr->saved until the script thread has the VM
+  msg->u.vm = vm_load_script(simscr->log, simscr->vmw, 
+			     scr->saved.data, scr->saved.len);
+  send_to_mt(simscr, msg);
+}
+
 static void* restore_script(simulator_ctx *sim, void *priv, primitive_obj *prim,
 			    inventory_item *inv, caj_string *out) {
   sim_scripts *simscr = (sim_scripts*)priv;
   sim_script *scr = new sim_script(prim, simscr);
-  scr->mt_state = SCR_MT_RUNNING;
+  scr->mt_state = SCR_MT_LOADING;
+  mt_update_snapshot(scr);
 
   scr->changed = CHANGED_REGION_START; // FIXME - HACK!
   scr->state_entry = 0;
   scr->timer_fired = 0;
+  // what it's restored from is its first saved snapshot. No other thread
+  // knows about it yet, so no need for saved_lock.
+  caj_string_steal(&scr->saved, out); scr->have_saved = 1;
+
+  if(g_atomic_int_get(&simscr->boot_pending) == 0) {
+    simscr->boot_start = g_timer_elapsed(simscr->timer, NULL);
+    simscr->boot_total = 0;
+    g_atomic_int_set(&simscr->boot_seq, 0);
+    g_atomic_int_set(&simscr->boot_running_ms, -1);
+  }
+  simscr->boot_total++; g_atomic_int_inc(&simscr->boot_pending);
+
   script_msg *msg = new script_msg();
-  msg->msg_type = CAJ_SMSG_RESTORE_SCRIPT;
-  msg->scr = scr;
-  caj_string_steal(&msg->u.cstr, out);
-  g_async_queue_push(scr->simscr->to_st, msg);
-  
+  msg->msg_type = CAJ_SMSG_LOAD_DONE;
+  msg->scr = scr; msg->u.vm = NULL;
+  g_thread_pool_push(simscr->load_pool, msg, NULL);
   return scr;
 }
 
+// Like send_to_script, but takes each worker's lock just once for the 
+// whole batch, which matters when a region's worth of scripts finish 
+// loading at once.
+static void send_batch_to_scripts(sim_scripts *simscr, 
+				  std::vector<script_msg*> &msgs) {
+  int poke = FALSE;
+  for(std::vector<script_worker*>::iterator witer = simscr->workers.begin();
+      witer != simscr->workers.end(); witer++) {
+    script_worker *worker = *witer;
+    g_mutex_lock(worker->lock);
+    for(std::vector<script_msg*>::iterator iter = msgs.begin();
+	iter != msgs.end(); iter++) {
+      sim_script *scr = (*iter)->scr;
+      if(scr->home != worker) continue;
+      assert(scr->sched != SCR_SCHED_DEAD);
+      scr->mail.push_back(*iter);
+      if(wake_script_locked(scr)) poke = TRUE;
+    }
+    g_mutex_unlock(worker->lock);
+  }
+  msgs.clear();
+  if(poke) wake_idle_worker(simscr);
+}
+
+// Turns a batch of LOAD_DONEs into the RESTORE_SCRIPTs that hand the VMs
+// over to the script threads, dropping any scripts killed meanwhile. They
+// have to stay SCR_MT_LOADING until they're actually sent, or killing one
+// would send KILL_SCRIPT ahead of its RESTORE_SCRIPT.
+static void mt_restore_loaded(sim_scripts *simscr, 
+			      std::vector<script_msg*> &loaded) {
+  std::vector<script_msg*> msgs;
+  for(std::vector<script_msg*>::iterator iter = loaded.begin();
+      iter != loaded.end(); iter++) {
+    script_msg *msg = *iter; sim_script *scr = msg->scr;
+    if(scr->prim == NULL) {
+      if(msg->u.vm != NULL) vm_free_script(msg->u.vm);
+      boot_script_done(simscr);
+      mt_free_script(scr); delete msg;
+      continue;
+    }
+    scr->mt_state = SCR_MT_RUNNING;
+    msg->msg_type = CAJ_SMSG_RESTORE_SCRIPT;
+    msgs.push_back(msg);
+  }
+  loaded.clear();
+  send_batch_to_scripts(simscr, msgs);
+}
+
 static void save_script(simulator_ctx *sim, void *priv, void *script,
 			caj_string *out) {
   sim_scripts *simscr = (sim_scripts*)priv;
   sim_script *scr = (sim_script*)script;
   assert(scr->magic == SCRIPT_MAGIC);
-  g_static_mutex_lock(&simscr->vm_mutex);
+  g_static_mutex_lock(&scr->saved_lock);
+  if(scr->have_saved && !g_atomic_int_get(&scr->saved_stale)) {
+    caj_string_copy(out, &scr->saved);
+    g_static_mutex_unlock(&scr->saved_lock);
+    return;
+  }
+  g_static_mutex_unlock(&scr->saved_lock);
+
+  // Out of date, or there's no snapshot yet. If the script isn't running
+  // right now (say, because the scripting threads have been shut down),
+  // we can bring it up to date ourselves. Otherwise, rather than wait for
+  // it, make do with the last snapshot; the script thread will replace it
+  // within SCRIPT_SAVE_INTERVAL anyway.
+  if(g_static_mutex_trylock(&scr->vm_mutex)) {
+    if(scr->vm != NULL && (!scr->have_saved || vm_script_is_dirty(scr->vm)))
+      serialise_to_saved(scr);
+  } else {
+    g_static_mutex_lock(&scr->saved_lock);
+    int have_saved = scr->have_saved;
+    if(have_saved) caj_string_copy(out, &scr->saved);
+    g_static_mutex_unlock(&scr->saved_lock);
+    if(have_saved) return;
+    g_static_mutex_lock(&scr->vm_mutex); // FIXME - stalls the main thread
+    if(scr->vm != NULL) serialise_to_saved(scr);
+  }
+
   if(scr->vm == NULL) {
     out->data = NULL; out->len = 0;
   } else {
-    size_t len;
-    out->data = vm_serialise_script(scr->vm, &len);
-    out->len = out->data != NULL ? len : 0;
+    g_static_mutex_lock(&scr->saved_lock);
+    caj_string_copy(out, &scr->saved);
+    g_static_mutex_unlock(&scr->saved_lock);
+  }
+  g_static_mutex_unlock(&scr->vm_mutex);
+}
+
+static void get_boot_stats(simulator_ctx *sim, void *priv, 
+			   caj_script_boot_stats *stats) {
+  sim_scripts *simscr = (sim_scripts*)priv;
+  stats->restored = simscr->boot_total;
+  stats->pending = g_atomic_int_get(&simscr->boot_pending);
+  int running_ms = g_atomic_int_get(&simscr->boot_running_ms);
+  if(stats->pending == 0 && running_ms >= 0) 
+    stats->time = running_ms / 1000.0;
+  else stats->time = g_timer_elapsed(simscr->timer, NULL) - simscr->boot_start;
+}
+
+static void add_prof_sample(void *priv, const char *func_name, 
+			    uint32_t samples) {
+  std::vector<std::pair<uint32_t, std::string> > *funcs = 
+    (std::vector<std::pair<uint32_t, std::string> >*)priv;
+  funcs->push_back(std::pair<uint32_t, std::string>(samples, func_name));
+}
+
+static void get_script_stats(simulator_ctx *sim, void *priv, void *script,
+			     caj_script_stats *stats) {
+  sim_script *scr = (sim_script*)script;
+  assert(scr->magic == SCRIPT_MAGIC);
+  memset(stats, 0, sizeof(*stats));
+  stats->queue_drops = g_atomic_int_get(&scr->queue_drops);
+
+  std::vector<std::pair<uint32_t, std::string> > funcs;
+  g_static_mutex_lock(&scr->vm_mutex);
+  stats->run_time = scr->run_time;
+  stats->events = scr->num_events; stats->rpcs = scr->num_rpcs;
+  if(scr->vm != NULL) {
+    stats->insns = vm_script_get_insn_count(scr->vm);
+    stats->heap_bytes = vm_script_get_mem_use(scr->vm);
+    stats->hibernating = vm_script_is_hibernating(scr->vm);
+    vm_script_get_profile(scr->vm, add_prof_sample, &funcs);
+  }
+  g_static_mutex_unlock(&scr->vm_mutex);
+
+  // the three it's been seen in most, as "name=samples"
+  std::sort(funcs.begin(), funcs.end());
+  size_t len = 0;
+  for(int i = (int)funcs.size() - 1; i >= 0 && i >= (int)funcs.size() - 3;
+      i--) {
+    int ret = snprintf(stats->hot_funcs + len, sizeof(stats->hot_funcs) - len,
+		       "%s%s=%u", len > 0 ? " " : "", funcs[i].second.c_str(),
+		       (unsigned)funcs[i].first);
+    if(ret < 0 || (size_t)ret >= sizeof(stats->hot_funcs) - len) break;
+    len += ret;
   }
-  g_static_mutex_unlock(&simscr->vm_mutex);
 }
 
 static void kill_script(simulator_ctx *sim, void *priv, void *script) {
@@ -1773,7 +2720,8 @@ static void kill_script(simulator_ctx *sim, void *priv, void *script) {
     msg->msg_type = CAJ_SMSG_KILL_SCRIPT;
     msg->scr = scr;
     send_to_script(simscr, msg);  
-  } else if(scr->mt_state != SCR_MT_COMPILING) {
+  } else if(scr->mt_state != SCR_MT_COMPILING && 
+	    scr->mt_state != SCR_MT_LOADING) {
     mt_free_script(scr);
   }
 }
@@ -1922,6 +2870,7 @@ static void handle_prim_change_event(simulator_ctx *sim, void *priv,
 				     void *script, int update_level) {
   sim_scripts *simscr = (sim_scripts*)priv;
   sim_script *scr = (sim_script*)script;
+  mt_update_snapshot(scr);
   if((scr->evmask & CAJ_EVMASK_PRIM_CHANGED) == 0 ||
      (update_level & (CAJ_OBJUPD_CHILDREN|CAJ_OBJUPD_TEXTURE|
 		      CAJ_OBJUPD_SCALE|CAJ_OBJUPD_SHAPE|
@@ -1951,10 +2900,29 @@ static void handle_prim_change_event(simulator_ctx *sim, void *priv,
   }
 }
 
-static gboolean mt_process_queued(gpointer data) {
+static gboolean mt_process_queued(GIOChannel *source, GIOCondition cond,
+				   gpointer data) {
   sim_scripts *simscr = (sim_scripts*)data;
-  script_msg* msg;
-  for(;;) {
+  script_msg* msg; uint64_t count;
+  std::vector<script_msg*> loaded;
+  if(read(simscr->mt_wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    CAJ_ERROR_L(simscr->log, "ERROR: reading script wakeup fd: %s\n",
+		strerror(errno));
+  }
+  // must be before we look at the queue, or we could miss a wakeup
+  g_atomic_int_set(&simscr->mt_wake_pending, 0);
+
+  // Updates from the whole batch are merged, so if several scripts all move
+  // or retexture a prim, physics and the viewers only hear about it once.
+  // The batch is limited so that scripts can't starve the networking.
+  double batch_end = g_timer_elapsed(simscr->timer, NULL) + MT_BATCH_TIME;
+  world_begin_update_batch(simscr->sim);
+  for(int num_msgs = 1; ; num_msgs++) {
+    if((num_msgs % 32) == 0 && 
+       g_timer_elapsed(simscr->timer, NULL) > batch_end) {
+      mt_wakeup(simscr); // come back for the rest later
+      break;
+    }
     msg = (script_msg*)g_async_queue_try_pop(simscr->to_mt);
     if(msg == NULL) break;
 
@@ -1975,6 +2943,9 @@ static gboolean mt_process_queued(gpointer data) {
 	msg->u.rpc.rpc_func(msg->u.rpc.st, msg->scr, msg->u.rpc.func_id);
       }
       break;
+    case CAJ_SMSG_ASYNC_CMD:
+      mt_run_cmd(msg->scr, msg->u.cmd);
+      break;
     case CAJ_SMSG_EVMASK:
       if(msg->scr->prim != NULL) {
 	CAJ_DEBUG_L(simscr->log, "DEBUG: got new script evmask 0x%x for %p in main thread\n",
@@ -1984,19 +2955,27 @@ static gboolean mt_process_queued(gpointer data) {
 				msg->scr, msg->u.evmask);
       }
       break;
-      
+    case CAJ_SMSG_COMPILE_DONE:
+      if(msg->u.compile->compiled) 
+	mt_compile_finished(simscr, msg->u.compile);
+      else mt_compile_done(msg->scr, msg->u.compile);
+      break;
+    case CAJ_SMSG_LOAD_DONE:
+      // handled at the end, see mt_restore_loaded
+      loaded.push_back(msg); continue;
     }
     delete msg;
     
   }
+  if(!loaded.empty()) mt_restore_loaded(simscr, loaded);
+  world_end_update_batch(simscr->sim);
 
-  return FALSE;
+  return TRUE;
 }
 
 int caj_scripting_init(int api_version, struct simulator_ctx* sim, 
 		       void **priv, struct cajeput_script_hooks *hooks) {
   sim_scripts *simscr = new sim_scripts(); *priv = simscr;
-  g_static_mutex_init(&simscr->vm_mutex);
 
   // FIXME - need to check api version!
 
@@ -2012,7 +2991,21 @@ int caj_scripting_init(int api_version, struct simulator_ctx* sim,
 
   simscr->sim = sim; 
   simscr->log = caj_get_logger(sim_get_simgroup(sim));
+  simscr->profile_funcs = 
+    sgrp_config_get_bool(sim_get_simgroup(sim), "script", 
+			 "profile_funcs", NULL);
   simscr->vmw = vm_world_new(state_change_cb);
+  {
+    char *jit_str = sgrp_config_get_value(sim_get_simgroup(sim), "script",
+					  "jit_threshold");
+    if(jit_str != NULL) {
+      int threshold = atoi(jit_str); g_free(jit_str);
+      if(threshold > 0 && !vm_world_set_jit(simscr->vmw, threshold)) {
+	CAJ_WARN_L(simscr->log, "WARNING: script JIT not supported on this "
+		   "platform, ignoring jit_threshold\n");
+      }
+    }
+  }
   vm_world_add_event(simscr->vmw, "state_entry", VM_TYPE_NONE, EVENT_STATE_ENTRY, 0);
   vm_world_add_event(simscr->vmw, "touch_start", VM_TYPE_NONE, EVENT_TOUCH_START,
 		     1, VM_TYPE_INT);
@@ -2070,6 +3063,7 @@ int caj_scripting_init(int api_version, struct simulator_ctx* sim,
   vm_world_add_func(simscr->vmw, "llGetNumberOfPrims", VM_TYPE_INT,
 		    llGetNumberOfPrims_cb, 0);
   vm_world_add_func(simscr->vmw, "llGetScale", VM_TYPE_VECT, llGetScale_cb, 0);
+  vm_world_add_func(simscr->vmw, "llGetMass", VM_TYPE_FLOAT, llGetMass_cb, 0);
 
   vm_world_add_func(simscr->vmw, "llGetKey", VM_TYPE_KEY,
 		    llGetKey_cb, 0);
@@ -2107,6 +3101,8 @@ int caj_scripting_init(int api_version, struct simulator_ctx* sim,
 
   vm_world_add_func(simscr->vmw, "llKey2Name", VM_TYPE_STR, 
 		    llKey2Name_cb, 1, VM_TYPE_KEY);
+  vm_world_add_func(simscr->vmw, "llGetObjectMass", VM_TYPE_FLOAT, 
+		    llGetObjectMass_cb, 1, VM_TYPE_KEY);
   vm_world_add_func(simscr->vmw, "llGetOwnerKey", VM_TYPE_KEY, 
 		    llGetOwnerKey_cb, 1, VM_TYPE_KEY);
   
@@ -2168,16 +3164,87 @@ int caj_scripting_init(int api_version, struct simulator_ctx* sim,
   
   
 
-  simscr->to_st = g_async_queue_new();
   simscr->to_mt = g_async_queue_new();
-  simscr->thread = g_thread_create(script_thread, simscr, TRUE, NULL);
-  assert(simscr->to_st != NULL); assert(simscr->to_mt != NULL); 
-  if(simscr->thread == NULL) {
-    CAJ_ERROR_L(simscr->log, "ERROR: couldn't create script thread\n"); 
+  assert(simscr->to_mt != NULL); 
+  simscr->mt_wake_fd = eventfd(0, EFD_NONBLOCK);
+  if(simscr->mt_wake_fd < 0) {
+    CAJ_ERROR_L(simscr->log, "ERROR: couldn't create eventfd: %s\n", 
+		strerror(errno));
     exit(1);
   }
+  simscr->mt_wake_pending = 0;
+  simscr->mt_wake_chan = g_io_channel_unix_new(simscr->mt_wake_fd);
+  simscr->mt_wake_watch = g_io_add_watch(simscr->mt_wake_chan, G_IO_IN, 
+					 mt_process_queued, simscr);
+  simscr->timer = g_timer_new();
+  simscr->next_worker = 0; simscr->shutdown = 0;
+  simscr->queued = 0; simscr->num_sleeping = 0;
+
+  int num_threads = 0;
+  char *threads_str = sgrp_config_get_value(sim_get_simgroup(sim), "script",
+					    "worker_threads");
+  if(threads_str != NULL) {
+    num_threads = atoi(threads_str); g_free(threads_str);
+  }
+  if(num_threads <= 0) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(num_threads <= 0) num_threads = 1;
+
+  for(int i = 0; i < num_threads; i++) {
+    script_worker *worker = new script_worker();
+    worker->simscr = simscr; worker->id = i;
+    worker->lock = g_mutex_new(); worker->cond = g_cond_new();
+    worker->sleeping = 0; worker->wake_tick = TW_NEVER;
+    list_head_init(&worker->runq);
+    tw_init(&worker->wheel, 0);
+    simscr->workers.push_back(worker);
+  }
+  // only start them once the workers list is complete, since they steal
+  // from each other.
+  for(int i = 0; i < num_threads; i++) {
+    script_worker *worker = simscr->workers[i];
+    worker->thread = g_thread_create(script_worker_thread, worker, TRUE, NULL);
+    if(worker->thread == NULL) {
+      CAJ_ERROR_L(simscr->log, "ERROR: couldn't create script thread\n"); 
+      exit(1);
+    }
+  }
 
-  mkdir("script_tmp/", 0755);
+  // restored scripts are loaded and verified by their own pool too, so 
+  // starting up a region with lots of them is limited by the number of 
+  // cores rather than done one at a time.
+  int load_threads = num_threads;
+  char *load_str = sgrp_config_get_value(sim_get_simgroup(sim), "script",
+					 "load_threads");
+  if(load_str != NULL) {
+    load_threads = atoi(load_str); g_free(load_str);
+    if(load_threads <= 0) load_threads = 1;
+  }
+  simscr->boot_start = 0.0; simscr->boot_total = 0;
+  simscr->boot_pending = 0; simscr->boot_seq = 0; 
+  simscr->boot_running_ms = -1;
+  simscr->load_pool = g_thread_pool_new(load_script, simscr, 
+					load_threads, FALSE, NULL);
+
+  // the compiler runs on its own threads, so a box of scripts being rezzed
+  // doesn't hold up the sim or the running scripts.
+  simscr->compile_pool = NULL; simscr->bc_cache_size = 0;
+  mkdir(BC_CACHE_DIR, 0755);
+  simscr->compiler = caj_lsl_compiler_new("runtime_funcs.lsl", 
+					  CAJ_LSL_OPTIMISE, stderr);
+  if(simscr->compiler == NULL) {
+    CAJ_ERROR_L(simscr->log, "ERROR: couldn't load script runtime functions; "
+		"scripts won't compile\n");
+  } else {
+    int compile_threads = 2;
+    char *compile_str = sgrp_config_get_value(sim_get_simgroup(sim), "script",
+					      "compile_threads");
+    if(compile_str != NULL) {
+      compile_threads = atoi(compile_str); g_free(compile_str);
+      if(compile_threads <= 0) compile_threads = 1;
+    }
+    simscr->compile_pool = g_thread_pool_new(compile_script, simscr, 
+					     compile_threads, FALSE, NULL);
+  }
 
   hooks->shutdown = shutdown_scripting;
   hooks->add_script = add_script;
@@ -2191,6 +3258,8 @@ int caj_scripting_init(int api_version, struct simulator_ctx* sim,
   hooks->disable_listens = disable_listens;
   hooks->reenable_listens = reenable_listens;
   hooks->prim_change_event = handle_prim_change_event;
+  hooks->get_stats = get_script_stats;
+  hooks->get_boot_stats = get_boot_stats;
 
   return 1;
 }
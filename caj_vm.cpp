@@ -22,6 +22,7 @@
 
 #include "caj_vm.h"
 #include "caj_vm_internal.h"
+#include "caj_vm_jit.h"
 #include "caj_types.h"
 #include "caj_logging.h"
 #include <cassert>
@@ -55,12 +56,17 @@ struct vm_nfunc_desc { // native function
   vm_native_func_cb cb;
 };
 
+struct vm_script_image;
+
 struct vm_world {
   std::vector<vm_nfunc_desc> nfuncs;
   std::map<std::string, int> nfunc_map;
   std::map<std::string, vm_nfunc_desc> event_map; // may want to give own type
   vm_state_change_cb state_change_cb;
   int num_events;
+  uint32_t jit_threshold; // 0 if JIT disabled
+  GMutex *image_lock; // scripts are loaded from several threads at once
+  std::multimap<uint64_t, vm_script_image*> images; // by vm_image_hash
 };
 
 #define VM_SCRAM_OK 0
@@ -71,15 +77,81 @@ struct vm_world {
 #define VM_SCRAM_MISSING_FUNC 5
 #define VM_SCRAM_MEM_LIMIT 6
 
+// Pre-decoded ("threaded") form of the bytecode, built by step_script. There's
+// one entry for each instruction, at the same ip, so tracevals, serialisation
+// and so on don't need to know anything about it.
+struct vm_threaded_insn {
+  const void *op; // label in step_script to jump to
+  int32_t arg; // ival, jump target for jumps and branches
+};
+
+// Each script's heap entries come from its own pool of slabs, split up into
+// size classes with a freelist for each. Anything too big for the largest
+// class is malloced, but kept on a list so that freeing the script can just
+// release the whole pool rather than walking the heap.
+#define VM_POOL_SLAB_SIZE 4096
+#define VM_POOL_NUM_CLASSES 10
+#define VM_POOL_MAX_SIZE 512
+
+struct vm_pool_chunk {
+  vm_pool_chunk *next;
+};
+
+union vm_pool_slab {
+  vm_pool_slab *next;
+  double align[2]; // keep the chunks 16-byte aligned
+};
+
+struct vm_pool_big {
+  vm_pool_big *next, *prev;
+  size_t cap; // usable size, for growing strings in place
+};
+
+struct vm_heap_pool {
+  vm_pool_chunk *free_chunks[VM_POOL_NUM_CLASSES];
+  vm_pool_slab *slabs;
+  char *bump, *bump_end; // unused space in the newest slab
+  vm_pool_big big; // list head
+};
+
+// The parts of a loaded script that never change once it's been verified and
+// its native functions bound. Scripts in the same world with identical code
+// share one of these, so 1000 copies of a door script only hold its code,
+// tracevals and function table once; each script_state just has its own 
+// globals, stack and heap.
+struct vm_script_image {
+  int refcnt; // protected by the world's image_lock
+  uint64_t hash;
+  uint32_t bytecode_len;
+  uint16_t num_funcs;
+  uint16_t* bytecode;
+  uint16_t* patched_bytecode;
+  vm_threaded_insn *threaded;
+  vm_traceval* tracevals;
+  vm_function *funcs;
+  int bind_failed; // prototype mismatch binding a native function
+  // the code was verified against these, so they have to match too
+  uint16_t num_gvals, num_gptrs;
+  uint8_t *gptr_types;
+};
+
 struct script_state {
   uint32_t ip;
-  uint32_t mem_use;
+  uint32_t mem_use; // what the script's asked for, not what the pool uses
   uint32_t bytecode_len;
   uint16_t num_gvals, num_gptrs;
   uint16_t num_funcs;
+  // these are copies of the image's, so the interpreter doesn't have to go
+  // through it. threaded is our own once the JIT gets involved.
+  vm_script_image *image;
   uint16_t* bytecode;
   uint16_t* patched_bytecode; // FIXME - only needed on 64-bit systems
+  vm_threaded_insn *threaded;
   vm_traceval* tracevals;
+  // JIT state, only allocated if the JIT's enabled
+  uint32_t *jit_calls; // per function
+  vm_jit_code **jit_code; // per function
+  void **jit_entry; // per insn, native code to run or NULL
   int32_t *stack_start, *stack_top;
   int32_t* gvals;
   heap_header** gptrs;
@@ -92,12 +164,26 @@ struct script_state {
   caj_logger *log;
   int32_t state_id;
   int scram_flag;
+  vm_heap_pool pool;
+  // while hibernating, the packed-up heap (see vm_script_hibernate); the
+  // stack and pool are freed and gptrs is all NULL.
+  unsigned char *hib_data; size_t hib_len;
+  uint64_t insn_count; // for profiling
+  uint32_t *prof_samples; // per function, if profiling's enabled
+  // set when anything vm_serialise_script saves might have changed; see
+  // vm_script_is_dirty. The heap only matters through gptrs, so writes to 
+  // the globals and state changes are all we need to catch.
+  int dirty; int clean_scram;
 };
 
 static int verify_code(script_state *st);
-static void script_calc_stack(script_state *st, traceval_stack &stack);
+static int step_script(script_state* st, int num_steps);
+#ifdef CAJ_VM_CHECK_HEAP
 static void unwind_stack(script_state * st);
+#endif
 static void vm_bind_events(script_state *st);
+static int vm_bind_natives(vm_world *w, vm_script_image *img, 
+			   caj_logger *log);
 
 void vm_func_set_ptr_ret(script_state *st, int func_no, heap_header *p);
 
@@ -109,19 +195,117 @@ static inline int ptr_stack_sz(void) {
   else assert(0);
 }
 
+static const uint16_t vm_pool_class_size[VM_POOL_NUM_CLASSES] = {
+  16, 32, 48, 64, 96, 128, 192, 256, 384, 512
+};
+
+// indexed by (size-1)/16
+static const uint8_t vm_pool_size_class[VM_POOL_MAX_SIZE/16] = {
+  0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7,
+  8, 8, 8, 8, 8, 8, 8, 8, 9, 9, 9, 9, 9, 9, 9, 9
+};
+
+static void vm_pool_init(vm_heap_pool *pool) {
+  for(int i = 0; i < VM_POOL_NUM_CLASSES; i++) pool->free_chunks[i] = NULL;
+  pool->slabs = NULL; pool->bump = pool->bump_end = NULL;
+  pool->big.next = pool->big.prev = &pool->big;
+}
+
+static void *vm_pool_alloc_big(vm_heap_pool *pool, size_t cap) {
+  vm_pool_big *b = (vm_pool_big*)malloc(sizeof(vm_pool_big) + cap);
+  b->next = pool->big.next; b->prev = &pool->big;
+  b->next->prev = b; pool->big.next = b;
+  b->cap = cap;
+  return b+1;
+}
+
+static void *vm_pool_alloc(vm_heap_pool *pool, size_t size) {
+  if(size > VM_POOL_MAX_SIZE) return vm_pool_alloc_big(pool, size);
+
+  int cls = vm_pool_size_class[(size-1) >> 4];
+  vm_pool_chunk *c = pool->free_chunks[cls];
+  if(c != NULL) {
+    pool->free_chunks[cls] = c->next; return c;
+  }
+
+  size_t csize = vm_pool_class_size[cls];
+  if(pool->bump + csize > pool->bump_end) {
+    // FIXME - the end of the old slab is wasted
+    vm_pool_slab *slab = (vm_pool_slab*)malloc(VM_POOL_SLAB_SIZE);
+    slab->next = pool->slabs; pool->slabs = slab;
+    pool->bump = (char*)(slab+1); pool->bump_end = (char*)slab + VM_POOL_SLAB_SIZE;
+  }
+  void *ret = pool->bump; pool->bump += csize;
+  return ret;
+}
+
+static void vm_pool_free(vm_heap_pool *pool, void *p, size_t size) {
+  if(size > VM_POOL_MAX_SIZE) {
+    vm_pool_big *b = ((vm_pool_big*)p) - 1;
+    b->prev->next = b->next; b->next->prev = b->prev;
+    free(b);
+  } else {
+    int cls = vm_pool_size_class[(size-1) >> 4];
+    vm_pool_chunk *c = (vm_pool_chunk*)p;
+    c->next = pool->free_chunks[cls]; pool->free_chunks[cls] = c;
+  }
+}
+
+// Makes an allocation at least new_size long, keeping the contents. Since
+// chunks stay in the same size class, this can only grow things in place up
+// to the end of the chunk; past that, we leave some slack for next time.
+static void *vm_pool_grow(vm_heap_pool *pool, void *p, size_t old_size,
+			  size_t new_size) {
+  if(old_size > VM_POOL_MAX_SIZE) {
+    vm_pool_big *b = ((vm_pool_big*)p) - 1;
+    if(new_size <= b->cap) return p;
+    size_t cap = new_size + new_size/2;
+    b = (vm_pool_big*)realloc(b, sizeof(vm_pool_big) + cap);
+    b->prev->next = b; b->next->prev = b; b->cap = cap;
+    return b+1;
+  }
+
+  int cls = vm_pool_size_class[(old_size-1) >> 4];
+  if(new_size <= vm_pool_class_size[cls]) return p;
+  void *q = new_size > VM_POOL_MAX_SIZE ? 
+    vm_pool_alloc_big(pool, new_size + new_size/2) :
+    vm_pool_alloc(pool, new_size);
+  memcpy(q, p, old_size);
+  vm_pool_free(pool, p, old_size);
+  return q;
+}
+
+// frees everything in the pool, whether it's still in use or not.
+static void vm_pool_release(vm_heap_pool *pool) {
+  while(pool->slabs != NULL) {
+    vm_pool_slab *slab = pool->slabs; pool->slabs = slab->next;
+    free(slab);
+  }
+  while(pool->big.next != &pool->big) {
+    vm_pool_big *b = pool->big.next; pool->big.next = b->next;
+    free(b);
+  }
+  vm_pool_init(pool);
+}
+
 static script_state *new_script(caj_logger *log) {
   script_state *st = new script_state();
   st->log = log;
   st->ip = 0;  st->mem_use = 0; st->scram_flag = 0;
   st->bytecode_len = 0; 
   st->num_gvals = st->num_gptrs = st->num_funcs = 0;
-  st->bytecode = st->patched_bytecode = NULL; 
-  st->tracevals = NULL;
+  st->image = NULL; st->bytecode = st->patched_bytecode = NULL; 
+  st->threaded = NULL; st->tracevals = NULL;
+  st->jit_calls = NULL; st->jit_code = NULL; st->jit_entry = NULL;
   st->nfuncs = NULL;
   st->stack_start = st->stack_top = NULL;
   st->gvals = NULL; st->gptr_types = NULL;
   st->gptrs = NULL; st->funcs = NULL;
   st->cur_state = NULL; st->state_id = 0;
+  st->hib_data = NULL; st->hib_len = 0;
+  st->insn_count = 0; st->prof_samples = NULL;
+  st->dirty = 1; st->clean_scram = 0;
+  vm_pool_init(&st->pool);
   return st;
 }
 
@@ -133,7 +317,7 @@ static heap_header *script_alloc(script_state *st, uint32_t len, uint8_t vtype)
 	     VM_LIMIT_HEAP, (int)len, (int)st->mem_use);
     st->scram_flag = VM_SCRAM_MEM_LIMIT; return NULL;
   }
-  heap_header* p = (heap_header*)malloc(hlen);
+  heap_header* p = (heap_header*)vm_pool_alloc(&st->pool, hlen);
   p->refcnt = ((uint32_t)vtype << 24) | 1;
   p->len = len;
   st->mem_use += hlen;
@@ -147,8 +331,9 @@ static heap_header *script_alloc_list(script_state *st, uint32_t len) {
 	     VM_LIMIT_HEAP, (int)len, (int)st->mem_use);
     st->scram_flag = VM_SCRAM_MEM_LIMIT; return NULL;
   }
-  heap_header* p = (heap_header*)malloc(len*sizeof(heap_header*) + 
-					sizeof(heap_header));
+  heap_header* p = (heap_header*)vm_pool_alloc(&st->pool, 
+					       len*sizeof(heap_header*) + 
+					       sizeof(heap_header));
   p->refcnt = ((uint32_t)VM_TYPE_LIST << 24) | 1;
   p->len = len;
   st->mem_use += fakelen;
@@ -159,6 +344,25 @@ static inline void *script_getptr(heap_header *p) {
   return p+1;
 }
 
+// Appends p2 to p1 in place if we can, which is only safe if nothing else 
+// can see p1. The memory limit is applied exactly as if we'd allocated a 
+// new string. Leaves p1 alone and returns NULL on failure.
+static heap_header *script_append_str(script_state *st, heap_header *p1,
+				      heap_header *p2) {
+  uint32_t len = p1->len + p2->len;
+  uint32_t hlen = len + sizeof(heap_header);
+  if(len > VM_LIMIT_HEAP || (st->mem_use+hlen) > VM_LIMIT_HEAP) {
+    CAJ_WARN("DEBUG: exceeded mem limit of %i allocating %i with %i in use\n",
+	     VM_LIMIT_HEAP, (int)len, (int)st->mem_use);
+    st->scram_flag = VM_SCRAM_MEM_LIMIT; return NULL;
+  }
+  heap_header *p = (heap_header*)vm_pool_grow(&st->pool, p1, p1->len + 
+					      sizeof(heap_header), hlen);
+  memcpy((char*)script_getptr(p)+p->len, script_getptr(p2), p2->len);
+  p->len = len; st->mem_use += p2->len;
+  return p;
+}
+
 static void heap_ref_decr(heap_header *p, script_state *st) {
   if( ((--(p->refcnt)) & 0xffffff) == 0) {
     // printf("DEBUG: freeing heap entry 0x%p\n",p);
@@ -167,10 +371,12 @@ static void heap_ref_decr(heap_header *p, script_state *st) {
       for(unsigned i = 0; i < p->len; i++)
 	heap_ref_decr(list[i], st);
       st->mem_use -= p->len*4 + sizeof(heap_header);
+      vm_pool_free(&st->pool, p, p->len*sizeof(heap_header*) + 
+		   sizeof(heap_header));
     } else {
       st->mem_use -= p->len + sizeof(heap_header);
+      vm_pool_free(&st->pool, p, p->len + sizeof(heap_header));
     }
-    free(p);
   }
 }
 
@@ -182,6 +388,31 @@ static inline uint32_t heap_get_refcnt(heap_header *p) {
   return p->refcnt & 0xffffff;
 }
 
+// List version of script_append_str. The items in p2 get an extra
+// reference each, so the caller still has to drop p2.
+static heap_header *script_append_list(script_state *st, heap_header *p1,
+				       heap_header *p2) {
+  uint32_t len = p1->len + p2->len;
+  uint32_t fakelen = len*4 + sizeof(heap_header);
+  if(len > VM_LIMIT_HEAP || (st->mem_use+fakelen) > VM_LIMIT_HEAP) {
+    CAJ_WARN("DEBUG: exceeded mem limit of %i allocating %i-item list with %i in use\n",
+	     VM_LIMIT_HEAP, (int)len, (int)st->mem_use);
+    st->scram_flag = VM_SCRAM_MEM_LIMIT; return NULL;
+  }
+  heap_header *p = (heap_header*)vm_pool_grow(&st->pool, p1, 
+					      p1->len*sizeof(heap_header*) + 
+					      sizeof(heap_header),
+					      len*sizeof(heap_header*) + 
+					      sizeof(heap_header));
+  heap_header **new_items = (heap_header**)script_getptr(p) + p->len;
+  heap_header **items = (heap_header**)script_getptr(p2);
+  for(uint32_t i = 0; i < p2->len; i++) {
+    heap_ref_incr(items[i]); new_items[i] = items[i];
+  }
+  p->len = len; st->mem_use += p2->len*4;
+  return p;
+}
+
 static heap_header* make_vm_string(script_state *st, const char* str) {
   int len = strlen(str);
   heap_header* p = script_alloc(st, len, VM_TYPE_STR);
@@ -224,24 +455,127 @@ static heap_header* make_single_list(script_state *st, heap_header* item) {
 }
 
 
+static void vm_free_code(uint16_t *bytecode, uint16_t *patched_bytecode,
+			 vm_threaded_insn *threaded, vm_traceval *tracevals,
+			 vm_function *funcs, uint16_t num_funcs) {
+  if(patched_bytecode != bytecode) delete[] patched_bytecode;
+  delete[] bytecode; delete[] threaded; delete[] tracevals;
+  for(unsigned i = 0; i < num_funcs; i++) {
+    delete[] funcs[i].arg_types; delete[] funcs[i].name;
+  }
+  delete[] funcs;
+}
+
+static void vm_image_unref(vm_world *w, vm_script_image *img) {
+  g_mutex_lock(w->image_lock);
+  if(--img->refcnt > 0) { g_mutex_unlock(w->image_lock); return; }
+  typedef std::multimap<uint64_t, vm_script_image*>::iterator image_iter;
+  std::pair<image_iter, image_iter> range = w->images.equal_range(img->hash);
+  for(image_iter iter = range.first; iter != range.second; iter++) {
+    if(iter->second == img) { w->images.erase(iter); break; }
+  }
+  g_mutex_unlock(w->image_lock);
+
+  vm_free_code(img->bytecode, img->patched_bytecode, img->threaded, 
+	       img->tracevals, img->funcs, img->num_funcs);
+  delete[] img->gptr_types; delete img;
+}
+
+// hashes what the loader read from the file, before binding
+static uint64_t vm_image_hash(script_state *st) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+#define HASH_BYTES(ptr, len) \
+  for(size_t i_ = 0; i_ < (size_t)(len); i_++) \
+    hash = (hash ^ ((const unsigned char*)(ptr))[i_]) * 0x100000001b3ULL;
+  HASH_BYTES(st->bytecode, st->bytecode_len*sizeof(uint16_t));
+  for(unsigned i = 0; i < st->num_funcs; i++) {
+    vm_function *func = &st->funcs[i];
+    HASH_BYTES(&func->ret_type, 1);
+    HASH_BYTES(&func->insn_ptr, sizeof(func->insn_ptr));
+    HASH_BYTES(func->arg_types, func->arg_count);
+    HASH_BYTES(func->name, strlen(func->name)+1);
+  }
+  HASH_BYTES(&st->num_gvals, sizeof(st->num_gvals));
+  HASH_BYTES(&st->num_gptrs, sizeof(st->num_gptrs));
+  HASH_BYTES(st->gptr_types, st->num_gptrs);
+#undef HASH_BYTES
+  return hash;
+}
+
+static int vm_image_matches(vm_script_image *img, script_state *st) {
+  if(img->bytecode_len != st->bytecode_len || img->num_funcs != st->num_funcs ||
+     img->num_gvals != st->num_gvals || img->num_gptrs != st->num_gptrs ||
+     memcmp(img->gptr_types, st->gptr_types, st->num_gptrs) != 0 ||
+     memcmp(img->bytecode, st->bytecode, 
+	    st->bytecode_len*sizeof(uint16_t)) != 0) 
+    return 0;
+  for(unsigned i = 0; i < st->num_funcs; i++) {
+    vm_function *ifunc = &img->funcs[i], *func = &st->funcs[i];
+    // natives are 0 until vm_bind_natives fills them in, and st's may be
+    // bound already if it's the image we've just made.
+    uint32_t insn_ptr = ifunc->insn_ptr & 0x80000000 ? 0 : ifunc->insn_ptr;
+    uint32_t st_insn_ptr = func->insn_ptr & 0x80000000 ? 0 : func->insn_ptr;
+    if(ifunc->ret_type != func->ret_type || insn_ptr != st_insn_ptr ||
+       ifunc->arg_count != func->arg_count || 
+       memcmp(ifunc->arg_types, func->arg_types, func->arg_count) != 0 ||
+       strcmp(ifunc->name, func->name) != 0)
+      return 0;
+  }
+  return 1;
+}
+
+// Looks for an image with the same code as the newly-loaded script. If there
+// is one, swaps the script's copy of the code for it. Call with image_lock.
+static int vm_image_find_locked(vm_world *w, script_state *st, uint64_t hash) {
+  typedef std::multimap<uint64_t, vm_script_image*>::iterator image_iter;
+  std::pair<image_iter, image_iter> range = w->images.equal_range(hash);
+  for(image_iter iter = range.first; iter != range.second; iter++) {
+    vm_script_image *img = iter->second;
+    if(!vm_image_matches(img, st)) continue;
+    vm_free_code(st->bytecode, st->patched_bytecode, st->threaded, 
+		 st->tracevals, st->funcs, st->num_funcs);
+    img->refcnt++; st->image = img;
+    st->bytecode = img->bytecode; st->patched_bytecode = img->patched_bytecode;
+    st->threaded = img->threaded; st->tracevals = img->tracevals;
+    st->funcs = img->funcs;
+    return 1;
+  }
+  return 0;
+}
+
 void vm_free_script(script_state * st) {
-  if(st->stack_start != NULL && st->ip != 0) {
+#ifdef CAJ_VM_CHECK_HEAP
+  if(st->hib_data != NULL) vm_script_wake(st);
+  // not needed since the pool's freed in one go, but good for finding leaks
+  // FIXME - unwind_stack falls over on scripts that died mid-function
+  if(st->stack_start != NULL && st->ip != 0 && st->scram_flag == 0) {
     unwind_stack(st);
   }
   for(unsigned i = 0; i < st->num_gptrs; i++) {
     heap_header *p = st->gptrs[i]; heap_ref_decr(p, st);
   }
+  if(st->mem_use != 0) 
+    CAJ_WARN("WARNING: script leaked %u bytes of heap\n", st->mem_use);
+#endif
+  vm_pool_release(&st->pool);
   delete[] st->gvals; delete[] st->gptrs; delete[] st->gptr_types;
-  if(st->patched_bytecode != st->bytecode) delete[] st->patched_bytecode;
-  delete[] st->bytecode; // FIXME - will want to add bytecode sharing
-  delete[] st->tracevals;
+  if(st->jit_code != NULL) {
+    for(unsigned i = 0; i < st->num_funcs; i++) vm_jit_free(st->jit_code[i]);
+  }
+  delete[] st->jit_calls; delete[] st->jit_code; delete[] st->jit_entry;
 
-  for(unsigned i = 0; i < st->num_funcs; i++) {
-    delete[] st->funcs[i].arg_types; delete[] st->funcs[i].name;
+  if(st->image != NULL) {
+    if(st->threaded != st->image->threaded) delete[] st->threaded;
+    vm_image_unref(st->world, st->image);
+  } else {
+    // didn't get as far as making an image
+    vm_free_code(st->bytecode, st->patched_bytecode, st->threaded, 
+		 st->tracevals, st->funcs, st->num_funcs);
   }
-  delete[] st->funcs;
   delete[] st->stack_start;
   delete[] st->cur_state;
+  free(st->hib_data);
+  delete[] st->prof_samples;
   delete st;
 }
 
@@ -268,6 +602,7 @@ static int vm_vtype_size(uint8_t vtype) { // not same as vm_asm equivalent
 class script_loader {
 private:
   script_state *st;
+  vm_world *world;
   caj_logger *log;
   unsigned char *data; int data_len, pos;
   int has_failed;
@@ -321,7 +656,8 @@ private:
   }
 
 public:
-  script_loader(caj_logger *log) : st(NULL), heap(NULL), log(log) {
+  script_loader(caj_logger *log, vm_world *w) : st(NULL), world(w), 
+						  heap(NULL), log(log) {
     
   }
   
@@ -339,7 +675,7 @@ public:
 
     free_our_heap();
     if(st != NULL) vm_free_script(st);
-    st = new_script(log);
+    st = new_script(log); st->world = world;
 
     int is_end = 0;
     while(!is_end) {
@@ -602,9 +938,39 @@ public:
       CAJ_WARN_L(log, "SCRIPT LOAD ERR: missing required section\n"); return NULL;
     }
 
-    if(!verify_code(st)) {
-      CAJ_WARN_L(log, "SCRIPT LOAD ERR: didn't verify\n"); return NULL;
-    };
+    // if we've already got this script's code loaded, share that.
+    uint64_t hash = vm_image_hash(st);
+    g_mutex_lock(world->image_lock);
+    int found = vm_image_find_locked(world, st, hash);
+    g_mutex_unlock(world->image_lock);
+
+    if(!found) {
+      if(!verify_code(st)) {
+	CAJ_WARN_L(log, "SCRIPT LOAD ERR: didn't verify\n"); return NULL;
+      };
+      step_script(st, 0); // just builds the threaded code
+      
+      vm_script_image *img = new vm_script_image();
+      img->refcnt = 1; img->hash = hash;
+      img->bytecode_len = st->bytecode_len; img->num_funcs = st->num_funcs;
+      img->bytecode = st->bytecode; img->patched_bytecode = st->patched_bytecode;
+      img->threaded = st->threaded; img->tracevals = st->tracevals;
+      img->funcs = st->funcs;
+      img->num_gvals = st->num_gvals; img->num_gptrs = st->num_gptrs;
+      img->gptr_types = new uint8_t[st->num_gptrs];
+      memcpy(img->gptr_types, st->gptr_types, st->num_gptrs);
+      img->bind_failed = vm_bind_natives(world, img, log);
+
+      // someone may have loaded the same code while we were verifying it
+      g_mutex_lock(world->image_lock);
+      if(vm_image_find_locked(world, st, hash)) {
+	delete[] img->gptr_types;
+	delete img; // its other contents just got freed
+      } else {
+	st->image = img; world->images.insert(std::make_pair(hash, img));
+      }
+      g_mutex_unlock(world->image_lock);
+    }
     
     { // final return
       script_state *st2 = st; free_our_heap(); st = NULL;
@@ -613,8 +979,9 @@ public:
   }
 };
 
-script_state* vm_load_script(caj_logger *log, void* data, int data_len) {
-  script_loader loader(log);
+script_state* vm_load_script(caj_logger *log, vm_world *w, 
+			     void* data, int data_len) {
+  script_loader loader(log, w);
   return loader.load((unsigned char*)data, data_len);
 }
 
@@ -676,6 +1043,13 @@ unsigned char* vm_serialise_script(script_state *st, size_t *len) {
   if(st->scram_flag != 0) {
     *len = 0; return NULL;
   }
+  if(st->hib_data != NULL) {
+    // simplest just to unpack it again for a moment
+    vm_script_wake(st);
+    unsigned char *ret = vm_serialise_script(st, len);
+    vm_script_hibernate(st);
+    return ret;
+  }
   vm_serialiser serial; std::vector<unsigned char*> tmpbufs;
   std::map<heap_header*,uint32_t> heap_map;
   uint32_t *gptrs = new uint32_t[st->num_gptrs];
@@ -698,6 +1072,115 @@ unsigned char* vm_serialise_script(script_state *st, size_t *len) {
   delete[] gptrs; return ret;
 }
 
+// Appends hptr (and the items in it, if it's a list) to a hibernating 
+// script's packed heap, and returns its index. Entries are a vtype byte, 
+// then the uint32 length, then the data - or, for lists, the item indexes.
+// It's in native byte order, since it never leaves the process.
+static uint32_t hib_pack_item(std::vector<unsigned char> &buf,
+			      std::map<heap_header*,uint32_t> &heap_map,
+			      heap_header *hptr) {
+  std::map<heap_header*,uint32_t>::iterator iter = heap_map.find(hptr);
+  if(iter != heap_map.end()) return iter->second;
+
+  uint8_t vtype = heap_entry_vtype(hptr); uint32_t len = hptr->len;
+  std::vector<uint32_t> items;
+  if(vtype == VM_TYPE_LIST) {
+    heap_header **list = (heap_header**)script_getptr(hptr);
+    for(uint32_t i = 0; i < len; i++)
+      items.push_back(hib_pack_item(buf, heap_map, list[i]));
+  }
+
+  size_t pos = buf.size();
+  buf.resize(pos + 1 + sizeof(uint32_t) + 
+	     (vtype == VM_TYPE_LIST ? len*sizeof(uint32_t) : len));
+  buf[pos] = vtype; memcpy(&buf[pos+1], &len, sizeof(uint32_t));
+  if(vtype == VM_TYPE_LIST) {
+    if(len > 0) 
+      memcpy(&buf[pos+1+sizeof(uint32_t)], &items[0], len*sizeof(uint32_t));
+  } else if(len > 0) {
+    memcpy(&buf[pos+1+sizeof(uint32_t)], script_getptr(hptr), len);
+  }
+  uint32_t idx = heap_map.size();
+  heap_map[hptr] = idx; return idx;
+}
+
+int vm_script_hibernate(script_state *st) {
+  if(st->hib_data != NULL) return 1;
+  if(st->ip != 0 || st->scram_flag != 0 || st->stack_start == NULL ||
+     st->stack_top != st->stack_start+1023) return 0;
+
+  std::vector<unsigned char> buf;
+  std::map<heap_header*,uint32_t> heap_map;
+  std::vector<uint32_t> gptrs;
+  for(unsigned i = 0; i < st->num_gptrs; i++) 
+    gptrs.push_back(hib_pack_item(buf, heap_map, st->gptrs[i]));
+  size_t pos = buf.size();
+  buf.resize(pos + gptrs.size()*sizeof(uint32_t));
+  if(!gptrs.empty())
+    memcpy(&buf[pos], &gptrs[0], gptrs.size()*sizeof(uint32_t));
+
+  // one byte extra, so hib_data isn't NULL for a script with no heap at all
+  st->hib_len = buf.size();
+  st->hib_data = (unsigned char*)malloc(st->hib_len + 1);
+  if(st->hib_len > 0) memcpy(st->hib_data, &buf[0], st->hib_len);
+
+  // the entire heap is reachable from the globals, so no need to walk it
+  vm_pool_release(&st->pool); st->mem_use = 0;
+  for(unsigned i = 0; i < st->num_gptrs; i++) st->gptrs[i] = NULL;
+  delete[] st->stack_start; st->stack_start = st->stack_top = NULL;
+  return 1;
+}
+
+void vm_script_wake(script_state *st) {
+  if(st->hib_data == NULL) return;
+  std::vector<heap_header*> entries;
+  size_t pos = 0, end = st->hib_len - st->num_gptrs*sizeof(uint32_t);
+  while(pos < end) {
+    uint8_t vtype = st->hib_data[pos]; uint32_t len; heap_header *p;
+    memcpy(&len, st->hib_data+pos+1, sizeof(uint32_t));
+    pos += 1+sizeof(uint32_t);
+    if(vtype == VM_TYPE_LIST) {
+      p = script_alloc_list(st, len);
+      assert(p != NULL); // it fitted before it was packed up
+      heap_header **list = (heap_header**)script_getptr(p);
+      for(uint32_t i = 0; i < len; i++) {
+	uint32_t idx; memcpy(&idx, st->hib_data+pos, sizeof(uint32_t));
+	list[i] = entries[idx]; heap_ref_incr(list[i]); 
+	pos += sizeof(uint32_t);
+      }
+    } else {
+      p = script_alloc(st, len, vtype);
+      assert(p != NULL);
+      memcpy(script_getptr(p), st->hib_data+pos, len); pos += len;
+    }
+    entries.push_back(p);
+  }
+  for(unsigned i = 0; i < st->num_gptrs; i++) {
+    uint32_t idx; memcpy(&idx, st->hib_data+pos, sizeof(uint32_t));
+    st->gptrs[i] = entries[idx]; heap_ref_incr(st->gptrs[i]); 
+    pos += sizeof(uint32_t);
+  }
+  // drop the references entries was holding
+  for(size_t i = 0; i < entries.size(); i++) heap_ref_decr(entries[i], st);
+
+  free(st->hib_data); st->hib_data = NULL; st->hib_len = 0;
+  st->stack_start = new int32_t[1024]; // as in vm_prepare_script
+  st->stack_top = st->stack_start+1023;
+}
+
+int vm_script_is_hibernating(script_state *st) {
+  return st->hib_data != NULL;
+}
+
+int vm_script_is_dirty(script_state *st) {
+  // a script that's failed serialises as nothing at all
+  return st->dirty || st->scram_flag != st->clean_scram;
+}
+
+void vm_script_clear_dirty(script_state *st) {
+  st->dirty = 0; st->clean_scram = st->scram_flag;
+}
+
 static int verify_pass1(unsigned char * visited, uint16_t *bytecode, vm_function *func,
 			caj_logger *log) {
   std::vector<uint32_t> pending;
@@ -811,6 +1294,7 @@ static vm_traceval traceval_pop(vm_traceval cur, uint8_t type,
 
 typedef std::vector<uint8_t> traceval_stack;
 
+#if defined(CAJ_VM_CHECK_HEAP) || defined(DEBUG_TRACEVALS)
 static void traceval_to_stack(vm_traceval cur, script_state *st,
 			      uint32_t ip, traceval_stack &stack) {
   for(;;) {
@@ -831,6 +1315,10 @@ static void traceval_to_stack(vm_traceval cur, script_state *st,
     case ICLASS_RDL_P:
     case ICLASS_RDG_P:
       vtype = VM_TYPE_PTR; break;
+    case ICLASS_LOCAL_I:
+      vtype = LOCAL_I_HAS_RET(GET_LOCAL_I_OP(insn)) ? 
+	VM_TYPE_INT : VM_TYPE_NONE;
+      break;
     case ICLASS_WRL_I:
     case ICLASS_WRL_P:
     case ICLASS_WRG_I:
@@ -903,7 +1391,9 @@ static void traceval_to_stack(vm_traceval cur, script_state *st,
     stack.push_back(args.back()); args.pop_back();
   }
 }
+#endif
 
+#ifdef CAJ_VM_CHECK_HEAP // only needed by unwind_stack
 static void calc_stack_curop(traceval_stack &stack, uint8_t vtype) {
   switch(vtype) {
   case VM_TYPE_NONE: 
@@ -947,6 +1437,9 @@ static void script_calc_stack(script_state *st, traceval_stack &stack) {
   case ICLASS_WRL_P:
   case ICLASS_WRG_P:
     stack.push_back(VM_TYPE_PTR); break;
+  case ICLASS_LOCAL_I:
+    if(LOCAL_I_HAS_ARG(GET_LOCAL_I_OP(insn))) stack.push_back(VM_TYPE_INT);
+    break;
   case ICLASS_JUMP:
     break;
   case ICLASS_CALL:
@@ -968,6 +1461,7 @@ static void script_calc_stack(script_state *st, traceval_stack &stack) {
 
   traceval_to_stack(st->tracevals[st->ip], st, st->ip, stack);
 }
+#endif
 
 static int verify_pass2(unsigned char * visited, uint16_t *bytecode, 
 			vm_function *func, script_state *st) {
@@ -1161,6 +1655,26 @@ static int verify_pass2(unsigned char * visited, uint16_t *bytecode,
 	  }
 	  break;
 	}
+      case ICLASS_LOCAL_I:
+	{
+	  int op = GET_LOCAL_I_OP(insn);
+	  int fudge = vs.verify->check_local_i(insn)*(ptr_stack_sz()-1);
+	  if(err != NULL) { delete vs.verify; goto out; }
+	  if(LOCAL_I_HAS_ARG(op))
+	    vs.trace = traceval_pop(vs.trace, VM_TYPE_INT, st);
+	  st->tracevals[vs.ip] = vs.trace;
+	  if(LOCAL_I_HAS_RET(op))
+	    vs.trace = build_traceval(vs.ip, 1);
+	  if(fudge + GET_LOCAL_I_OFFSET(insn) > LOCAL_I_MAX_OFFSET) {
+	    err = "64-bit fudge exceeds max local offset. Try on a 32-bit VM?";
+	    delete vs.verify; goto out;
+	  };
+	  if(fudge > 0) {
+	    assert(st->patched_bytecode != NULL);
+	    st->patched_bytecode[vs.ip] = bytecode[vs.ip] + fudge;
+	  }
+	  break;
+	}
       case ICLASS_RDG_I:
 	{
 	  int16_t ival = GET_IVAL(insn); 
@@ -1345,6 +1859,33 @@ static heap_header* get_stk_ptr(int32_t *tloc) {
   }
 }
 
+// For ADD_SS and ADD_LL: can the left operand p (already popped) be
+// modified in place? It can if we hold the only reference, or if the only
+// other one is the variable the next insn is about to overwrite with the
+// result, as in s += x or s = s + x.
+static int vm_can_append(script_state *st, heap_header *p, heap_header *p2,
+			 uint16_t next, int32_t *stack_top) {
+  uint32_t refcnt = heap_get_refcnt(p);
+  if(refcnt == 1) return 1;
+  if(refcnt != 2 || p == p2) return 0;
+  if(GET_ICLASS(next) == ICLASS_WRL_P) 
+    return get_stk_ptr(stack_top + ptr_stack_sz() + GET_IVAL(next)) == p;
+  if(GET_ICLASS(next) == ICLASS_WRG_P)
+    return st->gptrs[GET_IVAL(next)] == p;
+  return 0;
+}
+
+// If appending moved p to pnew, the variable vm_can_append found still
+// points at the old copy, which is now gone.
+static void vm_appended(script_state *st, heap_header *p, heap_header *pnew,
+			uint16_t next, int32_t *stack_top) {
+  if(pnew == p || heap_get_refcnt(pnew) != 2) return;
+  if(GET_ICLASS(next) == ICLASS_WRL_P) 
+    put_stk_ptr(stack_top + ptr_stack_sz() + GET_IVAL(next), pnew);
+  else st->gptrs[GET_IVAL(next)] = pnew;
+}
+
+#ifdef CAJ_VM_CHECK_HEAP
 static void unwind_stack(script_state * st) {
   traceval_stack stack;
   while(st->ip != 0) {
@@ -1377,6 +1918,7 @@ static void unwind_stack(script_state * st) {
     CAJ_DEBUG("DEBUG: unwind_stack: new ip = 0x%x\n", (unsigned)st->ip);
   }
 }
+#endif
 
 static heap_header *list_2_str(heap_header* list, int32_t pos, script_state *st) {
   heap_header* ret;
@@ -1442,14 +1984,212 @@ static heap_header *list_2_str(heap_header* list, int32_t pos, script_state *st)
   return make_vm_string(st, str);
 }
 
-static void step_script(script_state* st, int num_steps) {
+// Threaded code ops. Anything that's not common enough to be worth its own op
+// goes via THR_GENERIC, which is just the old decode-and-switch. The order 
+// here must match thr_ops in step_script.
+enum {
+  THR_GENERIC = 0, THR_ADD_II, THR_SUB_II, THR_MUL_II, THR_ADD_FF, THR_SUB_FF,
+  THR_MUL_FF, THR_EQ_II, THR_NEQ_II, THR_GR_II, THR_LES_II, THR_GEQ_II,
+  THR_LEQ_II, THR_COND, THR_NCOND, THR_RET, THR_DROP_I, THR_BEGIN_CALL,
+  THR_INC_I, THR_DEC_I, THR_JUMP, THR_RDG_I, THR_WRG_I, THR_RDL_I, THR_WRL_I,
+  THR_LOCAL_INC, THR_LOCAL_DEC, THR_LOCAL_ADD, THR_LOCAL_SUB,
+  // fused sequences. These only ever replace the first insn of the sequence;
+  // anything jumping into the middle of one just runs the unfused insns.
+  THR_RDL_RDL_ADD_II, // RDL_I a; RDL_I b; ADD_II
+  THR_EQ_II_BR, THR_NEQ_II_BR, THR_GR_II_BR, // <cmp>_II; NCOND; JUMP
+  THR_LES_II_BR, THR_GEQ_II_BR, THR_LEQ_II_BR,
+  THR_COND_BR, THR_NCOND_BR, // [N]COND; JUMP
+  THR_RDG_LOCAL_ADD, THR_RDL_LOCAL_ADD, // RD[GL]_I b; LOCAL_I ADD a
+  // RD[GL]_I b; LOCAL_I <cmp> a; [N]COND; JUMP. These jump if the comparison
+  // is true, so the NCOND versions use the opposite comparison.
+  THR_RDG_LOCAL_EQ_BR, THR_RDG_LOCAL_NEQ_BR, THR_RDG_LOCAL_GR_BR,
+  THR_RDG_LOCAL_LES_BR, THR_RDG_LOCAL_GEQ_BR, THR_RDG_LOCAL_LEQ_BR,
+  THR_RDL_LOCAL_EQ_BR, THR_RDL_LOCAL_NEQ_BR, THR_RDL_LOCAL_GR_BR,
+  THR_RDL_LOCAL_LES_BR, THR_RDL_LOCAL_GEQ_BR, THR_RDL_LOCAL_LEQ_BR,
+  THR_JIT, // enter native code, see jit_func_called
+  THR_NUM_OPS
+};
+
+static const void *thr_jit_op = NULL; // so we can JIT outside step_script
+
+static int thr_jump_target(uint16_t insn, uint32_t ip, uint32_t len, 
+			   int32_t *target) {
+  if(GET_ICLASS(insn) != ICLASS_JUMP) return 0;
+  int16_t ival = GET_IVAL(insn);
+  int64_t dest = (int64_t)ip + 1;
+  if(ival & 0x800) dest -= ival & 0x7ff; else dest += ival;
+  if(dest <= 0 || dest >= len) return 0; // let the slow path deal with it
+  *target = dest; return 1;
+}
+
+static void thread_code(script_state *st, const void *const *ops) {
+  uint16_t *bytecode = st->patched_bytecode;
+  uint32_t len = st->bytecode_len;
+  vm_threaded_insn *code = new vm_threaded_insn[len];
+
+  for(int i = 0; i < THR_NUM_OPS; i++) assert(ops[i] != NULL);
+
+  for(uint32_t ip = 0; ip < len; ip++) {
+    uint16_t insn = bytecode[ip];
+    int op = THR_GENERIC; int32_t arg = GET_IVAL(insn);
+    switch(GET_ICLASS(insn)) {
+    case ICLASS_NORMAL:
+      switch(GET_IVAL(insn)) {
+      case INSN_ADD_II: op = THR_ADD_II; break;
+      case INSN_SUB_II: op = THR_SUB_II; break;
+      case INSN_MUL_II: op = THR_MUL_II; break;
+      case INSN_ADD_FF: op = THR_ADD_FF; break;
+      case INSN_SUB_FF: op = THR_SUB_FF; break;
+      case INSN_MUL_FF: op = THR_MUL_FF; break;
+      case INSN_EQ_II: op = THR_EQ_II; break;
+      case INSN_NEQ_II: op = THR_NEQ_II; break;
+      case INSN_GR_II: op = THR_GR_II; break;
+      case INSN_LES_II: op = THR_LES_II; break;
+      case INSN_GEQ_II: op = THR_GEQ_II; break;
+      case INSN_LEQ_II: op = THR_LEQ_II; break;
+      case INSN_COND: op = THR_COND; break;
+      case INSN_NCOND: op = THR_NCOND; break;
+      case INSN_RET: op = THR_RET; break;
+      case INSN_DROP_I: op = THR_DROP_I; break;
+      case INSN_BEGIN_CALL: op = THR_BEGIN_CALL; break;
+      case INSN_INC_I: op = THR_INC_I; break;
+      case INSN_DEC_I: op = THR_DEC_I; break;
+      }
+      break;
+    case ICLASS_JUMP:
+      if(thr_jump_target(insn, ip, len, &arg)) op = THR_JUMP;
+      break;
+    case ICLASS_RDG_I: op = THR_RDG_I; break;
+    case ICLASS_WRG_I: op = THR_WRG_I; break;
+    case ICLASS_RDL_I: op = THR_RDL_I; break;
+    case ICLASS_WRL_I: op = THR_WRL_I; break;
+    case ICLASS_LOCAL_I:
+      arg = GET_LOCAL_I_OFFSET(insn);
+      switch(GET_LOCAL_I_OP(insn)) {
+      case LOCAL_I_INC: op = THR_LOCAL_INC; break;
+      case LOCAL_I_DEC: op = THR_LOCAL_DEC; break;
+      case LOCAL_I_ADD: op = THR_LOCAL_ADD; break;
+      case LOCAL_I_SUB: op = THR_LOCAL_SUB; break;
+      }
+      break;
+    }
+    code[ip].op = ops[op]; code[ip].arg = arg;
+  }
+
+  // now look for sequences worth fusing
+  for(uint32_t ip = 0; ip+1 < len; ip++) {
+    uint16_t insn = bytecode[ip], next = bytecode[ip+1];
+    uint16_t next2 = ip+2 < len ? bytecode[ip+2] : (uint16_t)INSN_ABORT;
+    int32_t target;
+    if(GET_ICLASS(insn) == ICLASS_RDL_I && GET_ICLASS(next) == ICLASS_RDL_I &&
+       next2 == INSN_ADD_II) {
+      code[ip].op = ops[THR_RDL_RDL_ADD_II];
+    } else if((insn == INSN_COND || insn == INSN_NCOND) &&
+	      thr_jump_target(next, ip+1, len, &target)) {
+      code[ip].op = ops[insn == INSN_COND ? THR_COND_BR : THR_NCOND_BR];
+      code[ip].arg = target;
+    } else if(next == INSN_NCOND && 
+	      thr_jump_target(next2, ip+2, len, &target)) {
+      int op;
+      switch(insn) {
+      case INSN_EQ_II: op = THR_EQ_II_BR; break;
+      case INSN_NEQ_II: op = THR_NEQ_II_BR; break;
+      case INSN_GR_II: op = THR_GR_II_BR; break;
+      case INSN_LES_II: op = THR_LES_II_BR; break;
+      case INSN_GEQ_II: op = THR_GEQ_II_BR; break;
+      case INSN_LEQ_II: op = THR_LEQ_II_BR; break;
+      default: continue;
+      }
+      code[ip].op = ops[op]; code[ip].arg = target;
+    } else if((GET_ICLASS(insn) == ICLASS_RDG_I || 
+	       GET_ICLASS(insn) == ICLASS_RDL_I) &&
+	      GET_ICLASS(next) == ICLASS_LOCAL_I) {
+      int is_rdg = GET_ICLASS(insn) == ICLASS_RDG_I;
+      int lop = GET_LOCAL_I_OP(next);
+      uint16_t next3 = ip+3 < len ? bytecode[ip+3] : (uint16_t)INSN_ABORT;
+      if(lop == LOCAL_I_ADD) {
+	code[ip].op = ops[is_rdg ? THR_RDG_LOCAL_ADD : THR_RDL_LOCAL_ADD];
+	continue;
+      }
+      if(!LOCAL_I_HAS_RET(lop) || (next2 != INSN_COND && next2 != INSN_NCOND) ||
+	 !thr_jump_target(next3, ip+3, len, &target))
+	continue;
+      if(next2 == INSN_NCOND) {
+	switch(lop) { // jump if the comparison's false instead
+	case LOCAL_I_EQ: lop = LOCAL_I_NEQ; break;
+	case LOCAL_I_NEQ: lop = LOCAL_I_EQ; break;
+	case LOCAL_I_GR: lop = LOCAL_I_LEQ; break;
+	case LOCAL_I_LES: lop = LOCAL_I_GEQ; break;
+	case LOCAL_I_GEQ: lop = LOCAL_I_LES; break;
+	case LOCAL_I_LEQ: lop = LOCAL_I_GR; break;
+	}
+      }
+      code[ip].op = ops[(is_rdg ? THR_RDG_LOCAL_EQ_BR : THR_RDL_LOCAL_EQ_BR) + 
+			lop - LOCAL_I_EQ];
+      code[ip].arg = target;
+    }
+  }
+
+  st->threaded = code;
+  thr_jit_op = ops[THR_JIT];
+}
+
+// Counts calls to a function, and JITs it when it gets hot enough. After 
+// that, the threaded code sends it to the native code where it can.
+static void jit_func_called(script_state *st, int func_no) {
+  if(st->jit_calls == NULL || 
+     ++st->jit_calls[func_no] != st->world->jit_threshold) return;
+
+  vm_function *func = &st->funcs[func_no];
+  assert(st->jit_code[func_no] == NULL);
+  if(st->threaded == st->image->threaded) {
+    // the image's threaded code is shared, so we need our own to patch
+    st->threaded = new vm_threaded_insn[st->bytecode_len];
+    memcpy(st->threaded, st->image->threaded, 
+	   st->bytecode_len*sizeof(vm_threaded_insn));
+  }
+  st->jit_code[func_no] = vm_jit_compile(st->patched_bytecode, func->insn_ptr,
+					 func->insn_end, st->jit_entry);
+  for(uint32_t ip = func->insn_ptr; ip < func->insn_end; ip++) {
+    if(st->jit_entry[ip] != NULL) st->threaded[ip].op = thr_jit_op;
+  }
+}
+
+// Uses GCC's labels-as-values: each instruction jumps straight to its handler
+// via the threaded code, rather than going through two levels of switch. 
+// Fused sequences count as all their instructions, so this can run a couple 
+// of instructions over num_steps.
+// Returns how many of the num_steps it didn't get round to using.
+static int step_script(script_state* st, int num_steps) {
+  static const void *const thr_ops[THR_NUM_OPS] = {
+    &&thr_generic, &&thr_add_ii, &&thr_sub_ii, &&thr_mul_ii, &&thr_add_ff,
+    &&thr_sub_ff, &&thr_mul_ff, &&thr_eq_ii, &&thr_neq_ii, &&thr_gr_ii,
+    &&thr_les_ii, &&thr_geq_ii, &&thr_leq_ii, &&thr_cond, &&thr_ncond,
+    &&thr_ret, &&thr_drop_i, &&thr_begin_call, &&thr_inc_i, &&thr_dec_i,
+    &&thr_jump, &&thr_rdg_i, &&thr_wrg_i, &&thr_rdl_i, &&thr_wrl_i,
+    &&thr_local_inc, &&thr_local_dec, &&thr_local_add, &&thr_local_sub,
+    &&thr_rdl_rdl_add_ii, &&thr_eq_ii_br, &&thr_neq_ii_br, &&thr_gr_ii_br,
+    &&thr_les_ii_br, &&thr_geq_ii_br, &&thr_leq_ii_br, &&thr_cond_br,
+    &&thr_ncond_br, &&thr_rdg_local_add, &&thr_rdl_local_add,
+    &&thr_rdg_local_eq_br, &&thr_rdg_local_neq_br, &&thr_rdg_local_gr_br,
+    &&thr_rdg_local_les_br, &&thr_rdg_local_geq_br, &&thr_rdg_local_leq_br,
+    &&thr_rdl_local_eq_br, &&thr_rdl_local_neq_br, &&thr_rdl_local_gr_br,
+    &&thr_rdl_local_les_br, &&thr_rdl_local_geq_br, &&thr_rdl_local_leq_br,
+    &&thr_jit
+  };
+  if(unlikely(st->threaded == NULL)) thread_code(st, thr_ops);
+
   uint16_t* bytecode = st->patched_bytecode;
+  const vm_threaded_insn *threaded = st->threaded;
   int32_t* stack_top = st->stack_top;
   uint32_t ip = st->ip;
   assert((st->ip & 0x80000000) == 0 && st->scram_flag == 0); // caller should know better :-P
   for( ; num_steps > 0 && ip != 0; num_steps--) {
     //printf("DEBUG: executing at %u: 0x%04x\n", ip, (int)bytecode[ip]);
-    uint16_t insn = bytecode[ip++];
+    uint16_t insn = bytecode[ip];
+    const vm_threaded_insn *ti = &threaded[ip++];
+    goto *ti->op;
+  thr_generic:
     switch(GET_ICLASS(insn)) {
     case ICLASS_NORMAL:
       switch(GET_IVAL(insn)) {
@@ -1457,15 +2197,15 @@ static void step_script(script_state* st, int num_steps) {
 	break;
       case INSN_ABORT:
 	goto abort_exec;
-      case INSN_ADD_II:
+      case INSN_ADD_II: thr_add_ii:
 	stack_top[2] = stack_top[2] + stack_top[1];
 	stack_top++;
 	break;
-      case INSN_SUB_II:
+      case INSN_SUB_II: thr_sub_ii:
 	stack_top[2] = stack_top[2] - stack_top[1];
 	stack_top++;
 	break;
-      case INSN_MUL_II:
+      case INSN_MUL_II: thr_mul_ii:
 	stack_top[2] = stack_top[2] * stack_top[1];
 	stack_top++;
 	break;
@@ -1481,15 +2221,15 @@ static void step_script(script_state* st, int num_steps) {
 	}
 	stack_top++;
 	break;
-      case INSN_ADD_FF:
+      case INSN_ADD_FF: thr_add_ff:
 	((float*)stack_top)[2] = ((float*)stack_top)[2] + ((float*)stack_top)[1];
 	stack_top++;
 	break;
-      case INSN_SUB_FF:
+      case INSN_SUB_FF: thr_sub_ff:
 	((float*)stack_top)[2] = ((float*)stack_top)[2] - ((float*)stack_top)[1];
 	stack_top++;
 	break;
-      case INSN_MUL_FF:
+      case INSN_MUL_FF: thr_mul_ff:
 	((float*)stack_top)[2] = ((float*)stack_top)[2] * ((float*)stack_top)[1];
 	stack_top++;
 	break;
@@ -1497,7 +2237,7 @@ static void step_script(script_state* st, int num_steps) {
 	((float*)stack_top)[2] = ((float*)stack_top)[2] / ((float*)stack_top)[1];
 	stack_top++;
 	break;
-      case INSN_RET:
+      case INSN_RET: thr_ret:
 	ip = *(++stack_top); 
 	break;
       case INSN_MOD_II:
@@ -1548,37 +2288,37 @@ static void step_script(script_state* st, int num_steps) {
       case INSN_NOT_L:
 	stack_top[1] = !stack_top[1];
 	break;	
-      case INSN_COND:
+      case INSN_COND: thr_cond:
 	if(*(++stack_top) == 0) ip++;
 	break;
-      case INSN_NCOND:
+      case INSN_NCOND: thr_ncond:
 	if(*(++stack_top) != 0) ip++;
 	break;
-      case INSN_EQ_II:
+      case INSN_EQ_II: thr_eq_ii:
 	stack_top[2] = stack_top[2] == stack_top[1];
 	stack_top++;
 	break;
-      case INSN_NEQ_II:
+      case INSN_NEQ_II: thr_neq_ii:
 	stack_top[2] = stack_top[2] != stack_top[1];
 	stack_top++;
 	break;
-      case INSN_GR_II:
+      case INSN_GR_II: thr_gr_ii:
 	stack_top[2] = stack_top[2] > stack_top[1];
 	stack_top++;
 	break;
-      case INSN_LES_II:
+      case INSN_LES_II: thr_les_ii:
 	stack_top[2] = stack_top[2] < stack_top[1];
 	stack_top++;
 	break;
-      case INSN_GEQ_II:
+      case INSN_GEQ_II: thr_geq_ii:
 	stack_top[2] = stack_top[2] >= stack_top[1];
 	stack_top++;
 	break;
-      case INSN_LEQ_II:
+      case INSN_LEQ_II: thr_leq_ii:
 	stack_top[2] = stack_top[2] <= stack_top[1];
 	stack_top++;
 	break;
-      case INSN_DROP_I:
+      case INSN_DROP_I: thr_drop_i:
 	stack_top++; break;
       case INSN_DROP_P:
 	heap_ref_decr(get_stk_ptr(stack_top+1), st); 
@@ -1632,19 +2372,30 @@ static void step_script(script_state* st, int num_steps) {
 	  break;
 	}
 	/* FIXME - implement other casts */
-      case INSN_BEGIN_CALL:
+      case INSN_BEGIN_CALL: thr_begin_call:
 	// --stack_top; // the magic is in the verifier.
 	*(stack_top--) = 0x1231234; // for debugging
 	break;
-      case INSN_INC_I:
+      case INSN_INC_I: thr_inc_i:
 	stack_top[1]++; break;
-      case INSN_DEC_I:
+      case INSN_DEC_I: thr_dec_i:
 	stack_top[1]--; break;
       case INSN_ADD_SS:
 	{
 	  heap_header *p2 = get_stk_ptr(stack_top+1); 
 	  heap_header *p1 = get_stk_ptr(stack_top+1+ptr_stack_sz()); 
 	  stack_top += ptr_stack_sz();
+	  if(vm_can_append(st, p1, p2, bytecode[ip], stack_top)) {
+	    heap_header *pnew = script_append_str(st, p1, p2);
+	    heap_ref_decr(p2,st);
+	    if(pnew == NULL) { 
+	      heap_ref_decr(p1,st); put_stk_ptr(stack_top+1,NULL); 
+	      goto abort_exec;
+	    }
+	    vm_appended(st, p1, pnew, bytecode[ip], stack_top);
+	    put_stk_ptr(stack_top+1,pnew);
+	    break;
+	  }
 	  heap_header *pnew = script_alloc(st, p1->len+p2->len, VM_TYPE_STR);
 	  if(pnew != NULL) {
 	    memcpy(script_getptr(pnew), script_getptr(p1), p1->len);
@@ -2074,6 +2825,17 @@ static void step_script(script_state* st, int num_steps) {
 	  heap_header *p2 = get_stk_ptr(stack_top+1); 
 	  heap_header *p1 = get_stk_ptr(stack_top+1+ptr_stack_sz()); 
 	  stack_top += ptr_stack_sz();
+	  if(vm_can_append(st, p1, p2, bytecode[ip], stack_top)) {
+	    heap_header *pnew = script_append_list(st, p1, p2);
+	    heap_ref_decr(p2,st);
+	    if(pnew == NULL) { 
+	      heap_ref_decr(p1,st); put_stk_ptr(stack_top+1,NULL); 
+	      goto abort_exec;
+	    }
+	    vm_appended(st, p1, pnew, bytecode[ip], stack_top);
+	    put_stk_ptr(stack_top+1,pnew);
+	    break;
+	  }
 	  heap_header *pnew = script_alloc_list(st, p1->len+p2->len);
 	  if(pnew != NULL) {
 	    heap_header **new_items = (heap_header**)script_getptr(pnew);
@@ -2100,7 +2862,7 @@ static void step_script(script_state* st, int num_steps) {
 	{ 
 	  int new_state = *(++stack_top);
 	  CAJ_DEBUG("DEBUG: setting state %i\n", new_state);
-	  st->state_id = new_state; 
+	  st->state_id = new_state; st->dirty = 1;
 	  vm_bind_events(st); // FIXME - this is excessively inefficient.
 	  if(st->scram_flag) goto abort_exec;
 	  st->world->state_change_cb(st, st->priv);
@@ -2160,19 +2922,21 @@ static void step_script(script_state* st, int num_steps) {
 	  uint32_t func_no = ip & 0x7fffffff;
 	  st->stack_top = stack_top; st->ip = ip;
 	  st->world->nfuncs[func_no].cb(st, st->priv, func_no);
-	  return;
+	  return num_steps;
 	} else if(st->funcs[ival].max_stack_use > (stack_top - st->stack_start)) { 
 	  CAJ_ERROR("ERROR: potential stack overflow, aborting\n");
 	  ip = stack_top[st->funcs[ival].frame_sz] - 1;
 	  st->scram_flag = VM_SCRAM_STACK_OVERFLOW; goto abort_exec;
 	}
+	jit_func_called(st, ival);
       }
       break;
-    case ICLASS_RDG_I:
+    case ICLASS_RDG_I: thr_rdg_i:
       *(stack_top--) = st->gvals[GET_IVAL(insn)];
       break;
-    case ICLASS_WRG_I:
+    case ICLASS_WRG_I: thr_wrg_i:
       st->gvals[GET_IVAL(insn)] = *(++stack_top);
+      st->dirty = 1;
       break;
     case ICLASS_RDG_P:
       {
@@ -2185,15 +2949,15 @@ static void step_script(script_state* st, int num_steps) {
       {
 	heap_ref_decr(st->gptrs[GET_IVAL(insn)], st);
 	st->gptrs[GET_IVAL(insn)] = get_stk_ptr(stack_top+1);
-	stack_top += ptr_stack_sz(); 
+	stack_top += ptr_stack_sz(); st->dirty = 1;
 	break;
       }
     // TODO - other global-related instructions
-    case ICLASS_RDL_I:
+    case ICLASS_RDL_I: thr_rdl_i:
       *stack_top = stack_top[GET_IVAL(insn)];
       stack_top--;
       break;
-    case ICLASS_WRL_I:
+    case ICLASS_WRL_I: thr_wrl_i:
       // FIXME - is this where we want to do the offset from
       stack_top++;
       stack_top[GET_IVAL(insn)] = *stack_top;
@@ -2213,20 +2977,116 @@ static void step_script(script_state* st, int num_steps) {
 	put_stk_ptr(stack_top+GET_IVAL(insn),p);
 	break;
       }
+    case ICLASS_LOCAL_I:
+      // the offset's from after the operand (if any) is popped
+      switch(GET_LOCAL_I_OP(insn)) {
+      case LOCAL_I_INC: thr_local_inc:
+	stack_top[GET_LOCAL_I_OFFSET(insn)]++; break;
+      case LOCAL_I_DEC: thr_local_dec:
+	stack_top[GET_LOCAL_I_OFFSET(insn)]--; break;
+      case LOCAL_I_ADD: thr_local_add:
+	stack_top++; stack_top[GET_LOCAL_I_OFFSET(insn)] += *stack_top; break;
+      case LOCAL_I_SUB: thr_local_sub:
+	stack_top++; stack_top[GET_LOCAL_I_OFFSET(insn)] -= *stack_top; break;
+#define LOCAL_I_CMP(op) \
+	stack_top[1] = stack_top[GET_LOCAL_I_OFFSET(insn)+1] op stack_top[1]; \
+	break;
+      case LOCAL_I_EQ: LOCAL_I_CMP(==)
+      case LOCAL_I_NEQ: LOCAL_I_CMP(!=)
+      case LOCAL_I_GR: LOCAL_I_CMP(>)
+      case LOCAL_I_LES: LOCAL_I_CMP(<)
+      case LOCAL_I_GEQ: LOCAL_I_CMP(>=)
+      case LOCAL_I_LEQ: LOCAL_I_CMP(<=)
+#undef LOCAL_I_CMP
+      default: // verifier should've caught this
+	CAJ_WARN("ERROR: unhandled local int op; insn 0x%04x\n",(int)insn);
+	ip--; st->scram_flag = VM_SCRAM_BAD_OPCODE; goto abort_exec;
+      }
+      break;
     default:
       CAJ_WARN("ERROR: unhandled insn class; insn 0x%04x\n",(int)insn);
       ip--; st->scram_flag = VM_SCRAM_BAD_OPCODE; goto abort_exec;
     }
+    continue;
+
+  thr_jump:
+    ip = ti->arg;
+    continue;
+  thr_rdl_rdl_add_ii:
+    *stack_top = stack_top[ti->arg];
+    *stack_top += stack_top[threaded[ip].arg - 1];
+    stack_top--; ip += 2; num_steps -= 2;
+    continue;
+#define THR_CMP_BR(op) \
+    if(stack_top[2] op stack_top[1]) ip += 2; else ip = ti->arg; \
+    stack_top += 2; num_steps -= 2; \
+    continue;
+  thr_eq_ii_br: THR_CMP_BR(==)
+  thr_neq_ii_br: THR_CMP_BR(!=)
+  thr_gr_ii_br: THR_CMP_BR(>)
+  thr_les_ii_br: THR_CMP_BR(<)
+  thr_geq_ii_br: THR_CMP_BR(>=)
+  thr_leq_ii_br: THR_CMP_BR(<=)
+#undef THR_CMP_BR
+  thr_rdg_local_add:
+    stack_top[threaded[ip].arg] += st->gvals[ti->arg];
+    ip++; num_steps--;
+    continue;
+  thr_rdl_local_add:
+    stack_top[threaded[ip].arg] += stack_top[ti->arg];
+    ip++; num_steps--;
+    continue;
+  // the operand's pushed and popped again, so the stack's where it started
+#define THR_LOCAL_BR(op, val) \
+    if(stack_top[threaded[ip].arg] op (val)) ip = ti->arg; else ip += 3; \
+    num_steps -= 3; \
+    continue;
+  thr_rdg_local_eq_br: THR_LOCAL_BR(==, st->gvals[GET_IVAL(insn)])
+  thr_rdg_local_neq_br: THR_LOCAL_BR(!=, st->gvals[GET_IVAL(insn)])
+  thr_rdg_local_gr_br: THR_LOCAL_BR(>, st->gvals[GET_IVAL(insn)])
+  thr_rdg_local_les_br: THR_LOCAL_BR(<, st->gvals[GET_IVAL(insn)])
+  thr_rdg_local_geq_br: THR_LOCAL_BR(>=, st->gvals[GET_IVAL(insn)])
+  thr_rdg_local_leq_br: THR_LOCAL_BR(<=, st->gvals[GET_IVAL(insn)])
+  thr_rdl_local_eq_br: THR_LOCAL_BR(==, stack_top[GET_IVAL(insn)])
+  thr_rdl_local_neq_br: THR_LOCAL_BR(!=, stack_top[GET_IVAL(insn)])
+  thr_rdl_local_gr_br: THR_LOCAL_BR(>, stack_top[GET_IVAL(insn)])
+  thr_rdl_local_les_br: THR_LOCAL_BR(<, stack_top[GET_IVAL(insn)])
+  thr_rdl_local_geq_br: THR_LOCAL_BR(>=, stack_top[GET_IVAL(insn)])
+  thr_rdl_local_leq_br: THR_LOCAL_BR(<=, stack_top[GET_IVAL(insn)])
+#undef THR_LOCAL_BR
+  thr_cond_br:
+    if(*(++stack_top) == 0) ip++; else ip = ti->arg;
+    num_steps--;
+    continue;
+  thr_ncond_br:
+    if(*(++stack_top) != 0) ip++; else ip = ti->arg;
+    num_steps--;
+    continue;
+  thr_jit:
+    {
+      vm_jit_ctx ctx;
+      ctx.stack_top = stack_top; ctx.gvals = st->gvals; 
+      ctx.budget = num_steps; ctx.dirty = 0;
+      uint32_t new_ip = vm_jit_run(&ctx, st->jit_entry[ip-1]);
+      stack_top = ctx.stack_top; st->dirty |= ctx.dirty;
+      if(new_ip == ip-1) { 
+	// came straight back (or looped round to here), so run it ourselves
+	num_steps = ctx.budget; goto thr_generic;
+      }
+      ip = new_ip; num_steps = ctx.budget + 1; // +1 for the loop's decrement
+      continue;
+    }
   }
  out:
   // note: this code is duplicated in INSN_CALL
   st->stack_top = stack_top; 
   st->ip = ip;
-  return; // FIXME;
+  return num_steps; // FIXME;
  abort_exec:
   st->stack_top = stack_top; st->ip = ip;
   CAJ_INFO("DEBUG: aborting code execution\n");
   if(st->scram_flag == 0) st->scram_flag = VM_SCRAM_ERR;
+  return num_steps;
 }
 
 int vm_script_is_idle(script_state *st) {
@@ -2279,6 +3139,25 @@ int check_ncall_args(const vm_nfunc_desc &nfunc, const vm_function &func) {
   return 0;
 }
 
+// done once per image, when it's loaded. Returns non-zero on failure.
+static int vm_bind_natives(vm_world *w, vm_script_image *img, 
+			   caj_logger *log) {
+  for(unsigned i = 0; i < img->num_funcs; i++) {
+    if(img->funcs[i].insn_ptr != 0) continue;
+    std::map<std::string, int>::iterator iter = 
+      w->nfunc_map.find(img->funcs[i].name);
+    if(iter != w->nfunc_map.end()) {
+      if(check_ncall_args(w->nfuncs[iter->second], img->funcs[i])){
+	CAJ_WARN_L(log, "ERROR: prototype mismatch binding %s\n",
+		   img->funcs[i].name);
+	return 1;
+      }
+      img->funcs[i].insn_ptr = 0x80000000 | iter->second;
+    }
+  }
+  return 0;
+}
+
 static void vm_bind_events(script_state *st) {
   vm_world *w = st->world;
   for(int i = 0; i < w->num_events; i++) st->cur_state[i] = 0xffff;
@@ -2288,16 +3167,8 @@ static void vm_bind_events(script_state *st) {
   state_prefix[prefix_len++] = ':';
  
   for(unsigned i = 0; i < st->num_funcs; i++) {
-    if(st->funcs[i].insn_ptr == 0) {
-      std::map<std::string, int>::iterator iter = 
-	w->nfunc_map.find(st->funcs[i].name);
-      if(iter != w->nfunc_map.end()) {
-	if(check_ncall_args(w->nfuncs[iter->second], st->funcs[i])){
-	  CAJ_WARN("ERROR: prototype mismatch binding %s\n",st->funcs[i].name);
-	  st->scram_flag = 1; return;
-	}
-	st->funcs[i].insn_ptr = 0x80000000 | iter->second;
-      }
+    if(st->funcs[i].insn_ptr == 0 || (st->funcs[i].insn_ptr & 0x80000000)) {
+      continue; // native, see vm_bind_natives
     } else if(strncmp(st->funcs[i].name, state_prefix, prefix_len) == 0) {
       // FIXME - need to handle multiple states!
 
@@ -2318,19 +3189,30 @@ static void vm_bind_events(script_state *st) {
 
 // the native funcs array is generally global so we don't free it
 void vm_prepare_script(script_state *st, void *priv, vm_world *w) {
-  assert(st->stack_top == NULL);
+  assert(st->stack_top == NULL && st->world == w);
   st->stack_start = new int32_t[1024]; // FIXME - pick this properly;
   st->stack_top = st->stack_start+1023;
   st->world = w; st->priv = priv;
 
   st->cur_state = new uint16_t[w->num_events];
+  if(st->image->bind_failed) { st->scram_flag = 1; return; }
   vm_bind_events(st);
+
+  if(w->jit_threshold > 0) {
+    st->jit_calls = new uint32_t[st->num_funcs];
+    st->jit_code = new vm_jit_code*[st->num_funcs];
+    st->jit_entry = new void*[st->bytecode_len];
+    memset(st->jit_calls, 0, st->num_funcs*sizeof(uint32_t));
+    memset(st->jit_code, 0, st->num_funcs*sizeof(vm_jit_code*));
+    memset(st->jit_entry, 0, st->bytecode_len*sizeof(void*));
+  }
 }
 
 void vm_call_event(script_state *st, int event_id, ...) {
   va_list args;
 
   assert(st->ip == 0 && st->scram_flag == 0);
+  vm_script_wake(st);
   assert(st->stack_top != NULL);
   assert(st->cur_state != NULL);
 
@@ -2352,6 +3234,7 @@ void vm_call_event(script_state *st, int event_id, ...) {
     assert(0); // can't be triggered by scripts, since return type checked
   }
   *(st->stack_top--) = 0; // return pointer
+  jit_func_called(st, func_no);
 
   va_start(args, event_id);
   for(int i = 0; i < func->arg_count; i++) {
@@ -2389,10 +3272,51 @@ int vm_event_has_handler(script_state *st, int event_id) {
   return st->cur_state[event_id] != 0xffff;
 }
 
+// Notes which function the script's in, including native functions it's
+// waiting on. Since it's only done when vm_run_script returns, that's 
+// roughly proportional to how long is spent in each one.
+static void vm_prof_sample(script_state *st) {
+  uint32_t ip = st->ip;
+  for(unsigned i = 0; i < st->num_funcs; i++) {
+    vm_function *func = &st->funcs[i];
+    if((ip & 0x80000000) ? func->insn_ptr == ip :
+       (func->insn_ptr != 0 && (func->insn_ptr & 0x80000000) == 0 &&
+	ip >= func->insn_ptr && ip < func->insn_end)) {
+      st->prof_samples[i]++; return;
+    }
+  }
+}
+
 void vm_run_script(script_state *st, int num_steps) {
   if(st->scram_flag != 0 || st->ip == 0) return;
   assert(st->stack_top != NULL);
-  step_script(st, num_steps);
+  st->insn_count += num_steps - step_script(st, num_steps);
+  if(st->prof_samples != NULL && st->ip != 0) vm_prof_sample(st);
+}
+
+uint64_t vm_script_get_insn_count(script_state *st) {
+  return st->insn_count;
+}
+
+uint32_t vm_script_get_mem_use(script_state *st) {
+  return st->hib_data != NULL ? st->hib_len : st->mem_use;
+}
+
+void vm_script_set_profiling(script_state *st, int enable) {
+  if(enable && st->prof_samples == NULL) {
+    st->prof_samples = new uint32_t[st->num_funcs];
+    memset(st->prof_samples, 0, st->num_funcs*sizeof(uint32_t));
+  } else if(!enable) {
+    delete[] st->prof_samples; st->prof_samples = NULL;
+  }
+}
+
+void vm_script_get_profile(script_state *st, vm_profile_cb cb, void *priv) {
+  if(st->prof_samples == NULL) return;
+  for(unsigned i = 0; i < st->num_funcs; i++) {
+    if(st->prof_samples[i] != 0) 
+      cb(priv, st->funcs[i].name, st->prof_samples[i]);
+  }
 }
 
 static void llVecNorm_cb(script_state *st, void *sc_priv, int func_id) {
@@ -2636,7 +3560,8 @@ static void llSubStringIndex_cb(script_state *st, void *sc_priv, int func_id) {
 struct vm_world* vm_world_new(vm_state_change_cb state_change_cb) {
   vm_world *w = new vm_world;
   w->state_change_cb = state_change_cb;
-  w->num_events = 0;
+  w->num_events = 0; w->jit_threshold = 0;
+  w->image_lock = g_mutex_new();
   vm_world_add_func(w, "llVecNorm", VM_TYPE_VECT, llVecNorm_cb, 1, VM_TYPE_VECT); 
   vm_world_add_func(w, "llVecMag", VM_TYPE_FLOAT, llVecMag_cb, 1, VM_TYPE_VECT); 
   vm_world_add_func(w, "llParseString2List", VM_TYPE_LIST, llParseString2List_cb, 
@@ -2695,8 +3620,19 @@ int vm_world_add_event(vm_world *w, const char* name, uint8_t ret_type,
   return desc.number;
 }
 
+// Enables the JIT for scripts prepared after this; functions are compiled
+// once they've been called threshold times. 0 disables it.
+int vm_world_set_jit(vm_world *w, uint32_t threshold) {
+  if(threshold > 0 && !vm_jit_init()) {
+    threshold = 0;
+  }
+  w->jit_threshold = threshold;
+  return threshold > 0;
+}
+
 void vm_world_free(vm_world *w) {
   // FIXME - this is incomplete and leaks memory;
+  g_mutex_free(w->image_lock);
   delete w;
 }
 
@@ -2774,6 +3710,33 @@ void vm_list_get_vector(heap_header *list, int32_t pos, caj_vector3* out) {
   }
 }
 
+// Copies a list out of the script's heap, so it can be passed to another 
+// thread and outlive the call. The vm_list_get_* functions work on the copy;
+// free it with vm_list_free. Lists can't contain lists, so one level is enough.
+heap_header *vm_list_copy(heap_header *list) {
+  assert(heap_entry_vtype(list) == VM_TYPE_LIST);
+  heap_header *p = (heap_header*)malloc(sizeof(heap_header) + 
+					list->len*sizeof(heap_header*));
+  p->refcnt = ((uint32_t)VM_TYPE_LIST << 24) | 1;
+  p->len = list->len;
+  heap_header **items = (heap_header**)script_getptr(list);
+  heap_header **copy = (heap_header**)script_getptr(p);
+  for(uint32_t i = 0; i < list->len; i++) {
+    assert(heap_entry_vtype(items[i]) != VM_TYPE_LIST);
+    copy[i] = (heap_header*)malloc(sizeof(heap_header) + items[i]->len);
+    memcpy(copy[i], items[i], sizeof(heap_header) + items[i]->len);
+    copy[i]->refcnt = ((uint32_t)heap_entry_vtype(items[i]) << 24) | 1;
+  }
+  return p;
+}
+
+void vm_list_free(heap_header *list) {
+  heap_header **items = (heap_header**)script_getptr(list);
+  for(uint32_t i = 0; i < list->len; i++)
+    free(items[i]);
+  free(list);
+}
+
 void vm_func_get_args(script_state *st, int func_no, ...) {
   va_list args;
   vm_nfunc_desc &desc = st->world->nfuncs[func_no];
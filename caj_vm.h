@@ -40,12 +40,35 @@
 // #define ICLASS_RDL_V  12
 // #define ICLASS_WRL_V  13
 #define ICLASS_CALL 14
+#define ICLASS_LOCAL_I 15 // op on an int local, see LOCAL_I_* below
 
 #define GET_ICLASS(insn) (((insn) >> 12) &0xf)
 #define GET_IVAL(insn) ((insn) & 0xfff)
 
 #define MAKE_INSN(iclass,ival) ((iclass) << 12 | (ival))
 
+// ICLASS_LOCAL_I ops. These save shuffling locals through the stack in 
+// loops. The top 4 bits of the ival are the op, and the bottom 8 are the
+// local's offset as for RDL_I, after any operand has been popped.
+#define LOCAL_I_INC 0 // local++
+#define LOCAL_I_DEC 1 // local--
+#define LOCAL_I_ADD 2 // int -> ; local += int
+#define LOCAL_I_SUB 3 // int -> ; local -= int
+#define LOCAL_I_EQ 4 // int -> int ; local == int
+#define LOCAL_I_NEQ 5
+#define LOCAL_I_GR 6
+#define LOCAL_I_LES 7
+#define LOCAL_I_GEQ 8
+#define LOCAL_I_LEQ 9
+#define NUM_LOCAL_I_OPS 10
+
+#define LOCAL_I_HAS_ARG(op) ((op) >= LOCAL_I_ADD)
+#define LOCAL_I_HAS_RET(op) ((op) >= LOCAL_I_EQ)
+#define LOCAL_I_MAX_OFFSET 0xff
+#define GET_LOCAL_I_OP(insn) (((insn) >> 8) & 0xf)
+#define GET_LOCAL_I_OFFSET(insn) ((insn) & 0xff)
+#define MAKE_LOCAL_I(op,offset) MAKE_INSN(ICLASS_LOCAL_I, (op) << 8 | (offset))
+
 #define unlikely(x)     __builtin_expect((x),0)
 
 #include <stdint.h>
@@ -148,9 +171,13 @@ void vm_world_add_func(vm_world *w, const char* name, uint8_t ret_type,
 		       vm_native_func_cb cb, int arg_count, ...);
 int vm_world_add_event(vm_world *w, const char* name, uint8_t ret_type, 
 		       int event_id, int arg_count, ...);
+int vm_world_set_jit(vm_world *w, uint32_t threshold);
 void vm_world_free(vm_world *w);
 
-script_state* vm_load_script(caj_logger *log, void* data, int data_len);
+// Scripts loaded into the same world with identical code share it, so the 
+// world must outlive them.
+script_state* vm_load_script(caj_logger *log, vm_world *w, 
+			     void* data, int data_len);
 unsigned char* vm_serialise_script(script_state *st, size_t *len);
 void vm_free_script(script_state * st);
 
@@ -159,8 +186,34 @@ int vm_script_is_runnable(script_state *st);
 int vm_script_has_failed(script_state *st);
 char* vm_script_get_error(script_state *st);
 
+// Frees the stack and heap of a script that's between events, keeping the
+// heap packed up in a more compact form. It wakes up again by itself when
+// it's given an event. Returns 0 if the script can't hibernate now.
+int vm_script_hibernate(script_state *st);
+void vm_script_wake(script_state *st);
+int vm_script_is_hibernating(script_state *st);
+
+// Whether anything vm_serialise_script would save has changed since the 
+// last vm_script_clear_dirty (or since it was loaded). Running code that 
+// only touches locals doesn't dirty a script.
+int vm_script_is_dirty(script_state *st);
+void vm_script_clear_dirty(script_state *st);
+
 void vm_prepare_script(script_state *st, void *priv, vm_world *w);
 void vm_run_script(script_state *st, int num_steps);
+
+// For profiling. The instruction count covers everything the script has run
+// since it was loaded. The memory use is its heap, or the packed-up heap if 
+// it's hibernating. With profiling enabled, vm_run_script notes which 
+// function the script stopped in each time, and vm_script_get_profile calls
+// cb for each function it's been seen in.
+typedef void(*vm_profile_cb)(void *priv, const char *func_name, 
+			     uint32_t samples);
+uint64_t vm_script_get_insn_count(script_state *st);
+uint32_t vm_script_get_mem_use(script_state *st);
+void vm_script_set_profiling(script_state *st, int enable);
+void vm_script_get_profile(script_state *st, vm_profile_cb cb, void *priv);
+
 int vm_event_has_handler(script_state *st, int event_id);
 void vm_call_event(script_state *st, int event_id, ...);
 int32_t vm_list_get_count(heap_header *list);
@@ -169,6 +222,8 @@ char *vm_list_get_str(heap_header *list, int32_t pos);
 int32_t vm_list_get_int(heap_header *list, int32_t pos);
 float vm_list_get_float(heap_header *list, int32_t pos);
 void vm_list_get_vector(heap_header *list, int32_t pos, caj_vector3* out);
+heap_header *vm_list_copy(heap_header *list);
+void vm_list_free(heap_header *list);
 void vm_func_get_args(script_state *st, int func_no, ...);
 void vm_func_set_int_ret(script_state *st, int func_no, int32_t ret);
 void vm_func_set_float_ret(script_state *st, int func_no, float ret);
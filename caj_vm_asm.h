@@ -72,6 +72,7 @@ private:
   const char* err;
   asm_verify* verify;
   int cond_flag;
+  int optimise; // run the peephole pass at the end of each function
   long empty_list_entry; // FIXME - HACK
 
   std::vector<uint16_t> bytecode;
@@ -90,6 +91,7 @@ private:
   std::vector<vm_function*> funcs;
 
   std::vector<uint32_t> list_build;
+  std::vector<void*> heap_data; // the serialiser doesn't free these
 
   vm_serialiser serial;
 
@@ -112,18 +114,141 @@ private:
     }
   }
 
+  static int is_cond(uint16_t insn) {
+    return insn == INSN_COND || insn == INSN_NCOND;
+  }
+
+  uint32_t jump_target(uint32_t pos) {
+    uint16_t ival = GET_IVAL(bytecode[pos]);
+    if(ival & 0x800) return pos+1-(ival & 0x7ff);
+    else return pos+1+ival;
+  }
+
+  // unlike do_fixup, this fails quietly if the jump won't fit
+  int set_jump_target(uint32_t pos, uint32_t dest) {
+    int32_t offset = (int32_t)dest-(int32_t)(pos+1);
+    if(offset < -2047 || offset > 2047) return 0;
+    if(offset < 0) {
+      bytecode[pos] = MAKE_INSN(ICLASS_JUMP, 0x800|(-offset));
+    } else {
+      bytecode[pos] = MAKE_INSN(ICLASS_JUMP, offset);
+    }
+    return 1;
+  }
+
+  // One round of peephole optimisation over the function we've just 
+  // finished: jumps to jumps go straight to the final destination, 
+  // unreachable code is dropped (return statements and constant conditions
+  // leave plenty), as are jumps to the next instruction, pushes that are
+  // immediately dropped, and ! before a conditional. Returns non-zero if it
+  // changed anything. This runs after verification, so it mustn't change 
+  // the stack layout at any reachable instruction.
+  int optimise_func(void) {
+    uint32_t start = func_start, end = bytecode.size();
+    int changed = 0;
+
+    for(uint32_t i = start; i < end; i++) {
+      if(GET_ICLASS(bytecode[i]) != ICLASS_JUMP) continue;
+      uint32_t dest = jump_target(i);
+      // the jump after a cond is conditional, so we can't skip over it
+      for(int hops = 0; hops < 8 && dest != i && dest < end &&
+	    GET_ICLASS(bytecode[dest]) == ICLASS_JUMP && 
+	    (dest == start || !is_cond(bytecode[dest-1])); hops++) {
+	dest = jump_target(dest);
+      }
+      if(dest != jump_target(i) && set_jump_target(i, dest)) changed = 1;
+    }
+
+    // is_target means a jump or a cond can get there other than by falling
+    // through from the previous instruction.
+    std::vector<uint8_t> reach(end-start+1, 0), is_target(end-start+1, 0);
+    std::vector<uint32_t> pending;
+    pending.push_back(start);
+    while(!pending.empty()) {
+      uint32_t i = pending.back(); pending.pop_back();
+      while(i < end && !reach[i-start]) {
+	reach[i-start] = 1;
+	uint16_t insn = bytecode[i];
+	if(insn == INSN_RET) break;
+	if(is_cond(insn)) {
+	  is_target[i+2-start] = 1; pending.push_back(i+2);
+	} else if(GET_ICLASS(insn) == ICLASS_JUMP) {
+	  i = jump_target(i); is_target[i-start] = 1;
+	  pending.push_back(i); break;
+	}
+	i++;
+      }
+    }
+
+    std::vector<uint8_t> keep(end-start, 1);
+    for(uint32_t i = start; i < end; i++) {
+      uint16_t insn = bytecode[i], next = i+1 < end ? bytecode[i+1] : 0;
+      if(!reach[i-start]) {
+	keep[i-start] = 0; changed = 1;
+      } else if(GET_ICLASS(insn) == ICLASS_JUMP && jump_target(i) == i+1 &&
+		(i == start || !is_cond(bytecode[i-1]))) {
+	keep[i-start] = 0; changed = 1;
+      } else if(i+1 < end && !is_target[i+1-start]) {
+	// pairs, where nothing else can jump into the middle
+	int iclass = GET_ICLASS(insn);
+	if(((iclass == ICLASS_RDG_I || iclass == ICLASS_RDL_I) && 
+	    next == INSN_DROP_I) ||
+	   ((iclass == ICLASS_RDG_P || iclass == ICLASS_RDL_P) && 
+	    next == INSN_DROP_P)) {
+	  keep[i-start] = keep[i+1-start] = 0; i++; changed = 1;
+	} else if(insn == INSN_NOT_L && is_cond(next)) {
+	  keep[i-start] = 0; changed = 1;
+	  bytecode[i+1] = next == INSN_COND ? INSN_NCOND : INSN_COND;
+	  i++;
+	}
+      }
+    }
+    if(!changed) return 0;
+
+    // new_pos[i] is where instruction i ends up, or the one after it if 
+    // it's deleted, so jumps to deleted instructions still work.
+    std::vector<uint32_t> new_pos(end-start+1);
+    uint32_t pos = start;
+    for(uint32_t i = start; i < end; i++) {
+      new_pos[i-start] = pos;
+      if(keep[i-start]) pos++;
+    }
+    new_pos[end-start] = pos;
+    for(uint32_t i = start; i < end; i++) {
+      if(!keep[i-start]) continue;
+      uint16_t insn = bytecode[i];
+      uint32_t dest = 0;
+      if(GET_ICLASS(insn) == ICLASS_JUMP) dest = new_pos[jump_target(i)-start];
+      bytecode[new_pos[i-start]] = insn;
+      if(GET_ICLASS(insn) == ICLASS_JUMP) {
+	// can't fail, since nothing got further apart
+	set_jump_target(new_pos[i-start], dest);
+      }
+    }
+    bytecode.resize(pos);
+    return 1;
+  }
+
 public:
   vm_asm() : func_start(0), err(NULL), verify(NULL), cond_flag(0),
-    empty_list_entry(-1){
+    optimise(0), empty_list_entry(-1){
     bytecode.push_back(INSN_QUIT);
   }
 
-  ~vm_asm() { // FIXME - incomplete
+  ~vm_asm() {
     for(std::vector<asm_verify*>::iterator iter = loc_verify.begin();
 	iter != loc_verify.end(); iter++) {
       delete *iter;
     }
     delete verify;
+    for(std::vector<vm_function*>::iterator iter = funcs.begin();
+	iter != funcs.end(); iter++) {
+      delete[] (*iter)->arg_offsets; delete *iter;
+    }
+    for(std::vector<void*>::iterator iter = heap_data.begin();
+	iter != heap_data.end(); iter++) {
+      free(*iter);
+    }
   }
 
   int vtype_size(uint8_t vtype) {
@@ -161,7 +286,7 @@ public:
       arg_offsets[i] = frame_sz;
       frame_sz += vtype_size(arg_types[i]);
     }
-    func->arg_offsets = arg_offsets; // FIXME - need to free this in cleanup!
+    func->arg_offsets = arg_offsets;
     func->func_num = funcs.size();
     func->insn_ptr = 0;
     func->arg_count = arg_count;
@@ -373,10 +498,16 @@ public:
     }
   }
 
+  unsigned char *alloc_heap_data(size_t len) {
+    unsigned char *data = (unsigned char*)malloc(len);
+    heap_data.push_back(data); return data;
+  }
+
   uint32_t add_string(const char* val) {
     // FIXME - reuse strings
     int len = strlen(val);
-    char *dat = strdup(val);
+    unsigned char *dat = alloc_heap_data(len+1);
+    memcpy(dat, val, len+1);
     return serial.add_heap_entry(VM_TYPE_STR,len,dat);
   }
 
@@ -399,20 +530,20 @@ public:
   }
 
   void list_add_int(int32_t val) {
-    unsigned char *data = (unsigned char*)malloc(4);
+    unsigned char *data = alloc_heap_data(4);
     serial.int_to_bin(val, data);
     list_build.push_back(serial.add_heap_entry(VM_TYPE_INT,4,data));
   }
 
   void list_add_float(float val) {
-    unsigned char *data = (unsigned char*)malloc(4);
+    unsigned char *data = alloc_heap_data(4);
     serial.float_to_bin(val, data);
     list_build.push_back(serial.add_heap_entry(VM_TYPE_FLOAT,4,data));
   }
 
 
   void list_add_vect(float *val) {
-    unsigned char *data = (unsigned char*)malloc(12);
+    unsigned char *data = alloc_heap_data(12);
     // FIXME - ordering?
     serial.float_to_bin(val[0], data+0);
     serial.float_to_bin(val[1], data+4);
@@ -422,7 +553,7 @@ public:
   }
 
   void list_add_rot(float *val) {
-    unsigned char *data = (unsigned char*)malloc(16);
+    unsigned char *data = alloc_heap_data(16);
     // FIXME - ordering?
     serial.float_to_bin(val[0], data+0);
     serial.float_to_bin(val[1], data+4);
@@ -436,7 +567,7 @@ public:
     if(count >  VM_LIMIT_HEAP || count*4 >  VM_LIMIT_HEAP) {
       err = "List too long"; return 0;
     }
-    unsigned char *data = (unsigned char*)malloc(count*4);
+    unsigned char *data = alloc_heap_data(count*4);
     unsigned offset = 0;
     for(int i = 0; i < count; i++) {
       uint32_t val = list_build[i];
@@ -544,6 +675,9 @@ public:
 	break;
       }
       break;
+    case ICLASS_LOCAL_I:
+      verify->check_local_i(val);
+      break;
     default:
       err = "Unknown instruction class"; return;
     }
@@ -576,6 +710,33 @@ public:
     insn(MAKE_INSN(ICLASS_WRL_I, offset));
   }
 
+  // Whether a LOCAL_I op can get at the given local from here. The offset's
+  // kept to half what fits in the insn, since the loader may have to double
+  // it for pointers on 64-bit VMs.
+  int local_int_op_ok(unsigned offset) {
+    if(err != NULL || verify == NULL) return 0;
+    if(offset >= verify->stack_types.size()) return 0;
+    return verify->stack_types.size()-offset <= LOCAL_I_MAX_OFFSET/2;
+  }
+
+  void local_int_op(int op, unsigned offset) {
+    if(err != NULL) return;
+    if(verify == NULL) { err = "Unverifiable code ordering"; return; }
+    unsigned size = verify->stack_types.size();
+    if(LOCAL_I_HAS_ARG(op)) size--; // it's measured with the operand popped
+    if(offset >= size) {
+      err = "Local variable out of bounds"; return;
+    }
+    if(caj_vm_check_types(verify->stack_types[offset], VM_TYPE_INT)) {
+      err = "Local variable of wrong type"; return;
+    }
+    offset = size-offset;
+    if(offset > LOCAL_I_MAX_OFFSET/2) {
+      err = "Local variable too far away for LOCAL_I op"; return;
+    }
+    insn(MAKE_LOCAL_I(op, offset));
+  }
+
   void rd_local_ptr(unsigned offset) {
 
     if(err != NULL) return;
@@ -673,6 +834,11 @@ public:
 	iter != fixups.end(); iter++) {
       do_fixup(*iter);
     }
+    if(err != NULL) return;
+
+    if(optimise) {
+      for(int pass = 0; pass < 8 && optimise_func(); pass++) ;
+    }
 
     for(std::vector<asm_verify*>::iterator iter = loc_verify.begin();
 	iter != loc_verify.end(); iter++) {
@@ -717,6 +883,10 @@ public:
     return ret;
   }
   
+  void set_optimise(int enable) {
+    optimise = enable;
+  }
+
   const char* get_error(void) {
     return err;
   }
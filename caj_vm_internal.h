@@ -191,6 +191,21 @@ class asm_verify {
     return fudge;
   }
 
+  int check_local_i(uint16_t insn) {
+    int op = GET_LOCAL_I_OP(insn), offset = GET_LOCAL_I_OFFSET(insn);
+    if(op >= NUM_LOCAL_I_OPS) { err = "Invalid local int op"; return 0; }
+    if(LOCAL_I_HAS_ARG(op)) pop_val(VM_TYPE_INT);
+    if(offset <= 0) { err = "Local int op with bogus offset"; return 0; }
+    uint8_t vtype = VM_TYPE_NONE;
+    int fudge = get_local(offset-1, vtype);
+    if(err != NULL) return 0;
+    if(caj_vm_check_types(vtype, VM_TYPE_INT)) {
+      err = "Local int op on wrong type"; return 0;
+    }
+    if(LOCAL_I_HAS_RET(op)) push_val(VM_TYPE_INT);
+    return fudge;
+  }
+
   int check_rdl_p(int offset) {
     if(offset <= 0) { err = "RDL_P with bogus offset"; return 0; }
     uint8_t vtype = VM_TYPE_NONE; 
@@ -0,0 +1,460 @@
+/* Copyright (c) 2009-2010 Aidan Thornton, all rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AIDAN THORNTON ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AIDAN THORNTON BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF 
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// A very simple template JIT: each supported VM instruction is turned into a
+// fixed sequence of x86-64 code, with no register allocation to speak of. 
+// The VM stack stays in memory (rbx holds stack_top), so we can drop back to
+// the interpreter between any two instructions - anything we don't handle,
+// any possible exception, and running out of time slice just exit with the
+// ip of the next instruction to interpret.
+//
+// Register usage: rbx = stack_top, r12 = gvals, r13d = budget, r14 = ctx
+
+#include "caj_vm.h"
+#include "caj_vm_jit.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <vector>
+
+#if defined(__x86_64__) && !defined(CAJ_VM_NO_JIT)
+
+#include <sys/mman.h>
+
+#define JIT_MIN_RUN 3 // not worth entering native code for less than this
+
+struct vm_jit_code {
+  void *mem;
+  size_t len;
+};
+
+static void *jit_trampoline = NULL;
+
+class jit_emitter {
+private:
+  struct fixup {
+    size_t pos; // of the rel32
+    uint32_t ip;
+  };
+
+  uint32_t start, end;
+  std::vector<int32_t> native; // offset of each insn's code, -1 if none
+  std::vector<fixup> jumps, exits;
+  std::vector<size_t> epilogue_fixups;
+
+public:
+  std::vector<uint8_t> buf;
+
+  jit_emitter(uint32_t start_, uint32_t end_) : start(start_), end(end_),
+					       native(end_-start_, -1) { }
+
+  void emit(int count, ...) {
+    va_list args; va_start(args, count);
+    for(int i = 0; i < count; i++) buf.push_back(va_arg(args, int));
+    va_end(args);
+  }
+
+  void imm32(int32_t val) {
+    for(int i = 0; i < 4; i++) buf.push_back((val >> (8*i)) & 0xff);
+  }
+
+  // ModRM (and displacement) for [rbx+disp]
+  void mem_rbx(int reg, int32_t disp) {
+    if(disp >= -128 && disp <= 127) {
+      emit(2, 0x43 | (reg << 3), disp & 0xff);
+    } else {
+      emit(1, 0x83 | (reg << 3)); imm32(disp);
+    }
+  }
+
+  void mark_insn(uint32_t ip) { native[ip-start] = buf.size(); }
+
+  // jcc is the second opcode byte of a near jcc (0x84 = je, etc), or 0 for 
+  // an unconditional jmp.
+  void jump_to(int jcc, uint32_t ip) {
+    if(jcc == 0) emit(1, 0xe9); else emit(2, 0x0f, jcc);
+    fixup f; f.pos = buf.size(); f.ip = ip;
+    if(ip >= start && ip < end) jumps.push_back(f); else exits.push_back(f);
+    imm32(0);
+  }
+
+  void exit_to(int jcc, uint32_t ip) {
+    if(jcc == 0) emit(1, 0xe9); else emit(2, 0x0f, jcc);
+    fixup f; f.pos = buf.size(); f.ip = ip;
+    exits.push_back(f); imm32(0);
+  }
+
+  // leave native code inline, without an out-of-line stub
+  void exit_here(uint32_t ip) {
+    emit(1, 0xb8); imm32(ip); // mov eax, ip
+    emit(1, 0xe9); epilogue_fixups.push_back(buf.size()); imm32(0);
+  }
+
+  void patch_rel32(size_t pos, size_t target) {
+    int32_t rel = (int32_t)target - (int32_t)(pos + 4);
+    for(int i = 0; i < 4; i++) buf[pos+i] = (rel >> (8*i)) & 0xff;
+  }
+
+  void finish(void) {
+    for(unsigned i = 0; i < jumps.size(); i++) {
+      int32_t dest = native[jumps[i].ip - start];
+      if(dest < 0) {
+	exits.push_back(jumps[i]); // shouldn't happen, but just in case.
+      } else {
+	patch_rel32(jumps[i].pos, dest);
+      }
+    }
+    for(unsigned i = 0; i < exits.size(); i++) {
+      patch_rel32(exits[i].pos, buf.size());
+      exit_here(exits[i].ip);
+    }
+
+    // the common epilogue
+    for(unsigned i = 0; i < epilogue_fixups.size(); i++)
+      patch_rel32(epilogue_fixups[i], buf.size());
+    emit(3, 0x49, 0x89, 0x1e); // mov [r14], rbx
+    emit(4, 0x45, 0x89, 0x6e, offsetof(vm_jit_ctx, budget)); // mov [r14+budget], r13d
+    emit(7, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b); // pop r14, r13, r12, rbx
+    emit(1, 0xc3); // ret
+  }
+
+  int32_t native_offset(uint32_t ip) { return native[ip-start]; }
+};
+
+static int jit_jump_target(uint16_t insn, uint32_t ip, uint32_t *target) {
+  int16_t ival = GET_IVAL(insn);
+  int64_t dest = (int64_t)ip + 1;
+  if(ival & 0x800) dest -= ival & 0x7ff; else dest += ival;
+  if(dest <= 0) return 0;
+  *target = dest; return 1;
+}
+
+static int jit_supported(uint16_t insn) {
+  switch(GET_ICLASS(insn)) {
+  case ICLASS_NORMAL:
+    switch(GET_IVAL(insn)) {
+    case INSN_NOOP:
+    case INSN_ADD_II: case INSN_SUB_II: case INSN_MUL_II:
+    case INSN_DIV_II: case INSN_MOD_II:
+    case INSN_AND_II: case INSN_OR_II: case INSN_XOR_II:
+    case INSN_NOT_I: case INSN_NOT_L: case INSN_SHL: case INSN_SHR:
+    case INSN_EQ_II: case INSN_NEQ_II: case INSN_GR_II:
+    case INSN_LES_II: case INSN_GEQ_II: case INSN_LEQ_II:
+    case INSN_ADD_FF: case INSN_SUB_FF: case INSN_MUL_FF: case INSN_DIV_FF:
+    case INSN_COND: case INSN_NCOND:
+    case INSN_DROP_I: case INSN_INC_I: case INSN_DEC_I:
+    case INSN_BEGIN_CALL:
+      return 1;
+    default:
+      return 0;
+    }
+  case ICLASS_JUMP:
+  case ICLASS_RDG_I:
+  case ICLASS_WRG_I:
+  case ICLASS_RDL_I:
+  case ICLASS_WRL_I:
+    return 1;
+  case ICLASS_LOCAL_I:
+    return GET_LOCAL_I_OP(insn) < NUM_LOCAL_I_OPS;
+  default:
+    return 0;
+  }
+}
+
+// stack_top[2] = stack_top[2] <op> stack_top[1]; stack_top++;
+static void jit_binop(jit_emitter &e, int opc) {
+  e.emit(1, 0x8b); e.mem_rbx(0, 8); // mov eax, [rbx+8]
+  if(opc > 0xff) e.emit(2, opc >> 8, opc & 0xff); else e.emit(1, opc);
+  e.mem_rbx(0, 4); // <op> eax, [rbx+4]
+  e.emit(1, 0x89); e.mem_rbx(0, 8); // mov [rbx+8], eax
+  e.emit(4, 0x48, 0x83, 0xc3, 0x04); // add rbx, 4
+}
+
+static void jit_cmpop(jit_emitter &e, int setcc) {
+  e.emit(1, 0x8b); e.mem_rbx(0, 8); // mov eax, [rbx+8]
+  e.emit(1, 0x3b); e.mem_rbx(0, 4); // cmp eax, [rbx+4]
+  e.emit(3, 0x0f, setcc, 0xc0); // setcc al
+  e.emit(3, 0x0f, 0xb6, 0xc0); // movzx eax, al
+  e.emit(1, 0x89); e.mem_rbx(0, 8); // mov [rbx+8], eax
+  e.emit(4, 0x48, 0x83, 0xc3, 0x04); // add rbx, 4
+}
+
+static void jit_floatop(jit_emitter &e, int opc) {
+  e.emit(3, 0xf3, 0x0f, 0x10); e.mem_rbx(0, 8); // movss xmm0, [rbx+8]
+  e.emit(3, 0xf3, 0x0f, opc); e.mem_rbx(0, 4); // <op>ss xmm0, [rbx+4]
+  e.emit(3, 0xf3, 0x0f, 0x11); e.mem_rbx(0, 8); // movss [rbx+8], xmm0
+  e.emit(4, 0x48, 0x83, 0xc3, 0x04); // add rbx, 4
+}
+
+// leaves the stack alone and drops back to the interpreter if the divisor's
+// 0 or -1, so it can raise the error or deal with INT_MIN / -1 itself.
+static void jit_divop(jit_emitter &e, uint32_t ip, int want_rem) {
+  e.emit(1, 0x8b); e.mem_rbx(1, 4); // mov ecx, [rbx+4]
+  e.emit(2, 0x85, 0xc9); // test ecx, ecx
+  e.exit_to(0x84, ip); // je
+  e.emit(3, 0x83, 0xf9, 0xff); // cmp ecx, -1
+  e.exit_to(0x84, ip); // je
+  e.emit(1, 0x8b); e.mem_rbx(0, 8); // mov eax, [rbx+8]
+  e.emit(3, 0x99, 0xf7, 0xf9); // cdq; idiv ecx
+  e.emit(1, 0x89); e.mem_rbx(want_rem ? 2 : 0, 8); // mov [rbx+8], eax/edx
+  e.emit(4, 0x48, 0x83, 0xc3, 0x04); // add rbx, 4
+}
+
+static void jit_insn(jit_emitter &e, uint16_t insn, uint32_t ip) {
+  if(!jit_supported(insn)) {
+    e.exit_here(ip); return;
+  }
+
+  uint16_t ival = GET_IVAL(insn);
+  if(GET_ICLASS(insn) == ICLASS_NORMAL && 
+     (ival == INSN_DIV_II || ival == INSN_MOD_II)) {
+    // checks have to come before we charge for the insn
+    jit_divop(e, ip, ival == INSN_MOD_II);
+    e.emit(4, 0x41, 0x83, 0xed, 0x01); // sub r13d, 1
+    return;
+  }
+
+  e.emit(4, 0x41, 0x83, 0xed, 0x01); // sub r13d, 1
+
+  switch(GET_ICLASS(insn)) {
+  case ICLASS_NORMAL:
+    switch(ival) {
+    case INSN_NOOP: break;
+    case INSN_ADD_II: jit_binop(e, 0x03); break;
+    case INSN_SUB_II: jit_binop(e, 0x2b); break;
+    case INSN_MUL_II: jit_binop(e, 0x0faf); break;
+    case INSN_AND_II: jit_binop(e, 0x23); break;
+    case INSN_OR_II: jit_binop(e, 0x0b); break;
+    case INSN_XOR_II: jit_binop(e, 0x33); break;
+    case INSN_SHL:
+    case INSN_SHR:
+      e.emit(1, 0x8b); e.mem_rbx(0, 8); // mov eax, [rbx+8]
+      e.emit(1, 0x8b); e.mem_rbx(1, 4); // mov ecx, [rbx+4]
+      e.emit(2, 0xd3, ival == INSN_SHL ? 0xe0 : 0xf8); // shl/sar eax, cl
+      e.emit(1, 0x89); e.mem_rbx(0, 8); // mov [rbx+8], eax
+      e.emit(4, 0x48, 0x83, 0xc3, 0x04); // add rbx, 4
+      break;
+    case INSN_NOT_I:
+      e.emit(1, 0xf7); e.mem_rbx(2, 4); // not dword [rbx+4]
+      break;
+    case INSN_NOT_L:
+      e.emit(1, 0x83); e.mem_rbx(7, 4); e.emit(1, 0); // cmp dword [rbx+4], 0
+      e.emit(3, 0x0f, 0x94, 0xc0); // sete al
+      e.emit(3, 0x0f, 0xb6, 0xc0); // movzx eax, al
+      e.emit(1, 0x89); e.mem_rbx(0, 4); // mov [rbx+4], eax
+      break;
+    case INSN_EQ_II: jit_cmpop(e, 0x94); break;
+    case INSN_NEQ_II: jit_cmpop(e, 0x95); break;
+    case INSN_GR_II: jit_cmpop(e, 0x9f); break;
+    case INSN_LES_II: jit_cmpop(e, 0x9c); break;
+    case INSN_GEQ_II: jit_cmpop(e, 0x9d); break;
+    case INSN_LEQ_II: jit_cmpop(e, 0x9e); break;
+    case INSN_ADD_FF: jit_floatop(e, 0x58); break;
+    case INSN_SUB_FF: jit_floatop(e, 0x5c); break;
+    case INSN_MUL_FF: jit_floatop(e, 0x59); break;
+    case INSN_DIV_FF: jit_floatop(e, 0x5e); break;
+    case INSN_COND:
+    case INSN_NCOND:
+      // pops the value, and skips the next insn if it's 0 (COND) or not (NCOND)
+      e.emit(4, 0x48, 0x83, 0xc3, 0x04); // add rbx, 4
+      e.emit(3, 0x83, 0x3b, 0x00); // cmp dword [rbx], 0
+      e.jump_to(ival == INSN_COND ? 0x84 : 0x85, ip+2);
+      break;
+    case INSN_DROP_I:
+      e.emit(4, 0x48, 0x83, 0xc3, 0x04); // add rbx, 4
+      break;
+    case INSN_INC_I:
+      e.emit(1, 0x83); e.mem_rbx(0, 4); e.emit(1, 1); // add dword [rbx+4], 1
+      break;
+    case INSN_DEC_I:
+      e.emit(1, 0x83); e.mem_rbx(5, 4); e.emit(1, 1); // sub dword [rbx+4], 1
+      break;
+    case INSN_BEGIN_CALL:
+      e.emit(2, 0xc7, 0x03); e.imm32(0x1231234); // mov dword [rbx], magic
+      e.emit(4, 0x48, 0x83, 0xeb, 0x04); // sub rbx, 4
+      break;
+    }
+    break;
+  case ICLASS_JUMP:
+    {
+      uint32_t target;
+      if(!jit_jump_target(insn, ip, &target)) {
+	e.exit_here(ip); break; // let the interpreter complain
+      }
+      // only place we check the budget, since it's the only way to loop.
+      e.emit(3, 0x45, 0x85, 0xed); // test r13d, r13d
+      e.exit_to(0x8e, target); // jle
+      e.jump_to(0, target);
+      break;
+    }
+  case ICLASS_RDG_I:
+    e.emit(4, 0x41, 0x8b, 0x84, 0x24); e.imm32(4*ival); // mov eax, [r12+4*ival]
+    e.emit(1, 0x89); e.mem_rbx(0, 0); // mov [rbx], eax
+    e.emit(4, 0x48, 0x83, 0xeb, 0x04); // sub rbx, 4
+    break;
+  case ICLASS_WRG_I:
+    e.emit(4, 0x48, 0x83, 0xc3, 0x04); // add rbx, 4
+    e.emit(1, 0x8b); e.mem_rbx(0, 0); // mov eax, [rbx]
+    e.emit(4, 0x41, 0x89, 0x84, 0x24); e.imm32(4*ival); // mov [r12+4*ival], eax
+    e.emit(4, 0x41, 0xc7, 0x46, offsetof(vm_jit_ctx, dirty)); e.imm32(1); // mov dword [r14+dirty], 1
+    break;
+  case ICLASS_RDL_I:
+    e.emit(1, 0x8b); e.mem_rbx(0, 4*ival); // mov eax, [rbx+4*ival]
+    e.emit(1, 0x89); e.mem_rbx(0, 0); // mov [rbx], eax
+    e.emit(4, 0x48, 0x83, 0xeb, 0x04); // sub rbx, 4
+    break;
+  case ICLASS_WRL_I:
+    e.emit(4, 0x48, 0x83, 0xc3, 0x04); // add rbx, 4
+    e.emit(1, 0x8b); e.mem_rbx(0, 0); // mov eax, [rbx]
+    e.emit(1, 0x89); e.mem_rbx(0, 4*ival); // mov [rbx+4*ival], eax
+    break;
+  case ICLASS_LOCAL_I:
+    {
+      int32_t off = 4*GET_LOCAL_I_OFFSET(insn);
+      switch(GET_LOCAL_I_OP(insn)) {
+      case LOCAL_I_INC:
+	e.emit(1, 0x83); e.mem_rbx(0, off); e.emit(1, 1); // add dword [rbx+off], 1
+	break;
+      case LOCAL_I_DEC:
+	e.emit(1, 0x83); e.mem_rbx(5, off); e.emit(1, 1); // sub dword [rbx+off], 1
+	break;
+      case LOCAL_I_ADD:
+      case LOCAL_I_SUB:
+	e.emit(4, 0x48, 0x83, 0xc3, 0x04); // add rbx, 4
+	e.emit(1, 0x8b); e.mem_rbx(0, 0); // mov eax, [rbx]
+	e.emit(1, GET_LOCAL_I_OP(insn) == LOCAL_I_ADD ? 0x01 : 0x29);
+	e.mem_rbx(0, off); // add/sub [rbx+off], eax
+	break;
+      default: // comparisons; the local's one further down before the pop
+	e.emit(1, 0x8b); e.mem_rbx(0, off+4); // mov eax, [rbx+off+4]
+	e.emit(1, 0x3b); e.mem_rbx(0, 4); // cmp eax, [rbx+4]
+	switch(GET_LOCAL_I_OP(insn)) {
+	case LOCAL_I_EQ: e.emit(3, 0x0f, 0x94, 0xc0); break; // sete al
+	case LOCAL_I_NEQ: e.emit(3, 0x0f, 0x95, 0xc0); break; // setne al
+	case LOCAL_I_GR: e.emit(3, 0x0f, 0x9f, 0xc0); break; // setg al
+	case LOCAL_I_LES: e.emit(3, 0x0f, 0x9c, 0xc0); break; // setl al
+	case LOCAL_I_GEQ: e.emit(3, 0x0f, 0x9d, 0xc0); break; // setge al
+	case LOCAL_I_LEQ: e.emit(3, 0x0f, 0x9e, 0xc0); break; // setle al
+	}
+	e.emit(3, 0x0f, 0xb6, 0xc0); // movzx eax, al
+	e.emit(1, 0x89); e.mem_rbx(0, 4); // mov [rbx+4], eax
+	break;
+      }
+      break;
+    }
+  }
+}
+
+int vm_jit_init(void) {
+  if(jit_trampoline != NULL) return 1;
+
+  static const uint8_t code[] = {
+    0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, // push rbx, r12, r13, r14
+    0x49, 0x89, 0xfe, // mov r14, rdi
+    0x49, 0x8b, 0x1e, // mov rbx, [r14]
+    0x4d, 0x8b, 0x66, offsetof(vm_jit_ctx, gvals), // mov r12, [r14+gvals]
+    0x45, 0x8b, 0x6e, offsetof(vm_jit_ctx, budget), // mov r13d, [r14+budget]
+    0xff, 0xe6, // jmp rsi
+  };
+  void *mem = mmap(NULL, sizeof(code), PROT_READ|PROT_WRITE, 
+		   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(mem == MAP_FAILED) return 0;
+  memcpy(mem, code, sizeof(code));
+  if(mprotect(mem, sizeof(code), PROT_READ|PROT_EXEC) != 0) {
+    munmap(mem, sizeof(code)); return 0;
+  }
+  jit_trampoline = mem; return 1;
+}
+
+vm_jit_code* vm_jit_compile(const uint16_t *bytecode, uint32_t start, 
+			    uint32_t end, void **entries) {
+  assert(jit_trampoline != NULL && start < end);
+
+  // figure out where it's worth entering the native code
+  std::vector<uint32_t> run(end-start+1, 0);
+  int any = 0;
+  for(uint32_t ip = end; ip > start; ip--) {
+    if(jit_supported(bytecode[ip-1])) {
+      run[ip-1-start] = run[ip-start] + 1;
+      if(run[ip-1-start] >= JIT_MIN_RUN) any = 1;
+    }
+  }
+  if(!any) return NULL;
+
+  jit_emitter e(start, end);
+  for(uint32_t ip = start; ip < end; ip++) {
+    e.mark_insn(ip);
+    jit_insn(e, bytecode[ip], ip);
+  }
+  e.finish();
+
+  vm_jit_code *code = new vm_jit_code();
+  code->len = e.buf.size();
+  code->mem = mmap(NULL, code->len, PROT_READ|PROT_WRITE, 
+		   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(code->mem == MAP_FAILED) {
+    delete code; return NULL;
+  }
+  memcpy(code->mem, &e.buf[0], code->len);
+  if(mprotect(code->mem, code->len, PROT_READ|PROT_EXEC) != 0) {
+    munmap(code->mem, code->len); delete code; return NULL;
+  }
+
+  for(uint32_t ip = start; ip < end; ip++) {
+    if(run[ip-start] >= JIT_MIN_RUN)
+      entries[ip] = (uint8_t*)code->mem + e.native_offset(ip);
+  }
+  return code;
+}
+
+void vm_jit_free(vm_jit_code *code) {
+  if(code == NULL) return;
+  munmap(code->mem, code->len); delete code;
+}
+
+uint32_t vm_jit_run(vm_jit_ctx *ctx, void *entry) {
+  typedef uint32_t(*jit_entry_func)(vm_jit_ctx *ctx, void *entry);
+  return ((jit_entry_func)jit_trampoline)(ctx, entry);
+}
+
+#else // no JIT for this platform
+
+struct vm_jit_code {
+  int dummy;
+};
+
+int vm_jit_init(void) {
+  return 0;
+}
+
+vm_jit_code* vm_jit_compile(const uint16_t *bytecode, uint32_t start, 
+			    uint32_t end, void **entries) {
+  return NULL;
+}
+
+void vm_jit_free(vm_jit_code *code) {
+}
+
+uint32_t vm_jit_run(vm_jit_ctx *ctx, void *entry) {
+  abort(); return 0;
+}
+
+#endif
@@ -0,0 +1,57 @@
+/* Copyright (c) 2009-2010 Aidan Thornton, all rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AIDAN THORNTON ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AIDAN THORNTON BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF 
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Baseline template JIT for the Cajeput VM. This is only used by caj_vm.cpp.
+
+#ifndef CAJ_VM_JIT_H
+#define CAJ_VM_JIT_H
+
+#include <stdint.h>
+
+// the bits of interpreter state the compiled code needs. Don't reorder
+// these without fixing the offsets in caj_vm_jit.cpp!
+struct vm_jit_ctx {
+  int32_t *stack_top;
+  int32_t *gvals;
+  int32_t budget; // instructions left in this time slice
+  int32_t dirty; // set to 1 by any write to a global
+};
+
+struct vm_jit_code;
+
+// returns false if there's no JIT for this platform
+int vm_jit_init(void);
+
+// Compiles the bytecode in [start, end) - normally a single function - and
+// sets entries[ip] for each ip it's worth entering the native code at. 
+// Returns NULL if there's nothing worth compiling.
+vm_jit_code* vm_jit_compile(const uint16_t *bytecode, uint32_t start, 
+			    uint32_t end, void **entries);
+void vm_jit_free(vm_jit_code *code);
+
+// Runs native code from the given entry point until it hits something it
+// can't handle or runs out of budget, and returns the ip to carry on 
+// interpreting from. Everything's always left at an instruction boundary,
+// so the interpreter can take over at any point.
+uint32_t vm_jit_run(vm_jit_ctx *ctx, void *entry);
+
+#endif
@@ -32,7 +32,7 @@
 extern "C" {
 #endif
 
-#define CAJEPUT_API_VERSION 0x0015
+#define CAJEPUT_API_VERSION 0x0017
 
 struct user_ctx;
 struct simulator_ctx;
@@ -65,6 +65,15 @@ void sim_set_script_priv(struct simulator_ctx *sim, void* p);
 float* sim_get_heightfield(struct simulator_ctx *sim);
 float sim_get_terrain_height(struct simulator_ctx *sim, int x, int y);
 
+// Terrain editing. These just mark the affected 16x16 patches dirty; the
+// changes get passed on to viewers and the physics engine in one batch from
+// the main loop, so it's fine to call them lots of times in a row.
+void sim_set_terrain_height(struct simulator_ctx *sim, int x, int y, 
+			    float height);
+// for code that modifies the sim_get_heightfield() array directly (inclusive)
+void sim_terrain_changed(struct simulator_ctx *sim, int x1, int y1, 
+			 int x2, int y2);
+
 double caj_get_timer(struct simgroup_ctx *sgrp);
 
 // These, on the other hand, require you to g_free the returned string
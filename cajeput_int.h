@@ -264,6 +264,8 @@ struct simulator_ctx {
   uint32_t region_x, region_y;
   uint64_t region_handle;
   float *terrain;
+  uint16_t dirty_terrain[16]; // not yet passed on to users/physics
+  guint terrain_flush_id;
   int state_flags;
   uint16_t udp_port;
   uuid_t region_id, owner;
@@ -280,6 +282,11 @@ struct simulator_ctx {
 
   collision_state *collisions;
 
+  // see world_begin_update_batch
+  int upd_batch_depth;
+  std::vector<uint32_t> upd_batch_order; // local IDs, first update first
+  std::map<uint32_t, int> upd_batch;
+
   //struct obj_bucket[8][8][32];
 
   // bunch of callbacks
@@ -345,6 +352,15 @@ void world_save_script_state(simulator_ctx *sim, inventory_item *inv,
 // note - takes ownership of the passed-in buffer
 void world_load_script_state(inventory_item *inv, caj_string *state);
 
+// for the /scriptstats report. Only covers scripts that are actually loaded.
+struct script_stats_entry {
+  primitive_obj *prim;
+  inventory_item *inv;
+  caj_script_stats stats;
+};
+void world_int_script_stats(simulator_ctx *sim, 
+			    std::vector<script_stats_entry> &out);
+
 
 // --------- HACKY OBJECT UPDATE STUFF ---------------
 
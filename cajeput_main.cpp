@@ -38,6 +38,7 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <cassert>
+#include <algorithm>
 
 #define CAJ_LOGGER (sgrp->log)
 
@@ -120,6 +121,45 @@ float* sim_get_heightfield(struct simulator_ctx *sim) {
 float sim_get_terrain_height(struct simulator_ctx *sim, int x, int y) {
   return sim->terrain[x + y*256];
 }
+
+static gboolean terrain_flush_idle(gpointer data) {
+  struct simulator_ctx *sim = (struct simulator_ctx*)data;
+  sim->terrain_flush_id = 0;
+
+  for(user_ctx *ctx = sim->ctxts; ctx != NULL; ctx = ctx->next) {
+    for(int i = 0; i < 16; i++) ctx->dirty_terrain[i] |= sim->dirty_terrain[i];
+  }
+  if(sim->physh.upd_terrain != NULL)
+    sim->physh.upd_terrain(sim, sim->phys_priv, sim->dirty_terrain);
+
+  memset(sim->dirty_terrain, 0, sizeof(sim->dirty_terrain));
+  return FALSE;
+}
+
+void sim_terrain_changed(struct simulator_ctx *sim, int x1, int y1, 
+			 int x2, int y2) {
+  if(x1 < 0) x1 = 0; 
+  if(y1 < 0) y1 = 0;
+  if(x2 > 255) x2 = 255;
+  if(y2 > 255) y2 = 255;
+  if(x1 > x2 || y1 > y2) return;
+
+  for(int py = y1/16; py <= y2/16; py++) {
+    for(int px = x1/16; px <= x2/16; px++) {
+      sim->dirty_terrain[py] |= 1 << px;
+    }
+  }
+  if(sim->terrain_flush_id == 0)
+    sim->terrain_flush_id = g_idle_add(terrain_flush_idle, sim);
+}
+
+void sim_set_terrain_height(struct simulator_ctx *sim, int x, int y, 
+			    float height) {
+  if(x < 0 || y < 0 || x > 255 || y > 255) return;
+  if(sim->terrain[x + y*256] == height) return;
+  sim->terrain[x + y*256] = height;
+  sim_terrain_changed(sim, x, y, x, y);
+}
 double caj_get_timer(struct simgroup_ctx *sgrp) {
   return g_timer_elapsed(sgrp->timer, NULL);
 }
@@ -280,6 +320,88 @@ static void simstatus_rest_handler (SoupServer *server,
 }
 
 
+// per-region physics timings, one region per line
+static void physstats_rest_handler (SoupServer *server,
+				    SoupMessage *msg,
+				    const char *path,
+				    GHashTable *query,
+				    SoupClientContext *client,
+				    gpointer user_data) {
+  struct simgroup_ctx* sgrp = (struct simgroup_ctx*) user_data;
+  std::string out; char buf[256];
+  for(std::map<uint64_t, simulator_ctx*>::iterator iter = sgrp->sims.begin();
+      iter != sgrp->sims.end(); iter++) {
+    simulator_ctx *sim = iter->second; caj_phys_stats stats;
+    if(sim->physh.get_stats == NULL) continue;
+    sim->physh.get_stats(sim, sim->phys_priv, &stats);
+    snprintf(buf, 256, "%s steps=%u late=%u last_ms=%.3f avg_ms=%.3f "
+	     "max_ms=%.3f%s\n", sim->shortname, (unsigned)stats.steps, 
+	     (unsigned)stats.late_steps, (double)stats.last_step_ms, 
+	     (double)stats.avg_step_ms, (double)stats.max_step_ms,
+	     stats.sleeping ? " sleeping" : "");
+    out.append(buf);
+  }
+  soup_message_set_status(msg,200);
+  soup_message_set_response(msg,"text/plain",SOUP_MEMORY_COPY,
+			    out.c_str(), out.length());
+}
+
+static bool script_stats_busier(const script_stats_entry &a, 
+				const script_stats_entry &b) {
+  return a.stats.run_time > b.stats.run_time;
+}
+
+// The scripts using the most time in each region, busiest first, after a
+// line saying how long it took to get the region's scripts running when it
+// started. The number of scripts listed per region can be set with ?top=N.
+static void scriptstats_rest_handler (SoupServer *server,
+				      SoupMessage *msg,
+				      const char *path,
+				      GHashTable *query,
+				      SoupClientContext *client,
+				      gpointer user_data) {
+  struct simgroup_ctx* sgrp = (struct simgroup_ctx*) user_data;
+  std::string out; char buf[512]; unsigned top = 10;
+  if(query != NULL) {
+    const char *top_str = (const char*)g_hash_table_lookup(query, "top");
+    if(top_str != NULL && atoi(top_str) > 0) top = atoi(top_str);
+  }
+  for(std::map<uint64_t, simulator_ctx*>::iterator iter = sgrp->sims.begin();
+      iter != sgrp->sims.end(); iter++) {
+    simulator_ctx *sim = iter->second;
+    std::vector<script_stats_entry> scripts;
+    if(sim->scripth.get_boot_stats != NULL) {
+      caj_script_boot_stats boot;
+      sim->scripth.get_boot_stats(sim, sim->script_priv, &boot);
+      if(boot.restored > 0) {
+	snprintf(buf, 512, "%s boot restored=%u pending=%u time_ms=%.3f\n",
+		 sim->shortname, (unsigned)boot.restored, 
+		 (unsigned)boot.pending, boot.time*1000.0);
+	out.append(buf);
+      }
+    }
+    world_int_script_stats(sim, scripts);
+    std::sort(scripts.begin(), scripts.end(), script_stats_busier);
+    for(unsigned i = 0; i < scripts.size() && i < top; i++) {
+      script_stats_entry &e = scripts[i]; char item_id[40];
+      uuid_unparse(e.inv->item_id, item_id);
+      snprintf(buf, 512, "%s %s \"%s\" in \"%s\" time_ms=%.3f insns=%llu "
+	       "events=%u rpcs=%u drops=%u heap=%u%s%s%s\n", sim->shortname,
+	       item_id, e.inv->name, e.prim->name != NULL ? e.prim->name : "",
+	       e.stats.run_time*1000.0,
+	       (unsigned long long)e.stats.insns, (unsigned)e.stats.events,
+	       (unsigned)e.stats.rpcs, (unsigned)e.stats.queue_drops,
+	       (unsigned)e.stats.heap_bytes, 
+	       e.stats.hibernating ? " hibernating" : "",
+	       e.stats.hot_funcs[0] != 0 ? " funcs: " : "", e.stats.hot_funcs);
+      out.append(buf);
+    }
+  }
+  soup_message_set_status(msg,200);
+  soup_message_set_response(msg,"text/plain",SOUP_MEMORY_COPY,
+			    out.c_str(), out.length());
+}
+
 static volatile int shutting_down = 0;
 
 static void shutdown_sim(simulator_ctx *sim) {
@@ -301,6 +423,7 @@ static void shutdown_sim(simulator_ctx *sim) {
     } else iter++;
   }
 
+  if(sim->terrain_flush_id != 0) g_source_remove(sim->terrain_flush_id);
   sim->physh.destroy(sim, sim->phys_priv);
   sim->phys_priv = NULL;
   
@@ -730,6 +853,8 @@ void load_sim(simgroup_ctx *sgrp, char *shortname) {
   sim->terrain = new float[256*256];
   for(int i = 0; i < 256*256; i++) sim->terrain[i] = 25.0f;
   load_terrain(sim,"terrain.raw"); // FIXME!
+  memset(sim->dirty_terrain, 0, sizeof(sim->dirty_terrain));
+  sim->terrain_flush_id = 0;
 
 
   // FIXME - better error handling needed
@@ -763,7 +888,7 @@ void load_sim(simgroup_ctx *sgrp, char *shortname) {
   }
 
   sim->world_tree = world_octree_create();
-  sim->ctxts = NULL;
+  sim->ctxts = NULL; sim->upd_batch_depth = 0;
   //uuid_generate_random(sim->region_secret);
   //sim_int_init_udp(sim);
   
@@ -771,6 +896,7 @@ void load_sim(simgroup_ctx *sgrp, char *shortname) {
 
   sim->collisions = new collision_state();
 
+  memset(&sim->physh, 0, sizeof(sim->physh));
   if(!cajeput_physics_init(CAJEPUT_API_VERSION, sim, 
 			     &sim->phys_priv, &sim->physh)) {
     CAJ_ERROR("Couldn't init physics engine!\n"); return;
@@ -926,6 +1052,10 @@ int main(void) {
   caj_int_caps_init(sgrp);
   soup_server_add_handler(sgrp->soup, "/simstatus", simstatus_rest_handler, 
 			  sgrp, NULL);
+  soup_server_add_handler(sgrp->soup, "/physstats", physstats_rest_handler, 
+			  sgrp, NULL);
+  soup_server_add_handler(sgrp->soup, "/scriptstats", scriptstats_rest_handler, 
+			  sgrp, NULL);
   soup_server_run_async(sgrp->soup);
 
   g_timeout_add(1000, cleanup_timer, sgrp);
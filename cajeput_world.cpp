@@ -29,6 +29,7 @@
 #include "cajeput_user_glue.h"
 #include <cassert>
 #include <stdio.h>
+#include <math.h>
 
 #define CAJ_LOGGER (sim->sgrp->log)
 
@@ -509,6 +510,90 @@ struct primitive_obj* world_get_root_prim(struct primitive_obj *prim) {
   return prim;
 }
 
+// kg per cubic metre, indexed by MATERIAL_*. Roughly the real-world values.
+static const float material_density[] = {
+  2400.0f, // MATERIAL_STONE
+  7800.0f, // MATERIAL_METAL
+  2500.0f, // MATERIAL_GLASS
+  700.0f, // MATERIAL_WOOD
+  1000.0f, // MATERIAL_FLESH
+  950.0f, // MATERIAL_PLASTIC
+  1200.0f, // MATERIAL_RUBBER
+  100.0f, // MATERIAL_LIGHT - no idea what this is meant to be
+};
+
+// really tiny prims make the physics solver unhappy
+#define MIN_PRIM_MASS 0.1f
+
+// This is exact for boxes, cylinders, prisms and spheres (with taper, path
+// cut, profile cut and hollow) and a rough guess for everything else.
+float world_prim_volume(struct primitive_obj *prim) {
+  float vol = prim->ob.scale.x * prim->ob.scale.y * prim->ob.scale.z;
+
+  // how much of the bounding box the basic shape fills
+  float shape_frac;
+  switch(prim->profile_curve & PROFILE_SHAPE_MASK) {
+  case PROFILE_SHAPE_SQUARE: shape_frac = 1.0f; break;
+  case PROFILE_SHAPE_CIRCLE: shape_frac = M_PI/4.0; break;
+  case PROFILE_SHAPE_SEMICIRC: shape_frac = M_PI/8.0; break;
+  case PROFILE_SHAPE_ISO_TRI:
+  case PROFILE_SHAPE_EQUIL_TRI:
+  case PROFILE_SHAPE_RIGHT_TRI:
+  default:
+    shape_frac = 0.5f; break;
+  }
+
+  if((prim->path_curve & PATH_CURVE_MASK) == PATH_CURVE_STRAIGHT) {
+    // taper - same convention as the physics code. The cross-section area
+    // varies quadratically along the path, hence the 1/3 term.
+    float x_bottom = 1.0f, x_top = 1.0f, y_bottom = 1.0f, y_top = 1.0f;
+    if(prim->path_scale_x <= 100) x_bottom = prim->path_scale_x/100.0f;
+    else if(prim->path_scale_x <= 200) x_top = (200-prim->path_scale_x)/100.0f;
+    if(prim->path_scale_y <= 100) y_bottom = prim->path_scale_y/100.0f;
+    else if(prim->path_scale_y <= 200) y_top = (200-prim->path_scale_y)/100.0f;
+    shape_frac *= x_bottom*y_bottom + 
+      (x_bottom*(y_top-y_bottom) + y_bottom*(x_top-x_bottom))/2.0f +
+      (x_top-x_bottom)*(y_top-y_bottom)/3.0f;
+  } else if((prim->profile_curve & PROFILE_SHAPE_MASK) == 
+	    PROFILE_SHAPE_SEMICIRC) {
+    shape_frac = M_PI/6.0; // sphere
+  } else {
+    // torus, tube or ring. Very approximate - ignores hole size and so on.
+    shape_frac *= M_PI/8.0;
+  }
+  vol *= shape_frac;
+
+  // path cut, profile cut and hollow
+  vol *= 1.0f - (prim->path_begin + prim->path_end)/50000.0f;
+  vol *= 1.0f - (prim->profile_begin + prim->profile_end)/50000.0f;
+  float hollow = prim->profile_hollow/50000.0f;
+  vol *= 1.0f - hollow*hollow;
+
+  return vol > 0.0f ? vol : 0.0f;
+}
+
+float world_prim_mass(struct primitive_obj *prim) {
+  float density = material_density[MATERIAL_WOOD];
+  if(prim->material < sizeof(material_density)/sizeof(material_density[0]))
+    density = material_density[prim->material];
+  float mass = world_prim_volume(prim) * density;
+  return mass > MIN_PRIM_MASS ? mass : MIN_PRIM_MASS;
+}
+
+float world_object_mass(struct world_obj *obj) {
+  if(obj->type == OBJ_TYPE_AVATAR) {
+    return WORLD_AVATAR_MASS;
+  } else if(obj->type == OBJ_TYPE_PRIM) {
+    primitive_obj *root = world_get_root_prim((primitive_obj*)obj);
+    float mass = world_prim_mass(root);
+    for(int i = 0; i < root->num_children; i++) 
+      mass += world_prim_mass(root->children[i]);
+    return mass;
+  } else {
+    return 0.0f;
+  }
+}
+
 // NOTE: if you're adding new fields to prims and want them to be initialised
 // properly, you *must* edit cajeput_dump.cpp as well as here, since it doesn't
 // use world_begin_new_prim when revivifying loaded prims.
@@ -1259,6 +1344,26 @@ void world_load_script_state(inventory_item *inv, caj_string *state) {
   inv->spriv = sinfo;
 }
 
+void world_int_script_stats(simulator_ctx *sim, 
+			    std::vector<script_stats_entry> &out) {
+  if(sim->scripth.get_stats == NULL) return;
+  for(std::map<uint32_t, world_obj*>::iterator iter = sim->localid_map.begin();
+      iter != sim->localid_map.end(); iter++) {
+    if(iter->second->type != OBJ_TYPE_PRIM) continue;
+    primitive_obj *prim = (primitive_obj*)iter->second;
+    for(unsigned i = 0; i < prim->inv.num_items; i++) {
+      inventory_item *inv = prim->inv.items[i];
+      if(inv->inv_type != INV_TYPE_LSL || inv->spriv == NULL) continue;
+      script_info *sinfo = (script_info*)inv->spriv;
+      if(sinfo->priv == NULL) continue;
+      script_stats_entry entry; entry.prim = prim; entry.inv = inv;
+      sim->scripth.get_stats(sim, sim->script_priv, sinfo->priv, 
+			     &entry.stats);
+      out.push_back(entry);
+    }
+  }
+}
+
 static void world_move_root_obj_int(struct simulator_ctx *sim, struct world_obj *ob,
 			     const caj_vector3 &new_pos) {
   assert(ob->parent == NULL);
@@ -1676,6 +1781,24 @@ static void mark_deleted_obj_for_updates(simulator_ctx* sim, world_obj *obj) {
   }
 }
 
+static void notify_prim_scripts(simulator_ctx* sim, primitive_obj *prim,
+				int update_level) {
+  if(sim->scripth.prim_change_event == NULL) return;
+
+  // FIXME - optimise this to avoid unnecesary checks.
+  for(unsigned i = 0; i < prim->inv.num_items; i++) {
+    inventory_item *inv = prim->inv.items[i];
+    if(inv->inv_type == INV_TYPE_LSL && inv->asset_type == ASSET_LSL_TEXT 
+       && inv->spriv != NULL) {
+      script_info *sinfo = (script_info*)inv->spriv;
+      if(sinfo->priv != NULL) {
+	sim->scripth.prim_change_event(sim, sim->script_priv, sinfo->priv, 
+				       update_level);
+      }
+    }
+  }
+}
+
 static void mark_object_updated_nophys(simulator_ctx* sim, world_obj *obj, 
 				       int update_level) {
   if(obj->type != OBJ_TYPE_PRIM) return;
@@ -1692,29 +1815,62 @@ static void mark_object_updated_nophys(simulator_ctx* sim, world_obj *obj,
     }
   }
 
-  // FIXME - optimise this to avoid unnecesary checks.
-  for(unsigned i = 0; i < prim->inv.num_items; i++) {
-    inventory_item *inv = prim->inv.items[i];
-    if(inv->inv_type == INV_TYPE_LSL && inv->asset_type == ASSET_LSL_TEXT 
-       && inv->spriv != NULL) {
-      script_info *sinfo = (script_info*)inv->spriv;
-      if(sinfo->priv != NULL) {
-	int evmask = sim->scripth.get_evmask(sim, sim->script_priv, sinfo->priv);
-	if((evmask & CAJ_EVMASK_PRIM_CHANGED) && 
-	   sim->scripth.prim_change_event != NULL) {
-	  sim->scripth.prim_change_event(sim, sim->script_priv, sinfo->priv, 
-					 update_level);
-	}
-      }
+  notify_prim_scripts(sim, prim, update_level);
+  if(update_level & CAJ_OBJUPD_POSROT) {
+    // scripts in child prims also care where the root is
+    for(int i = 0; i < prim->num_children; i++) {
+      notify_prim_scripts(sim, prim->children[i], CAJ_OBJUPD_POSROT);
     }
   }
 }
 
+static void flush_update_batch(simulator_ctx* sim) {
+  // swap them out first, in case anything we call marks more updates
+  std::vector<uint32_t> order; std::map<uint32_t, int> upds;
+  order.swap(sim->upd_batch_order); upds.swap(sim->upd_batch);
+
+  for(std::vector<uint32_t>::iterator iter = order.begin(); 
+      iter != order.end(); iter++) {
+    world_obj *obj = world_object_by_localid(sim, *iter);
+    if(obj == NULL) continue; // deleted since
+    int update_level = upds[*iter];
+    sim->physh.upd_object(sim, sim->phys_priv, obj, update_level);
+    mark_object_updated_nophys(sim, obj, update_level);
+  }
+}
+
 void world_mark_object_updated(simulator_ctx* sim, world_obj *obj, int update_level) {
+  if(sim->upd_batch_depth > 0) {
+    // linking, unlinking and creation have ordering rules the physics code
+    // relies on (see cajeput_world.h), so don't try and merge those.
+    if(update_level & (CAJ_OBJUPD_CREATED|CAJ_OBJUPD_PARENT|
+		       CAJ_OBJUPD_CHILDREN)) {
+      flush_update_batch(sim);
+    } else {
+      std::map<uint32_t, int>::iterator iter = 
+	sim->upd_batch.find(obj->local_id);
+      if(iter == sim->upd_batch.end()) {
+	sim->upd_batch[obj->local_id] = update_level;
+	sim->upd_batch_order.push_back(obj->local_id);
+      } else {
+	iter->second |= update_level;
+      }
+      return;
+    }
+  }
   sim->physh.upd_object(sim, sim->phys_priv, obj, update_level);
   mark_object_updated_nophys(sim, obj, update_level);
 }
 
+void world_begin_update_batch(struct simulator_ctx *sim) {
+  sim->upd_batch_depth++;
+}
+
+void world_end_update_batch(struct simulator_ctx *sim) {
+  assert(sim->upd_batch_depth > 0);
+  if(--sim->upd_batch_depth == 0) flush_update_batch(sim);
+}
+
 void world_move_obj_from_phys(struct simulator_ctx *sim, struct world_obj *ob,
 			      const caj_vector3 *new_pos) {
   world_move_root_obj_int(sim, ob, *new_pos);
@@ -1728,6 +1884,39 @@ void world_prim_apply_impulse(struct simulator_ctx *sim, struct primitive_obj* p
   sim->physh.apply_impulse(sim, sim->phys_priv, &prim->ob, impulse, is_local);
 }
 
+// physics engines aren't required to support queries, in which case we 
+// just report no hits.
+void world_phys_raycast(struct simulator_ctx *sim, const caj_vector3 *start,
+			const caj_vector3 *end, int reject, int max_hits,
+			caj_phys_query_cb cb, void *cb_priv) {
+  if(sim->physh.raycast == NULL) {
+    cb(sim, cb_priv, NULL, 0); return;
+  }
+  sim->physh.raycast(sim, sim->phys_priv, start, end, reject, max_hits,
+		     cb, cb_priv);
+}
+
+void world_phys_sphere_sweep(struct simulator_ctx *sim, 
+			     const caj_vector3 *start, const caj_vector3 *end,
+			     float radius, int reject, int max_hits,
+			     caj_phys_query_cb cb, void *cb_priv) {
+  if(sim->physh.sphere_sweep == NULL) {
+    cb(sim, cb_priv, NULL, 0); return;
+  }
+  sim->physh.sphere_sweep(sim, sim->phys_priv, start, end, radius, reject,
+			  max_hits, cb, cb_priv);
+}
+
+void world_phys_overlap(struct simulator_ctx *sim, const caj_vector3 *centre,
+			float radius, int reject, int max_hits,
+			caj_phys_query_cb cb, void *cb_priv) {
+  if(sim->physh.overlap == NULL) {
+    cb(sim, cb_priv, NULL, 0); return;
+  }
+  sim->physh.overlap(sim, sim->phys_priv, centre, radius, reject, max_hits,
+		     cb, cb_priv);
+}
+
 static void send_prim_collision(struct simulator_ctx *sim, struct primitive_obj* prim, 
 				int coll_type, struct world_obj *collider) {
   //printf("DEBUG: in send_prim_collision, type %i\n", coll_type);
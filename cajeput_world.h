@@ -80,6 +80,7 @@ struct world_obj {
 #define CAJ_OBJUPD_EXTRA_PARAMS 0x400
 #define CAJ_OBJUPD_AVATARS 0x800 // object's avatar children changed due to avatar sitting or standing.
 #define CAJ_OBJUPD_AV_ON_SEAT 0x1000 // avatar sat on this prim or got up.
+#define CAJ_OBJUPD_PROPERTIES 0x2000 // name or description. Viewers ask.
 
   // bunch of SL constants
 #define MATERIAL_STONE   0
@@ -91,6 +92,8 @@ struct world_obj {
 #define MATERIAL_RUBBER  6
 #define MATERIAL_LIGHT   7 // ???
 
+#define WORLD_AVATAR_MASS 50.0f // kg; FIXME - should depend on avatar size
+
   // bunch more SL constants (ObjectUpdate.RegionData.UpdateFlags)
 #define PRIM_FLAG_PHYSICAL 0x1
 #define PRIM_FLAG_CREATE_SELECTED 0x2
@@ -241,6 +244,25 @@ struct primitive_obj {
   typedef void(*compile_done_cb)(void *priv, int success, const char* output, 
 				 int output_len);
 
+  // per-script accounting, for the /scriptstats report
+  struct caj_script_stats {
+    uint64_t insns; // VM instructions run
+    double run_time; // seconds spent running it
+    uint32_t events, rpcs; // handled and issued, respectively
+    uint32_t queue_drops; // events thrown away because too many were queued
+    uint32_t heap_bytes;
+    int hibernating;
+    // functions it's most often in, if per-function profiling is turned on
+    char hot_funcs[128];
+  };
+
+  // Scripts restored at once, which normally means when the region started.
+  struct caj_script_boot_stats {
+    uint32_t restored;
+    uint32_t pending; // not running yet
+    double time; // seconds until they were all running, or so far
+  };
+
   struct cajeput_script_hooks {
     // most of these hooks are mandatory.
     void* (*add_script)(simulator_ctx *sim, void *priv, primitive_obj *prim, 
@@ -267,9 +289,16 @@ struct primitive_obj {
     void (*disable_listens)(simulator_ctx *sim, void *priv, void *script);
     void (*reenable_listens)(simulator_ctx *sim, void *priv, void *script);
 
-    // also entirely optional. Feeds object update info to scripts.
+    // also entirely optional. Feeds object update info to scripts. Called for
+    // every update to a prim, whether or not the script wants changed events.
     void (*prim_change_event)(simulator_ctx *sim, void *priv, void *script,
 			      int update_level);
+
+    // optional, fills in stats for the /scriptstats report.
+    void (*get_stats)(simulator_ctx *sim, void *priv, void *script,
+		      struct caj_script_stats *stats);
+    void (*get_boot_stats)(simulator_ctx *sim, void *priv,
+			   struct caj_script_boot_stats *stats);
   };
 
   int caj_scripting_init(int api_version, struct simulator_ctx* sim, 
@@ -323,6 +352,34 @@ struct caj_phys_collision {
 #endif
 };
 
+struct caj_phys_stats {
+  uint32_t steps;
+  uint32_t late_steps; // started more than a step after they were due
+  float last_step_ms, avg_step_ms, max_step_ms;
+  int sleeping; // nothing moving, so not being stepped at all
+};
+
+// Physics queries (raycasts, sphere sweeps and overlap tests) are 
+// asynchronous: they're batched up and run by the physics thread between 
+// steps, and the callback is called in the main thread some time later.
+// Positions are region coordinates. Hits from raycasts and sweeps are sorted
+// nearest first; num_hits is -1 if the query was cancelled because physics
+// is shutting down, in which case the callback must only free its state.
+struct caj_phys_hit {
+  uint32_t local_id; // of the prim or avatar hit, or 0 for the terrain
+  caj_vector3 pos, normal;
+  float fraction; // how far along the ray or sweep, from 0 to 1
+};
+
+typedef void(*caj_phys_query_cb)(struct simulator_ctx *sim, void *priv,
+				 struct caj_phys_hit *hits, int num_hits);
+
+// flags for reject, chosen to match llCastRay's RC_REJECT_* constants
+#define CAJ_PHYS_REJECT_AGENTS 0x1
+#define CAJ_PHYS_REJECT_PHYSICAL 0x2
+#define CAJ_PHYS_REJECT_NONPHYSICAL 0x4
+#define CAJ_PHYS_REJECT_LAND 0x8
+
 struct cajeput_physics_hooks {
   /* upd_object also does adding of objects */
   void(*upd_object)(struct simulator_ctx *sim, void *priv,
@@ -339,6 +396,23 @@ struct cajeput_physics_hooks {
   void(*apply_impulse)(struct simulator_ctx *sim, void *priv,
 		       struct world_obj *obj, caj_vector3 impulse,
 		       int is_local);
+  /* dirty is 16 rows of patch bitmasks, in the same form as the
+     user_get_dirty_terrain_array() one. Called from the main thread. */
+  void(*upd_terrain)(struct simulator_ctx *sim, void *priv,
+		     const uint16_t *dirty);
+  void(*get_stats)(struct simulator_ctx *sim, void *priv,
+		   struct caj_phys_stats *stats);
+  /* the queries. See above; these are all called from the main thread. */
+  void(*raycast)(struct simulator_ctx *sim, void *priv,
+		 const caj_vector3 *start, const caj_vector3 *end,
+		 int reject, int max_hits, caj_phys_query_cb cb, void *cb_priv);
+  void(*sphere_sweep)(struct simulator_ctx *sim, void *priv,
+		      const caj_vector3 *start, const caj_vector3 *end,
+		      float radius, int reject, int max_hits, 
+		      caj_phys_query_cb cb, void *cb_priv);
+  void(*overlap)(struct simulator_ctx *sim, void *priv,
+		 const caj_vector3 *centre, float radius, int reject, 
+		 int max_hits, caj_phys_query_cb cb, void *cb_priv);
 };
 
 int cajeput_physics_init(int api_version, struct simulator_ctx *sim, 
@@ -361,6 +435,12 @@ void world_move_obj_from_phys(struct simulator_ctx *sim, struct world_obj *ob,
   // generally, I'd prefer it if you didn't use this directly
 void world_mark_object_updated(simulator_ctx* sim, world_obj *obj, int update_level);
 
+  // Between these, object updates are merged and passed on to physics and
+  // scripts once per object at the end, rather than every time. For doing 
+  // lots of changes at once, like running a batch of script calls. They nest.
+void world_begin_update_batch(struct simulator_ctx *sim);
+void world_end_update_batch(struct simulator_ctx *sim);
+
 void world_insert_obj(struct simulator_ctx *sim, struct world_obj *ob);
 
 void world_add_attachment(struct simulator_ctx *sim, struct avatar_obj *av, 
@@ -378,6 +458,12 @@ struct world_obj* world_object_by_id(struct simulator_ctx *sim, const uuid_t id)
 struct world_obj* world_object_by_localid(struct simulator_ctx *sim, uint32_t id);
 
 struct primitive_obj* world_get_root_prim(struct primitive_obj *prim);
+
+// Estimated volume in cubic metres, and mass in kg (volume times the density
+// of prim->material). world_object_mass gives the mass of the whole linkset.
+float world_prim_volume(struct primitive_obj *prim);
+float world_prim_mass(struct primitive_obj *prim);
+float world_object_mass(struct world_obj *obj);
 struct primitive_obj* world_prim_by_link_id(struct simulator_ctx* sim, 
 					    struct primitive_obj *prim, 
 					    int link_num);
@@ -421,6 +507,18 @@ void world_prim_start_rezzed_script(struct simulator_ctx *sim,
 void world_prim_apply_impulse(struct simulator_ctx *sim, struct primitive_obj* prim,
 			      caj_vector3 impulse, int is_local);
 
+  // asynchronous physics queries; see struct caj_phys_hit for the details.
+void world_phys_raycast(struct simulator_ctx *sim, const caj_vector3 *start,
+			const caj_vector3 *end, int reject, int max_hits,
+			caj_phys_query_cb cb, void *cb_priv);
+void world_phys_sphere_sweep(struct simulator_ctx *sim, 
+			     const caj_vector3 *start, const caj_vector3 *end,
+			     float radius, int reject, int max_hits,
+			     caj_phys_query_cb cb, void *cb_priv);
+void world_phys_overlap(struct simulator_ctx *sim, const caj_vector3 *centre,
+			float radius, int reject, int max_hits,
+			caj_phys_query_cb cb, void *cb_priv);
+
 
 void user_rez_script(struct user_ctx *ctx, struct primitive_obj *prim,
 		     const char *name, const char *descrip, uint32_t flags,
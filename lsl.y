@@ -26,10 +26,10 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <stdio.h>
 #include "caj_lsl_parse.h"
-int yylex (void);
-void yyerror (char const *);
-int yydebug;
+void yyerror (struct lsl_location *loc, lsl_parse_state *ps, char const *);
+int lsl_parse_mem(lsl_parse_state *ps, const char *src, int len);
 
 typedef struct lsl_location YYLTYPE;
 # define YYLTYPE_IS_DECLARED 1
@@ -46,25 +46,23 @@ typedef struct lsl_location YYLTYPE;
  }
 
  static expr_node * enode_make_int(char *s, YYLTYPE *loc) {
-  struct expr_node *enode = malloc(sizeof(struct expr_node));
+  struct expr_node *enode = lsl_alloc(sizeof(struct expr_node));
   enode->u.i = strtol(s, NULL, 0); // do we really want octal? Hmmm...
   enode->node_type = NODE_CONST; enode_set_loc(enode, loc);
   enode->vtype = VM_TYPE_INT;
-  free(s);
   return enode;
 }
 
 static expr_node * enode_make_float(char *s, YYLTYPE *loc) {
-  struct expr_node *enode = malloc(sizeof(struct expr_node));
+  struct expr_node *enode = lsl_alloc(sizeof(struct expr_node));
   enode->u.f = strtof(s, NULL); enode_set_loc(enode, loc);
   enode->node_type = NODE_CONST;
   enode->vtype = VM_TYPE_FLOAT;
-  free(s);
   return enode;
 }
 
 static expr_node * enode_make_str(char *s, YYLTYPE *loc) {
-  struct expr_node *enode = malloc(sizeof(struct expr_node));
+  struct expr_node *enode = lsl_alloc(sizeof(struct expr_node));
   enode->u.s = s; enode_set_loc(enode, loc);
   enode->node_type = NODE_CONST;
   enode->vtype = VM_TYPE_STR;
@@ -74,7 +72,7 @@ static expr_node * enode_make_str(char *s, YYLTYPE *loc) {
 /* FIXME - propagate constants down to this node? */
  static expr_node * enode_make_vect(expr_node *x, expr_node *y, expr_node *z,
 				    YYLTYPE *loc) {
-  struct expr_node *enode = malloc(sizeof(struct expr_node));
+  struct expr_node *enode = lsl_alloc(sizeof(struct expr_node));
   enode->node_type = NODE_VECTOR; enode_set_loc(enode, loc);
   enode->vtype = VM_TYPE_VECT;
   enode->u.child[0] = x; enode->u.child[1] = y; enode->u.child[2] = z;
@@ -84,7 +82,7 @@ static expr_node * enode_make_str(char *s, YYLTYPE *loc) {
  static expr_node * enode_make_rot(expr_node *x, expr_node *y, 
 				   expr_node *z, expr_node *w,
 				    YYLTYPE *loc) {
-  struct expr_node *enode = malloc(sizeof(struct expr_node));
+  struct expr_node *enode = lsl_alloc(sizeof(struct expr_node));
   enode->node_type = NODE_ROTATION; enode_set_loc(enode, loc);
   enode->vtype = VM_TYPE_ROT;
   enode->u.child[0] = x; enode->u.child[1] = y; 
@@ -93,7 +91,7 @@ static expr_node * enode_make_str(char *s, YYLTYPE *loc) {
 }
 
  static expr_node * enode_make_list(list_node *list, YYLTYPE *loc) {
-  struct expr_node *enode = malloc(sizeof(struct expr_node));
+  struct expr_node *enode = lsl_alloc(sizeof(struct expr_node));
   enode->u.list = list; enode_set_loc(enode, loc);
   enode->node_type = NODE_LIST;
   enode->vtype = VM_TYPE_LIST;
@@ -101,8 +99,9 @@ static expr_node * enode_make_str(char *s, YYLTYPE *loc) {
 }
 
 
- static expr_node * enode_make_id(char *s, char *item, YYLTYPE *loc) {
-   struct expr_node *enode = malloc(sizeof(struct expr_node));
+ static expr_node * enode_make_id(lsl_parse_state *ps, char *s, char *item, 
+				   YYLTYPE *loc) {
+   struct expr_node *enode = lsl_alloc(sizeof(struct expr_node));
    const lsl_const *c = find_lsl_const(s);
    enode_set_loc(enode, loc);
    if(c == NULL) {
@@ -110,7 +109,6 @@ static expr_node * enode_make_str(char *s, YYLTYPE *loc) {
      enode->u.ident.name = s;
      enode->u.ident.item = item;
    } else { // FIXME - this could lead to assertion failures elsewhere!
-     free(s);
      enode->node_type = NODE_CONST; enode->vtype = c->vtype;
      switch(c->vtype) {
      case VM_TYPE_INT:
@@ -118,7 +116,7 @@ static expr_node * enode_make_str(char *s, YYLTYPE *loc) {
      case VM_TYPE_FLOAT:
        enode->u.f = c->u.f; break;     
      case VM_TYPE_STR:
-       enode->u.s = strdup(c->u.s); break;     
+       enode->u.s = lsl_strdup(c->u.s); break;     
      case VM_TYPE_ROT:
        enode->u.v[3] = c->u.v[3];
        // fall through
@@ -127,7 +125,7 @@ static expr_node * enode_make_str(char *s, YYLTYPE *loc) {
        enode->u.v[2] = c->u.v[2];
        break;
      default:
-       yyerror("Unhandled type of named constant");
+       yyerror(loc, ps, "Unhandled type of named constant");
        enode->vtype = VM_TYPE_NONE; 
      }
    }
@@ -135,7 +133,7 @@ static expr_node * enode_make_str(char *s, YYLTYPE *loc) {
 }
 
  static expr_node * enode_make_id_type(char *s, uint8_t vtype, YYLTYPE *loc) {
-   struct expr_node *enode = malloc(sizeof(struct expr_node));
+   struct expr_node *enode = lsl_alloc(sizeof(struct expr_node));
    enode->node_type = NODE_IDENT; enode->vtype = vtype;
    enode->u.ident.name = s;
    enode->u.ident.item = NULL; // FIXME
@@ -144,33 +142,33 @@ static expr_node * enode_make_str(char *s, YYLTYPE *loc) {
 }
 
  static expr_node *enode_make_call(char* name, list_node* args, YYLTYPE *loc) {
-   struct expr_node *enode = malloc(sizeof(struct expr_node));
+   struct expr_node *enode = lsl_alloc(sizeof(struct expr_node));
    enode->node_type = NODE_CALL; enode->u.call.name = name;
    enode->u.call.args = args; enode_set_loc(enode, loc);
    return enode;
  }
 
  static  expr_node * enode_binop(expr_node *l, expr_node *r, int node_type, YYLTYPE *loc) {
-    expr_node *enode = malloc(sizeof(expr_node));
+    expr_node *enode = lsl_alloc(sizeof(expr_node));
     enode->node_type = node_type; enode_set_loc(enode, loc);
     enode->u.child[0] = l; enode->u.child[1] = r;
     return enode;
 }
 
  static  expr_node * enode_unaryop(expr_node *expr, int node_type, YYLTYPE *loc) {
-    expr_node *enode = malloc(sizeof(expr_node));
+    expr_node *enode = lsl_alloc(sizeof(expr_node));
     enode->node_type = node_type; enode->vtype = expr->vtype;
     enode->u.child[0] = expr; enode_set_loc(enode, loc);
     return enode;  
 }
 
  static expr_node *enode_clone_id(expr_node *expr) {
-   struct expr_node *enode = malloc(sizeof(struct expr_node));
+   struct expr_node *enode = lsl_alloc(sizeof(struct expr_node));
    assert(expr->node_type == NODE_IDENT);
    enode->node_type = NODE_IDENT; 
-   enode->u.ident.name = strdup(expr->u.ident.name);
+   enode->u.ident.name = lsl_strdup(expr->u.ident.name);
    enode->u.ident.item = (expr->u.ident.item == NULL ? NULL : 
-			  strdup(expr->u.ident.item));
+			  lsl_strdup(expr->u.ident.item));
    enode->vtype = expr->vtype; enode->loc = expr->loc;
    return enode;
  }
@@ -234,20 +232,18 @@ static expr_node *enode_negate(expr_node *expr, YYLTYPE *loc) {
 }
 
  static statement* new_statement(int stype, YYLTYPE *loc) {
-  statement *statem = malloc(sizeof(statement));
+  statement *statem = lsl_alloc(sizeof(statement));
   statem->stype = stype; statem->loc = *loc;
   statem->next = NULL; 
   return statem;
 }
 
  static list_node* make_list_entry(expr_node *expr) {
-   list_node* lnode = malloc(sizeof(list_node));
+   list_node* lnode = lsl_alloc(sizeof(list_node));
    lnode->expr = expr; lnode->next = NULL;
    return lnode;
  }
 
- struct lsl_program global_prog; // FIXME - remove this
-
 typedef struct func_args {
   func_arg *first; func_arg **add;
 }  func_args;
@@ -261,6 +257,13 @@ typedef struct func_args {
 
 %}
 %locations
+%define api.pure
+%parse-param { lsl_parse_state *ps }
+%lex-param { lsl_parse_state *ps }
+%initial-action {
+  @$.first_line = @$.last_line = 0;
+  @$.first_column = @$.last_column = 0;
+};
  /* %debug */
 %error-verbose
 %union {
@@ -313,39 +316,42 @@ typedef struct func_args {
 %type <vtype> type 
 %type <list> list
 
+%code {
+  static int yylex(YYSTYPE *lvalp, YYLTYPE *llocp, lsl_parse_state *ps);
+}
+
 /* 1 shift-reduce conflict due to dangling else problem
  * 2 due to vector/rotation literals - FIXME figure out why exactly!
  */
 %expect 3
 %%
 program : functions states { 
-  $$ = NULL; global_prog.funcs = $1->funcs; global_prog.globals = $1->globals;
-  global_prog.states = $2;
-  free($1);
+  $$ = NULL; ps->prog.funcs = $1->funcs; ps->prog.globals = $1->globals;
+  ps->prog.states = $2;
 }; 
 global : type IDENTIFIER ';'  {
-  $$ = malloc(sizeof(global));
+  $$ = lsl_alloc(sizeof(global));
   $$->vtype = $1; $$->next = NULL;  $$->name = $2; $$->val = NULL;
  }
        | type IDENTIFIER '=' expr ';' { 
-  $$ = malloc(sizeof(global));
+  $$ = lsl_alloc(sizeof(global));
   $$->vtype = $1; $$->next = NULL;  $$->name = $2; $$->val = $4;
 
  }  ; 
 functions : /* nowt */ { 
-  $$ = malloc(sizeof(lsl_globals)); $$->funcs = NULL; $$->add_func = &$$->funcs;
+  $$ = lsl_alloc(sizeof(lsl_globals)); $$->funcs = NULL; $$->add_func = &$$->funcs;
    $$->globals = NULL; $$->add_global = &$$->globals;
 } 
 | functions function { *($1->add_func) = $2; $1->add_func = &$2->next; $$ = $1; }
 | functions global { *($1->add_global) = $2; $1->add_global = &$2->next; $$ = $1; };
 function : type IDENTIFIER '(' arguments ')' function_body {
-  $$ = malloc(sizeof(function));
+  $$ = lsl_alloc(sizeof(function));
   $$->ret_type = $1; $$->next = NULL;
   $$->name = $2; $$->args = $4; $$->code = $6;
 }     | IDENTIFIER '(' arguments ')' function_body {
   /* ideally, we'd define "ret_type : | type" and avoid the code duplication,
      but this causes a fatal shift/reduce conflict with the def. of global */
-  $$ = malloc(sizeof(function));
+  $$ = lsl_alloc(sizeof(function));
   $$->ret_type = VM_TYPE_NONE; $$->next = NULL;
   $$->name = $1; $$->args = $3; $$->code = $5;
   } ;
@@ -355,31 +361,31 @@ states : /* nothing */ { $$=NULL; }
 state_id : DEFAULT { $$ = NULL; }
          | STATE IDENTIFIER { $$ = $2; } ;
 state_funcs : /* nothing */ { 
-  $$ = malloc(sizeof(lsl_state)); $$->funcs = NULL; $$->add_func = &$$->funcs; 
+  $$ = lsl_alloc(sizeof(lsl_state)); $$->funcs = NULL; $$->add_func = &$$->funcs; 
 }
-            | state_funcs state_func { *$1->add_func = $2; $1->add_func = &$2->next; $$ = $1 } ;
+            | state_funcs state_func { *$1->add_func = $2; $1->add_func = &$2->next; $$ = $1; } ;
 state_func : IDENTIFIER '(' arguments ')' function_body{
   /* FIXME - code duplication! */
-  $$ = malloc(sizeof(function));
+  $$ = lsl_alloc(sizeof(function));
   $$->ret_type = VM_TYPE_NONE; $$->next = NULL;
   $$->name = $1; $$->args = $3; $$->code = $5;
   } ;
 arguments : /* nothing */ { $$ = NULL; }
-          | arglist { $$ = $1->first; free($1); } ;
-arglist : argument { $$ = malloc(sizeof(func_args)); $$->first = $1; $$->add = &$1->next; }
+          | arglist { $$ = $1->first; } ;
+arglist : argument { $$ = lsl_alloc(sizeof(func_args)); $$->first = $1; $$->add = &$1->next; }
      | arglist ',' argument { *($1->add) = $3; $1->add = &$3->next; $$ = $1; } ;
 argument: type IDENTIFIER { 
-  $$ = malloc(sizeof(func_arg)); $$->vtype = $1; 
+  $$ = lsl_alloc(sizeof(func_arg)); $$->vtype = $1; 
   $$->name = $2; $$->next = NULL;
 }
-function_body : '{' statements '}' { $$ = $2 };
-statements : /* nothing */ { $$ = malloc(sizeof(basic_block)); $$->first = NULL;
-                             $$->add_here = &($$->first) }
+function_body : '{' statements '}' { $$ = $2; };
+statements : /* nothing */ { $$ = lsl_alloc(sizeof(basic_block)); $$->first = NULL;
+                             $$->add_here = &($$->first); }
 | statements statement { 
   if($2 != NULL) { *($1->add_here) = $2; $1->add_here = &$2->next; }
   $$ = $1;
  } ;
-statement : ';' { $$ = NULL } |  expr ';' { 
+statement : ';' { $$ = NULL; } |  expr ';' { 
   $$ = new_statement(STMT_EXPR, &@1);
   $$->expr[0] = $1; 
  } 
@@ -396,7 +402,7 @@ statement : ';' { $$ = NULL } |  expr ';' {
 	    ;
 block_stmt : '{' statements '}' { 
   $$ = new_statement(STMT_BLOCK, &@1);
-  $$->child[0] = $2->first; free($2);
+  $$->child[0] = $2->first;
  } ;
 local : type IDENTIFIER {
   $$ = new_statement(STMT_DECL, &@1);
@@ -437,20 +443,20 @@ state_stmt : STATE IDENTIFIER ';'{
   $$ = new_statement(STMT_STATE, &@1);  $$->s = $2;
  } 
     | STATE DEFAULT {
-  $$ = new_statement(STMT_STATE, &@1); $$->s = strdup("default");
+  $$ = new_statement(STMT_STATE, &@1); $$->s = lsl_strdup("default");
  }
  ; 
-opt_expr : /* nothing */ { $$ = NULL } | expr ;
+opt_expr : /* nothing */ { $$ = NULL; } | expr ;
 ret_stmt : RETURN { $$ = new_statement(STMT_RET, &@1); $$->expr[0] = NULL; }
          | RETURN expr { $$ = new_statement(STMT_RET, &@1); $$->expr[0] = $2; }
          ;
-variable: IDENTIFIER { $$ = enode_make_id($1, NULL, &@1); }
-| IDENTIFIER '.' IDENTIFIER { $$ = enode_make_id($1, $3, &@1); }
+variable: IDENTIFIER { $$ = enode_make_id(ps, $1, NULL, &@1); }
+| IDENTIFIER '.' IDENTIFIER { $$ = enode_make_id(ps, $1, $3, &@1); }
    ; 
-call : IDENTIFIER '(' list ')' { $$ = enode_make_call($1,$3->first, &@1); free($3); }
-list : { $$ = malloc(sizeof(list_head)); $$->first = NULL; $$->add_here = &$$->first; }
+call : IDENTIFIER '(' list ')' { $$ = enode_make_call($1,$3->first, &@1); }
+list : { $$ = lsl_alloc(sizeof(list_head)); $$->first = NULL; $$->add_here = &$$->first; }
        | expr { 
-	 $$ = malloc(sizeof(list_head)); $$->first = make_list_entry($1);
+	 $$ = lsl_alloc(sizeof(list_head)); $$->first = make_list_entry($1);
 	 $$->add_here = &($$->first->next);
 	 }
        | list ',' expr { 
@@ -499,7 +505,7 @@ scexpr : NUMBER { $$ = enode_make_int($1, &@1); }
        | '(' expr ')' { $$ = $2; }
 | '<' scexpr ',' scexpr  ',' scexpr ',' scexpr '>'{ $$ = enode_make_rot($2,$4,$6,$8, &@1); } 
 | '<' scexpr ',' scexpr  ',' scexpr '>' { $$ = enode_make_vect($2,$4,$6, &@1); } 
-| '[' list ']' { $$ = enode_make_list($2->first, &@1); free($2); }
+| '[' list ']' { $$ = enode_make_list($2->first, &@1); }
 | variable INCR { $$ = enode_unaryop($1, NODE_POSTINC, &@1); } 
 | variable DECR { $$ = enode_unaryop($1, NODE_POSTDEC, &@1); } 
 | INCR variable { $$ = enode_unaryop($2, NODE_PREINC, &@1); }
@@ -745,25 +751,20 @@ static void print_stmts(statement *statem, int indent) {
 }
 #endif
 
-lsl_program *caj_parse_lsl(const char* fname) {
-  extern FILE *yyin;
+/* The parse tree is allocated from the calling thread's current arena (see
+   lsl_arena_set), and lives exactly as long as that does. */
+lsl_program *caj_parse_lsl(const char* src, int len, FILE *out) {
+  lsl_parse_state ps;
 #if 0 // debugging code
   function *func;
 #endif
-  yylloc.first_line = yylloc.last_line = 0;
-  yylloc.first_column = yylloc.last_column = 0;
-  yydebug = 1;
-  yyin = fopen(fname,"r");
-  if(yyin == NULL) {
-    printf("ERROR: file not found\n");
-    return NULL;
-  }
-  global_prog.funcs = NULL;
-  if(yyparse()) return NULL;
+  ps.out = out; ps.scanner = NULL;
+  ps.prog.funcs = NULL; ps.prog.globals = NULL; ps.prog.states = NULL;
+  if(lsl_parse_mem(&ps, src, len)) return NULL;
 
 #if 0 // debugging code
   
-   for(func = global_prog.funcs; func != NULL; func = func->next) {
+   for(func = ps.prog.funcs; func != NULL; func = func->next) {
      statement* statem; func_arg *arg;
      printf("%s %s(", type_names[func->ret_type],
            func->name);
@@ -777,12 +778,86 @@ lsl_program *caj_parse_lsl(const char* fname) {
    }
 #endif
 
-  return &global_prog;
+  {
+    lsl_program *prog = lsl_alloc(sizeof(lsl_program));
+    *prog = ps.prog; return prog;
+  }
 }
 
+int lsl_scan(YYSTYPE *lvalp, YYLTYPE *llocp, void *scanner);
 
-void yyerror(char const *error) { 
+static int yylex(YYSTYPE *lvalp, YYLTYPE *llocp, lsl_parse_state *ps) {
+  return lsl_scan(lvalp, llocp, ps->scanner);
+}
+
+void yyerror(YYLTYPE *loc, lsl_parse_state *ps, char const *error) { 
   // FIXME - add column number
-  printf("(%i, 0): %s\n", yylloc.first_line, error);
+  fprintf(ps->out, "(%i, 0): %s\n", loc->first_line, error);
+}
+
+/* Dead simple arena allocator for the parse tree, so that the compiler can
+   run in-process without leaking the lot each time. There's one current 
+   arena per thread; nothing allocated from it is ever freed individually. */
+#define LSL_ARENA_BLOCK 16384
+#define LSL_ARENA_ALIGN 16
+
+struct lsl_arena_block {
+  struct lsl_arena_block *next;
+  size_t used, size;
+};
+
+struct lsl_arena {
+  struct lsl_arena_block *blocks;
+};
+
+#define LSL_ARENA_HDR ((sizeof(struct lsl_arena_block) + LSL_ARENA_ALIGN - 1) \
+		       & ~(size_t)(LSL_ARENA_ALIGN - 1))
+
+static __thread lsl_arena *cur_arena = NULL;
+
+lsl_arena *lsl_arena_new(void) {
+  lsl_arena *arena = malloc(sizeof(lsl_arena));
+  if(arena == NULL) abort();
+  arena->blocks = NULL;
+  return arena;
+}
+
+void lsl_arena_free(lsl_arena *arena) {
+  struct lsl_arena_block *b, *next;
+  if(arena == NULL) return;
+  for(b = arena->blocks; b != NULL; b = next) {
+    next = b->next; free(b);
+  }
+  free(arena);
+}
+
+lsl_arena *lsl_arena_set(lsl_arena *arena) {
+  lsl_arena *old = cur_arena;
+  cur_arena = arena; return old;
+}
+
+void *lsl_alloc(size_t len) {
+  lsl_arena *arena = cur_arena;
+  struct lsl_arena_block *b;
+  void *p;
+  assert(arena != NULL);
+  len = (len + LSL_ARENA_ALIGN - 1) & ~(size_t)(LSL_ARENA_ALIGN - 1);
+  b = arena->blocks;
+  if(b == NULL || b->size - b->used < len) {
+    size_t size = len > LSL_ARENA_BLOCK ? len : LSL_ARENA_BLOCK;
+    b = malloc(LSL_ARENA_HDR + size);
+    if(b == NULL) abort();
+    b->size = size; b->used = 0;
+    b->next = arena->blocks; arena->blocks = b;
+  }
+  p = (char*)b + LSL_ARENA_HDR + b->used;
+  b->used += len;
+  return p;
+}
+
+char *lsl_strdup(const char *s) {
+  size_t len = strlen(s) + 1;
+  char *ret = lsl_alloc(len);
+  memcpy(ret, s, len); return ret;
 }
 
@@ -23,14 +23,19 @@
 #include "cajeput_core.h" // for sim_get_heightfield
 #include "cajeput_world.h"
 #include "cajeput_prim.h"
+#include "caj_logging.h"
 #include <btBulletDynamicsCommon.h>
 #include <BulletCollision/CollisionShapes/btHeightfieldTerrainShape.h>
+#include <BulletCollision/CollisionDispatch/btSimulationIslandManager.h>
 #include <stdio.h> /* for debugging */
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <set>
 #include <vector>
 #include <deque>
 #include <map>
+#include <algorithm>
 
 #define GRAVITY 9.8
 
@@ -38,11 +43,27 @@ struct phys_obj;
 
 typedef std::vector<caj_phys_collision> collisions_info;
 
+#define PHYS_QUERY_RAY 0
+#define PHYS_QUERY_SWEEP 1
+#define PHYS_QUERY_OVERLAP 2
+
+// don't let a flood of queries hold up stepping the region too much
+#define PHYS_MAX_QUERIES_PER_STEP 64
+
+struct phys_query {
+  int type; // PHYS_QUERY_*
+  btVector3 start, end; // physics coordinates, i.e. Y and Z swapped
+  btScalar radius;
+  int reject, max_hits;
+  caj_phys_query_cb cb;
+  void *cb_priv;
+  std::vector<caj_phys_hit> hits;
+};
+
 struct physics_ctx {
   simulator_ctx *sim;
 
   GStaticMutex mutex;
-  GThread *thread;
 
   btDefaultCollisionConfiguration* collisionConfiguration;
   btCollisionDispatcher* dispatcher;
@@ -51,6 +72,8 @@ struct physics_ctx {
   btDiscreteDynamicsWorld* dynamicsWorld;
 
   btCollisionShape* ground_shape;
+  btRigidBody* ground_body;
+  float *heightfield; // our own copy, physics thread only
   btStaticPlaneShape *plane_0x;
   btStaticPlaneShape *plane_1x;
   btStaticPlaneShape *plane_0y;
@@ -61,10 +84,273 @@ struct physics_ctx {
   std::set<phys_obj*> changed;
   int shutdown;
   std::deque<collisions_info*> collision_upds;
+  float *terrain_upd; // only the patches in terrain_dirty are valid
+  uint16_t terrain_dirty[16];
+  std::deque<phys_query*> queries; // waiting to be run
+  std::deque<phys_query*> query_results; // waiting for the main thread
+
+  // protected by the pool mutex
+  struct physics_pool *pool;
+  int sched_state; // PHYS_SCHED_*
+  double deadline; // when the next step is due, pool time
+  std::multimap<double, physics_ctx*>::iterator sched_iter;
+  caj_phys_stats stats;
+};
+
+#define PHYS_STEP_TIME (1.0/60.0)
+
+// The ground shape's height range. Bullet can't change it without 
+// recreating the shape, and anything outside it falls outside the ground's
+// AABB in the broadphase, so our copy of the heightfield is clamped to it.
+// FIXME - this limits max terrain height to 100 metres
+#define TERRAIN_MIN_HEIGHT 0.0f
+#define TERRAIN_MAX_HEIGHT 100.0f
+
+static inline float clamp_terrain_height(float h) {
+  if(h < TERRAIN_MIN_HEIGHT) return TERRAIN_MIN_HEIGHT;
+  if(h > TERRAIN_MAX_HEIGHT) return TERRAIN_MAX_HEIGHT;
+  return h;
+}
+
+#define PHYS_SCHED_IDLE 0 /* asleep, not queued */
+#define PHYS_SCHED_QUEUED 1
+#define PHYS_SCHED_RUNNING 2
+
+// Rather than each region having its own physics thread, all the regions in
+// the process share one pool of worker threads (by default, one per core).
+// A region that has something to do is queued by the time its next step
+// is due, and the workers always take the one with the earliest deadline.
+// Regions where nothing is moving drop out of the queue entirely until
+// something changes.
+struct physics_pool {
+  GMutex *mutex;
+  GCond *cond; // work queued, or a region finished its step
+  GTimer *timer;
+  std::vector<GThread*> threads;
+  std::multimap<double, physics_ctx*> queue; // keyed by deadline
+  GThreadPool *solver_pool; // NULL unless parallel_solver is enabled
+  int solver_threads;
+  int num_regions;
+  int shutdown;
+};
+
+static struct physics_pool *phys_pool = NULL; // main thread only
+
+// ------------- OPTIONAL PARALLEL ISLAND SOLVER ------------------
+
+// Islands of touching objects are independent of each other as far as the
+// constraint solver is concerned, so for regions with lots of physical
+// objects we can hand them out to several threads, each with its own
+// solver instance. This is opt-in ([physics] parallel_solver = true).
+// Note that the narrowphase still runs single-threaded; the dispatcher's
+// pool allocators aren't thread-safe.
+
+// below this many contact manifolds + constraints, it isn't worth it
+#define PARALLEL_SOLVE_MIN_COST 32
+
+struct solver_island {
+  int first_body, num_bodies;
+  int first_manifold, num_manifolds;
+  int first_constraint, num_constraints;
+};
+
+struct caj_parallel_world;
+
+struct solver_batch_task {
+  caj_parallel_world *world;
+  int batch;
+};
+
+static void solver_batch_func(gpointer data, gpointer user_data);
+
+static int constraint_island_id(const btTypedConstraint* c) {
+  const btCollisionObject& a = c->getRigidBodyA();
+  const btCollisionObject& b = c->getRigidBodyB();
+  return a.getIslandTag() >= 0 ? a.getIslandTag() : b.getIslandTag();
+}
+
+static bool constraint_island_less(const btTypedConstraint* lhs, 
+				   const btTypedConstraint* rhs) {
+  return constraint_island_id(lhs) < constraint_island_id(rhs);
+}
+
+struct caj_parallel_world : public btDiscreteDynamicsWorld {
+  GThreadPool *thread_pool; // shared, not ours
+  int num_batches;
+  std::vector<btSequentialImpulseConstraintSolver*> solvers; // one per batch
+  std::vector<solver_batch_task> tasks;
+
+  // per-step scratch space
+  btAlignedObjectArray<btCollisionObject*> bodies;
+  btAlignedObjectArray<btPersistentManifold*> manifolds;
+  btAlignedObjectArray<btTypedConstraint*> constraints;
+  std::vector<btTypedConstraint*> sorted_constraints;
+  std::vector<solver_island> islands;
+  std::vector<std::vector<int> > batches;
+  btContactSolverInfo *cur_info;
+
+  GMutex *done_mutex;
+  GCond *done_cond;
+  int pending; // batches still being solved, protected by done_mutex
+
+  caj_parallel_world(btDispatcher* dispatcher, 
+		     btBroadphaseInterface* pair_cache,
+		     btSequentialImpulseConstraintSolver* solver,
+		     btCollisionConfiguration* config,
+		     GThreadPool *thread_pool, int num_batches) :
+    btDiscreteDynamicsWorld(dispatcher, pair_cache, solver, config),
+    thread_pool(thread_pool), num_batches(num_batches) {
+    solvers.push_back(solver);
+    for(int i = 1; i < num_batches; i++) 
+      solvers.push_back(new btSequentialImpulseConstraintSolver());
+    tasks.resize(num_batches); batches.resize(num_batches);
+    for(int i = 0; i < num_batches; i++) {
+      tasks[i].world = this; tasks[i].batch = i;
+    }
+    done_mutex = g_mutex_new(); done_cond = g_cond_new();
+    pending = 0;
+  }
+
+  virtual ~caj_parallel_world() {
+    // solvers[0] belongs to the caller, like it would normally.
+    for(int i = 1; i < num_batches; i++) delete solvers[i];
+    g_cond_free(done_cond); g_mutex_free(done_mutex);
+  }
+
+  struct island_collector : public btSimulationIslandManager::IslandCallback {
+    caj_parallel_world *world;
+    size_t next_constraint; // into sorted_constraints
+
+    virtual void ProcessIsland(btCollisionObject** island_bodies, 
+			       int num_bodies, 
+			       btPersistentManifold** island_manifolds,
+			       int num_manifolds, int island_id) {
+      solver_island island;
+      std::vector<btTypedConstraint*> &sorted = world->sorted_constraints;
+      island.first_constraint = world->constraints.size();
+      if(island_id < 0) {
+	// if islands aren't split, everything's in island -1
+	for(size_t i = 0; i < sorted.size(); i++) 
+	  world->constraints.push_back(sorted[i]);
+      } else {
+	// islands come in ascending order, so this island's constraints are
+	// the next run in sorted_constraints. Skip those of sleeping islands.
+	while(next_constraint < sorted.size() && 
+	      constraint_island_id(sorted[next_constraint]) < island_id)
+	  next_constraint++;
+	while(next_constraint < sorted.size() && 
+	      constraint_island_id(sorted[next_constraint]) == island_id)
+	  world->constraints.push_back(sorted[next_constraint++]);
+      }
+      island.num_constraints = world->constraints.size() - 
+	island.first_constraint;
+      if(num_manifolds + island.num_constraints == 0) return;
+
+      island.first_body = world->bodies.size(); 
+      island.num_bodies = num_bodies;
+      for(int i = 0; i < num_bodies; i++) 
+	world->bodies.push_back(island_bodies[i]);
+      island.first_manifold = world->manifolds.size(); 
+      island.num_manifolds = num_manifolds;
+      for(int i = 0; i < num_manifolds; i++) 
+	world->manifolds.push_back(island_manifolds[i]);
+      world->islands.push_back(island);
+    }
+  };
+
+  void solve_island(btSequentialImpulseConstraintSolver *solver, 
+		    const solver_island &island) {
+    solver->solveGroup(island.num_bodies ? &bodies[island.first_body] : NULL,
+		       island.num_bodies, 
+		       island.num_manifolds ? 
+		         &manifolds[island.first_manifold] : NULL,
+		       island.num_manifolds,
+		       island.num_constraints ? 
+		         &constraints[island.first_constraint] : NULL,
+		       island.num_constraints, *cur_info, NULL,
+		       m_stackAlloc, m_dispatcher1);
+  }
+
+  void solve_batch(int batch) {
+    for(std::vector<int>::iterator iter = batches[batch].begin(); 
+	iter != batches[batch].end(); iter++) {
+      solve_island(solvers[batch], islands[*iter]);
+    }
+  }
+
+  virtual void solveConstraints(btContactSolverInfo& solver_info) {
+    cur_info = &solver_info;
+    bodies.resize(0); manifolds.resize(0); constraints.resize(0);
+    islands.clear();
+    sorted_constraints.resize(getNumConstraints());
+    for(int i = 0; i < getNumConstraints(); i++) 
+      sorted_constraints[i] = getConstraint(i);
+    std::stable_sort(sorted_constraints.begin(), sorted_constraints.end(),
+		     constraint_island_less);
+
+    island_collector collector; collector.world = this;
+    collector.next_constraint = 0;
+    getSimulationIslandManager()->buildAndProcessIslands(getDispatcher(), 
+							 this, &collector);
+    
+    int total_cost = manifolds.size() + constraints.size();
+    if(islands.size() < 2 || total_cost < PARALLEL_SOLVE_MIN_COST) {
+      for(std::vector<solver_island>::iterator iter = islands.begin(); 
+	  iter != islands.end(); iter++) {
+	solve_island(solvers[0], *iter);
+      }
+      return;
+    }
+
+    // biggest islands first, each to whichever batch has least work so far
+    std::vector<std::pair<int,int> > by_cost; // (-cost, island)
+    for(size_t i = 0; i < islands.size(); i++) {
+      by_cost.push_back(std::pair<int,int>(-(islands[i].num_manifolds + 
+					     islands[i].num_constraints), i));
+    }
+    std::sort(by_cost.begin(), by_cost.end());
+    std::vector<int> batch_cost(num_batches, 0);
+    for(int i = 0; i < num_batches; i++) batches[i].clear();
+    for(std::vector<std::pair<int,int> >::iterator iter = by_cost.begin(); 
+	iter != by_cost.end(); iter++) {
+      int best = 0;
+      for(int i = 1; i < num_batches; i++) 
+	if(batch_cost[i] < batch_cost[best]) best = i;
+      batches[best].push_back(iter->second);
+      batch_cost[best] -= iter->first;
+    }
+
+    // we do batch 0 ourselves
+    g_mutex_lock(done_mutex);
+    pending = 0;
+    for(int i = 1; i < num_batches; i++) {
+      if(batches[i].empty()) continue;
+      pending++;
+      g_thread_pool_push(thread_pool, &tasks[i], NULL);
+    }
+    g_mutex_unlock(done_mutex);
+
+    solve_batch(0);
+
+    g_mutex_lock(done_mutex);
+    while(pending > 0) g_cond_wait(done_cond, done_mutex);
+    g_mutex_unlock(done_mutex);
+  }
 };
 
+static void solver_batch_func(gpointer data, gpointer user_data) {
+  solver_batch_task *task = (solver_batch_task*)data;
+  caj_parallel_world *world = task->world;
+  world->solve_batch(task->batch);
+
+  g_mutex_lock(world->done_mutex);
+  if(--world->pending == 0) g_cond_signal(world->done_cond);
+  g_mutex_unlock(world->done_mutex);
+}
+
 struct part_map {
   int num_parts;
+  float *masses; // points into the same allocation, after parts
   uint32_t parts[1];
 };
 
@@ -97,6 +383,33 @@ struct phys_obj {
 
 static gboolean phys_update_in_mt(gpointer priv);
 
+// call with pool mutex held
+static void schedule_region_locked(struct physics_pool *pool, 
+				   struct physics_ctx *phys, double deadline) {
+  phys->deadline = deadline;
+  phys->sched_state = PHYS_SCHED_QUEUED;
+  phys->sched_iter = pool->queue.insert(std::pair<double,physics_ctx*>(deadline,
+									phys));
+  g_cond_broadcast(pool->cond);
+}
+
+// call with phys->mutex held
+static void wake_region_locked(struct physics_ctx *phys) {
+  struct physics_pool *pool = phys->pool;
+  g_mutex_lock(pool->mutex);
+  if(phys->sched_state == PHYS_SCHED_IDLE && !phys->shutdown) {
+    schedule_region_locked(pool, phys, g_timer_elapsed(pool->timer, NULL));
+  }
+  g_mutex_unlock(pool->mutex);
+}
+
+// call with phys->mutex held
+static void mark_changed_locked(struct physics_ctx *phys, 
+				struct phys_obj *physobj) {
+  phys->changed.insert(physobj);
+  wake_region_locked(phys);
+}
+
 // internal to this module
 #define PHYS_TYPE_PHANTOM 0
 #define PHYS_TYPE_NORMAL 1 /* collided with, but not physical */
@@ -315,27 +628,81 @@ static btCollisionShape* shape_from_obj(struct world_obj *obj) {
   return compound;
 }
 
+static part_map* alloc_part_map(int num_parts) {
+  part_map *parts = (part_map*)malloc(offsetof(part_map, parts)+
+				      (sizeof(uint32_t)+sizeof(float))*num_parts);
+  parts->num_parts = num_parts;
+  parts->masses = (float*)(parts->parts + num_parts);
+  return parts;
+}
+
+// Also works out the mass of each part, since we can't look at the prims
+// from the physics thread.
 static part_map* make_part_map(struct world_obj *obj) {
   if(obj->type == OBJ_TYPE_PRIM) {
     primitive_obj *prim = (primitive_obj*)obj;
-    part_map *parts = (part_map*)malloc(offsetof(part_map, parts)+
-					sizeof(uint32_t)*(prim->num_children+1));
-    parts->num_parts = prim->num_children+1;
+    part_map *parts = alloc_part_map(prim->num_children+1);
     parts->parts[0] = prim->ob.local_id;
+    parts->masses[0] = world_prim_mass(prim);
     for(int i = 0; i < prim->num_children; i++) {
       parts->parts[i+1] = prim->children[i]->ob.local_id;
+      parts->masses[i+1] = world_prim_mass(prim->children[i]);
     }
     return parts;
   } else if(obj->type == OBJ_TYPE_AVATAR) {
-    part_map *parts = (part_map*)malloc(offsetof(part_map, parts)+
-					sizeof(uint32_t));
-    parts->num_parts = 1; parts->parts[0] = obj->local_id;
+    part_map *parts = alloc_part_map(1);
+    parts->parts[0] = obj->local_id;
+    parts->masses[0] = WORLD_AVATAR_MASS;
     return parts;
   } else {
     return NULL;
   }
 }
 
+// Works out the total mass and the inertia about the root prim's origin.
+// For linksets, this is each part's own inertia rotated into the root's 
+// frame plus the parallel axis term for its offset; btCompoundShape's own
+// calculateLocalInertia just uses the bounding box. (We don't shift the 
+// centre of mass, though, so off-centre linksets will still be a bit off.)
+static btScalar calc_mass_props(struct phys_obj *physobj, 
+				btVector3 &inertia) {
+  if(physobj->phystype != PHYS_TYPE_PHYSICAL) {
+    inertia.setValue(0,0,0); return 0.0f;
+  }
+
+  part_map *parts = physobj->parts;
+  btCompoundShape *compound = NULL;
+  if(parts->num_parts > 1)
+    compound = dynamic_cast<btCompoundShape*>(physobj->shape);
+  if(compound == NULL) {
+    btScalar mass = parts->masses[0];
+    physobj->shape->calculateLocalInertia(mass, inertia);
+    return mass;
+  }
+
+  btScalar mass = 0.0f; 
+  inertia.setValue(0,0,0);
+  assert(compound->getNumChildShapes() == parts->num_parts);
+  for(int i = 0; i < parts->num_parts; i++) {
+    btScalar part_mass = parts->masses[i];
+    btVector3 part_inertia;
+    compound->getChildShape(i)->calculateLocalInertia(part_mass, part_inertia);
+
+    const btTransform &trans = compound->getChildTransform(i);
+    const btMatrix3x3 &basis = trans.getBasis();
+    const btVector3 &off = trans.getOrigin();
+    for(int j = 0; j < 3; j++) {
+      btScalar val = 0.0f;
+      for(int k = 0; k < 3; k++) 
+	val += basis[j][k] * basis[j][k] * part_inertia[k];
+      val += part_mass * (off.length2() - off[j]*off[j]);
+      inertia[j] += val;
+    }
+    mass += part_mass;
+  }
+  return mass;
+}
+
 static int compute_phys_type(struct world_obj *obj) {
   if(obj->type == OBJ_TYPE_AVATAR) {
     return PHYS_TYPE_PHYSICAL;
@@ -388,7 +755,7 @@ static void add_object(struct simulator_ctx *sim, void *priv,
     g_static_mutex_lock(&phys->mutex);
     if(phys_type == PHYS_TYPE_PHYSICAL)
       phys->physical.insert(physobj);
-    phys->changed.insert(physobj);
+    mark_changed_locked(phys, physobj);
     g_static_mutex_unlock(&phys->mutex);
   } else {
     obj->phys = NULL;
@@ -410,7 +777,7 @@ static void upd_child_pos(struct simulator_ctx *sim, physics_ctx *phys,
 				     child->rot.w).inverse());
       g_static_mutex_lock(&phys->mutex);
       physobj->child_pos_upd[i+1] = trans;
-      phys->changed.insert(physobj);
+      mark_changed_locked(phys, physobj);
       g_static_mutex_unlock(&phys->mutex);
       return;
     }
@@ -428,7 +795,7 @@ static void upd_object_pos(struct simulator_ctx *sim, void *priv,
     physobj->rot = btQuaternion(obj->rot.x,obj->rot.z,obj->rot.y,obj->rot.w);
     printf("DEBUG: object rotation <%f,%f,%f,%f>\n",obj->rot.x,obj->rot.y,obj->rot.z,obj->rot.w);
     physobj->pos_update = 1;
-    phys->changed.insert(physobj);
+    mark_changed_locked(phys, physobj);
     g_static_mutex_unlock(&phys->mutex);
   } else if(obj->parent != NULL && obj->parent->type == OBJ_TYPE_PRIM) {
     upd_child_pos(sim, phys, (primitive_obj*)obj->parent, obj);
@@ -454,7 +821,7 @@ static void del_object(struct simulator_ctx *sim, void *priv,
     struct phys_obj *physobj = (struct phys_obj *)obj->phys;
     g_static_mutex_lock(&phys->mutex);
     physobj->is_deleted = 1; physobj->obj = NULL;
-    phys->changed.insert(physobj);
+    mark_changed_locked(phys, physobj);
     if(physobj->newshape != NULL) {
       free_shape(physobj->newshape); physobj->newshape = NULL;
       free(physobj->newparts);
@@ -493,7 +860,7 @@ static void upd_object_full(struct simulator_ctx *sim, physics_ctx *phys,
       physobj->rot = btQuaternion(obj->rot.x,obj->rot.z,obj->rot.y,obj->rot.w);
       physobj->child_pos_upd.clear();
       physobj->pos_update = 0; physobj->phystype = phys_type;
-      phys->changed.insert(physobj);
+      mark_changed_locked(phys, physobj);
 
       // FIXME - should really only do this if phys_type has changed...
       if(phys_type == PHYS_TYPE_PHYSICAL)
@@ -521,7 +888,7 @@ static void upd_object(struct simulator_ctx *sim, void *priv,
     del_object(sim, phys, obj);
   } else if((update_flags & (CAJ_OBJUPD_SHAPE|CAJ_OBJUPD_SCALE|
 			     CAJ_OBJUPD_CREATED|CAJ_OBJUPD_CHILDREN|
-			     CAJ_OBJUPD_PARENT)) || 
+			     CAJ_OBJUPD_PARENT|CAJ_OBJUPD_MATERIAL)) || 
      new_phys_type != phys_type) {
     upd_object_full(sim, phys, obj, new_phys_type);
   } else if(update_flags & CAJ_OBJUPD_POSROT) {
@@ -553,7 +920,7 @@ static void apply_impulse(struct simulator_ctx *sim, void *priv,
   // FIXME - handle impulses in local reference frame
   g_static_mutex_lock(&phys->mutex);
   physobj->impulse += btVector3(impulse.x, impulse.z, impulse.y);
-  phys->changed.insert(physobj);
+  mark_changed_locked(phys, physobj);
   g_static_mutex_unlock(&phys->mutex);
 }
 
@@ -568,6 +935,7 @@ static void set_target_velocity(struct simulator_ctx *sim, void *priv,
   g_static_mutex_lock(&phys->mutex);
   physobj->target_velocity = btVector3(velocity.x, velocity.z, velocity.y);
   // phys->changed.insert(physobj); // not needed, I think.
+  wake_region_locked(phys);
   g_static_mutex_unlock(&phys->mutex);
 }
 
@@ -584,14 +952,95 @@ static void set_avatar_flying(struct simulator_ctx *sim, void *priv,
     g_static_mutex_lock(&phys->mutex); // is_flying only changed from main thread
     physobj->is_flying = is_flying;
     physobj->flying_changed = 1;
-    phys->changed.insert(physobj);
+    mark_changed_locked(phys, physobj);
     g_static_mutex_unlock(&phys->mutex);    
   }
 }
 
+// called from main thread. We only copy the dirty patches here; the actual
+// heightfield the physics thread uses is updated between steps.
+static void upd_terrain(struct simulator_ctx *sim, void *priv, 
+			const uint16_t *dirty) {
+  struct physics_ctx *phys = (struct physics_ctx*)priv;
+  float *heightfield = sim_get_heightfield(sim);
+
+  g_static_mutex_lock(&phys->mutex);
+  for(int py = 0; py < 16; py++) {
+    if(dirty[py] == 0) continue;
+    for(int px = 0; px < 16; px++) {
+      if(!(dirty[py] & (1<<px))) continue;
+      for(int y = py*16; y < py*16+16; y++) {
+	memcpy(phys->terrain_upd + y*WORLD_REGION_SIZE + px*16,
+	       heightfield + y*WORLD_REGION_SIZE + px*16, 16*sizeof(float));
+      }
+    }
+    phys->terrain_dirty[py] |= dirty[py];
+  }
+  wake_region_locked(phys);
+  g_static_mutex_unlock(&phys->mutex);
+}
+
+// Throws away the cached ground contacts of anything near an edited patch,
+// so the next step regenerates them against the new heights, and wakes it 
+// up in case the ground's dropped out from underneath it.
+struct terrain_refresh_callback : public btBroadphaseAabbCallback {
+  struct physics_ctx *phys;
+
+  terrain_refresh_callback(struct physics_ctx *phys) : phys(phys) { }
+
+  virtual bool process(const btBroadphaseProxy* proxy) {
+    btCollisionObject *obj = (btCollisionObject*)proxy->m_clientObject;
+    if(obj == phys->ground_body) return true;
+
+    btOverlappingPairCache *pairs = 
+      phys->overlappingPairCache->getOverlappingPairCache();
+    btBroadphasePair *pair = 
+      pairs->findPair(phys->ground_body->getBroadphaseHandle(), 
+		      (btBroadphaseProxy*)proxy);
+    if(pair != NULL) pairs->cleanOverlappingPair(*pair, phys->dispatcher);
+    obj->activate();
+    return true;
+  }
+};
+
+// runs on physics thread
+static void do_terrain_updates_locked(struct physics_ctx *phys) {
+  terrain_refresh_callback refresh(phys);
+
+  for(int py = 0; py < 16; py++) {
+    if(phys->terrain_dirty[py] == 0) continue;
+    for(int px = 0; px < 16; px++) {
+      if(!(phys->terrain_dirty[py] & (1<<px))) continue;
+
+      // we need both the old and new heights here, since objects resting on
+      // ground that's been lowered need waking up too.
+      float min_height = 1e10f, max_height = -1e10f;
+      for(int y = py*16; y < py*16+16; y++) {
+	for(int x = px*16; x < px*16+16; x++) {
+	  int i = y*WORLD_REGION_SIZE + x;
+	  float old_h = phys->heightfield[i];
+	  float new_h = clamp_terrain_height(phys->terrain_upd[i]);
+	  if(old_h < min_height) min_height = old_h;
+	  if(new_h < min_height) min_height = new_h;
+	  if(old_h > max_height) max_height = old_h;
+	  if(new_h > max_height) max_height = new_h;
+	  phys->heightfield[i] = new_h;
+	}
+      }
+
+      // the triangles along the lower edges of the patch are shared with
+      // the neighbouring ones, hence the extra metre of slop.
+      btVector3 aabb_min(px*16 - 1.0f, min_height - 1.0f, py*16 - 1.0f);
+      btVector3 aabb_max(px*16 + 17.0f, max_height + 1.0f, py*16 + 17.0f);
+      phys->overlappingPairCache->aabbTest(aabb_min, aabb_max, refresh);
+    }
+    phys->terrain_dirty[py] = 0;
+  }
+}
 
 // runs on physics thread
 static void do_phys_updates_locked(struct physics_ctx *phys) {
+  do_terrain_updates_locked(phys);
 
   for(std::set<phys_obj*>::iterator iter = phys->changed.begin(); 
       iter != phys->changed.end(); iter++) {
@@ -628,12 +1077,8 @@ static void do_phys_updates_locked(struct physics_ctx *phys) {
 	physobj->parts = physobj->newparts; physobj->newparts = NULL;
       }
 
-      btScalar mass;
-      if(physobj->phystype != PHYS_TYPE_PHYSICAL) 
-	mass = 0.0f;
-      else if(physobj->objtype == OBJ_TYPE_AVATAR)
-	mass = 50.0f;
-      else mass = 10.0f; // FIXME - dynamic mass?
+      btVector3 local_inertia;
+      btScalar mass = calc_mass_props(physobj, local_inertia);
 	
       btTransform transform;
       transform.setIdentity();
@@ -642,8 +1087,6 @@ static void do_phys_updates_locked(struct physics_ctx *phys) {
       transform.setOrigin(physobj->pos);
 
       btDefaultMotionState* motion = new btDefaultMotionState(transform);
-      btVector3 local_inertia(0,0,0);
-      physobj->shape->calculateLocalInertia(mass, local_inertia);
       btRigidBody::btRigidBodyConstructionInfo body_info(mass, motion, 
 							 physobj->shape,
 							 local_inertia);
@@ -692,16 +1135,8 @@ static void do_phys_updates_locked(struct physics_ctx *phys) {
 	shape->updateChildTransform(iter->first, iter->second);
       }
 
-      // FIXME - code duplication!
-      btScalar mass;
-      if(physobj->phystype != PHYS_TYPE_PHYSICAL) 
-	mass = 0.0f;
-      else if(physobj->objtype == OBJ_TYPE_AVATAR)
-	mass = 50.0f;
-      else mass = 10.0f; // FIXME - dynamic mass?
-  
       btVector3 inertia;
-      shape->calculateLocalInertia(mass,inertia);
+      btScalar mass = calc_mass_props(physobj, inertia);
       physobj->body->setMassProps(mass,inertia);
       physobj->body->updateInertiaTensor();
 
@@ -865,80 +1300,462 @@ void tick_callback(btDynamicsWorld *world, btScalar timeStep) {
 
 }
 
-// main physics thread
-// TODO - we should suspend processing totally when nothing's happening
-// (and also avoid unnecesary processing on stationary objects, if possible).
-static gpointer physics_thread(gpointer data) {
-  struct physics_ctx *phys = (struct physics_ctx*)data;
-  GTimer *timer = g_timer_new();
-  double next_step = 0.0;
-  for(;;) {
-    g_static_mutex_lock(&phys->mutex);
+// ------------- PHYSICS QUERIES ---------------------
 
-    do_phys_updates_locked(phys);
+// Works out whether a query should see a given collision object and if so,
+// what local ID to report. part is the child shape index, or -1.
+static int query_want_hit(struct physics_ctx *phys, phys_query *query,
+			  const btCollisionObject *obj, int part,
+			  uint32_t *local_id) {
+  if(obj == phys->ground_body) {
+    *local_id = 0;
+    return !(query->reject & CAJ_PHYS_REJECT_LAND);
+  }
+  phys_obj *physobj = (phys_obj*)obj->getUserPointer();
+  if(physobj == NULL || physobj->parts == NULL) return FALSE; // sim borders
+  if(physobj->objtype == OBJ_TYPE_AVATAR) {
+    if(query->reject & CAJ_PHYS_REJECT_AGENTS) return FALSE;
+  } else {
+    // phystype can be changed by the main thread under us, but the 
+    // broadphase group is only touched by the physics thread.
+    int is_phys = obj->getBroadphaseHandle()->m_collisionFilterGroup 
+      == COL_PHYS_PRIM;
+    if(query->reject & (is_phys ? CAJ_PHYS_REJECT_PHYSICAL :
+			CAJ_PHYS_REJECT_NONPHYSICAL)) return FALSE;
+  }
+  if(part >= 0 && part < physobj->parts->num_parts) 
+    *local_id = get_collider_id(physobj, part);
+  else *local_id = physobj->parts->parts[0];
+  return TRUE;
+}
 
-    for(std::set<phys_obj*>::iterator iter = phys->physical.begin(); 
-	iter != phys->physical.end(); iter++) {
-      struct phys_obj *physobj = *iter;
-      btTransform trans;
-      physobj->body->getMotionState()->getWorldTransform(trans);
-      physobj->pos = trans.getOrigin();
-      physobj->rot = trans.getRotation().inverse();
-      physobj->velocity = physobj->body->getLinearVelocity();
-      if(physobj->objtype == OBJ_TYPE_AVATAR) {
-	physobj->footfall.x = physobj->footfall_tmp.getX();
-	physobj->footfall.y = physobj->footfall_tmp.getZ();
-	physobj->footfall.z = physobj->footfall_tmp.getY();
-	physobj->footfall.w = physobj->footfall_tmp.getW();
-      }
+static void add_query_hit(phys_query *query, uint32_t local_id, 
+			  const btVector3 &pos, const btVector3 &normal,
+			  btScalar fraction) {
+  caj_phys_hit hit;
+  hit.local_id = local_id;
+  hit.pos.x = pos.getX(); hit.pos.y = pos.getZ(); hit.pos.z = pos.getY();
+  btVector3 norm = normal.length2() > 0.0f ? normal.normalized() : normal;
+  hit.normal.x = norm.getX(); hit.normal.y = norm.getZ(); 
+  hit.normal.z = norm.getY();
+  hit.fraction = fraction;
+  query->hits.push_back(hit);
+}
+
+// compound shapes pass the child index as the triangle index
+static int query_part_id(btCollisionWorld::LocalShapeInfo *info) {
+  if(info == NULL || info->m_shapePart != -1) return -1;
+  return info->m_triangleIndex;
+}
+
+// These all collect every hit rather than just the nearest, since we 
+// may need to skip some and the caller might want more than one anyway.
+struct query_ray_callback : public btCollisionWorld::RayResultCallback {
+  struct physics_ctx *phys;
+  phys_query *query;
+
+  query_ray_callback(struct physics_ctx *phys, phys_query *query) :
+    phys(phys), query(query) {
+    m_collisionFilterGroup = m_collisionFilterMask = -1;
+  }
+
+  virtual btScalar addSingleResult(btCollisionWorld::LocalRayResult& res,
+				   bool normalInWorldSpace) {
+    uint32_t local_id;
+    if(!query_want_hit(phys, query, res.m_collisionObject,
+		       query_part_id(res.m_localShapeInfo), &local_id))
+      return m_closestHitFraction;
+    btVector3 normal = res.m_hitNormalLocal;
+    if(!normalInWorldSpace)
+      normal = res.m_collisionObject->getWorldTransform().getBasis()*normal;
+    btVector3 pos; pos.setInterpolate3(query->start, query->end,
+				       res.m_hitFraction);
+    add_query_hit(query, local_id, pos, normal, res.m_hitFraction);
+    m_collisionObject = res.m_collisionObject;
+    return m_closestHitFraction;
+  }
+};
+
+struct query_sweep_callback : public btCollisionWorld::ConvexResultCallback {
+  struct physics_ctx *phys;
+  phys_query *query;
+
+  query_sweep_callback(struct physics_ctx *phys, phys_query *query) :
+    phys(phys), query(query) {
+    m_collisionFilterGroup = m_collisionFilterMask = -1;
+  }
+
+  virtual btScalar addSingleResult(btCollisionWorld::LocalConvexResult& res,
+				   bool normalInWorldSpace) {
+    uint32_t local_id;
+    if(!query_want_hit(phys, query, res.m_hitCollisionObject,
+		       query_part_id(res.m_localShapeInfo), &local_id))
+      return m_closestHitFraction;
+    btVector3 normal = res.m_hitNormalLocal;
+    if(!normalInWorldSpace)
+      normal = res.m_hitCollisionObject->getWorldTransform().getBasis()*normal;
+    add_query_hit(query, local_id, res.m_hitPointLocal, normal, 
+		  res.m_hitFraction);
+    return m_closestHitFraction;
+  }
+};
+
+struct query_overlap_callback : public btCollisionWorld::ContactResultCallback {
+  struct physics_ctx *phys;
+  phys_query *query;
+  std::set<uint32_t> seen;
+
+  query_overlap_callback(struct physics_ctx *phys, phys_query *query) :
+    phys(phys), query(query) {
+    m_collisionFilterGroup = m_collisionFilterMask = -1;
+  }
+
+  virtual btScalar addSingleResult(btManifoldPoint& pt,
+				   const btCollisionObject* obj0, 
+				   int part0, int index0,
+				   const btCollisionObject* obj1,
+				   int part1, int index1) {
+    uint32_t local_id;
+    if(pt.getDistance() > 0.0f) return 0;
+    if(!query_want_hit(phys, query, obj1, part1 == -1 ? index1 : -1, 
+		       &local_id))
+      return 0;
+    if(!seen.insert(local_id).second) return 0;
+    add_query_hit(query, local_id, pt.getPositionWorldOnB(), 
+		  pt.m_normalWorldOnB, 0.0f);
+    return 0;
+  }
+};
+
+static bool query_hit_less(const caj_phys_hit &h1, const caj_phys_hit &h2) {
+  return h1.fraction < h2.fraction;
+}
+
+static void run_query(struct physics_ctx *phys, phys_query *query) {
+  btTransform from, to;
+  from.setIdentity(); to.setIdentity();
+  from.setOrigin(query->start); to.setOrigin(query->end);
+
+  switch(query->type) {
+  case PHYS_QUERY_RAY:
+    {
+      query_ray_callback cb(phys, query);
+      phys->dynamicsWorld->rayTest(query->start, query->end, cb);
+      break;
     }
+  case PHYS_QUERY_SWEEP:
+    {
+      btSphereShape sphere(query->radius);
+      query_sweep_callback cb(phys, query);
+      phys->dynamicsWorld->convexSweepTest(&sphere, from, to, cb);
+      break;
+    }
+  case PHYS_QUERY_OVERLAP:
+    {
+      btSphereShape sphere(query->radius);
+      btCollisionObject obj;
+      obj.setCollisionShape(&sphere);
+      obj.setWorldTransform(from);
+      query_overlap_callback cb(phys, query);
+      phys->dynamicsWorld->contactTest(&obj, cb);
+      break;
+    }
+  default:
+    assert(0);
+  }
 
-    g_static_mutex_unlock(&phys->mutex);
+  std::stable_sort(query->hits.begin(), query->hits.end(), query_hit_less);
+  if(query->max_hits > 0 && (int)query->hits.size() > query->max_hits)
+    query->hits.resize(query->max_hits);
+}
+
+// Runs queued queries between steps. The world isn't being modified at this
+// point, and only the worker stepping this region ever touches it.
+static void run_queries(struct physics_ctx *phys) {
+  std::vector<phys_query*> batch;
+  g_static_mutex_lock(&phys->mutex);
+  while(!phys->queries.empty() && batch.size() < PHYS_MAX_QUERIES_PER_STEP) {
+    batch.push_back(phys->queries.front());
+    phys->queries.pop_front();
+  }
+  g_static_mutex_unlock(&phys->mutex);
+  if(batch.empty()) return;
+
+  for(std::vector<phys_query*>::iterator iter = batch.begin();
+      iter != batch.end(); iter++) {
+    run_query(phys, *iter);
+  }
+
+  g_static_mutex_lock(&phys->mutex);
+  phys->query_results.insert(phys->query_results.end(), 
+			     batch.begin(), batch.end());
+  g_static_mutex_unlock(&phys->mutex);
+}
+
+// main thread only
+static void queue_query(struct physics_ctx *phys, phys_query *query) {
+  g_static_mutex_lock(&phys->mutex);
+  phys->queries.push_back(query);
+  wake_region_locked(phys);
+  g_static_mutex_unlock(&phys->mutex);
+}
+
+static phys_query* new_query(int type, const caj_vector3 *start,
+			     const caj_vector3 *end, float radius, int reject,
+			     int max_hits, caj_phys_query_cb cb, 
+			     void *cb_priv) {
+  phys_query *query = new phys_query();
+  query->type = type;
+  query->start = btVector3(start->x, start->z, start->y);
+  query->end = btVector3(end->x, end->z, end->y);
+  query->radius = radius;
+  query->reject = reject; query->max_hits = max_hits;
+  query->cb = cb; query->cb_priv = cb_priv;
+  return query;
+}
 
-    // poke the main thread. Note that this ain't really useful on the first pass
-    if(g_idle_add(phys_update_in_mt, phys) == 0) {
-      printf("WARNING: couldn't poke main thread in physics code\n");
+static void raycast(struct simulator_ctx *sim, void *priv,
+		    const caj_vector3 *start, const caj_vector3 *end,
+		    int reject, int max_hits, caj_phys_query_cb cb, 
+		    void *cb_priv) {
+  struct physics_ctx *phys = (struct physics_ctx*)priv;
+  queue_query(phys, new_query(PHYS_QUERY_RAY, start, end, 0.0f, reject,
+			      max_hits, cb, cb_priv));
+}
+
+static void sphere_sweep(struct simulator_ctx *sim, void *priv,
+			 const caj_vector3 *start, const caj_vector3 *end,
+			 float radius, int reject, int max_hits, 
+			 caj_phys_query_cb cb, void *cb_priv) {
+  struct physics_ctx *phys = (struct physics_ctx*)priv;
+  queue_query(phys, new_query(PHYS_QUERY_SWEEP, start, end, radius, reject,
+			      max_hits, cb, cb_priv));
+}
+
+static void overlap(struct simulator_ctx *sim, void *priv,
+		    const caj_vector3 *centre, float radius, int reject, 
+		    int max_hits, caj_phys_query_cb cb, void *cb_priv) {
+  struct physics_ctx *phys = (struct physics_ctx*)priv;
+  queue_query(phys, new_query(PHYS_QUERY_OVERLAP, centre, centre, radius, 
+			      reject, max_hits, cb, cb_priv));
+}
+
+// steps one region once. Runs on a pool worker thread, and only one worker
+// will ever be stepping a given region at once.
+static void physics_step(struct physics_ctx *phys) {
+  g_static_mutex_lock(&phys->mutex);
+  do_phys_updates_locked(phys);
+  for(std::set<phys_obj*>::iterator iter = phys->physical.begin(); 
+      iter != phys->physical.end(); iter++) {
+    struct phys_obj *physobj = *iter; 
+
+    // FIXME - generalise this to more general target velocity support?
+    if(physobj->objtype != OBJ_TYPE_AVATAR) continue;
+
+    btVector3 impulse = physobj->target_velocity;
+    assert(physobj->body != NULL);
+    impulse -= physobj->body->getLinearVelocity();
+    impulse *= 0.9f * WORLD_AVATAR_MASS;
+
+    if(!physobj->is_flying) impulse.setY(0.0f);
+    physobj->body->applyCentralImpulse(impulse);
+
+    if(physobj->target_velocity.getX() != 0.0f || 
+       physobj->target_velocity.getY() != 0.0f || 
+       physobj->target_velocity.getZ() != 0.0f) {
+      physobj->body->setActivationState(ACTIVE_TAG);
     }
+  }
+  g_static_mutex_unlock(&phys->mutex);
 
-    // FIXME - this really doesn't look right...
-    double time_skip = next_step - g_timer_elapsed(timer, NULL);
-    next_step =  g_timer_elapsed(timer, NULL) + (1.0/60.0);
-    if(time_skip > 0.0) {
-      usleep(1000000*time_skip);
+  phys->dynamicsWorld->stepSimulation(PHYS_STEP_TIME,10);
+
+  g_static_mutex_lock(&phys->mutex);
+  for(std::set<phys_obj*>::iterator iter = phys->physical.begin(); 
+      iter != phys->physical.end(); iter++) {
+    struct phys_obj *physobj = *iter;
+    if(physobj->body == NULL) continue; // added since the step
+    btTransform trans;
+    physobj->body->getMotionState()->getWorldTransform(trans);
+    physobj->pos = trans.getOrigin();
+    physobj->rot = trans.getRotation().inverse();
+    physobj->velocity = physobj->body->getLinearVelocity();
+    if(physobj->objtype == OBJ_TYPE_AVATAR) {
+      physobj->footfall.x = physobj->footfall_tmp.getX();
+      physobj->footfall.y = physobj->footfall_tmp.getZ();
+      physobj->footfall.z = physobj->footfall_tmp.getY();
+      physobj->footfall.w = physobj->footfall_tmp.getW();
     }
+  }
+  g_static_mutex_unlock(&phys->mutex);
 
-    g_static_mutex_lock(&phys->mutex);
-    if(phys->shutdown) {
-      g_static_mutex_unlock(&phys->mutex); break;
+  run_queries(phys);
+
+  // poke the main thread.
+  if(g_idle_add(phys_update_in_mt, phys) == 0) {
+    printf("WARNING: couldn't poke main thread in physics code\n");
+  }
+}
+
+// Nothing's moving and there's nothing pending, so we can stop stepping this
+// region until something changes. Call with phys->mutex held.
+static int region_is_idle_locked(struct physics_ctx *phys) {
+  if(!phys->changed.empty() || !phys->queries.empty()) return FALSE;
+  for(int i = 0; i < 16; i++) {
+    if(phys->terrain_dirty[i] != 0) return FALSE;
+  }
+  for(std::set<phys_obj*>::iterator iter = phys->physical.begin(); 
+      iter != phys->physical.end(); iter++) {
+    struct phys_obj *physobj = *iter;
+    if(physobj->body == NULL || physobj->body->isActive()) return FALSE;
+    if(physobj->target_velocity.getX() != 0.0f || 
+       physobj->target_velocity.getY() != 0.0f || 
+       physobj->target_velocity.getZ() != 0.0f) return FALSE;
+  }
+  return TRUE;
+}
+
+static gpointer physics_worker(gpointer data) {
+  struct physics_pool *pool = (struct physics_pool*)data;
+  g_mutex_lock(pool->mutex);
+  while(!pool->shutdown) {
+    if(pool->queue.empty()) {
+      g_cond_wait(pool->cond, pool->mutex); continue;
     }
-    do_phys_updates_locked(phys);
-    for(std::set<phys_obj*>::iterator iter = phys->physical.begin(); 
-	iter != phys->physical.end(); iter++) {
-      struct phys_obj *physobj = *iter; 
-
-      // FIXME - generalise this to more general target velocity support?
-      if(physobj->objtype != OBJ_TYPE_AVATAR) continue;
-
-      btVector3 impulse = physobj->target_velocity;
-      assert(physobj->body != NULL);
-      impulse -= physobj->body->getLinearVelocity();
-      impulse *= 0.9f * 50.0f; // FIXME - don't hardcode mass
-
-      if(!physobj->is_flying) impulse.setY(0.0f);
-      physobj->body->applyCentralImpulse(impulse);
-
-      if(physobj->target_velocity.getX() != 0.0f || 
-	 physobj->target_velocity.getY() != 0.0f || 
-	 physobj->target_velocity.getZ() != 0.0f) {
-	physobj->body->setActivationState(ACTIVE_TAG);
-      }
+
+    std::multimap<double, physics_ctx*>::iterator next = pool->queue.begin();
+    double now = g_timer_elapsed(pool->timer, NULL);
+    if(next->first > now) {
+      GTimeVal tval;
+      g_get_current_time(&tval);
+      g_time_val_add(&tval, (glong)((next->first - now) * 1000000.0));
+      g_cond_timed_wait(pool->cond, pool->mutex, &tval);
+      continue;
+    }
+
+    struct physics_ctx *phys = next->second;
+    pool->queue.erase(next);
+    phys->sched_state = PHYS_SCHED_RUNNING;
+    g_mutex_unlock(pool->mutex);
+
+    physics_step(phys);
+
+    // lock order is always phys->mutex, then pool->mutex
+    g_static_mutex_lock(&phys->mutex);
+    int idle = phys->shutdown || region_is_idle_locked(phys);
+    g_mutex_lock(pool->mutex);
+
+    double end = g_timer_elapsed(pool->timer, NULL);
+    float step_ms = (end - now) * 1000.0;
+    caj_phys_stats *stats = &phys->stats;
+    stats->steps++;
+    if(now - phys->deadline > PHYS_STEP_TIME) stats->late_steps++;
+    stats->last_step_ms = step_ms;
+    stats->avg_step_ms = stats->avg_step_ms * 0.95f + step_ms * 0.05f;
+    if(step_ms > stats->max_step_ms) stats->max_step_ms = step_ms;
+    stats->sleeping = idle;
+
+    if(idle) {
+      phys->sched_state = PHYS_SCHED_IDLE;
+      g_cond_broadcast(pool->cond); // destroy_physics may be waiting
+    } else {
+      // if we've fallen behind, don't try and catch up.
+      double deadline = phys->deadline + PHYS_STEP_TIME;
+      schedule_region_locked(pool, phys, deadline > end ? deadline : end);
     }
     g_static_mutex_unlock(&phys->mutex);
+  }
+  g_mutex_unlock(pool->mutex);
+  return NULL;
+}
 
-    phys->dynamicsWorld->stepSimulation(1.f/60.f,10);
+static struct physics_pool* physics_pool_ref(struct simulator_ctx *sim) {
+  if(phys_pool != NULL) {
+    g_mutex_lock(phys_pool->mutex);
+    phys_pool->num_regions++;
+    g_mutex_unlock(phys_pool->mutex);
+    return phys_pool;
   }
 
-  g_timer_destroy(timer); return NULL;
+  struct physics_pool *pool = new physics_pool();
+  pool->mutex = g_mutex_new();
+  pool->cond = g_cond_new();
+  pool->timer = g_timer_new();
+  pool->num_regions = 1;
+  pool->shutdown = 0;
+
+  int num_threads = 0;
+  char *threads_str = sgrp_config_get_value(sim_get_simgroup(sim), "physics",
+					    "worker_threads");
+  if(threads_str != NULL) {
+    num_threads = atoi(threads_str); g_free(threads_str);
+  }
+  if(num_threads <= 0) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(num_threads <= 0) num_threads = 1;
+
+  pool->solver_pool = NULL; pool->solver_threads = 1;
+  if(sgrp_config_get_bool(sim_get_simgroup(sim), "physics", 
+			  "parallel_solver", NULL)) {
+    threads_str = sgrp_config_get_value(sim_get_simgroup(sim), "physics",
+					"solver_threads");
+    if(threads_str != NULL) {
+      pool->solver_threads = atoi(threads_str); g_free(threads_str);
+    } else {
+      pool->solver_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    // the stepping thread solves one batch itself
+    if(pool->solver_threads > 1) {
+      pool->solver_pool = g_thread_pool_new(solver_batch_func, NULL, 
+					    pool->solver_threads - 1, 
+					    FALSE, NULL);
+      CAJ_DEBUG_L(caj_get_logger(sim_get_simgroup(sim)),
+		  "DEBUG: using parallel physics solver, %i threads\n",
+		  pool->solver_threads);
+    }
+  }
+
+  for(int i = 0; i < num_threads; i++) {
+    GThread *thread = g_thread_create(physics_worker, pool, TRUE, NULL);
+    if(thread == NULL) {
+      printf("ERROR: couldn't create physics thread\n"); exit(1);
+    }
+    pool->threads.push_back(thread);
+  }
+  CAJ_DEBUG_L(caj_get_logger(sim_get_simgroup(sim)),
+	      "DEBUG: started %i physics worker threads\n", num_threads);
+
+  phys_pool = pool; return pool;
+}
+
+static void physics_pool_unref(struct physics_pool *pool) {
+  g_mutex_lock(pool->mutex);
+  int remaining = --pool->num_regions;
+  if(remaining == 0) {
+    pool->shutdown = 1;
+    g_cond_broadcast(pool->cond);
+  }
+  g_mutex_unlock(pool->mutex);
+  if(remaining > 0) return;
+
+  for(std::vector<GThread*>::iterator iter = pool->threads.begin();
+      iter != pool->threads.end(); iter++) {
+    g_thread_join(*iter);
+  }
+  if(pool->solver_pool != NULL)
+    g_thread_pool_free(pool->solver_pool, FALSE, TRUE);
+  g_cond_free(pool->cond);
+  g_mutex_free(pool->mutex);
+  g_timer_destroy(pool->timer);
+  delete pool;
+  if(phys_pool == pool) phys_pool = NULL;
+}
+
+static void get_stats(struct simulator_ctx *sim, void *priv, 
+		      struct caj_phys_stats *stats) {
+  struct physics_ctx *phys = (struct physics_ctx*)priv;
+  g_mutex_lock(phys->pool->mutex);
+  *stats = phys->stats;
+  g_mutex_unlock(phys->pool->mutex);
 }
 
 // the part of the code handling physics updates that runs in the main thread
@@ -1000,6 +1817,17 @@ static gboolean phys_update_in_mt(gpointer priv) {
     delete collisions;
   }
 
+  while(!phys->query_results.empty()) {
+    phys_query *query = phys->query_results.front();
+    phys->query_results.pop_front();
+    g_static_mutex_unlock(&phys->mutex);
+    query->cb(phys->sim, query->cb_priv, 
+	      query->hits.empty() ? NULL : &query->hits[0], 
+	      query->hits.size());
+    delete query;
+    g_static_mutex_lock(&phys->mutex);
+  }
+
   g_static_mutex_unlock(&phys->mutex);
 
   return FALSE; // clear this idle callback
@@ -1011,11 +1839,34 @@ static void destroy_physics(struct simulator_ctx *sim, void *priv) {
   g_static_mutex_lock(&phys->mutex);
   phys->shutdown = 1;
   g_static_mutex_unlock(&phys->mutex);
-  g_thread_join(phys->thread);
+
+  // take ourselves out of the pool, waiting for any in-progress step
+  struct physics_pool *pool = phys->pool;
+  g_mutex_lock(pool->mutex);
+  if(phys->sched_state == PHYS_SCHED_QUEUED) {
+    pool->queue.erase(phys->sched_iter);
+    phys->sched_state = PHYS_SCHED_IDLE;
+  }
+  while(phys->sched_state == PHYS_SCHED_RUNNING) 
+    g_cond_wait(pool->cond, pool->mutex);
+  g_mutex_unlock(pool->mutex);
+  physics_pool_unref(pool);
 
   // cancel any remaining pending updates.
   while(g_idle_remove_by_data(phys)) { }
 
+  // and any queries, even ones that have been run. The callers still need
+  // to be told so they can clean up.
+  phys->queries.insert(phys->queries.end(), phys->query_results.begin(),
+		       phys->query_results.end());
+  phys->query_results.clear();
+  while(!phys->queries.empty()) {
+    phys_query *query = phys->queries.front();
+    phys->queries.pop_front();
+    query->cb(sim, query->cb_priv, NULL, -1);
+    delete query;
+  }
+
   // You know I said this is only called from the physics thread? That's not
   // quite true. After we've shut down physics, there may be deleted objects
   // that need cleaning up, and this is as good a place as any to do so.
@@ -1047,6 +1898,8 @@ static void destroy_physics(struct simulator_ctx *sim, void *priv) {
   delete phys->plane_0y;
   delete phys->plane_1y;
   delete phys->ground_shape;
+  delete[] phys->heightfield;
+  delete[] phys->terrain_upd;
 
   delete phys->dynamicsWorld;
   delete phys->solver;
@@ -1084,6 +1937,11 @@ int cajeput_physics_init(int api_version, struct simulator_ctx *sim,
   hooks->set_avatar_flying = set_avatar_flying;
   hooks->destroy = destroy_physics;
   hooks->apply_impulse = apply_impulse;
+  hooks->upd_terrain = upd_terrain;
+  hooks->get_stats = get_stats;
+  hooks->raycast = raycast;
+  hooks->sphere_sweep = sphere_sweep;
+  hooks->overlap = overlap;
 
   phys->collisionConfiguration = new btDefaultCollisionConfiguration();
   phys->dispatcher = new btCollisionDispatcher(phys->collisionConfiguration);
@@ -1092,35 +1950,55 @@ int cajeput_physics_init(int api_version, struct simulator_ctx *sim,
 
   phys->overlappingPairCache = new bt32BitAxisSweep3(worldMin,worldMax,MAX_OBJECTS);
 
+  phys->pool = physics_pool_ref(sim);
+
   phys->solver = new btSequentialImpulseConstraintSolver();
-  phys->dynamicsWorld =  new btDiscreteDynamicsWorld(phys->dispatcher,
-						     phys->overlappingPairCache,
-						     phys->solver,
-						     phys->collisionConfiguration);
+  if(phys->pool->solver_pool != NULL) {
+    phys->dynamicsWorld = new caj_parallel_world(phys->dispatcher,
+						 phys->overlappingPairCache,
+						 phys->solver,
+						 phys->collisionConfiguration,
+						 phys->pool->solver_pool,
+						 phys->pool->solver_threads);
+  } else {
+    phys->dynamicsWorld =  new btDiscreteDynamicsWorld(phys->dispatcher,
+						       phys->overlappingPairCache,
+						       phys->solver,
+						       phys->collisionConfiguration);
+  }
 
   phys->dynamicsWorld->setInternalTickCallback(tick_callback, phys);
   phys->dynamicsWorld->setGravity(btVector3(0,-GRAVITY,0));
 
+  // btHeightfieldTerrainShape doesn't make its own copy of the heightfield,
+  // so we do, in order that terrain edits can't change it mid-step.
+  phys->heightfield = new float[WORLD_REGION_SIZE*WORLD_REGION_SIZE];
   float *heightfield = sim_get_heightfield(sim);
-  // WARNING: note that this does *NOT* make its own copy of the heightfield
-  // FIXME - this limits max terrain height to 100 metres
+  for(int i = 0; i < WORLD_REGION_SIZE*WORLD_REGION_SIZE; i++)
+    phys->heightfield[i] = clamp_terrain_height(heightfield[i]);
+  phys->terrain_upd = new float[WORLD_REGION_SIZE*WORLD_REGION_SIZE];
+  memset(phys->terrain_dirty, 0, sizeof(phys->terrain_dirty));
+
   phys->ground_shape = new btHeightfieldTerrainShape(WORLD_REGION_SIZE, 
 						     WORLD_REGION_SIZE, 
-						     heightfield,
-						     0, 0.0f, 100.0f, 1,
+						     phys->heightfield, 0,
+						     TERRAIN_MIN_HEIGHT,
+						     TERRAIN_MAX_HEIGHT, 1,
 						     PHY_FLOAT, 0);
   // scaling is a HACK to avoid a "falling off the edge of the world" bug
   phys->ground_shape->setLocalScaling(btVector3(1.004,1,1.004)); 
   btTransform ground_transform;
   ground_transform.setIdentity();
-  ground_transform.setOrigin(btVector3(WORLD_REGION_SIZE/2.0f, 50,
+  ground_transform.setOrigin(btVector3(WORLD_REGION_SIZE/2.0f, 
+				       (TERRAIN_MIN_HEIGHT+TERRAIN_MAX_HEIGHT)/2,
 				       WORLD_REGION_SIZE/2.0f
 ));
   
   btDefaultMotionState* motion = new btDefaultMotionState(ground_transform);
   btRigidBody::btRigidBodyConstructionInfo body_info(0.0,motion,phys->ground_shape,btVector3(0,0,0));
-  btRigidBody* body = new btRigidBody(body_info);
-  phys->dynamicsWorld->addRigidBody(body, COL_GROUND, GROUND_COLLIDES_WITH);
+  phys->ground_body = new btRigidBody(body_info);
+  phys->dynamicsWorld->addRigidBody(phys->ground_body, COL_GROUND, 
+				    GROUND_COLLIDES_WITH);
 
 
   // Sim edges - will need to selectively remove when region
@@ -1134,11 +2012,13 @@ int cajeput_physics_init(int api_version, struct simulator_ctx *sim,
   phys->shutdown = 0;
   g_static_mutex_init(&phys->mutex);
 
-  phys->thread = g_thread_create(physics_thread, phys, TRUE, NULL);
-  
-  if(phys->thread == NULL) {
-    printf("ERROR: couldn't create physics thread\n"); exit(1);
-  }
+  memset(&phys->stats, 0, sizeof(phys->stats));
+
+  // step at least once, even if there's nothing physical in the region yet.
+  g_mutex_lock(phys->pool->mutex);
+  schedule_region_locked(phys->pool, phys, 
+			 g_timer_elapsed(phys->pool->timer, NULL));
+  g_mutex_unlock(phys->pool->mutex);
 
   return TRUE;
 }